@@ -0,0 +1,314 @@
+/*
+ * Benchmarks of the mapper, the hashes and the builder.
+ *
+ *     bench_crush --benchmark_format=json
+ *
+ * The maps are hierarchies of @levels levels of buckets of @fanout
+ * items all of the same algorithm, the devices being at level 0. A
+ * rule takes the root and chooses, or chooses leaves in the buckets of
+ * level 1, firstn or indep.
+ *
+ * LGPL2
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/crush_ln_table.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/freeze.h"
+}
+
+struct bench_map {
+  crush_map *map;
+  int ruleno;
+  int numrep;
+  std::vector<__u32> weights;
+  std::vector<char> cwin;
+
+  bench_map(int alg, int fanout, int levels, int numrep, bool indep);
+  ~bench_map() { crush_destroy(map); }
+
+  /* @out percent of the devices are out and @partial percent are
+     reweighted to 0.5 */
+  void reweight(int out, int partial);
+};
+
+static int count_devices(int fanout, int levels) {
+  int devices = 1;
+  for (int l = 0; l < levels; l++)
+    devices *= fanout;
+  return devices;
+}
+
+bench_map::bench_map(int alg, int fanout, int levels, int numrep, bool indep)
+    : numrep(numrep) {
+  map = crush_create();
+  map->choose_local_tries = 0;
+  map->choose_local_fallback_tries = 0;
+  map->choose_total_tries = 50;
+  map->chooseleaf_descend_once = 1;
+  map->chooseleaf_vary_r = 1;
+  map->chooseleaf_stable = 1;
+  map->allowed_bucket_algs = (1 << CRUSH_BUCKET_UNIFORM) |
+    (1 << CRUSH_BUCKET_LIST) | (1 << CRUSH_BUCKET_TREE) |
+    (1 << CRUSH_BUCKET_STRAW2) | (1 << CRUSH_BUCKET_STRAW2_TREE);
+
+  int devices = count_devices(fanout, levels);
+  std::vector<int> items(devices), item_weights(devices, 0x10000);
+  for (int i = 0; i < devices; i++)
+    items[i] = i;
+  for (int l = 1; l <= levels; l++) {
+    std::vector<int> buckets, bucket_weights;
+    for (size_t i = 0; i < items.size(); i += fanout) {
+      crush_bucket *b = crush_make_bucket(map, alg, CRUSH_HASH_DEFAULT, l,
+                                          fanout, &items[i], &item_weights[i]);
+      int id;
+      crush_add_bucket(map, 0, b, &id);
+      buckets.push_back(id);
+      bucket_weights.push_back(b->weight);
+    }
+    items.swap(buckets);
+    item_weights.swap(bucket_weights);
+  }
+
+  crush_rule *rule = crush_make_rule(3, 0, 1, 1, numrep);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_TAKE, items[0], 0);
+  if (levels > 1)
+    crush_rule_set_step(rule, 1, indep ? CRUSH_RULE_CHOOSELEAF_INDEP :
+                        CRUSH_RULE_CHOOSELEAF_FIRSTN, numrep, 1);
+  else
+    crush_rule_set_step(rule, 1, indep ? CRUSH_RULE_CHOOSE_INDEP :
+                        CRUSH_RULE_CHOOSE_FIRSTN, numrep, 0);
+  crush_rule_set_step(rule, 2, CRUSH_RULE_EMIT, 0, 0);
+  ruleno = crush_add_rule(map, rule, -1);
+  crush_finalize(map);
+
+  weights.assign(map->max_devices, 0x10000);
+  cwin.resize(crush_work_size(map, numrep));
+  crush_init_workspace(map, &cwin[0]);
+}
+
+void bench_map::reweight(int out, int partial) {
+  for (size_t i = 0; i < weights.size(); i++) {
+    __u32 h = crush_hash32(CRUSH_HASH_RJENKINS1, i) % 100;
+    weights[i] = h < (__u32)out ? 0 :
+      h < (__u32)(out + partial) ? 0x8000 : 0x10000;
+  }
+}
+
+static void map_inputs(benchmark::State &state, bench_map &m) {
+  std::vector<int> result(m.numrep);
+  int x = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+      crush_do_rule(m.map, m.ruleno, x++, &result[0], m.numrep,
+                    &m.weights[0], m.weights.size(), &m.cwin[0], NULL));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+/* a single bucket of @width devices */
+static void BM_do_rule_alg(benchmark::State &state) {
+  bench_map m(state.range(0), state.range(1), 1, 3, false);
+  map_inputs(state, m);
+}
+BENCHMARK(BM_do_rule_alg)
+  ->ArgNames({"alg", "width"})
+  ->ArgsProduct({{CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+                  CRUSH_BUCKET_STRAW2, CRUSH_BUCKET_STRAW2_TREE},
+                 {8, 64, 512, 4096}});
+
+static void BM_do_rule_depth(benchmark::State &state) {
+  bench_map m(CRUSH_BUCKET_STRAW2, state.range(0), state.range(1), 3, false);
+  map_inputs(state, m);
+}
+BENCHMARK(BM_do_rule_depth)
+  ->ArgNames({"fanout", "levels"})
+  ->ArgsProduct({{10}, {1, 2, 3, 4, 5}})
+  ->ArgsProduct({{32}, {1, 2, 3}});
+
+static void BM_do_rule_replicas(benchmark::State &state) {
+  bench_map m(CRUSH_BUCKET_STRAW2, 32, 2, state.range(0), state.range(1));
+  map_inputs(state, m);
+}
+BENCHMARK(BM_do_rule_replicas)
+  ->ArgNames({"numrep", "indep"})
+  ->ArgsProduct({{1, 3, 6, 10, 20}, {0, 1}});
+
+static void BM_do_rule_out(benchmark::State &state) {
+  bench_map m(CRUSH_BUCKET_STRAW2, 16, 3, 3, state.range(2));
+  m.reweight(state.range(0), state.range(1));
+  map_inputs(state, m);
+}
+BENCHMARK(BM_do_rule_out)
+  ->ArgNames({"out", "partial", "indep"})
+  ->ArgsProduct({{0, 1, 10, 30}, {0, 10}, {0, 1}});
+
+/* the distribution of the time of one mapping, in nanoseconds */
+static void BM_do_rule_latency(benchmark::State &state) {
+  bench_map m(CRUSH_BUCKET_STRAW2, 16, 3, state.range(0), state.range(1));
+  m.reweight(state.range(2), 0);
+  std::vector<int> result(m.numrep);
+  std::vector<double> latencies;
+  int x = 0;
+  for (auto _ : state) {
+    auto begin = std::chrono::steady_clock::now();
+    benchmark::DoNotOptimize(
+      crush_do_rule(m.map, m.ruleno, x++, &result[0], m.numrep,
+                    &m.weights[0], m.weights.size(), &m.cwin[0], NULL));
+    auto end = std::chrono::steady_clock::now();
+    latencies.push_back(std::chrono::duration<double, std::nano>(end - begin).count());
+  }
+  std::sort(latencies.begin(), latencies.end());
+  size_t n = latencies.size();
+  state.counters["p50_ns"] = latencies[n / 2];
+  state.counters["p99_ns"] = latencies[n * 99 / 100];
+  state.counters["p999_ns"] = latencies[n * 999 / 1000];
+  state.counters["max_ns"] = latencies[n - 1];
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_do_rule_latency)
+  ->ArgNames({"numrep", "indep", "out"})
+  ->Args({3, 0, 0})
+  ->Args({3, 0, 10})
+  ->Args({3, 1, 0})
+  ->Args({3, 1, 10})
+  ->Args({10, 1, 0})
+  ->Args({10, 1, 10});
+
+enum engine { DO_RULE, BATCH, PLAN, FROZEN, INTERLEAVED };
+
+/* the same mappings computed by each engine */
+static void BM_engine(benchmark::State &state) {
+  const int batch = 256;
+  bench_map m(CRUSH_BUCKET_STRAW2, 16, 3, 3, false);
+  std::vector<int> x(batch), result(batch * m.numrep), len(batch);
+  crush_plan *plan = crush_compile_rule(m.map, m.ruleno, m.numrep);
+  crush_map *frozen = crush_map_freeze(m.map);
+  std::vector<char> frozen_cwin(crush_work_size(frozen, m.numrep));
+  crush_init_workspace(frozen, &frozen_cwin[0]);
+  std::vector<char> interleave_cwin(crush_interleave_work_size(plan));
+  crush_init_workspace(m.map, &interleave_cwin[0]);
+  int next = 0;
+  for (auto _ : state) {
+    for (int i = 0; i < batch; i++)
+      x[i] = next++;
+    switch (state.range(0)) {
+    case DO_RULE:
+      for (int i = 0; i < batch; i++)
+        len[i] = crush_do_rule(m.map, m.ruleno, x[i], &result[i * m.numrep],
+                               m.numrep, &m.weights[0], m.weights.size(),
+                               &m.cwin[0], NULL);
+      break;
+    case BATCH:
+      crush_do_rule_batch(m.map, m.ruleno, &x[0], batch, &result[0], m.numrep,
+                          m.numrep, &len[0], &m.weights[0], m.weights.size(),
+                          &m.cwin[0], NULL);
+      break;
+    case PLAN:
+      for (int i = 0; i < batch; i++)
+        len[i] = crush_do_plan(plan, x[i], &result[i * m.numrep],
+                               &m.weights[0], m.weights.size(), &m.cwin[0],
+                               NULL);
+      break;
+    case FROZEN:
+      for (int i = 0; i < batch; i++)
+        len[i] = crush_do_rule(frozen, m.ruleno, x[i], &result[i * m.numrep],
+                               m.numrep, &m.weights[0], m.weights.size(),
+                               &frozen_cwin[0], NULL);
+      break;
+    case INTERLEAVED:
+      crush_do_plan_interleaved(plan, &x[0], batch, &result[0], m.numrep,
+                                &len[0], &m.weights[0], m.weights.size(),
+                                &interleave_cwin[0], NULL);
+      break;
+    }
+    benchmark::DoNotOptimize(&result[0]);
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+  crush_destroy_plan(plan);
+  crush_destroy(frozen);
+}
+BENCHMARK(BM_engine)
+  ->ArgName("engine")
+  ->Arg(DO_RULE)->Arg(BATCH)->Arg(PLAN)->Arg(FROZEN)->Arg(INTERLEAVED);
+
+static void BM_hash32(benchmark::State &state) {
+  __u32 a = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(a = crush_hash32(CRUSH_HASH_RJENKINS1, a));
+}
+BENCHMARK(BM_hash32);
+
+static void BM_hash32_2(benchmark::State &state) {
+  __u32 a = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(a = crush_hash32_2(CRUSH_HASH_RJENKINS1, a, 1));
+}
+BENCHMARK(BM_hash32_2);
+
+static void BM_hash32_3(benchmark::State &state) {
+  __u32 a = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(a = crush_hash32_3(CRUSH_HASH_RJENKINS1, a, 1, 2));
+}
+BENCHMARK(BM_hash32_3);
+
+static void BM_hash32_4(benchmark::State &state) {
+  __u32 a = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(a = crush_hash32_4(CRUSH_HASH_RJENKINS1, a, 1, 2, 3));
+}
+BENCHMARK(BM_hash32_4);
+
+static void BM_hash32_5(benchmark::State &state) {
+  __u32 a = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(a = crush_hash32_5(CRUSH_HASH_RJENKINS1, a, 1, 2, 3, 4));
+}
+BENCHMARK(BM_hash32_5);
+
+/* on the 16 bits of a hash, as bucket_straw2_choose() does */
+static void BM_crush_ln(benchmark::State &state) {
+  unsigned int u = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(crush_ln(u & 0xffff));
+    u += 0x9e37;
+  }
+}
+BENCHMARK(BM_crush_ln);
+
+/* the construction of a map of 10^@levels devices, crush_finalize()
+   included */
+static void BM_build(benchmark::State &state) {
+  for (auto _ : state) {
+    bench_map m(state.range(0), 10, state.range(1), 3, false);
+    benchmark::DoNotOptimize(m.map);
+  }
+  state.SetItemsProcessed(state.iterations() * count_devices(10, state.range(1)));
+}
+BENCHMARK(BM_build)
+  ->ArgNames({"alg", "levels"})
+  ->ArgsProduct({{CRUSH_BUCKET_TREE, CRUSH_BUCKET_STRAW2, CRUSH_BUCKET_STRAW2_TREE},
+                 {2, 3, 4}})
+  ->Unit(benchmark::kMicrosecond);
+
+static void BM_finalize(benchmark::State &state) {
+  bench_map m(CRUSH_BUCKET_STRAW2, 10, state.range(0), 3, false);
+  for (auto _ : state)
+    crush_finalize(m.map);
+  state.SetItemsProcessed(state.iterations() * count_devices(10, state.range(0)));
+}
+BENCHMARK(BM_finalize)
+  ->ArgName("levels")
+  ->Arg(2)->Arg(3)->Arg(4)
+  ->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
@@ -3,6 +3,7 @@
 #include "mapper.h"
 #include "builder.h"
 #include "crush.h"
+#include "context.h"
 #include "hash.h"
 #include "stdio.h"
 
@@ -467,12 +468,16 @@ void map_with_crush(int replication_count, int hosts_count, int object_map[][NUM
     __u32 weights[hosts_count];
     for(int i = 0; i < hosts_count; i++)
       weights[i] = 0x10000;
-    int cwin_size = crush_work_size(m, replication_count);
-    char cwin[cwin_size];
-    crush_init_workspace(m, cwin);
+    /* each map is a new epoch, even if it is allocated where the
+       previous one was */
+    static __u32 epoch;
+    struct crush_context *ctx = crush_context_thread();
+    assert(ctx != NULL);
+    int bound = crush_context_bind(ctx, m, ++epoch, replication_count);
+    assert(bound == 0);
     for(int x = 0; x < NUMBER_OF_OBJECTS; x++) {
       memset(result, '\0', sizeof(int) * replication_count);
-      assert(crush_do_rule(m, ruleno, x, result, replication_count, weights, hosts_count, cwin) == replication_count);
+      assert(crush_context_do_rule(ctx, ruleno, x, result, replication_count, weights, hosts_count, NULL) == replication_count);
       for(int i = 0; i < replication_count; i++) {
         object_map[i][x] = result[i];
       }
@@ -0,0 +1,168 @@
+/*
+ * Allocate the buckets and arrays of a map from a few large chunks.
+ *
+ * Blocks are carved one after the other in the most recent chunk and
+ * are preceded by their capacity, a multiple of 8 bytes. Nothing is
+ * released before the arena: a block that grows beyond its capacity
+ * is copied to a new block twice as large, unless it is the last
+ * block of the chunk and there is room after it.
+ *
+ * LGPL2
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "crush_compat.h"
+#include "arena.h"
+
+#define CRUSH_ARENA_CHUNK_SIZE (64 * 1024)
+
+/* the capacity of a block, before it */
+#define BLOCK_HEADER sizeof(__u64)
+
+struct crush_arena_chunk {
+	struct crush_arena_chunk *next;
+	size_t size;		/* bytes of data */
+	size_t used;		/* bytes of data carved in blocks */
+	size_t last;		/* offset of the header of the last block */
+	__u64 data[];
+};
+
+struct crush_arena {
+	struct crush_arena_chunk *chunks; /* the most recent first */
+	size_t next_size;
+	int count;
+	struct crush_allocator allocator;
+};
+
+static void *default_alloc(void *ctx, size_t size)
+{
+	(void)ctx;
+	return malloc(size);
+}
+
+static void default_free(void *ctx, void *p, size_t size)
+{
+	(void)ctx;
+	(void)size;
+	free(p);
+}
+
+static size_t align8(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+static __u64 *block_header(const void *p)
+{
+	return (__u64 *)((char *)p - BLOCK_HEADER);
+}
+
+struct crush_arena *crush_arena_create(size_t chunk_size,
+				       const struct crush_allocator *allocator)
+{
+	struct crush_allocator a = { default_alloc, default_free, NULL };
+	struct crush_arena *arena;
+
+	if (allocator)
+		a = *allocator;
+	arena = a.alloc(a.ctx, sizeof(*arena));
+	if (!arena)
+		return NULL;
+	arena->chunks = NULL;
+	arena->next_size = chunk_size ? align8(chunk_size) :
+		CRUSH_ARENA_CHUNK_SIZE;
+	arena->count = 0;
+	arena->allocator = a;
+	return arena;
+}
+
+void crush_arena_destroy(struct crush_arena *arena)
+{
+	struct crush_allocator a;
+	struct crush_arena_chunk *chunk, *next;
+
+	if (!arena)
+		return;
+	a = arena->allocator;
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		a.free(a.ctx, chunk, sizeof(*chunk) + chunk->size);
+	}
+	a.free(a.ctx, arena, sizeof(*arena));
+}
+
+void *crush_arena_alloc(struct crush_arena *arena, size_t size)
+{
+	struct crush_arena_chunk *chunk = arena->chunks;
+	size_t capacity = align8(size);
+	char *header;
+
+	if (size > ((size_t)-1) / 4)
+		return NULL;
+	if (!chunk || chunk->size - chunk->used < BLOCK_HEADER + capacity) {
+		size_t chunk_size = arena->next_size;
+
+		while (chunk_size < BLOCK_HEADER + capacity)
+			chunk_size *= 2;
+		chunk = arena->allocator.alloc(arena->allocator.ctx,
+					       sizeof(*chunk) + chunk_size);
+		if (!chunk)
+			return NULL;
+		chunk->next = arena->chunks;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		arena->chunks = chunk;
+		arena->next_size = 2 * chunk_size;
+		arena->count++;
+	}
+	header = (char *)chunk->data + chunk->used;
+	*(__u64 *)header = capacity;
+	chunk->last = chunk->used;
+	chunk->used += BLOCK_HEADER + capacity;
+	return header + BLOCK_HEADER;
+}
+
+void *crush_arena_realloc(struct crush_arena *arena, void *p, size_t size)
+{
+	struct crush_arena_chunk *chunk = arena->chunks;
+	size_t capacity;
+	void *q;
+
+	if (!p)
+		return crush_arena_alloc(arena, size);
+	capacity = *block_header(p);
+	if (size <= capacity)
+		return p;
+	if (size > ((size_t)-1) / 4)
+		return NULL;
+	/* the last block grows in place if the chunk has room */
+	if ((char *)block_header(p) == (char *)chunk->data + chunk->last &&
+	    chunk->size - chunk->used >= align8(size) - capacity) {
+		chunk->used += align8(size) - capacity;
+		*block_header(p) = align8(size);
+		return p;
+	}
+	q = crush_arena_alloc(arena, size > 2 * capacity ? size : 2 * capacity);
+	if (!q)
+		return NULL;
+	memcpy(q, p, capacity);
+	return q;
+}
+
+int crush_arena_owns(const struct crush_arena *arena, const void *p)
+{
+	const struct crush_arena_chunk *chunk;
+
+	for (chunk = arena->chunks; chunk; chunk = chunk->next)
+		if ((const char *)p >= (const char *)chunk->data &&
+		    (const char *)p < (const char *)chunk->data + chunk->size)
+			return 1;
+	return 0;
+}
+
+int crush_arena_chunks(const struct crush_arena *arena)
+{
+	return arena->count;
+}
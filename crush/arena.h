@@ -0,0 +1,107 @@
+#ifndef CEPH_CRUSH_ARENA_H
+#define CEPH_CRUSH_ARENA_H
+
+/*
+ * Allocate the buckets and arrays of a map from a few large chunks.
+ *
+ * LGPL2
+ */
+
+#include <stddef.h>
+
+/** @ingroup API
+ *
+ * Where an arena gets its chunks from. __alloc__ returns __size__
+ * bytes aligned for any type or NULL, __free__ releases a chunk
+ * returned by __alloc__ and its __size__. Both are given __ctx__.
+ */
+struct crush_allocator {
+	void *(*alloc)(void *ctx, size_t size);	/*!< allocate a chunk */
+	void (*free)(void *ctx, void *p, size_t size); /*!< release a chunk */
+	void *ctx;				/*!< given to alloc and free */
+};
+
+struct crush_arena;
+
+/** @ingroup API
+ *
+ * Allocate an arena whose first chunk is __chunk_size__ bytes, or 64KB
+ * if __chunk_size__ is 0. When a chunk is full, the next one is twice
+ * as large, so that an arena of n bytes is made of O(log(n)) chunks.
+ * The chunks and the arena itself are allocated with __allocator__
+ * or, if it is NULL, with __malloc(3)__. The __allocator__ is copied.
+ *
+ * An arena is not thread safe.
+ *
+ * @param chunk_size the size of the first chunk or 0
+ * @param allocator the source of the chunks or NULL
+ *
+ * @returns an arena to be released with crush_arena_destroy() or NULL
+ */
+extern struct crush_arena *crush_arena_create(size_t chunk_size,
+					      const struct crush_allocator *allocator);
+
+/** @ingroup API
+ *
+ * Release all the chunks of __arena__ and the __arena__ itself.
+ *
+ * @param arena the arena
+ */
+extern void crush_arena_destroy(struct crush_arena *arena);
+
+/** @ingroup API
+ *
+ * Return __size__ bytes of __arena__ aligned on 8 bytes, which are
+ * released with the __arena__.
+ *
+ * - return NULL if a chunk cannot be allocated
+ *
+ * @param arena the arena
+ * @param size the number of bytes
+ *
+ * @returns the bytes or NULL
+ */
+extern void *crush_arena_alloc(struct crush_arena *arena, size_t size);
+
+/** @ingroup API
+ *
+ * Resize __p__, returned by crush_arena_alloc() or
+ * crush_arena_realloc(), to __size__ bytes as __realloc(3)__ does,
+ * except that a block is never released and a __size__ of 0 or NULL
+ * are valid. A block that grows is moved to a block twice as large
+ * so that growing it one element at a time is amortized: it moves
+ * again only when that capacity is exhausted.
+ *
+ * - return NULL if a chunk cannot be allocated, __p__ is unchanged
+ *
+ * @param arena the arena
+ * @param p a block of the __arena__ or NULL
+ * @param size the number of bytes
+ *
+ * @returns the resized block or NULL
+ */
+extern void *crush_arena_realloc(struct crush_arena *arena, void *p,
+				 size_t size);
+
+/** @ingroup API
+ *
+ * Return true if __p__ points in a chunk of __arena__.
+ *
+ * @param arena the arena
+ * @param p a pointer
+ *
+ * @returns 1 if __p__ is in the __arena__, 0 otherwise
+ */
+extern int crush_arena_owns(const struct crush_arena *arena, const void *p);
+
+/** @ingroup API
+ *
+ * Return the number of chunks allocated by __arena__.
+ *
+ * @param arena the arena
+ *
+ * @returns the number of chunks
+ */
+extern int crush_arena_chunks(const struct crush_arena *arena);
+
+#endif
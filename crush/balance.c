@@ -0,0 +1,413 @@
+/*
+ * Adjust the weight sets of straw2 buckets so that devices receive
+ * their share of the inputs.
+ *
+ * The mapping of every input is kept with the mask of the buckets it
+ * chose from, as returned by crush_take_visited(). After the weights
+ * of some buckets are adjusted, only the inputs whose mask intersects
+ * the mask of these buckets are mapped again and the count of each
+ * device is updated with the difference between the old and the new
+ * mapping.
+ *
+ * The inputs are cut in chunks that a pool of threads take in turn
+ * with crush_chunks_take(), as in crush_do_rule_parallel(), the pool
+ * being created once for all the passes. Each thread writes the
+ * mappings of its chunks and accumulates the count differences in its
+ * own array, which are added when all chunks are mapped.
+ *
+ * LGPL2
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crush_compat.h"
+#include "crush.h"
+#include "mapper.h"
+#include "context.h"
+#include "parallel.h"
+#include "balance.h"
+
+/* the number of inputs a thread takes at a time */
+#define CRUSH_BALANCE_CHUNK 1024
+
+struct balance_worker {
+	struct crush_context *ctx;
+	void *cwin;
+	__s64 *delta;		/* of the count of each device */
+	__u64 mapped;
+};
+
+struct balance {
+	const struct crush_map *map;
+	int ruleno;
+	int result_max;
+	int x_begin;
+	int x_count;
+	const __u32 *weights;
+	int weight_max;
+	struct crush_weight_summary *summary; /* of weights */
+	struct crush_choose_arg *choose_args;
+	int *result;		/* x_count rows of result_max items */
+	int *result_len;
+	__u64 *visited;		/* the crush_take_visited() of each input */
+	__u64 changed;		/* the buckets adjusted since the last pass */
+	struct crush_chunks chunks;
+	struct crush_pool *pool;
+	int threads;
+	struct balance_worker *workers;
+	/* per device */
+	__s64 *count;
+	double *device_target;
+	/* per bucket */
+	char *reached;		/* the weights and counts below are set */
+	double *bucket_weight;	/* of the devices that are not out */
+	double *bucket_count;
+	double *bucket_target;
+};
+
+static inline int is_device(const struct balance *b, int item)
+{
+	return item >= 0 && item < b->map->max_devices;
+}
+
+static inline const struct crush_bucket *get_bucket(const struct balance *b,
+						    int item)
+{
+	if (item >= 0 || -1-item >= b->map->max_buckets)
+		return NULL;
+	return b->map->buckets[-1-item];
+}
+
+static void worker_run(void *arg, int worker)
+{
+	struct balance *b = arg;
+	struct balance_worker *w = &b->workers[worker];
+	int begin, end, i, j;
+
+	while (crush_chunks_take(&b->chunks, &begin, &end)) {
+		for (i = begin; i < end; i++) {
+			int *result = b->result + (size_t)i * b->result_max;
+
+			if (!(b->visited[i] & b->changed))
+				continue;
+			for (j = 0; j < b->result_len[i]; j++)
+				if (is_device(b, result[j]))
+					w->delta[result[j]]--;
+			crush_take_visited(w->cwin);
+			b->result_len[i] = crush_do_rule(b->map, b->ruleno,
+							 b->x_begin + i, result,
+							 b->result_max,
+							 b->weights,
+							 b->weight_max, w->cwin,
+							 b->choose_args);
+			b->visited[i] = crush_take_visited(w->cwin);
+			for (j = 0; j < b->result_len[i]; j++)
+				if (is_device(b, result[j]))
+					w->delta[result[j]]++;
+			w->mapped++;
+		}
+	}
+}
+
+/* map the inputs that chose from a bucket in b->changed again */
+static void balance_pass(struct balance *b)
+{
+	int t, d;
+
+	crush_chunks_init(&b->chunks, b->x_count, CRUSH_BALANCE_CHUNK);
+	crush_pool_run(b->pool, worker_run, b);
+	for (t = 0; t < b->threads; t++) {
+		__s64 *delta = b->workers[t].delta;
+
+		for (d = 0; d < b->map->max_devices; d++) {
+			b->count[d] += delta[d];
+			delta[d] = 0;
+		}
+	}
+}
+
+/* the weight of the item at @pos of @bucket, without the devices out */
+static double item_weight(const struct balance *b,
+			  const struct crush_bucket *bucket, int pos)
+{
+	int item = bucket->items[pos];
+	double weight = crush_get_bucket_item_weight(bucket, pos);
+
+	if (item >= 0) {
+		if (item >= b->weight_max)
+			return 0;
+		if (b->weights[item] < 0x10000)
+			weight = weight * b->weights[item] / 0x10000;
+		return weight;
+	}
+	if (!get_bucket(b, item))
+		return 0;
+	return b->bucket_weight[-1-item];
+}
+
+static double item_count(const struct balance *b, int item)
+{
+	if (item >= 0)
+		return is_device(b, item) ? b->count[item] : 0;
+	if (!get_bucket(b, item))
+		return 0;
+	return b->bucket_count[-1-item];
+}
+
+static double item_target(const struct balance *b, int item)
+{
+	if (item >= 0)
+		return is_device(b, item) ? b->device_target[item] : 0;
+	if (!get_bucket(b, item))
+		return 0;
+	return b->bucket_target[-1-item];
+}
+
+/* set the weight and the count of @bucket and of the buckets below */
+static void reach_bucket(struct balance *b, const struct crush_bucket *bucket)
+{
+	int idx = -1-bucket->id;
+	double weight = 0, count = 0;
+	__u32 i;
+
+	if (b->reached[idx])
+		return;
+	b->reached[idx] = 1;
+	for (i = 0; i < bucket->size; i++) {
+		const struct crush_bucket *child = get_bucket(b,
+							      bucket->items[i]);
+
+		if (child)
+			reach_bucket(b, child);
+		weight += item_weight(b, bucket, i);
+		count += item_count(b, bucket->items[i]);
+	}
+	b->bucket_weight[idx] = weight;
+	b->bucket_count[idx] = count;
+}
+
+/* share @target between the items of @bucket, in proportion of their weight */
+static void share_target(struct balance *b, const struct crush_bucket *bucket,
+			 double target)
+{
+	int idx = -1-bucket->id;
+	__u32 i;
+
+	b->bucket_target[idx] += target;
+	if (b->bucket_weight[idx] <= 0)
+		return;
+	for (i = 0; i < bucket->size; i++) {
+		int item = bucket->items[i];
+		double share = target * item_weight(b, bucket, i) /
+			b->bucket_weight[idx];
+		const struct crush_bucket *child = get_bucket(b, item);
+
+		if (child)
+			share_target(b, child, share);
+		else if (is_device(b, item))
+			b->device_target[item] += share;
+	}
+}
+
+/* compute the targets and return the largest deviation of a device */
+static double balance_targets(struct balance *b)
+{
+	const struct crush_rule *rule = b->map->rules[b->ruleno];
+	double deviation = 0;
+	__u32 s;
+	int t, d;
+
+	for (t = 0; t < b->map->max_buckets; t++) {
+		b->reached[t] = 0;
+		b->bucket_target[t] = 0;
+	}
+	for (d = 0; d < b->map->max_devices; d++)
+		b->device_target[d] = 0;
+	for (s = 0; s < rule->len; s++) {
+		const struct crush_bucket *root;
+
+		if (rule->steps[s].op != CRUSH_RULE_TAKE)
+			continue;
+		root = get_bucket(b, rule->steps[s].arg1);
+		/* a bucket taken twice is shared once */
+		if (!root || b->reached[-1-root->id])
+			continue;
+		reach_bucket(b, root);
+		share_target(b, root, b->bucket_count[-1-root->id]);
+	}
+	for (d = 0; d < b->map->max_devices; d++) {
+		double target = b->device_target[d];
+		double diff = b->count[d] - target;
+
+		if (target <= 0)
+			continue;
+		if (diff < 0)
+			diff = -diff;
+		if (diff / target > deviation)
+			deviation = diff / target;
+	}
+	return deviation;
+}
+
+/* multiply the weight of the items too far from their target */
+static void balance_adjust(struct balance *b, double tolerance)
+{
+	__s32 idx;
+	__u32 i, p;
+
+	b->changed = 0;
+	for (idx = 0; idx < b->map->max_buckets; idx++) {
+		const struct crush_bucket *bucket = b->map->buckets[idx];
+		struct crush_choose_arg *arg = &b->choose_args[idx];
+
+		if (!bucket || !b->reached[idx] ||
+		    bucket->alg != CRUSH_BUCKET_STRAW2 || !arg->weight_set)
+			continue;
+		for (i = 0; i < bucket->size; i++) {
+			int item = bucket->items[i];
+			double target = item_target(b, item);
+			double count = item_count(b, item);
+			double diff = count - target;
+			double factor;
+
+			if (diff < 0)
+				diff = -diff;
+			/* the devices of a bucket within the tolerance may
+			   still all deviate by more than it: a bucket is
+			   kept closer to its target */
+			if (target <= 0 ||
+			    diff <= (item < 0 ? tolerance / 2 : tolerance) * target)
+				continue;
+			/* an item that is never chosen doubles its weight */
+			factor = count > 0 ? (1 + target / count) / 2 : 2;
+			for (p = 0; p < arg->weight_set_size; p++) {
+				struct crush_weight_set *ws = &arg->weight_set[p];
+				double weight;
+
+				if (i >= ws->size || ws->weights[i] == 0)
+					continue;
+				weight = ws->weights[i] * factor;
+				if (weight < 1)
+					weight = 1;
+				if (weight > 0xffffffffu)
+					weight = 0xffffffffu;
+				ws->weights[i] = weight;
+				b->changed |= crush_visited_bit(bucket->id);
+			}
+		}
+	}
+}
+
+static void balance_free(struct balance *b)
+{
+	int t;
+
+	crush_pool_destroy(b->pool);
+	if (b->workers)
+		for (t = 0; t < b->threads; t++) {
+			crush_context_destroy(b->workers[t].ctx);
+			free(b->workers[t].delta);
+		}
+	free(b->workers);
+	crush_destroy_weight_summary(b->summary);
+	free(b->result);
+	free(b->result_len);
+	free(b->visited);
+	free(b->count);
+	free(b->device_target);
+	free(b->reached);
+	free(b->bucket_weight);
+	free(b->bucket_count);
+	free(b->bucket_target);
+}
+
+int crush_balance(const struct crush_map *map, int ruleno,
+		  int result_max, int x_begin, int x_count,
+		  const __u32 *weights, int weight_max,
+		  struct crush_choose_arg *choose_args,
+		  int max_iterations, __u32 tolerance, int threads,
+		  struct crush_balance_report *report)
+{
+	struct balance b;
+	double deviation;
+	int iterations = 0, t, r;
+
+	if ((__u32)ruleno >= map->max_rules || !map->rules[ruleno] ||
+	    result_max < 1 || x_count < 0 || !choose_args)
+		return -EINVAL;
+
+	memset(&b, 0, sizeof(b));
+	b.map = map;
+	b.ruleno = ruleno;
+	b.result_max = result_max;
+	b.x_begin = x_begin;
+	b.x_count = x_count;
+	b.weights = weights;
+	b.weight_max = weight_max;
+	b.choose_args = choose_args;
+	crush_chunks_init(&b.chunks, x_count, CRUSH_BALANCE_CHUNK);
+	b.pool = crush_pool_create(threads, crush_chunks_count(&b.chunks));
+	b.threads = b.pool ? crush_pool_threads(b.pool) : 0;
+	b.summary = crush_make_weight_summary(weights, weight_max);
+	b.result = malloc(((size_t)x_count * result_max + 1) * sizeof(int));
+	b.result_len = calloc((size_t)x_count + 1, sizeof(int));
+	b.visited = malloc(((size_t)x_count + 1) * sizeof(__u64));
+	b.count = calloc(map->max_devices + 1, sizeof(__s64));
+	b.device_target = malloc((map->max_devices + 1) * sizeof(double));
+	b.reached = malloc(map->max_buckets + 1);
+	b.bucket_weight = malloc((map->max_buckets + 1) * sizeof(double));
+	b.bucket_count = malloc((map->max_buckets + 1) * sizeof(double));
+	b.bucket_target = malloc((map->max_buckets + 1) * sizeof(double));
+	b.workers = calloc(b.threads + 1, sizeof(*b.workers));
+	r = -ENOMEM;
+	if (!b.pool || !b.summary || !b.result || !b.result_len || !b.visited || !b.count ||
+	    !b.device_target || !b.reached || !b.bucket_weight ||
+	    !b.bucket_count || !b.bucket_target || !b.workers)
+		goto out;
+	for (t = 0; t < b.threads; t++) {
+		b.workers[t].ctx = crush_context_create();
+		b.workers[t].delta = calloc(map->max_devices + 1,
+					    sizeof(__s64));
+		if (!b.workers[t].ctx || !b.workers[t].delta ||
+		    crush_context_bind(b.workers[t].ctx, map, 0, result_max))
+			goto out;
+		crush_context_set_weight_summary(b.workers[t].ctx, b.summary);
+		b.workers[t].cwin = crush_context_workspace(b.workers[t].ctx);
+		crush_set_track_visited(b.workers[t].cwin, 1);
+	}
+
+	/* every input is mapped the first time */
+	for (t = 0; t < x_count; t++)
+		b.visited[t] = ~0ULL;
+	b.changed = ~0ULL;
+	balance_pass(&b);
+	for (;;) {
+		deviation = balance_targets(&b);
+		if (deviation * 0x10000 <= tolerance) {
+			r = 0;
+			break;
+		}
+		r = 1;
+		if (iterations == max_iterations)
+			break;
+		balance_adjust(&b, tolerance / (double)0x10000);
+		if (!b.changed)
+			break;
+		iterations++;
+		balance_pass(&b);
+	}
+
+	if (report) {
+		report->iterations = iterations;
+		report->deviation = deviation * 0x10000 < 0xffffffffu ?
+			deviation * 0x10000 : 0xffffffffu;
+		report->mapped = 0;
+		for (t = 0; t < b.threads; t++)
+			report->mapped += b.workers[t].mapped;
+	}
+out:
+	balance_free(&b);
+	return r;
+}
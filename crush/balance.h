@@ -0,0 +1,76 @@
+#ifndef CEPH_CRUSH_BALANCE_H
+#define CEPH_CRUSH_BALANCE_H
+
+/*
+ * Adjust the weight sets of straw2 buckets so that devices receive
+ * their share of the inputs.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * The outcome of crush_balance().
+ */
+struct crush_balance_report {
+	int iterations;		/*!< the number of times weights were adjusted */
+	__u32 deviation;	/*!< the largest |count - target| / target of a device, 16.16 fixed point */
+	__u64 mapped;		/*!< the number of inputs mapped, the first mapping included */
+};
+
+/** @ingroup API
+ *
+ * Adjust the weight sets of __choose_args__ so that the number of
+ * times each device appears in the mappings of the __x_count__
+ * consecutive inputs starting at __x_begin__ by the rule __ruleno__ is
+ * close to its target. The item weights of __map__ are not modified:
+ * __choose_args__ is an overlay, usually allocated with
+ * crush_make_choose_args(), to be given to crush_do_rule() afterwards.
+ *
+ * The target of a device is its share of the items emitted below the
+ * bucket taken by the rule, in proportion of its weight in its parent
+ * bucket. The devices that are out according to __weights__ have no
+ * target and do not count in the weight of their ancestors.
+ *
+ * At each iteration, the inputs are mapped and the weight of an item
+ * of a straw2 bucket whose count deviates from its target by more than
+ * __tolerance__, or half of it if the item is a bucket, is moved half
+ * way to weight * target / count, in all the weight sets of the
+ * bucket. Only the inputs whose mapping chose from a bucket that
+ * was adjusted are mapped again, see crush_take_visited(). It stops
+ * when no device deviates by more than __tolerance__ or after
+ * __max_iterations__ iterations.
+ *
+ * The inputs are mapped by __threads__ threads. If __threads__ is 0,
+ * one thread per online CPU is used.
+ *
+ * - return -EINVAL if __ruleno__ is not a rule of __map__, if
+ *   __result_max__ < 1, if __x_count__ < 0 or if __choose_args__ is NULL
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param map the crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param result_max the maximum number of items in a mapping
+ * @param x_begin the first input
+ * @param x_count the number of inputs
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param choose_args an array of __map->max_buckets__ crush_choose_arg
+ * @param max_iterations the maximum number of iterations
+ * @param tolerance the acceptable deviation, 16.16 fixed point
+ * @param threads the number of threads or 0
+ * @param report the outcome or NULL
+ *
+ * @returns 0 if no device deviates by more than __tolerance__, 1 if
+ * __max_iterations__ was reached before, < 0 on error
+ */
+extern int crush_balance(const struct crush_map *map, int ruleno,
+			 int result_max, int x_begin, int x_count,
+			 const __u32 *weights, int weight_max,
+			 struct crush_choose_arg *choose_args,
+			 int max_iterations, __u32 tolerance, int threads,
+			 struct crush_balance_report *report);
+
+#endif
@@ -10,17 +10,66 @@
 
 #include "builder.h"
 #include "hash.h"
+#include "arena.h"
 
 #define dprintk(args...) /* printf(args) */
 
 #define BUG_ON(x) assert(!(x))
 
-struct crush_map *crush_create()
+/*
+ * The buckets made for a map that has an arena are allocated in it,
+ * the others with malloc(3). The arrays of a bucket are allocated
+ * where the bucket is, so that a bucket made without the arena
+ * stays out of it when it is added to the map.
+ */
+static struct crush_arena *arena_of(const struct crush_map *map,
+				    const void *owner)
+{
+	if (map && map->arena && crush_arena_owns(map->arena, owner))
+		return map->arena;
+	return NULL;
+}
+
+static void *arena_alloc(struct crush_arena *arena, size_t size)
+{
+	if (arena)
+		return crush_arena_alloc(arena, size);
+	return malloc(size);
+}
+
+/*
+ * The size realloc(3) is asked for an array of @size bytes: the next
+ * power of two, so that an array grown one item at a time, as the
+ * bucket arrays are, is only moved when its size doubles. realloc(3)
+ * to the same capacity leaves it in place.
+ */
+static size_t malloc_capacity(size_t size)
+{
+	size_t capacity = 16;
+
+	if (size == 0)
+		return 0;
+	while (capacity < size && capacity <= ((size_t)-1) / 2)
+		capacity *= 2;
+	return capacity < size ? size : capacity;
+}
+
+static void *arena_realloc(struct crush_arena *arena, void *p, size_t size)
+{
+	if (arena)
+		return crush_arena_realloc(arena, p, size);
+	return realloc(p, malloc_capacity(size));
+}
+
+/* arena blocks are released with the arena */
+static void arena_free(struct crush_arena *arena, void *p)
+{
+	if (!arena)
+		free(p);
+}
+
+static void crush_init(struct crush_map *m)
 {
-	struct crush_map *m;
-	m = malloc(sizeof(*m));
-        if (!m)
-                return NULL;
 	memset(m, 0, sizeof(*m));
 
 	/* initialize legacy tunable values */
@@ -34,9 +83,44 @@ struct crush_map *crush_create()
 	// by default, use legacy types, and also exclude tree,
 	// since it was buggy.
 	m->allowed_bucket_algs = CRUSH_LEGACY_ALLOWED_BUCKET_ALGS;
+}
+
+struct crush_map *crush_create()
+{
+	struct crush_map *m;
+	m = malloc(sizeof(*m));
+        if (!m)
+                return NULL;
+	crush_init(m);
+	return m;
+}
+
+struct crush_map *crush_create_arena(struct crush_arena *arena)
+{
+	struct crush_map *m;
+
+	if (!arena)
+		return NULL;
+	m = crush_arena_alloc(arena, sizeof(*m));
+	if (!m) {
+		crush_arena_destroy(arena);
+		return NULL;
+	}
+	crush_init(m);
+	m->arena = arena;
 	return m;
 }
 
+static int link_parents(struct crush_map *map);
+static int index_rules(struct crush_map *map);
+
+/* the bytes of the array of bucket workspaces of @max_buckets buckets */
+static size_t work_array_size(__s32 max_buckets)
+{
+	return crush_work_align(sizeof(struct crush_work) +
+				max_buckets * sizeof(struct crush_work_bucket *));
+}
+
 /*
  * finalize should be called _after_ all buckets are added to the map.
  */
@@ -47,10 +131,8 @@ void crush_finalize(struct crush_map *map)
 
 	/* Calculate the needed working space while we do other
 	   finalization tasks. */
-	map->working_size = sizeof(struct crush_work);
 	/* Space for the array of pointers to per-bucket workspace */
-	map->working_size += map->max_buckets *
-		sizeof(struct crush_work_bucket *);
+	map->working_size = work_array_size(map->max_buckets);
 
 	/* calc max_devices */
 	map->max_devices = 0;
@@ -62,15 +144,369 @@ void crush_finalize(struct crush_map *map)
 				map->max_devices = map->buckets[b]->items[i] + 1;
 
 		switch (map->buckets[b]->alg) {
+		case CRUSH_BUCKET_STRAW2:
+			/* On failure item_reciprocals is NULL and the
+			   mapper divides by the weights instead. */
+			crush_calc_straw2_reciprocals(map,
+				(struct crush_bucket_straw2 *)map->buckets[b]);
+			break;
+		case CRUSH_BUCKET_TREE:
+			/* On failure descent_weights is NULL and the
+			   mapper descends the node weights instead. */
+			crush_calc_tree_descent(map,
+				(struct crush_bucket_tree *)map->buckets[b]);
+			break;
 		default:
-			/* The base case, permutation variables and
-			   the pointer to the permutation array. */
-			map->working_size += sizeof(struct crush_work_bucket);
 			break;
 		}
-		/* Every bucket has a permutation array. */
-		map->working_size += map->buckets[b]->size * sizeof(__u32);
+		/* The permutation variables, the pointer to the
+		   permutation array and the array itself. */
+		map->working_size +=
+			crush_work_bucket_size(map->buckets[b]->size);
 	}
+
+	/* On failure the back-links are NULL and the incremental
+	   functions build them again. */
+	link_parents(map);
+
+	/* On failure crush_find_rule() scans the rules instead. */
+	index_rules(map);
+}
+
+/** rule table **/
+
+static void release_rule_table(struct crush_map *map)
+{
+	arena_free(arena_of(map, map), map->rule_table);
+	map->rule_table = NULL;
+}
+
+static int index_rules(struct crush_map *map)
+{
+	struct crush_rule_table *table;
+	/* the (ruleset, type) of each row, ruleset first */
+	__u16 keys[CRUSH_MAX_RULES];
+	int rows = 0, row, i;
+	__u32 r;
+
+	release_rule_table(map);
+	if (map->max_rules > CRUSH_MAX_RULES)
+		return -E2BIG;
+	for (r = 0; r < map->max_rules; r++) {
+		const struct crush_rule *rule = map->rules[r];
+		__u16 key;
+
+		if (!rule)
+			continue;
+		key = rule->mask.ruleset << 8 | rule->mask.type;
+		for (row = 0; row < rows && keys[row] < key; row++)
+			;
+		if (row < rows && keys[row] == key)
+			continue;
+		memmove(keys + row + 1, keys + row,
+			(rows - row) * sizeof(keys[0]));
+		keys[row] = key;
+		rows++;
+	}
+
+	table = arena_alloc(arena_of(map, map), crush_rule_table_size(rows));
+	if (!table)
+		return -ENOMEM;
+	for (i = 0, row = 0; i <= CRUSH_MAX_RULESET; i++) {
+		while (row < rows && keys[row] >> 8 < i)
+			row++;
+		table->first[i] = row;
+	}
+	for (row = 0; row < rows; row++) {
+		table->types[row] = keys[row] & 0xff;
+		for (i = 0; i < CRUSH_RULE_TABLE_SIZES; i++)
+			table->rules[row][i] = -1;
+	}
+	for (r = 0; r < map->max_rules; r++) {
+		const struct crush_rule *rule = map->rules[r];
+
+		if (!rule)
+			continue;
+		for (row = table->first[rule->mask.ruleset];
+		     table->types[row] != rule->mask.type; row++)
+			;
+		for (i = rule->mask.min_size; i <= rule->mask.max_size; i++)
+			if (table->rules[row][i] < 0)
+				table->rules[row][i] = r;
+	}
+	map->rule_table = table;
+	return 0;
+}
+
+/** parents **/
+
+static __s32 *parent_link(const struct crush_map *map, int item)
+{
+	if (item < 0) {
+		if ((__u32)(-1-item) >= map->max_bucket_parents)
+			return NULL;
+		return &map->bucket_parents[-1-item];
+	}
+	if ((__u32)item >= map->max_device_parents)
+		return NULL;
+	return &map->device_parents[item];
+}
+
+static int grow_parents(struct crush_arena *arena, __s32 **parents,
+			__u32 *max, __u32 size)
+{
+	__s32 *p;
+
+	if (size <= *max)
+		return 0;
+	if (size < 2 * *max)
+		size = 2 * *max;
+	p = arena_realloc(arena, *parents, size * sizeof(*p));
+	if (!p)
+		return -ENOMEM;
+	memset(p + *max, 0, (size - *max) * sizeof(*p));
+	*parents = p;
+	*max = size;
+	return 0;
+}
+
+/* make sure @item has a back-link */
+static int reserve_parent(struct crush_map *map, int item)
+{
+	struct crush_arena *arena = arena_of(map, map);
+
+	if (item < 0)
+		return grow_parents(arena, &map->bucket_parents,
+				    &map->max_bucket_parents, -item);
+	return grow_parents(arena, &map->device_parents,
+			    &map->max_device_parents, item + 1);
+}
+
+static int link_parents(struct crush_map *map)
+{
+	struct crush_arena *arena = arena_of(map, map);
+	__s32 *link;
+	__u32 i;
+	int b;
+
+	map->max_bucket_parents = map->max_device_parents = 0;
+	if (grow_parents(arena, &map->bucket_parents, &map->max_bucket_parents,
+			 map->max_buckets ? map->max_buckets : 1) < 0 ||
+	    grow_parents(arena, &map->device_parents, &map->max_device_parents,
+			 map->max_devices ? map->max_devices : 1) < 0)
+		goto nomem;
+
+	for (b = 0; b < map->max_buckets; b++) {
+		const struct crush_bucket *bucket = map->buckets[b];
+
+		if (!bucket)
+			continue;
+		for (i = 0; i < bucket->size; i++) {
+			/* a dangling bucket id is not in the table yet */
+			if (reserve_parent(map, bucket->items[i]) < 0)
+				goto nomem;
+			link = parent_link(map, bucket->items[i]);
+			*link = *link ? CRUSH_PARENT_MANY : bucket->id;
+		}
+	}
+	return 0;
+
+nomem:
+	arena_free(arena, map->bucket_parents);
+	arena_free(arena, map->device_parents);
+	map->bucket_parents = map->device_parents = NULL;
+	map->max_bucket_parents = map->max_device_parents = 0;
+	return -ENOMEM;
+}
+
+int crush_get_parent(const struct crush_map *map, int item)
+{
+	const __s32 *link = parent_link(map, item);
+
+	return link ? *link : 0;
+}
+
+static struct crush_bucket *get_bucket(const struct crush_map *map, int id)
+{
+	if (id >= 0 || -1-id >= map->max_buckets)
+		return NULL;
+	return map->buckets[-1-id];
+}
+
+/*
+ * Check that the ancestors of the bucket @id can be updated
+ * incrementally and that @item is not one of them.
+ */
+static int check_ancestors(const struct crush_map *map, int id, int item)
+{
+	int depth;
+
+	for (depth = 0; depth <= map->max_buckets; depth++) {
+		if (id == CRUSH_PARENT_MANY)
+			return -EINVAL;
+		if (id == 0)
+			return 0;
+		if (id == item)
+			return -ELOOP;
+		id = crush_get_parent(map, id);
+	}
+	return -ELOOP;
+}
+
+/* set the weight of the bucket @id in each of its ancestors */
+static void reweight_ancestors(struct crush_map *map, int id)
+{
+	int parent;
+
+	while ((parent = crush_get_parent(map, id)) != 0) {
+		crush_bucket_adjust_item_weight(map, get_bucket(map, parent),
+						id, get_bucket(map, id)->weight);
+		id = parent;
+	}
+}
+
+static int prepare_incremental(struct crush_map *map, int item, int *parent)
+{
+	int r;
+
+	if (!map->bucket_parents) {
+		r = link_parents(map);
+		if (r < 0)
+			return r;
+	}
+	*parent = crush_get_parent(map, item);
+	if (*parent == 0)
+		return -ENOENT;
+	return check_ancestors(map, *parent, 0);
+}
+
+int crush_map_add_bucket(struct crush_map *map, int id,
+			 struct crush_bucket *bucket, int *idout)
+{
+	__s32 max_buckets = map->max_buckets;
+	__u32 i;
+	int r;
+
+	for (i = 0; i < bucket->size; i++)
+		if (bucket->items[i] < 0 && !get_bucket(map, bucket->items[i]))
+			return -ENOENT;
+	if (!map->bucket_parents) {
+		r = link_parents(map);
+		if (r < 0)
+			return r;
+	}
+	for (i = 0; i < bucket->size; i++) {
+		r = reserve_parent(map, bucket->items[i]);
+		if (r < 0)
+			return r;
+		if (crush_get_parent(map, bucket->items[i]) != 0)
+			return -EEXIST;
+	}
+	if (id == 0)
+		id = crush_get_next_bucket_id(map);
+	r = reserve_parent(map, id);
+	if (r < 0)
+		return r;
+	r = crush_add_bucket(map, id, bucket, idout);
+	if (r < 0)
+		return r;
+
+	switch (bucket->alg) {
+	case CRUSH_BUCKET_STRAW2:
+		crush_calc_straw2_reciprocals(map,
+			(struct crush_bucket_straw2 *)bucket);
+		break;
+	case CRUSH_BUCKET_TREE:
+		crush_calc_tree_descent(map, (struct crush_bucket_tree *)bucket);
+		break;
+	default:
+		break;
+	}
+	map->working_size += work_array_size(map->max_buckets) -
+		work_array_size(max_buckets) +
+		crush_work_bucket_size(bucket->size);
+	for (i = 0; i < bucket->size; i++) {
+		*parent_link(map, bucket->items[i]) = id;
+		if (bucket->items[i] >= map->max_devices)
+			map->max_devices = bucket->items[i] + 1;
+	}
+	return 0;
+}
+
+int crush_map_add_item(struct crush_map *map, int bucketno, int item, int weight)
+{
+	struct crush_bucket *bucket = get_bucket(map, bucketno);
+	__u32 size;
+	int r;
+
+	if (!bucket || (item < 0 && !get_bucket(map, item)))
+		return -ENOENT;
+	if (!map->bucket_parents) {
+		r = link_parents(map);
+		if (r < 0)
+			return r;
+	}
+	r = reserve_parent(map, item);
+	if (r < 0)
+		return r;
+	r = reserve_parent(map, bucketno);
+	if (r < 0)
+		return r;
+	if (crush_get_parent(map, item) != 0)
+		return -EEXIST;
+	r = check_ancestors(map, bucketno, item);
+	if (r < 0)
+		return r;
+
+	size = bucket->size;
+	r = crush_bucket_add_item(map, bucket, item, weight);
+	if (r < 0)
+		return r;
+	map->working_size += crush_work_bucket_size(bucket->size) -
+		crush_work_bucket_size(size);
+	*parent_link(map, item) = bucketno;
+	if (item >= map->max_devices)
+		map->max_devices = item + 1;
+	reweight_ancestors(map, bucketno);
+	return 0;
+}
+
+int crush_map_adjust_item_weight(struct crush_map *map, int item, int weight)
+{
+	int parent;
+	int r = prepare_incremental(map, item, &parent);
+
+	if (r < 0)
+		return r;
+	crush_bucket_adjust_item_weight(map, get_bucket(map, parent),
+					item, weight);
+	reweight_ancestors(map, parent);
+	return 0;
+}
+
+int crush_map_remove_item(struct crush_map *map, int item)
+{
+	struct crush_bucket *bucket;
+	__u32 size;
+	int parent;
+	int r = prepare_incremental(map, item, &parent);
+
+	if (r < 0)
+		return r;
+	bucket = get_bucket(map, parent);
+	size = bucket->size;
+	r = crush_bucket_remove_item(map, bucket, item);
+	if (r < 0)
+		return r;
+	map->working_size -= crush_work_bucket_size(size) -
+		crush_work_bucket_size(bucket->size);
+	*parent_link(map, item) = 0;
+	/* the devices that are in no bucket do not count */
+	while (map->max_devices > 0 &&
+	       crush_get_parent(map, map->max_devices - 1) == 0)
+		map->max_devices--;
+	reweight_ancestors(map, parent);
+	return 0;
 }
 
 
@@ -79,6 +515,7 @@ void crush_finalize(struct crush_map *map)
 
 int crush_add_rule(struct crush_map *map, struct crush_rule *rule, int ruleno)
 {
+	struct crush_arena *arena = arena_of(map, map);
 	__u32 r;
 
 	if (ruleno < 0) {
@@ -98,7 +535,7 @@ int crush_add_rule(struct crush_map *map, struct crush_rule *rule, int ruleno)
 			return -ENOSPC;
 		oldsize = map->max_rules;
 		map->max_rules = r+1;
-		if ((_realloc = realloc(map->rules, map->max_rules * sizeof(map->rules[0]))) == NULL) {
+		if ((_realloc = arena_realloc(arena, map->rules, map->max_rules * sizeof(map->rules[0]))) == NULL) {
 			return -ENOMEM; 
 		} else {
 			map->rules = _realloc;
@@ -108,6 +545,8 @@ int crush_add_rule(struct crush_map *map, struct crush_rule *rule, int ruleno)
 
 	/* add it */
 	map->rules[r] = rule;
+	/* until crush_finalize() indexes it */
+	release_rule_table(map);
 	return r;
 }
 
@@ -153,6 +592,7 @@ int crush_add_bucket(struct crush_map *map,
 		     struct crush_bucket *bucket,
 		     int *idout)
 {
+	struct crush_arena *arena = arena_of(map, map);
 	int pos;
 
 	/* find a bucket id */
@@ -168,7 +608,7 @@ int crush_add_bucket(struct crush_map *map,
 		else
 			map->max_buckets = 8;
 		void *_realloc = NULL;
-		if ((_realloc = realloc(map->buckets, map->max_buckets * sizeof(map->buckets[0]))) == NULL) {
+		if ((_realloc = arena_realloc(arena, map->buckets, map->max_buckets * sizeof(map->buckets[0]))) == NULL) {
 			return -ENOMEM; 
 		} else {
 			map->buckets = _realloc;
@@ -193,22 +633,30 @@ int crush_remove_bucket(struct crush_map *map, struct crush_bucket *bucket)
 	int pos = -1 - bucket->id;
        assert(pos < map->max_buckets);
 	map->buckets[pos] = NULL;
-	crush_destroy_bucket(bucket);
+	crush_release_bucket(map, bucket);
 	return 0;
 }
 
+void crush_release_bucket(struct crush_map *map, struct crush_bucket *bucket)
+{
+	/* the arena is released by crush_destroy() */
+	if (!arena_of(map, bucket))
+		crush_destroy_bucket(bucket);
+}
+
 
 /* uniform bucket */
 
 struct crush_bucket_uniform *
-crush_make_uniform_bucket(int hash, int type, int size,
+crush_make_uniform_bucket(struct crush_map *map, int hash, int type, int size,
 			  int *items,
 			  int item_weight)
 {
+	struct crush_arena *arena = arena_of(map, map);
 	int i;
 	struct crush_bucket_uniform *bucket;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = arena_alloc(arena, sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -222,7 +670,7 @@ crush_make_uniform_bucket(int hash, int type, int size,
 
 	bucket->h.weight = size * item_weight;
 	bucket->item_weight = item_weight;
-	bucket->h.items = malloc(sizeof(__s32)*size);
+	bucket->h.items = arena_alloc(arena, sizeof(__s32)*size);
 
         if (!bucket->h.items)
                 goto err;
@@ -232,8 +680,8 @@ crush_make_uniform_bucket(int hash, int type, int size,
 
 	return bucket;
 err:
-        free(bucket->h.items);
-        free(bucket);
+        arena_free(arena, bucket->h.items);
+        arena_free(arena, bucket);
         return NULL;
 }
 
@@ -241,15 +689,16 @@ err:
 /* list bucket */
 
 struct crush_bucket_list*
-crush_make_list_bucket(int hash, int type, int size,
+crush_make_list_bucket(struct crush_map *map, int hash, int type, int size,
 		       int *items,
 		       int *weights)
 {
+	struct crush_arena *arena = arena_of(map, map);
 	int i;
 	int w;
 	struct crush_bucket_list *bucket;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = arena_alloc(arena, sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -258,15 +707,15 @@ crush_make_list_bucket(int hash, int type, int size,
 	bucket->h.type = type;
 	bucket->h.size = size;
 
-	bucket->h.items = malloc(sizeof(__s32)*size);
+	bucket->h.items = arena_alloc(arena, sizeof(__s32)*size);
         if (!bucket->h.items)
                 goto err;
 
 
-        bucket->item_weights = malloc(sizeof(__u32)*size);
+        bucket->item_weights = arena_alloc(arena, sizeof(__u32)*size);
         if (!bucket->item_weights)
                 goto err;
-	bucket->sum_weights = malloc(sizeof(__u32)*size);
+	bucket->sum_weights = arena_alloc(arena, sizeof(__u32)*size);
         if (!bucket->sum_weights)
                 goto err;
 	w = 0;
@@ -287,10 +736,10 @@ crush_make_list_bucket(int hash, int type, int size,
 
 	return bucket;
 err:
-        free(bucket->sum_weights);
-        free(bucket->item_weights);
-        free(bucket->h.items);
-        free(bucket);
+        arena_free(arena, bucket->sum_weights);
+        arena_free(arena, bucket->item_weights);
+        arena_free(arena, bucket->h.items);
+        arena_free(arena, bucket);
         return NULL;
 }
 
@@ -333,16 +782,17 @@ static int calc_depth(int size)
 }
 
 struct crush_bucket_tree*
-crush_make_tree_bucket(int hash, int type, int size,
+crush_make_tree_bucket(struct crush_map *map, int hash, int type, int size,
 		       int *items,    /* in leaf order */
 		       int *weights)
 {
+	struct crush_arena *arena = arena_of(map, map);
 	struct crush_bucket_tree *bucket;
 	int depth;
 	int node;
 	int i, j;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = arena_alloc(arena, sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -360,7 +810,7 @@ crush_make_tree_bucket(int hash, int type, int size,
 		return bucket;
 	}
 
-	bucket->h.items = malloc(sizeof(__s32)*size);
+	bucket->h.items = arena_alloc(arena, sizeof(__s32)*size);
         if (!bucket->h.items)
                 goto err;
 
@@ -369,7 +819,7 @@ crush_make_tree_bucket(int hash, int type, int size,
 	bucket->num_nodes = 1 << depth;
 	dprintk("size %d depth %d nodes %d\n", size, depth, bucket->num_nodes);
 
-        bucket->node_weights = malloc(sizeof(__u32)*bucket->num_nodes);
+        bucket->node_weights = arena_alloc(arena, sizeof(__u32)*bucket->num_nodes);
         if (!bucket->node_weights)
                 goto err;
 
@@ -398,14 +848,50 @@ crush_make_tree_bucket(int hash, int type, int size,
 	}
 	BUG_ON(bucket->node_weights[bucket->num_nodes/2] != bucket->h.weight);
 
+	if (crush_calc_tree_descent(map, bucket) < 0)
+		goto err;
+
 	return bucket;
 err:
-        free(bucket->node_weights);
-        free(bucket->h.items);
-        free(bucket);
+        arena_free(arena, bucket->node_weights);
+        arena_free(arena, bucket->h.items);
+        arena_free(arena, bucket);
         return NULL;
 }
 
+int crush_calc_tree_descent(struct crush_map *map,
+			    struct crush_bucket_tree *bucket)
+{
+	struct crush_arena *arena = arena_of(map, bucket);
+	void *_realloc = NULL;
+	__u32 half, n, p = 0;
+
+	/* a single leaf is its own root: there is nothing to descend */
+	if (bucket->num_nodes <= 2) {
+		arena_free(arena, bucket->descent_weights);
+		bucket->descent_weights = NULL;
+		return 0;
+	}
+	if ((_realloc = arena_realloc(arena, bucket->descent_weights,
+				sizeof(__u32)*(bucket->num_nodes - 2))) == NULL) {
+		arena_free(arena, bucket->descent_weights);
+		bucket->descent_weights = NULL;
+		return -ENOMEM;
+	} else {
+		bucket->descent_weights = _realloc;
+	}
+	/* the nodes whose lowest bit set is half are a level of the
+	   tree, from left to right */
+	for (half = bucket->num_nodes >> 1; half > 1; half >>= 1) {
+		for (n = half; n < bucket->num_nodes; n += half << 1, p++) {
+			bucket->descent_weights[2*p] = bucket->node_weights[n];
+			bucket->descent_weights[2*p+1] =
+				bucket->node_weights[n - (half >> 1)];
+		}
+	}
+	return 0;
+}
+
 
 
 /* straw bucket */
@@ -563,10 +1049,11 @@ crush_make_straw_bucket(struct crush_map *map,
 			int *items,
 			int *weights)
 {
+	struct crush_arena *arena = arena_of(map, map);
 	struct crush_bucket_straw *bucket;
 	int i;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = arena_alloc(arena, sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -575,13 +1062,13 @@ crush_make_straw_bucket(struct crush_map *map,
 	bucket->h.type = type;
 	bucket->h.size = size;
 
-        bucket->h.items = malloc(sizeof(__s32)*size);
+        bucket->h.items = arena_alloc(arena, sizeof(__s32)*size);
         if (!bucket->h.items)
                 goto err;
-	bucket->item_weights = malloc(sizeof(__u32)*size);
+	bucket->item_weights = arena_alloc(arena, sizeof(__u32)*size);
         if (!bucket->item_weights)
                 goto err;
-        bucket->straws = malloc(sizeof(__u32)*size);
+        bucket->straws = arena_alloc(arena, sizeof(__u32)*size);
         if (!bucket->straws)
                 goto err;
 
@@ -597,13 +1084,69 @@ crush_make_straw_bucket(struct crush_map *map,
 
 	return bucket;
 err:
-        free(bucket->straws);
-        free(bucket->item_weights);
-        free(bucket->h.items);
-        free(bucket);
+        arena_free(arena, bucket->straws);
+        arena_free(arena, bucket->item_weights);
+        arena_free(arena, bucket->h.items);
+        arena_free(arena, bucket);
         return NULL;
 }
 
+/* straw2 bucket */
+
+__u64 crush_calc_straw2_reciprocal(__u32 weight)
+{
+	unsigned int log2 = 0, shift, i;
+	__u64 quotient = 0, remainder = 0;
+
+	if (weight == 0)
+		return 0;
+	while (((__u64)1 << log2) < weight)
+		log2++;
+	/*
+	 * Granlund & Montgomery: with shift = 49 + ceil(log2(weight))
+	 * and multiplier = ceil(2^shift / weight), (a * multiplier) >>
+	 * shift == a / weight for all a < 2^49. The multiplier is in
+	 * [2^49, 2^50] and is computed with a long division of
+	 * 2^shift - 1 because 2^shift does not fit in 64 bits.
+	 */
+	shift = 49 + log2;
+	for (i = 0; i < shift; i++) {
+		remainder = (remainder << 1) | 1;
+		quotient <<= 1;
+		if (remainder >= weight) {
+			remainder -= weight;
+			quotient |= 1;
+		}
+	}
+	return ((__u64)shift << CRUSH_RECIPROCAL_SHIFT_BITS) | (quotient + 1);
+}
+
+int crush_calc_straw2_reciprocals(struct crush_map *map,
+				  struct crush_bucket_straw2 *bucket)
+{
+	struct crush_arena *arena = arena_of(map, bucket);
+	void *_realloc = NULL;
+	unsigned i;
+
+	if (!map || !map->straw2_reciprocals || bucket->h.size == 0) {
+		arena_free(arena, bucket->item_reciprocals);
+		bucket->item_reciprocals = NULL;
+		return 0;
+	}
+	if ((_realloc = arena_realloc(arena, bucket->item_reciprocals,
+				sizeof(__u64)*bucket->h.size)) == NULL) {
+		arena_free(arena, bucket->item_reciprocals);
+		bucket->item_reciprocals = NULL;
+		return -ENOMEM;
+	} else {
+		bucket->item_reciprocals = _realloc;
+	}
+	for (i = 0; i < bucket->h.size; i++)
+		bucket->item_reciprocals[i] =
+			crush_calc_straw2_reciprocal(bucket->item_weights[i]);
+	return 0;
+}
+
 struct crush_bucket_straw2 *
 crush_make_straw2_bucket(struct crush_map *map,
 			 int hash,
@@ -612,10 +1155,11 @@ crush_make_straw2_bucket(struct crush_map *map,
 			 int *items,
 			 int *weights)
 {
+	struct crush_arena *arena = arena_of(map, map);
 	struct crush_bucket_straw2 *bucket;
 	int i;
 
-	bucket = malloc(sizeof(*bucket));
+	bucket = arena_alloc(arena, sizeof(*bucket));
         if (!bucket)
                 return NULL;
 	memset(bucket, 0, sizeof(*bucket));
@@ -624,10 +1168,10 @@ crush_make_straw2_bucket(struct crush_map *map,
 	bucket->h.type = type;
 	bucket->h.size = size;
 
-        bucket->h.items = malloc(sizeof(__s32)*size);
+        bucket->h.items = arena_alloc(arena, sizeof(__s32)*size);
         if (!bucket->h.items)
                 goto err;
-	bucket->item_weights = malloc(sizeof(__u32)*size);
+	bucket->item_weights = arena_alloc(arena, sizeof(__u32)*size);
         if (!bucket->item_weights)
                 goto err;
 
@@ -638,15 +1182,106 @@ crush_make_straw2_bucket(struct crush_map *map,
 		bucket->item_weights[i] = weights[i];
 	}
 
+	if (crush_calc_straw2_reciprocals(map, bucket) < 0)
+		goto err;
+
 	return bucket;
 err:
-        free(bucket->item_weights);
-        free(bucket->h.items);
-        free(bucket);
+        arena_free(arena, bucket->item_weights);
+        arena_free(arena, bucket->h.items);
+        arena_free(arena, bucket);
         return NULL;
 }
 
 
+int crush_calc_straw2_tree(struct crush_map *map,
+			   struct crush_bucket_straw2_tree *bucket)
+{
+	struct crush_arena *arena = arena_of(map, bucket);
+	__u32 sizes[CRUSH_STRAW2_TREE_MAX_LEVELS + 1];
+	int levels = crush_straw2_tree_levels(bucket->h.size, sizes);
+	__u32 num_nodes = 0, i;
+	__u32 *nodes, *children;
+	void *_realloc = NULL;
+	int l;
+
+	for (l = 1; l <= levels; l++)
+		num_nodes += sizes[l];
+	if (num_nodes == 0) {
+		arena_free(arena, bucket->node_weights);
+		bucket->node_weights = NULL;
+		bucket->num_nodes = 0;
+		return 0;
+	}
+	if ((_realloc = arena_realloc(arena, bucket->node_weights,
+				sizeof(__u32)*num_nodes)) == NULL) {
+		return -ENOMEM;
+	} else {
+		bucket->node_weights = _realloc;
+	}
+	bucket->num_nodes = num_nodes;
+
+	children = bucket->item_weights;
+	nodes = bucket->node_weights;
+	for (l = 1; l <= levels; l++) {
+		memset(nodes, 0, sizeof(__u32)*sizes[l]);
+		for (i = 0; i < sizes[l - 1]; i++)
+			nodes[i / CRUSH_STRAW2_TREE_FANOUT] += children[i];
+		children = nodes;
+		nodes += sizes[l];
+	}
+	return 0;
+}
+
+struct crush_bucket_straw2_tree *
+crush_make_straw2_tree_bucket(struct crush_map *map,
+			      int hash,
+			      int type,
+			      int size,
+			      int *items,
+			      int *weights)
+{
+	struct crush_arena *arena = arena_of(map, map);
+	struct crush_bucket_straw2_tree *bucket;
+	int i;
+
+	bucket = arena_alloc(arena, sizeof(*bucket));
+	if (!bucket)
+		return NULL;
+	memset(bucket, 0, sizeof(*bucket));
+	bucket->h.alg = CRUSH_BUCKET_STRAW2_TREE;
+	bucket->h.hash = hash;
+	bucket->h.type = type;
+	bucket->h.size = size;
+
+	bucket->h.items = arena_alloc(arena, sizeof(__s32)*size);
+	if (!bucket->h.items)
+		goto err;
+	bucket->item_weights = arena_alloc(arena, sizeof(__u32)*size);
+	if (!bucket->item_weights)
+		goto err;
+
+	bucket->h.weight = 0;
+	for (i=0; i<size; i++) {
+		bucket->h.items[i] = items[i];
+		if (crush_addition_is_unsafe(bucket->h.weight, weights[i]))
+			goto err;
+		bucket->h.weight += weights[i];
+		bucket->item_weights[i] = weights[i];
+	}
+
+	if (crush_calc_straw2_tree(map, bucket) < 0)
+		goto err;
+
+	return bucket;
+err:
+	arena_free(arena, bucket->node_weights);
+	arena_free(arena, bucket->item_weights);
+	arena_free(arena, bucket->h.items);
+	arena_free(arena, bucket);
+	return NULL;
+}
+
 
 struct crush_bucket*
 crush_make_bucket(struct crush_map *map,
@@ -662,31 +1297,140 @@ crush_make_bucket(struct crush_map *map,
 			item_weight = weights[0];
 		else
 			item_weight = 0;
-		return (struct crush_bucket *)crush_make_uniform_bucket(hash, type, size, items, item_weight);
+		return (struct crush_bucket *)crush_make_uniform_bucket(map, hash, type, size, items, item_weight);
 
 	case CRUSH_BUCKET_LIST:
-		return (struct crush_bucket *)crush_make_list_bucket(hash, type, size, items, weights);
+		return (struct crush_bucket *)crush_make_list_bucket(map, hash, type, size, items, weights);
 
 	case CRUSH_BUCKET_TREE:
-		return (struct crush_bucket *)crush_make_tree_bucket(hash, type, size, items, weights);
+		return (struct crush_bucket *)crush_make_tree_bucket(map, hash, type, size, items, weights);
 
 	case CRUSH_BUCKET_STRAW:
 		return (struct crush_bucket *)crush_make_straw_bucket(map, hash, type, size, items, weights);
 	case CRUSH_BUCKET_STRAW2:
 		return (struct crush_bucket *)crush_make_straw2_bucket(map, hash, type, size, items, weights);
+	case CRUSH_BUCKET_STRAW2_TREE:
+		return (struct crush_bucket *)crush_make_straw2_tree_bucket(map, hash, type, size, items, weights);
 	}
 	return 0;
 }
 
 
+/* a malloc(3) copy of the @size bytes of @src, or of nothing */
+static void *clone_array(const void *src, size_t size, int *err)
+{
+	void *dst;
+
+	if (!src)
+		return NULL;
+	dst = malloc(size ? size : 1);
+	if (!dst) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+	memcpy(dst, src, size);
+	return dst;
+}
+
+struct crush_bucket *crush_clone_bucket(const struct crush_bucket *bucket)
+{
+	size_t size = bucket->size * sizeof(__u32);
+	struct crush_bucket *b;
+	int err = 0;
+
+	switch (bucket->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		b = clone_array(bucket, sizeof(struct crush_bucket_uniform), &err);
+		break;
+	case CRUSH_BUCKET_LIST: {
+		const struct crush_bucket_list *l =
+			(const struct crush_bucket_list *)bucket;
+		struct crush_bucket_list *c = clone_array(l, sizeof(*l), &err);
+
+		if (c) {
+			c->item_weights = clone_array(l->item_weights, size, &err);
+			c->sum_weights = clone_array(l->sum_weights, size, &err);
+		}
+		b = (struct crush_bucket *)c;
+		break;
+	}
+	case CRUSH_BUCKET_TREE: {
+		const struct crush_bucket_tree *t =
+			(const struct crush_bucket_tree *)bucket;
+		struct crush_bucket_tree *c = clone_array(t, sizeof(*t), &err);
+
+		if (c) {
+			c->node_weights = clone_array(t->node_weights,
+				t->num_nodes * sizeof(__u32), &err);
+			c->descent_weights = clone_array(t->descent_weights,
+				(t->num_nodes - 2) * sizeof(__u32), &err);
+		}
+		b = (struct crush_bucket *)c;
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		const struct crush_bucket_straw *t =
+			(const struct crush_bucket_straw *)bucket;
+		struct crush_bucket_straw *c = clone_array(t, sizeof(*t), &err);
+
+		if (c) {
+			c->item_weights = clone_array(t->item_weights, size, &err);
+			c->straws = clone_array(t->straws, size, &err);
+		}
+		b = (struct crush_bucket *)c;
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		const struct crush_bucket_straw2 *t =
+			(const struct crush_bucket_straw2 *)bucket;
+		struct crush_bucket_straw2 *c = clone_array(t, sizeof(*t), &err);
+
+		if (c) {
+			c->item_weights = clone_array(t->item_weights, size, &err);
+			c->item_reciprocals = clone_array(t->item_reciprocals,
+				bucket->size * sizeof(__u64), &err);
+		}
+		b = (struct crush_bucket *)c;
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2_TREE: {
+		const struct crush_bucket_straw2_tree *t =
+			(const struct crush_bucket_straw2_tree *)bucket;
+		struct crush_bucket_straw2_tree *c =
+			clone_array(t, sizeof(*t), &err);
+
+		if (c) {
+			c->item_weights = clone_array(t->item_weights, size, &err);
+			c->node_weights = clone_array(t->node_weights,
+				t->num_nodes * sizeof(__u32), &err);
+		}
+		b = (struct crush_bucket *)c;
+		break;
+	}
+	default:
+		return NULL;
+	}
+	if (!b)
+		return NULL;
+	b->items = clone_array(bucket->items, size, &err);
+	if (err < 0) {
+		/* the arrays not copied are NULL */
+		crush_destroy_bucket(b);
+		return NULL;
+	}
+	return b;
+}
+
+
 /************************************************/
 
-int crush_add_uniform_bucket_item(struct crush_bucket_uniform *bucket, int item, int weight)
+int crush_add_uniform_bucket_item(struct crush_map *map, struct crush_bucket_uniform *bucket, int item, int weight)
 {
+	struct crush_arena *arena = arena_of(map, bucket);
         int newsize = bucket->h.size + 1;
 	void *_realloc = NULL;
 	
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
@@ -703,22 +1447,23 @@ int crush_add_uniform_bucket_item(struct crush_bucket_uniform *bucket, int item,
         return 0;
 }
 
-int crush_add_list_bucket_item(struct crush_bucket_list *bucket, int item, int weight)
+int crush_add_list_bucket_item(struct crush_map *map, struct crush_bucket_list *bucket, int item, int weight)
 {
+	struct crush_arena *arena = arena_of(map, bucket);
         int newsize = bucket->h.size + 1;
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
 	}
-	if ((_realloc = realloc(bucket->sum_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->sum_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->sum_weights = _realloc;
@@ -743,79 +1488,77 @@ int crush_add_list_bucket_item(struct crush_bucket_list *bucket, int item, int w
 	return 0;
 }
 
-int crush_add_tree_bucket_item(struct crush_bucket_tree *bucket, int item, int weight)
+int crush_add_tree_bucket_item(struct crush_map *map, struct crush_bucket_tree *bucket, int item, int weight)
 {
+	struct crush_arena *arena = arena_of(map, bucket);
 	int newsize = bucket->h.size + 1;
-	int depth = calc_depth(newsize);;
+	int depth = calc_depth(newsize);
+	__u32 num_nodes = 1 << depth;
 	int node;
 	int j;
 	void *_realloc = NULL;
 
-	bucket->num_nodes = 1 << depth;
+	/* no node weighs more than the bucket */
+	if (crush_addition_is_unsafe(bucket->h.weight, weight))
+                return -ERANGE;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->node_weights, sizeof(__u32)*bucket->num_nodes)) == NULL) {
-		return -ENOMEM;
-	} else {
-		bucket->node_weights = _realloc;
+	if (num_nodes > bucket->num_nodes) {
+		if ((_realloc = arena_realloc(arena, bucket->node_weights, sizeof(__u32)*num_nodes)) == NULL) {
+			return -ENOMEM;
+		} else {
+			bucket->node_weights = _realloc;
+		}
+		memset(bucket->node_weights + bucket->num_nodes, 0,
+		       sizeof(__u32)*(num_nodes - bucket->num_nodes));
+		/* the depth increased: the old root is the left child
+		   of the new root and the right subtree is empty */
+		if (bucket->num_nodes > 0)
+			bucket->node_weights[num_nodes/2] =
+				bucket->node_weights[bucket->num_nodes/2];
+		bucket->num_nodes = num_nodes;
 	}
 
 	node = crush_calc_tree_node(newsize-1);
 	bucket->node_weights[node] = weight;
 
-	/* if the depth increase, we need to initialize the new root node's weight before add bucket item */
-	int root = bucket->num_nodes/2;
-	if (depth >= 2 && (node - 1) == root) {
-		/* if the new item is the first node in right sub tree, so
-		* the root node initial weight is left sub tree's weight
-		*/
-		bucket->node_weights[root] = bucket->node_weights[root/2];
-	}
-
 	for (j=1; j<depth; j++) {
 		node = parent(node);
-
-                if (crush_addition_is_unsafe(bucket->node_weights[node], weight))
-                        return -ERANGE;
-
 		bucket->node_weights[node] += weight;
                 dprintk(" node %d weight %d\n", node, bucket->node_weights[node]);
 	}
 
-
-	if (crush_addition_is_unsafe(bucket->h.weight, weight))
-                return -ERANGE;
-	
 	bucket->h.items[newsize-1] = item;
         bucket->h.weight += weight;
         bucket->h.size++;
 
-	return 0;
+	return crush_calc_tree_descent(map, bucket);
 }
 
 int crush_add_straw_bucket_item(struct crush_map *map,
 				struct crush_bucket_straw *bucket,
 				int item, int weight)
 {
+	struct crush_arena *arena = arena_of(map, bucket);
 	int newsize = bucket->h.size + 1;
 
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
 	}
-	if ((_realloc = realloc(bucket->straws, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->straws, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->straws = _realloc;
@@ -837,16 +1580,17 @@ int crush_add_straw2_bucket_item(struct crush_map *map,
 				 struct crush_bucket_straw2 *bucket,
 				 int item, int weight)
 {
+	struct crush_arena *arena = arena_of(map, bucket);
 	int newsize = bucket->h.size + 1;
 
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
@@ -861,7 +1605,38 @@ int crush_add_straw2_bucket_item(struct crush_map *map,
 	bucket->h.weight += weight;
 	bucket->h.size++;
 
-	return 0;
+	return crush_calc_straw2_reciprocals(map, bucket);
+}
+
+int crush_add_straw2_tree_bucket_item(struct crush_map *map, struct crush_bucket_straw2_tree *bucket,
+				      int item, int weight)
+{
+	struct crush_arena *arena = arena_of(map, bucket);
+	int newsize = bucket->h.size + 1;
+
+	void *_realloc = NULL;
+
+	if ((_realloc = arena_realloc(arena, bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+		return -ENOMEM;
+	} else {
+		bucket->h.items = _realloc;
+	}
+	if ((_realloc = arena_realloc(arena, bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+		return -ENOMEM;
+	} else {
+		bucket->item_weights = _realloc;
+	}
+
+	bucket->h.items[newsize-1] = item;
+	bucket->item_weights[newsize-1] = weight;
+
+	if (crush_addition_is_unsafe(bucket->h.weight, weight))
+                return -ERANGE;
+
+	bucket->h.weight += weight;
+	bucket->h.size++;
+
+	return crush_calc_straw2_tree(map, bucket);
 }
 
 int crush_bucket_add_item(struct crush_map *map,
@@ -869,15 +1644,17 @@ int crush_bucket_add_item(struct crush_map *map,
 {
 	switch (b->alg) {
 	case CRUSH_BUCKET_UNIFORM:
-		return crush_add_uniform_bucket_item((struct crush_bucket_uniform *)b, item, weight);
+		return crush_add_uniform_bucket_item(map, (struct crush_bucket_uniform *)b, item, weight);
 	case CRUSH_BUCKET_LIST:
-		return crush_add_list_bucket_item((struct crush_bucket_list *)b, item, weight);
+		return crush_add_list_bucket_item(map, (struct crush_bucket_list *)b, item, weight);
 	case CRUSH_BUCKET_TREE:
-		return crush_add_tree_bucket_item((struct crush_bucket_tree *)b, item, weight);
+		return crush_add_tree_bucket_item(map, (struct crush_bucket_tree *)b, item, weight);
 	case CRUSH_BUCKET_STRAW:
 		return crush_add_straw_bucket_item(map, (struct crush_bucket_straw *)b, item, weight);
 	case CRUSH_BUCKET_STRAW2:
 		return crush_add_straw2_bucket_item(map, (struct crush_bucket_straw2 *)b, item, weight);
+	case CRUSH_BUCKET_STRAW2_TREE:
+		return crush_add_straw2_tree_bucket_item(map, (struct crush_bucket_straw2_tree *)b, item, weight);
 	default:
 		return -1;
 	}
@@ -885,8 +1662,9 @@ int crush_bucket_add_item(struct crush_map *map,
 
 /************************************************/
 
-int crush_remove_uniform_bucket_item(struct crush_bucket_uniform *bucket, int item)
+int crush_remove_uniform_bucket_item(struct crush_map *map, struct crush_bucket_uniform *bucket, int item)
 {
+	struct crush_arena *arena = arena_of(map, bucket);
 	unsigned i, j;
 	int newsize;
 	void *_realloc = NULL;
@@ -897,7 +1675,7 @@ int crush_remove_uniform_bucket_item(struct crush_bucket_uniform *bucket, int it
 	if (i == bucket->h.size)
 		return -ENOENT;
 
-	for (j = i; j < bucket->h.size; j++)
+	for (j = i; j + 1 < bucket->h.size; j++)
 		bucket->h.items[j] = bucket->h.items[j+1];
 	newsize = --bucket->h.size;
 	if (bucket->item_weight < bucket->h.weight)
@@ -905,7 +1683,7 @@ int crush_remove_uniform_bucket_item(struct crush_bucket_uniform *bucket, int it
 	else
 		bucket->h.weight = 0;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
@@ -913,8 +1691,9 @@ int crush_remove_uniform_bucket_item(struct crush_bucket_uniform *bucket, int it
 	return 0;
 }
 
-int crush_remove_list_bucket_item(struct crush_bucket_list *bucket, int item)
+int crush_remove_list_bucket_item(struct crush_map *map, struct crush_bucket_list *bucket, int item)
 {
+	struct crush_arena *arena = arena_of(map, bucket);
 	unsigned i, j;
 	int newsize;
 	unsigned weight;
@@ -926,7 +1705,7 @@ int crush_remove_list_bucket_item(struct crush_bucket_list *bucket, int item)
 		return -ENOENT;
 
 	weight = bucket->item_weights[i];
-	for (j = i; j < bucket->h.size; j++) {
+	for (j = i; j + 1 < bucket->h.size; j++) {
 		bucket->h.items[j] = bucket->h.items[j+1];
 		bucket->item_weights[j] = bucket->item_weights[j+1];
 		bucket->sum_weights[j] = bucket->sum_weights[j+1] - weight;
@@ -939,17 +1718,17 @@ int crush_remove_list_bucket_item(struct crush_bucket_list *bucket, int item)
 	
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
 	}
-	if ((_realloc = realloc(bucket->sum_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->sum_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->sum_weights = _realloc;
@@ -957,8 +1736,9 @@ int crush_remove_list_bucket_item(struct crush_bucket_list *bucket, int item)
 	return 0;
 }
 
-int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
+int crush_remove_tree_bucket_item(struct crush_map *map, struct crush_bucket_tree *bucket, int item)
 {
+	struct crush_arena *arena = arena_of(map, bucket);
 	unsigned i;
 	unsigned newsize;
 
@@ -998,12 +1778,19 @@ int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
 		--newsize;
 	}
 
-	if (newsize != bucket->h.size) {
+	if (newsize == 0) {
+		arena_free(arena, bucket->h.items);
+		bucket->h.items = NULL;
+		arena_free(arena, bucket->node_weights);
+		bucket->node_weights = NULL;
+		bucket->num_nodes = 0;
+		bucket->h.size = 0;
+	} else if (newsize != bucket->h.size) {
 		int olddepth, newdepth;
 
 		void *_realloc = NULL;
 
-		if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+		if ((_realloc = arena_realloc(arena, bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 			return -ENOMEM;
 		} else {
 			bucket->h.items = _realloc;
@@ -1013,7 +1800,7 @@ int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
 		newdepth = calc_depth(newsize);
 		if (olddepth != newdepth) {
 			bucket->num_nodes = 1 << newdepth;
-			if ((_realloc = realloc(bucket->node_weights, 
+			if ((_realloc = arena_realloc(arena, bucket->node_weights, 
 						sizeof(__u32)*bucket->num_nodes)) == NULL) {
 				return -ENOMEM;
 			} else {
@@ -1023,45 +1810,45 @@ int crush_remove_tree_bucket_item(struct crush_bucket_tree *bucket, int item)
 
 		bucket->h.size = newsize;
 	}
-	return 0;
+	return crush_calc_tree_descent(map, bucket);
 }
 
 int crush_remove_straw_bucket_item(struct crush_map *map,
 				   struct crush_bucket_straw *bucket, int item)
 {
+	struct crush_arena *arena = arena_of(map, bucket);
 	int newsize = bucket->h.size - 1;
 	unsigned i, j;
 
-	for (i = 0; i < bucket->h.size; i++) {
-		if (bucket->h.items[i] == item) {
-			bucket->h.size--;
-			if (bucket->item_weights[i] < bucket->h.weight)
-				bucket->h.weight -= bucket->item_weights[i];
-			else
-				bucket->h.weight = 0;
-			for (j = i; j < bucket->h.size; j++) {
-				bucket->h.items[j] = bucket->h.items[j+1];
-				bucket->item_weights[j] = bucket->item_weights[j+1];
-			}
+	for (i = 0; i < bucket->h.size; i++)
+		if (bucket->h.items[i] == item)
 			break;
-		}
-	}
 	if (i == bucket->h.size)
 		return -ENOENT;
+
+	bucket->h.size--;
+	if (bucket->item_weights[i] < bucket->h.weight)
+		bucket->h.weight -= bucket->item_weights[i];
+	else
+		bucket->h.weight = 0;
+	for (j = i; j < bucket->h.size; j++) {
+		bucket->h.items[j] = bucket->h.items[j+1];
+		bucket->item_weights[j] = bucket->item_weights[j+1];
+	}
 	
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
 	}
-	if ((_realloc = realloc(bucket->straws, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->straws, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->straws = _realloc;
@@ -1073,55 +1860,100 @@ int crush_remove_straw_bucket_item(struct crush_map *map,
 int crush_remove_straw2_bucket_item(struct crush_map *map,
 				    struct crush_bucket_straw2 *bucket, int item)
 {
+	struct crush_arena *arena = arena_of(map, bucket);
 	int newsize = bucket->h.size - 1;
 	unsigned i, j;
 
-	for (i = 0; i < bucket->h.size; i++) {
-		if (bucket->h.items[i] == item) {
-			bucket->h.size--;
-			if (bucket->item_weights[i] < bucket->h.weight)
-				bucket->h.weight -= bucket->item_weights[i];
-			else
-				bucket->h.weight = 0;
-			for (j = i; j < bucket->h.size; j++) {
-				bucket->h.items[j] = bucket->h.items[j+1];
-				bucket->item_weights[j] = bucket->item_weights[j+1];
-			}
+	for (i = 0; i < bucket->h.size; i++)
+		if (bucket->h.items[i] == item)
 			break;
-		}
+	if (i == bucket->h.size)
+		return -ENOENT;
+
+	bucket->h.size--;
+	if (bucket->item_weights[i] < bucket->h.weight)
+		bucket->h.weight -= bucket->item_weights[i];
+	else
+		bucket->h.weight = 0;
+	for (j = i; j < bucket->h.size; j++) {
+		bucket->h.items[j] = bucket->h.items[j+1];
+		bucket->item_weights[j] = bucket->item_weights[j+1];
+	}
+
+	void *_realloc = NULL;
+
+	if ((_realloc = arena_realloc(arena, bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+		return -ENOMEM;
+	} else {
+		bucket->h.items = _realloc;
+	}
+	if ((_realloc = arena_realloc(arena, bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+		return -ENOMEM;
+	} else {
+		bucket->item_weights = _realloc;
 	}
+
+	return crush_calc_straw2_reciprocals(map, bucket);
+}
+
+int crush_remove_straw2_tree_bucket_item(struct crush_map *map, struct crush_bucket_straw2_tree *bucket,
+					 int item)
+{
+	struct crush_arena *arena = arena_of(map, bucket);
+	int newsize = bucket->h.size - 1;
+	unsigned i;
+
+	for (i = 0; i < bucket->h.size; i++)
+		if (bucket->h.items[i] == item)
+			break;
 	if (i == bucket->h.size)
 		return -ENOENT;
 
+	bucket->h.size--;
+	if (bucket->item_weights[i] < bucket->h.weight)
+		bucket->h.weight -= bucket->item_weights[i];
+	else
+		bucket->h.weight = 0;
+	/* the last item takes its place, the other items stay in their group */
+	bucket->h.items[i] = bucket->h.items[newsize];
+	bucket->item_weights[i] = bucket->item_weights[newsize];
+
+	if (newsize == 0) {
+		/* arena_realloc(arena, , 0) may free and return NULL */
+		return crush_calc_straw2_tree(map, bucket);
+	}
+
 	void *_realloc = NULL;
 
-	if ((_realloc = realloc(bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->h.items, sizeof(__s32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->h.items = _realloc;
 	}
-	if ((_realloc = realloc(bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
+	if ((_realloc = arena_realloc(arena, bucket->item_weights, sizeof(__u32)*newsize)) == NULL) {
 		return -ENOMEM;
 	} else {
 		bucket->item_weights = _realloc;
 	}
 
-	return 0;
+	return crush_calc_straw2_tree(map, bucket);
 }
 
 int crush_bucket_remove_item(struct crush_map *map, struct crush_bucket *b, int item)
 {
 	switch (b->alg) {
 	case CRUSH_BUCKET_UNIFORM:
-		return crush_remove_uniform_bucket_item((struct crush_bucket_uniform *)b, item);
+		return crush_remove_uniform_bucket_item(map, (struct crush_bucket_uniform *)b, item);
 	case CRUSH_BUCKET_LIST:
-		return crush_remove_list_bucket_item((struct crush_bucket_list *)b, item);
+		return crush_remove_list_bucket_item(map, (struct crush_bucket_list *)b, item);
 	case CRUSH_BUCKET_TREE:
-		return crush_remove_tree_bucket_item((struct crush_bucket_tree *)b, item);
+		return crush_remove_tree_bucket_item(map, (struct crush_bucket_tree *)b, item);
 	case CRUSH_BUCKET_STRAW:
 		return crush_remove_straw_bucket_item(map, (struct crush_bucket_straw *)b, item);
 	case CRUSH_BUCKET_STRAW2:
 		return crush_remove_straw2_bucket_item(map, (struct crush_bucket_straw2 *)b, item);
+	case CRUSH_BUCKET_STRAW2_TREE:
+		return crush_remove_straw2_tree_bucket_item(map, (struct crush_bucket_straw2_tree *)b, item);
 	default:
 		return -1;
 	}
@@ -1162,7 +1994,7 @@ int crush_adjust_list_bucket_item_weight(struct crush_bucket_list *bucket, int i
 	return diff;
 }
 
-int crush_adjust_tree_bucket_item_weight(struct crush_bucket_tree *bucket, int item, int weight)
+int crush_adjust_tree_bucket_item_weight(struct crush_map *map, struct crush_bucket_tree *bucket, int item, int weight)
 {
 	int diff;
 	int node;
@@ -1186,6 +2018,8 @@ int crush_adjust_tree_bucket_item_weight(struct crush_bucket_tree *bucket, int i
 		bucket->node_weights[node] += diff;
 	}
 
+	/* on failure the mapper descends the node weights instead */
+	crush_calc_tree_descent(map, bucket);
 	return diff;
 }
 
@@ -1230,6 +2064,37 @@ int crush_adjust_straw2_bucket_item_weight(struct crush_map *map,
 	diff = weight - bucket->item_weights[idx];
 	bucket->item_weights[idx] = weight;
 	bucket->h.weight += diff;
+	if (bucket->item_reciprocals)
+		bucket->item_reciprocals[idx] =
+			crush_calc_straw2_reciprocal(weight);
+
+	return diff;
+}
+
+int crush_adjust_straw2_tree_bucket_item_weight(struct crush_bucket_straw2_tree *bucket,
+						int item, int weight)
+{
+	__u32 sizes[CRUSH_STRAW2_TREE_MAX_LEVELS + 1];
+	int levels = crush_straw2_tree_levels(bucket->h.size, sizes);
+	__u32 *nodes = bucket->node_weights;
+	unsigned idx;
+	int diff, l;
+
+	for (idx = 0; idx < bucket->h.size; idx++)
+		if (bucket->h.items[idx] == item)
+			break;
+	if (idx == bucket->h.size)
+		return 0;
+
+	diff = weight - bucket->item_weights[idx];
+	bucket->item_weights[idx] = weight;
+	bucket->h.weight += diff;
+	/* the nodes above the item */
+	for (l = 1; l <= levels; l++) {
+		idx /= CRUSH_STRAW2_TREE_FANOUT;
+		nodes[idx] += diff;
+		nodes += sizes[l];
+	}
 
 	return diff;
 }
@@ -1246,7 +2111,7 @@ int crush_bucket_adjust_item_weight(struct crush_map *map,
 		return crush_adjust_list_bucket_item_weight((struct crush_bucket_list *)b,
 							    item, weight);
 	case CRUSH_BUCKET_TREE:
-		return crush_adjust_tree_bucket_item_weight((struct crush_bucket_tree *)b,
+		return crush_adjust_tree_bucket_item_weight(map, (struct crush_bucket_tree *)b,
 							    item, weight);
 	case CRUSH_BUCKET_STRAW:
 		return crush_adjust_straw_bucket_item_weight(map,
@@ -1256,6 +2121,9 @@ int crush_bucket_adjust_item_weight(struct crush_map *map,
 		return crush_adjust_straw2_bucket_item_weight(map,
 							      (struct crush_bucket_straw2 *)b,
 							     item, weight);
+	case CRUSH_BUCKET_STRAW2_TREE:
+		return crush_adjust_straw2_tree_bucket_item_weight((struct crush_bucket_straw2_tree *)b,
+								   item, weight);
 	default:
 		return -1;
 	}
@@ -1316,26 +2184,36 @@ static int crush_reweight_list_bucket(struct crush_map *crush, struct crush_buck
 static int crush_reweight_tree_bucket(struct crush_map *crush, struct crush_bucket_tree *bucket)
 {
 	unsigned i;
+	int depth = calc_depth(bucket->h.size);
+	int j;
+
+	/* the leaves are odd, the other nodes are sums of leaves */
+	for (i = 0; i < bucket->num_nodes; i += 2)
+		bucket->node_weights[i] = 0;
 
 	bucket->h.weight = 0;
 	for (i = 0; i < bucket->h.size; i++) {
 		int node = crush_calc_tree_node(i);
 		int id = bucket->h.items[i];
+		__u32 weight;
 		if (id < 0) {
 			struct crush_bucket *c = crush->buckets[-1-id];
 			crush_reweight_bucket(crush, c);
 			bucket->node_weights[node] = c->weight;
 		}
+		weight = bucket->node_weights[node];
 
-		if (crush_addition_is_unsafe(bucket->h.weight, bucket->node_weights[node]))
+		if (crush_addition_is_unsafe(bucket->h.weight, weight))
                         return -ERANGE;
 
-		bucket->h.weight += bucket->node_weights[node];
-
-
+		bucket->h.weight += weight;
+		for (j = 1; j < depth; j++) {
+			node = parent(node);
+			bucket->node_weights[node] += weight;
+		}
 	}
 
-	return 0;
+	return crush_calc_tree_descent(crush, bucket);
 }
 
 static int crush_reweight_straw_bucket(struct crush_map *crush, struct crush_bucket_straw *bucket)
@@ -1380,7 +2258,29 @@ static int crush_reweight_straw2_bucket(struct crush_map *crush, struct crush_bu
                 bucket->h.weight += bucket->item_weights[i];
 	}
 
-	return 0;
+	return crush_calc_straw2_reciprocals(crush, bucket);
+}
+
+static int crush_reweight_straw2_tree_bucket(struct crush_map *crush, struct crush_bucket_straw2_tree *bucket)
+{
+	unsigned i;
+
+	bucket->h.weight = 0;
+	for (i = 0; i < bucket->h.size; i++) {
+		int id = bucket->h.items[i];
+		if (id < 0) {
+			struct crush_bucket *c = crush->buckets[-1-id];
+			crush_reweight_bucket(crush, c);
+			bucket->item_weights[i] = c->weight;
+		}
+
+		if (crush_addition_is_unsafe(bucket->h.weight, bucket->item_weights[i]))
+			return -ERANGE;
+
+		bucket->h.weight += bucket->item_weights[i];
+	}
+
+	return crush_calc_straw2_tree(crush, bucket);
 }
 
 int crush_reweight_bucket(struct crush_map *crush, struct crush_bucket *b)
@@ -1396,6 +2296,8 @@ int crush_reweight_bucket(struct crush_map *crush, struct crush_bucket *b)
 		return crush_reweight_straw_bucket(crush, (struct crush_bucket_straw *)b);
 	case CRUSH_BUCKET_STRAW2:
 		return crush_reweight_straw2_bucket(crush, (struct crush_bucket_straw2 *)b);
+	case CRUSH_BUCKET_STRAW2_TREE:
+		return crush_reweight_straw2_tree_bucket(crush, (struct crush_bucket_straw2_tree *)b);
 	default:
 		return -1;
 	}
@@ -1403,6 +2305,73 @@ int crush_reweight_bucket(struct crush_map *crush, struct crush_bucket *b)
 
 /***************************/
 
+struct crush_choose_arg *crush_make_choose_args(const struct crush_map *map,
+						int num_positions)
+{
+	struct crush_choose_arg *args;
+	size_t size = map->max_buckets * sizeof(*args);
+	char *space;
+	int b, position;
+	__u32 i;
+
+	if (num_positions < 1)
+		return NULL;
+	/* the choose_args, then the weight sets, then the arrays */
+	for (b = 0; b < map->max_buckets; b++) {
+		const struct crush_bucket *bucket = map->buckets[b];
+
+		if (!bucket || bucket->alg != CRUSH_BUCKET_STRAW2)
+			continue;
+		size += num_positions * sizeof(struct crush_weight_set);
+		size += (num_positions + 1) * bucket->size * sizeof(__u32);
+	}
+	args = calloc(1, size ? size : 1);
+	if (!args)
+		return NULL;
+	space = (char *)(args + map->max_buckets);
+	for (b = 0; b < map->max_buckets; b++) {
+		const struct crush_bucket_straw2 *bucket =
+			(const struct crush_bucket_straw2 *)map->buckets[b];
+
+		if (!bucket || bucket->h.alg != CRUSH_BUCKET_STRAW2)
+			continue;
+		args[b].weight_set = (struct crush_weight_set *)space;
+		args[b].weight_set_size = num_positions;
+		space += num_positions * sizeof(struct crush_weight_set);
+	}
+	for (b = 0; b < map->max_buckets; b++) {
+		const struct crush_bucket_straw2 *bucket =
+			(const struct crush_bucket_straw2 *)map->buckets[b];
+
+		if (!args[b].weight_set)
+			continue;
+		for (position = 0; position < num_positions; position++) {
+			struct crush_weight_set *weight_set =
+				&args[b].weight_set[position];
+
+			weight_set->weights = (__u32 *)space;
+			weight_set->size = bucket->h.size;
+			for (i = 0; i < bucket->h.size; i++)
+				weight_set->weights[i] = bucket->item_weights[i];
+			space += bucket->h.size * sizeof(__u32);
+		}
+		args[b].ids = (__s32 *)space;
+		args[b].ids_size = bucket->h.size;
+		for (i = 0; i < bucket->h.size; i++)
+			args[b].ids[i] = bucket->h.items[i];
+		space += bucket->h.size * sizeof(__s32);
+	}
+	assert((size_t)(space - (char *)args) == size);
+	return args;
+}
+
+void crush_destroy_choose_args(struct crush_choose_arg *args)
+{
+	free(args);
+}
+
+/***************************/
+
 /* methods to check for safe arithmetic operations */
 
 int crush_addition_is_unsafe(__u32 a, __u32 b)
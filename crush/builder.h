@@ -2,6 +2,7 @@
 #define CEPH_CRUSH_BUILDER_H
 
 #include "crush.h"
+#include "arena.h"
 
 /** @ingroup API
  *
@@ -29,6 +30,34 @@
  * @returns a pointer to the newly created crush_map or NULL
  */
 extern struct crush_map *crush_create();
+/** @ingroup API
+ *
+ * Allocate a crush_map in __arena__ and initialize it as
+ * crush_create() does. The map owns the __arena__: crush_destroy()
+ * releases it, with the map, in one go.
+ *
+ * The buckets made for the map by crush_make_bucket(), the arrays the
+ * builder allocates or grows for them and the arrays of the map
+ * itself are allocated in the __arena__, which amortizes their
+ * growth. Building a map of any size takes a few allocations, one
+ * per chunk of the __arena__. Nothing is released before the map:
+ * the memory of a removed item or bucket is only reused by the next
+ * crush_destroy().
+ *
+ * A bucket of the map must be released with crush_remove_bucket() or
+ * crush_release_bucket(), not crush_destroy_bucket(). The rules and
+ * the buckets allocated without the map, for instance by
+ * crush_make_rule(), are released by crush_destroy() one by one, as
+ * they would be for a map of crush_create().
+ *
+ * - return NULL if __arena__ is NULL or the map cannot be allocated,
+ *   in which case the __arena__ is released
+ *
+ * @param arena an arena returned by crush_arena_create()
+ *
+ * @returns a pointer to the newly created crush_map or NULL
+ */
+extern struct crush_map *crush_create_arena(struct crush_arena *arena);
 /** @ingroup API
  *
  * Analyze the content of __map__ and set the internal values required
@@ -144,8 +173,8 @@ extern int crush_add_bucket(struct crush_map *map,
  * Allocate a crush_bucket with __malloc(3)__ and initialize it. The
  * content of the bucket is filled with __size__ items from
  * __items__. The item selection is set to use __alg__ which is one of
- * ::CRUSH_BUCKET_UNIFORM , ::CRUSH_BUCKET_LIST or
- * ::CRUSH_BUCKET_STRAW2. The initial __items__ are assigned a
+ * ::CRUSH_BUCKET_UNIFORM , ::CRUSH_BUCKET_LIST, ::CRUSH_BUCKET_STRAW2
+ * or ::CRUSH_BUCKET_STRAW2_TREE. The initial __items__ are assigned a
  * weight from the __weights__ array, depending on the value of
  * __alg__. If __alg__ is ::CRUSH_BUCKET_UNIFORM, all items are set
  * to have a weight equal to __weights[0]__, otherwise the weight of
@@ -160,6 +189,17 @@ extern int crush_add_bucket(struct crush_map *map,
  * @param weights the weight of each item in __items__, depending on __alg__
  */
 struct crush_bucket *crush_make_bucket(struct crush_map *map, int alg, int hash, int type, int size, int *items, int *weights);
+/** @ingroup API
+ *
+ * Allocate a copy of __bucket__ and of its arrays with __malloc(3)__,
+ * to be modified without changing __bucket__ and released with
+ * crush_destroy_bucket(). The copy has the same id.
+ *
+ * @param bucket the bucket to copy
+ *
+ * @returns the copy or NULL if __malloc(3)__ fails or __bucket->alg__ is unknown
+ */
+extern struct crush_bucket *crush_clone_bucket(const struct crush_bucket *bucket);
 /** @ingroup API
  *
  * Add __item__ to __bucket__ with __weight__. The weight of the new
@@ -218,11 +258,23 @@ extern int crush_reweight_bucket(struct crush_map *crush, struct crush_bucket *b
  * @returns 0
  */
 extern int crush_remove_bucket(struct crush_map *map, struct crush_bucket *bucket);
+/** @ingroup API
+ *
+ * Deallocate __bucket__, made for __map__ by crush_make_bucket() and
+ * not added to it, via crush_destroy_bucket() unless it is in the
+ * arena of the __map__, see crush_create_arena().
+ *
+ * @param map the crush_map __bucket__ was made for
+ * @param bucket the bucket to deallocate
+ */
+extern void crush_release_bucket(struct crush_map *map, struct crush_bucket *bucket);
 /** @ingroup API
  *
  * Remove __item__ from __bucket__ and subtract the item weight from
  * the bucket weight. If the weight of the item is greater than the
  * weight of the bucket, silentely set the bucket weight to zero.
+ * If __bucket->alg__ is ::CRUSH_BUCKET_STRAW2_TREE, the last item of
+ * the bucket takes the position of __item__.
  *
  * - return -ENOMEN if the __bucket__ cannot be sized down with __realloc(3)__.
  * - return -1 if the value of __bucket->alg__ is unknown.
@@ -234,16 +286,146 @@ extern int crush_remove_bucket(struct crush_map *map, struct crush_bucket *bucke
  */
 extern int crush_bucket_remove_item(struct crush_map *map, struct crush_bucket *bucket, int item);
 
+/** @ingroup API
+ *
+ * The value of the back-link of an item that is in more than one
+ * bucket, see crush_map.bucket_parents.
+ */
+#define CRUSH_PARENT_MANY 1
+
+/** @ingroup API
+ *
+ * Return the id of the bucket containing __item__, as found by the
+ * last crush_finalize() and maintained by crush_map_add_item(),
+ * crush_map_adjust_item_weight() and crush_map_remove_item().
+ *
+ * @param map the crush_map
+ * @param item the device or bucket id
+ *
+ * @returns the bucket id, 0 if __item__ is in no bucket or ::CRUSH_PARENT_MANY
+ */
+extern int crush_get_parent(const struct crush_map *map, int item);
+/** @ingroup API
+ *
+ * Add __bucket__ to a finalized __map__ with crush_add_bucket() and
+ * update what crush_finalize() would, including the back-links of its
+ * items, without going through the other buckets. The new bucket is in
+ * no bucket: crush_map_add_item() links it to its parent. The
+ * workspaces of the map must be initialized again with
+ * crush_init_workspace() since __map->working_size__ grows.
+ *
+ * - return -ENOENT if an item of __bucket__ is a bucket that does not exist
+ * - return -EEXIST if an item of __bucket__ is already in a bucket
+ * - return -ENOMEM if __realloc(3)__ fails
+ * - return the errors of crush_add_bucket()
+ *
+ * @param[in] map the crush_map
+ * @param[in] bucketno the bucket unique identifer or 0
+ * @param[in] bucket the bucket to add to the __map__
+ * @param[out] idout a pointer to the bucket identifier
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_map_add_bucket(struct crush_map *map, int bucketno,
+				struct crush_bucket *bucket, int *idout);
+/** @ingroup API
+ *
+ * Add __item__ with __weight__ to the bucket __bucketno__ of a
+ * finalized __map__ and update what crush_finalize() would, as well
+ * as the weights of the ancestors of __bucketno__, in time
+ * proportional to the depth of the hierarchy instead of the size of
+ * the map. The workspaces of the map must be initialized again with
+ * crush_init_workspace() since __map->working_size__ grows.
+ *
+ * The incremental functions rely on each item being in at most one
+ * bucket: crush_finalize() must be called instead after any other
+ * modification of the map.
+ *
+ * - return -ENOENT if __bucketno__ or the bucket __item__ does not exist
+ * - return -EEXIST if __item__ is already in a bucket
+ * - return -ELOOP if __item__ is __bucketno__ or one of its ancestors
+ * - return -EINVAL if __bucketno__ or an ancestor is in more than one bucket
+ * - return -ENOMEM if __realloc(3)__ fails
+ * - return the errors of crush_bucket_add_item()
+ *
+ * @param map the crush_map
+ * @param bucketno the bucket to add __item__ to
+ * @param item the device or bucket id to add
+ * @param weight the weight of __item__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_map_add_item(struct crush_map *map, int bucketno, int item, int weight);
+/** @ingroup API
+ *
+ * Set the __weight__ of __item__ in the bucket containing it, with
+ * crush_bucket_adjust_item_weight(), and update the weights of its
+ * ancestors as with crush_map_add_item().
+ *
+ * - return -ENOENT if __item__ is in no bucket
+ * - return -EINVAL if __item__ or an ancestor is in more than one bucket
+ *
+ * @param map the crush_map
+ * @param item the device or bucket id
+ * @param weight the new weight of __item__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_map_adjust_item_weight(struct crush_map *map, int item, int weight);
+/** @ingroup API
+ *
+ * Remove __item__ from the bucket containing it, with
+ * crush_bucket_remove_item(), and update the weights of its
+ * ancestors as with crush_map_add_item(). If __item__ is a bucket,
+ * it stays in the map without a parent.
+ *
+ * - return -ENOENT if __item__ is in no bucket
+ * - return -EINVAL if __item__ or an ancestor is in more than one bucket
+ * - return the errors of crush_bucket_remove_item()
+ *
+ * @param map the crush_map
+ * @param item the device or bucket id
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_map_remove_item(struct crush_map *map, int item);
+/** @ingroup API
+ *
+ * Allocate, in a single block, an array of __map->max_buckets__
+ * crush_choose_arg for crush_do_rule(). The entry of each straw2
+ * bucket has __num_positions__ weight sets initialized with the
+ * weights of the bucket and ids initialized with its items, so that
+ * mapping with it gives the same results as mapping without until
+ * they are modified. The entries of the other buckets are zero.
+ *
+ * The array does not follow changes to __map__ and must be allocated
+ * again if buckets are added or removed or change size.
+ *
+ * @param map the crush_map
+ * @param num_positions the number of weight sets of each straw2 bucket, > 0
+ *
+ * @returns an array to be released with crush_destroy_choose_args() or NULL if __malloc(3)__ fails
+ */
+extern struct crush_choose_arg *crush_make_choose_args(const struct crush_map *map,
+						       int num_positions);
+/** @ingroup API
+ *
+ * Release an array returned by crush_make_choose_args().
+ *
+ * @param args the array
+ */
+extern void crush_destroy_choose_args(struct crush_choose_arg *args);
+
 struct crush_bucket_uniform *
-crush_make_uniform_bucket(int hash, int type, int size,
+crush_make_uniform_bucket(struct crush_map *map, int hash, int type, int size,
 			  int *items,
 			  int item_weight);
 struct crush_bucket_list*
-crush_make_list_bucket(int hash, int type, int size,
+crush_make_list_bucket(struct crush_map *map, int hash, int type, int size,
 		       int *items,
 		       int *weights);
 struct crush_bucket_tree*
-crush_make_tree_bucket(int hash, int type, int size,
+crush_make_tree_bucket(struct crush_map *map, int hash, int type, int size,
 		       int *items,    /* in leaf order */
 		       int *weights);
 struct crush_bucket_straw *
@@ -251,6 +433,29 @@ crush_make_straw_bucket(struct crush_map *map,
 			int hash, int type, int size,
 			int *items,
 			int *weights);
+struct crush_bucket_straw2_tree *
+crush_make_straw2_tree_bucket(struct crush_map *map,
+			      int hash, int type, int size,
+			      int *items,
+			      int *weights);
+/* Sets __bucket->descent_weights__ from its __node_weights__. Returns
+   -ENOMEM if the array cannot be allocated, in which case it is NULL
+   and crush_do_rule() descends the __node_weights__ instead. */
+extern int crush_calc_tree_descent(struct crush_map *map,
+				   struct crush_bucket_tree *bucket);
+/* Sets the __node_weights__ of __bucket__ from its __item_weights__.
+   Returns -ENOMEM if the array cannot be allocated. */
+extern int crush_calc_straw2_tree(struct crush_map *map,
+				  struct crush_bucket_straw2_tree *bucket);
+
+/* Returns the multiply-shift form of a straw2 item __weight__, see
+   crush_bucket_straw2 and crush_map.straw2_reciprocals. */
+extern __u64 crush_calc_straw2_reciprocal(__u32 weight);
+/* Sets or clears __bucket->item_reciprocals__ depending on
+   __map->straw2_reciprocals__. Returns -ENOMEM if the array cannot be
+   allocated, in which case it is NULL. */
+extern int crush_calc_straw2_reciprocals(struct crush_map *map,
+					 struct crush_bucket_straw2 *bucket);
 
 extern int crush_addition_is_unsafe(__u32 a, __u32 b);
 extern int crush_multiplication_is_unsafe(__u32  a, __u32 b);
@@ -0,0 +1,282 @@
+/*
+ * Remember the results of crush_do_rule(, NULL).
+ *
+ * A slot is an array of words protected by a sequence number, as a
+ * seqlock: a writer makes the sequence odd, updates the slot and makes
+ * it even again. A reader copies the slot and only trusts the copy if
+ * the sequence was even and did not change meanwhile. The words are
+ * read and written with relaxed atomics so that the copy of a slot
+ * being updated is not a data race, only a miss.
+ *
+ * LGPL2
+ */
+
+#include <stdlib.h>
+
+#include "crush_compat.h"
+#include "crush.h"
+#include "hash.h"
+#include "mapper.h"
+#include "cache.h"
+
+/* the words of a slot, followed by result_max items */
+enum {
+	SLOT_SEQ,
+	SLOT_EPOCH,
+	SLOT_GENERATION,
+	SLOT_RULENO,
+	SLOT_X,
+	SLOT_RESULT_MAX,
+	SLOT_LEN,
+	SLOT_RESULT,
+};
+
+/* ruleno of a free slot, crush_get_rule() never accepts it */
+#define SLOT_FREE ((__u32)-1)
+
+/* the number of inputs mapped at once by crush_cache_warm() */
+#define CRUSH_CACHE_WARM_CHUNK 256
+
+struct crush_cache {
+	int result_max;
+	int dense;		/* if set, the slot of x is x */
+	__u32 slot_words;	/* SLOT_RESULT + result_max */
+	__u32 slots;		/* a power of two unless dense */
+	__u32 *words;
+};
+
+static struct crush_cache *cache_alloc(__u32 slots, int result_max,
+				       int dense)
+{
+	struct crush_cache *cache = malloc(sizeof(*cache));
+
+	if (!cache)
+		return NULL;
+	cache->result_max = result_max;
+	cache->dense = dense;
+	cache->slot_words = SLOT_RESULT + result_max;
+	cache->slots = slots;
+	cache->words = malloc((size_t)slots * cache->slot_words *
+			      sizeof(__u32));
+	if (!cache->words) {
+		free(cache);
+		return NULL;
+	}
+	crush_cache_clear(cache);
+	return cache;
+}
+
+struct crush_cache *crush_cache_create(size_t memory, int result_max)
+{
+	size_t slot_size;
+	__u32 slots = 2;
+
+	if (result_max < 1)
+		return NULL;
+	slot_size = (SLOT_RESULT + (size_t)result_max) * sizeof(__u32);
+	if (memory < sizeof(struct crush_cache) + 2 * slot_size)
+		return NULL;
+	memory -= sizeof(struct crush_cache);
+	while (slots <= 0x40000000u && (size_t)slots * 2 * slot_size <= memory)
+		slots *= 2;
+	return cache_alloc(slots, result_max, 0);
+}
+
+struct crush_cache *crush_cache_create_dense(__u32 x_count, int result_max)
+{
+	if (result_max < 1 || x_count < 1)
+		return NULL;
+	return cache_alloc(x_count, result_max, 1);
+}
+
+void crush_cache_clear(struct crush_cache *cache)
+{
+	__u32 slot;
+
+	for (slot = 0; slot < cache->slots; slot++) {
+		__u32 *w = cache->words + (size_t)slot * cache->slot_words;
+
+		w[SLOT_SEQ] = 0;
+		w[SLOT_RULENO] = SLOT_FREE;
+	}
+}
+
+void crush_cache_destroy(struct crush_cache *cache)
+{
+	if (!cache)
+		return;
+	free(cache->words);
+	free(cache);
+}
+
+static inline __u32 *slot_words(const struct crush_cache *cache, __u32 slot)
+{
+	return cache->words + (size_t)slot * cache->slot_words;
+}
+
+static inline __u32 load(const __u32 *w)
+{
+	return __atomic_load_n(w, __ATOMIC_RELAXED);
+}
+
+static inline void store(__u32 *w, __u32 value)
+{
+	__atomic_store_n(w, value, __ATOMIC_RELAXED);
+}
+
+/*
+ * The candidate slots of an input, or 0 if it is not cached. The
+ * second candidate of a hashed cache is the neighbour of the first.
+ */
+static int candidates(const struct crush_cache *cache, __u32 epoch,
+		      int ruleno, int x, __u32 generation, __u32 *slots)
+{
+	__u32 hash;
+
+	if (cache->dense) {
+		if ((__u32)x >= cache->slots)
+			return 0;
+		slots[0] = x;
+		return 1;
+	}
+	hash = crush_hash32_rjenkins1_4(x, ruleno, epoch, generation);
+	slots[0] = hash & (cache->slots - 1);
+	slots[1] = slots[0] ^ 1;
+	return 2;
+}
+
+static inline int slot_is(const __u32 *w, __u32 epoch, int ruleno, int x,
+			  __u32 generation, int result_max)
+{
+	return load(&w[SLOT_RULENO]) == (__u32)ruleno &&
+		load(&w[SLOT_X]) == (__u32)x &&
+		load(&w[SLOT_RESULT_MAX]) == (__u32)result_max &&
+		load(&w[SLOT_EPOCH]) == epoch &&
+		load(&w[SLOT_GENERATION]) == generation;
+}
+
+/* copy the result of @x to @result and return its length or -1 */
+static int cache_lookup(const struct crush_cache *cache, __u32 epoch,
+			int ruleno, int x, __u32 generation,
+			int *result, int result_max)
+{
+	__u32 slots[2];
+	int n = candidates(cache, epoch, ruleno, x, generation, slots);
+	int i, j;
+
+	for (i = 0; i < n; i++) {
+		const __u32 *w = slot_words(cache, slots[i]);
+		__u32 seq = __atomic_load_n(&w[SLOT_SEQ], __ATOMIC_ACQUIRE);
+		int len;
+
+		if (seq & 1 ||
+		    !slot_is(w, epoch, ruleno, x, generation, result_max))
+			continue;
+		len = load(&w[SLOT_LEN]);
+		if (len > result_max)
+			continue;
+		for (j = 0; j < len; j++)
+			result[j] = load(&w[SLOT_RESULT + j]);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (load(&w[SLOT_SEQ]) == seq)
+			return len;
+	}
+	return -1;
+}
+
+static void cache_store(struct crush_cache *cache, __u32 epoch,
+			int ruleno, int x, __u32 generation, int result_max,
+			const int *result, int len)
+{
+	__u32 slots[2];
+	int n = candidates(cache, epoch, ruleno, x, generation, slots);
+	__u32 *w = NULL;
+	__u32 seq;
+	int i;
+
+	if (n == 0)
+		return;
+	/* a free or stale candidate, otherwise the first one */
+	for (i = 0; i < n && !w; i++) {
+		__u32 *c = slot_words(cache, slots[i]);
+
+		if (load(&c[SLOT_RULENO]) == SLOT_FREE ||
+		    load(&c[SLOT_EPOCH]) != epoch ||
+		    load(&c[SLOT_GENERATION]) != generation)
+			w = c;
+	}
+	if (!w)
+		w = slot_words(cache, slots[0]);
+
+	seq = load(&w[SLOT_SEQ]);
+	if (seq & 1 ||
+	    !__atomic_compare_exchange_n(&w[SLOT_SEQ], &seq, seq + 1, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;	/* another thread is updating the slot */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	store(&w[SLOT_EPOCH], epoch);
+	store(&w[SLOT_GENERATION], generation);
+	store(&w[SLOT_RULENO], ruleno);
+	store(&w[SLOT_X], x);
+	store(&w[SLOT_RESULT_MAX], result_max);
+	store(&w[SLOT_LEN], len);
+	for (i = 0; i < len; i++)
+		store(&w[SLOT_RESULT + i], result[i]);
+	__atomic_store_n(&w[SLOT_SEQ], seq + 2, __ATOMIC_RELEASE);
+}
+
+int crush_cache_do_rule(struct crush_cache *cache,
+			const struct crush_map *map, __u32 epoch,
+			int ruleno, int x, int *result, int result_max,
+			const __u32 *weights, int weight_max,
+			__u32 generation, void *cwin)
+{
+	int len;
+
+	if (result_max > cache->result_max)
+		return crush_do_rule(map, ruleno, x, result, result_max,
+				     weights, weight_max, cwin, NULL);
+	len = cache_lookup(cache, epoch, ruleno, x, generation,
+			   result, result_max);
+	if (len >= 0)
+		return len;
+	len = crush_do_rule(map, ruleno, x, result, result_max,
+			    weights, weight_max, cwin, NULL);
+	cache_store(cache, epoch, ruleno, x, generation, result_max,
+		    result, len);
+	return len;
+}
+
+int crush_cache_warm(struct crush_cache *cache,
+		     const struct crush_map *map, __u32 epoch,
+		     int ruleno, const int *x, int x_count,
+		     const __u32 *weights, int weight_max,
+		     __u32 generation, void *cwin)
+{
+	const int result_max = cache->result_max;
+	int result_len[CRUSH_CACHE_WARM_CHUNK];
+	int *result;
+	int i, j, n;
+
+	result = malloc(CRUSH_CACHE_WARM_CHUNK * result_max * sizeof(*result));
+	if (!result)
+		return 0;
+	for (i = 0; i < x_count; i += n) {
+		n = x_count - i;
+		if (n > CRUSH_CACHE_WARM_CHUNK)
+			n = CRUSH_CACHE_WARM_CHUNK;
+		if (!crush_do_rule_batch(map, ruleno, x + i, n,
+					 result, result_max, result_max,
+					 result_len, weights, weight_max,
+					 cwin, NULL)) {
+			free(result);
+			return 0;
+		}
+		for (j = 0; j < n; j++)
+			cache_store(cache, epoch, ruleno, x[i + j], generation,
+				    result_max, result + j * result_max,
+				    result_len[j]);
+	}
+	free(result);
+	return x_count;
+}
@@ -0,0 +1,141 @@
+#ifndef CEPH_CRUSH_CACHE_H
+#define CEPH_CRUSH_CACHE_H
+
+/*
+ * Remember the results of crush_do_rule().
+ *
+ * LGPL2
+ */
+
+#include <stddef.h>
+
+#include "crush.h"
+
+struct crush_cache;
+
+/** @ingroup API
+ *
+ * Allocate a cache of at most __memory__ bytes for the results of
+ * crush_cache_do_rule() of up to __result_max__ items. The inputs are
+ * hashed to a fixed number of slots, two of which are candidates for
+ * a given input: a result is stored in the candidate that is free or
+ * holds a result of another epoch or generation, otherwise in the one
+ * designated by the hash. The cache is never resized.
+ *
+ * The cache can be read and updated concurrently by any number of
+ * threads without locking: each slot has a sequence number that a
+ * reader checks before and after copying a result, and that a writer
+ * makes odd while it updates the slot. A reader never waits and a
+ * writer that finds a slot being updated leaves it alone.
+ *
+ * - return NULL if __result_max__ < 1, if __memory__ is too small for
+ *   two slots or if __malloc(3)__ fails
+ *
+ * @param memory the memory budget in bytes
+ * @param result_max the maximum number of items in a result
+ *
+ * @returns a cache to be released with crush_cache_destroy() or NULL
+ */
+extern struct crush_cache *crush_cache_create(size_t memory, int result_max);
+
+/** @ingroup API
+ *
+ * Allocate a cache with one slot for each input in [0, __x_count__),
+ * for instance one per placement group, instead of hashing them. An
+ * input outside of this range is never cached. The slot of an input
+ * keeps the result of the last rule, epoch and generation it was
+ * mapped with. See crush_cache_create() for concurrency.
+ *
+ * - return NULL if __result_max__ < 1, if __x_count__ < 1 or if
+ *   __malloc(3)__ fails
+ *
+ * @param x_count the number of inputs
+ * @param result_max the maximum number of items in a result
+ *
+ * @returns a cache to be released with crush_cache_destroy() or NULL
+ */
+extern struct crush_cache *crush_cache_create_dense(__u32 x_count,
+						    int result_max);
+
+/** @ingroup API
+ *
+ * Return the result of crush_do_rule() for __map__, __ruleno__, __x__
+ * and __weights__ from __cache__ if it is there, otherwise compute it
+ * with crush_do_rule() and store it in __cache__.
+ *
+ * A result is stored with __epoch__ and __generation__ and only
+ * returned for the same values: the caller changes __epoch__ whenever
+ * __map__ is modified or replaced and __generation__ whenever the
+ * content of __weights__ changes. There is no other invalidation: the
+ * results of the previous values are replaced as they are found.
+ *
+ * The results are also keyed by __result_max__, which changes the
+ * mapping of most rules. If __result_max__ is greater than the
+ * __result_max__ of the cache, the result is computed and not stored.
+ *
+ * @param cache the cache from crush_cache_create() or crush_cache_create_dense()
+ * @param map the crush_map
+ * @param epoch the version of __map__
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param x the value to map
+ * @param result an array of __result_max__ items
+ * @param result_max the size of the __result__ array
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param generation the version of __weights__
+ * @param cwin must be the value of crush_work_size(__map__, __result_max__)
+ *
+ * @return the number of items in __result__
+ */
+extern int crush_cache_do_rule(struct crush_cache *cache,
+			       const struct crush_map *map, __u32 epoch,
+			       int ruleno, int x, int *result, int result_max,
+			       const __u32 *weights, int weight_max,
+			       __u32 generation, void *cwin);
+
+/** @ingroup API
+ *
+ * Map the __x_count__ inputs of __x__ with crush_do_rule_batch() and
+ * store their results in __cache__, as crush_cache_do_rule() would
+ * with the __result_max__ of __cache__,
+ * for instance to fill a dense cache with all the placement groups of
+ * a pool before serving lookups.
+ *
+ * @param cache the cache from crush_cache_create() or crush_cache_create_dense()
+ * @param map the crush_map
+ * @param epoch the version of __map__
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param x an array of __x_count__ values to map
+ * @param x_count the size of the __x__ array
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param generation the version of __weights__
+ * @param cwin must be the value of crush_work_size(__map__, result_max) with the result_max of __cache__
+ *
+ * @return 0 on error or __x_count__ on success
+ */
+extern int crush_cache_warm(struct crush_cache *cache,
+			    const struct crush_map *map, __u32 epoch,
+			    int ruleno, const int *x, int x_count,
+			    const __u32 *weights, int weight_max,
+			    __u32 generation, void *cwin);
+
+/** @ingroup API
+ *
+ * Forget all the results of __cache__. It must not be used by another
+ * thread at the same time.
+ *
+ * @param cache the cache
+ */
+extern void crush_cache_clear(struct crush_cache *cache);
+
+/** @ingroup API
+ *
+ * Release a cache returned by crush_cache_create() or
+ * crush_cache_create_dense().
+ *
+ * @param cache the cache
+ */
+extern void crush_cache_destroy(struct crush_cache *cache);
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef CEPH_CRUSH_CHOOSE_H
+#define CEPH_CRUSH_CHOOSE_H
+
+/*
+ * The pieces of crush_choose_firstn(), crush_choose_indep() and
+ * crush_do_plan() that crush_do_plan_interleaved() runs in its own
+ * order, one lane at a time. They are private to mapper.c and
+ * interleave.c, not part of the API.
+ *
+ * LGPL2
+ */
+
+#ifdef __KERNEL__
+# include <linux/crush/crush.h>
+#else
+# include "crush_compat.h"
+# include "crush.h"
+# include "stats.h"
+#endif
+#include "mapper.h"
+
+/*
+ * Count an event of the rule being mapped or of a bucket, see
+ * crush_set_stats(). Without CRUSH_STATS they compile to nothing.
+ */
+#if defined(CRUSH_STATS) && !defined(__KERNEL__)
+#define crush_stat(work, counter) do {					\
+		if ((work)->rule_stats)					\
+			(work)->rule_stats->counter++;			\
+	} while (0)
+#define crush_bucket_stat(work, bucket, counter) do {			\
+		if ((work)->stats)					\
+			(work)->stats->buckets[-1-(bucket)->id].counter++; \
+	} while (0)
+
+/* select the counters of @ruleno before mapping with it */
+static inline void crush_stats_rule(void *cwin, int ruleno)
+{
+	struct crush_work *work = cwin;
+
+	work->rule_stats = work->stats ? &work->stats->rules[ruleno] : NULL;
+}
+#else
+#define crush_stat(work, counter) do { } while (0)
+#define crush_bucket_stat(work, bucket, counter) do { } while (0)
+#define crush_stats_rule(cwin, ruleno) do { } while (0)
+#endif
+
+/*
+ * Record that the mapper chose from @bucket, for crush_take_visited()
+ * and the visits of crush_set_stats(). Unless one of them is enabled
+ * it only tests work->track and it compiles to nothing in the kernel.
+ */
+#ifndef __KERNEL__
+/* the functions shared by mapper.c and interleave.c are not exported */
+#define CRUSH_PRIVATE __attribute__((visibility("hidden")))
+
+extern CRUSH_PRIVATE void crush_track_visit(struct crush_work *work,
+					    const struct crush_bucket *bucket);
+
+#define crush_visit(work, bucket) do {					\
+		if (unlikely((work)->track))				\
+			crush_track_visit(work, bucket);		\
+	} while (0)
+#else
+#define crush_visit(work, bucket) do { } while (0)
+#endif
+
+/*
+ * A filter of the items already chosen: each one sets the bit of its
+ * low six bits so that an item whose bit is clear cannot collide and
+ * the output vector is only scanned when it is set. It keeps the
+ * collision test short when numrep is large, e.g. k+m=20.
+ */
+#define crush_item_bit(item) (1ULL << ((item) & 63))
+
+static inline int crush_collides(const int *out, int outpos, __u64 filter,
+				 int item)
+{
+	int i;
+
+	if (!(filter & crush_item_bit(item)))
+		return 0;
+	for (i = 0; i < outpos; i++)
+		if (out[i] == item)
+			return 1;
+	return 0;
+}
+
+/* the type of @item, 0 for a device */
+static inline int crush_item_type(const struct crush_map *map, int item)
+{
+	if (item < 0)
+		return map->buckets[-1-item]->type;
+	return 0;
+}
+
+/*
+ * Count an item chosen after @ftotal failed tries, see
+ * crush_set_choose_tries().
+ */
+static inline void crush_count_tries(struct crush_work *work,
+				     unsigned int ftotal)
+{
+#ifndef __KERNEL__
+	if (ftotal < work->choose_tries_size)
+		work->choose_tries[ftotal]++;
+#endif
+}
+
+enum {
+	CRUSH_RETRY_SKIP,	/* give up the replica */
+	CRUSH_RETRY_BUCKET,	/* choose again from the same bucket */
+	CRUSH_RETRY_DESCENT,	/* descend again from the first bucket */
+};
+
+/*
+ * Count the rejection by crush_choose_firstn() of an item chosen from
+ * @in, because it collides if @collide is set, and return the
+ * CRUSH_RETRY_* to do next.
+ */
+static inline int crush_firstn_retry(struct crush_work *work,
+				     const struct crush_bucket *in,
+				     int collide,
+				     unsigned int *ftotal,
+				     unsigned int *flocal,
+				     unsigned int tries,
+				     unsigned int local_retries,
+				     unsigned int local_fallback_retries)
+{
+	int retry;
+
+	(void)work;	/* only counted with CRUSH_STATS */
+	(*ftotal)++;
+	(*flocal)++;
+	crush_bucket_stat(work, in, retries);
+
+	if (collide && *flocal <= local_retries)
+		/* retry locally a few times */
+		retry = CRUSH_RETRY_BUCKET;
+	else if (local_fallback_retries > 0 &&
+		 *flocal <= in->size + local_fallback_retries)
+		/* exhaustive bucket search */
+		retry = CRUSH_RETRY_BUCKET;
+	else if (*ftotal < tries)
+		/* then retry descent */
+		retry = CRUSH_RETRY_DESCENT;
+	else
+		/* else give up */
+		retry = CRUSH_RETRY_SKIP;
+	if (retry == CRUSH_RETRY_BUCKET)
+		crush_stat(work, local_retries);
+	else if (retry == CRUSH_RETRY_DESCENT)
+		crush_stat(work, descent_retries);
+	return retry;
+}
+
+/*
+ * The r of crush_choose_indep() for the replica @rep in the round
+ * @ftotal. It is based on the position even in the nested call: if
+ * the first layer chooses the same bucket in a different position,
+ * a different item tends to be chosen in that bucket. This involves
+ * more devices in data movement and tends to distribute the load.
+ */
+static inline int crush_indep_r(const struct crush_bucket *in, int rep,
+				int parent_r, int numrep, unsigned int ftotal)
+{
+	int r = rep + parent_r;
+
+	/* be careful */
+	if (in->alg == CRUSH_BUCKET_UNIFORM && in->size % numrep == 0)
+		/* r'=r+(n+1)*f_total */
+		return r + (numrep+1) * ftotal;
+	/* r' = r + n*f_total */
+	return r + numrep * ftotal;
+}
+
+/*
+ * The end of crush_choose_indep() after @ftotal rounds: the replicas
+ * of [@outpos, @endpos) still undefined are given up.
+ */
+static inline void crush_indep_finish(struct crush_work *work,
+				      int *out, int *out2,
+				      int outpos, int endpos,
+				      unsigned int ftotal)
+{
+	int rep;
+
+	for (rep = outpos; rep < endpos; rep++) {
+		if (out[rep] == CRUSH_ITEM_UNDEF) {
+			crush_stat(work, skip_reps);
+			out[rep] = CRUSH_ITEM_NONE;
+		}
+		if (out2 && out2[rep] == CRUSH_ITEM_UNDEF) {
+			out2[rep] = CRUSH_ITEM_NONE;
+		}
+	}
+	crush_count_tries(work, ftotal);
+}
+
+#ifndef __KERNEL__
+/*
+ * The draw of crush_choose_firstn() and crush_choose_indep() in @in,
+ * the exhaustive permutation search once @flocal is large enough,
+ * and is_out(), for interleave.c.
+ */
+extern CRUSH_PRIVATE int crush_lane_choose_item(
+	struct crush_work *work, const struct crush_bucket *in,
+	int x, int r, unsigned int flocal,
+	unsigned int local_fallback_retries,
+	const struct crush_choose_arg *choose_args, int position);
+extern CRUSH_PRIVATE int crush_lane_is_out(const struct crush_map *map,
+					   const struct crush_work *work,
+					   const __u32 *weight, int weight_max,
+					   int item, int x);
+
+/* the number of replicas of the indep step @s when @osize are chosen */
+static inline int crush_plan_indep_size(const struct crush_plan_step *s,
+					int result_max, int osize)
+{
+	return s->numrep < result_max - osize ? s->numrep : result_max - osize;
+}
+
+/*
+ * Once the choose step @s stored @osize items in *@o, and their
+ * leaves in @c, make them the working vector *@w.
+ */
+static inline void crush_plan_chosen(const struct crush_plan_step *s,
+				     int **w, int *wsize, int **o,
+				     const int *c, int osize)
+{
+	int *tmp;
+
+	if (s->recurse_to_leaf)
+		memcpy(*o, c, osize*sizeof(**o));
+	tmp = *o;
+	*o = *w;
+	*w = tmp;
+	*wsize = osize;
+}
+
+/* append the @wsize items of @w to @result, return its new size */
+static inline int crush_plan_emit(int *result, int result_len,
+				  int result_max, const int *w, int wsize)
+{
+	int i;
+
+	for (i = 0; i < wsize && result_len < result_max; i++) {
+		result[result_len] = w[i];
+		result_len++;
+	}
+	return result_len;
+}
+#endif
+
+#endif
@@ -0,0 +1,860 @@
+/*
+ * Single pass compiler for the text description of a map.
+ *
+ * The text is split into words, { and } and each statement is applied
+ * to the map as soon as it is parsed: a bucket is built with one call
+ * to crush_make_bucket() when its closing } is found. Names are kept
+ * as pointers into the text, in hash tables, and are never copied.
+ *
+ * LGPL2
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+
+#include "crush_compat.h"
+#include "builder.h"
+#include "hash.h"
+#include "compiler.h"
+
+struct token {
+	const char *p;
+	int len;
+	int line;
+};
+
+struct name {
+	const char *p;
+	int len;
+	int value;
+};
+
+/* open addressing hash table from names to values */
+struct names {
+	struct name *table;
+	unsigned int mask;
+	unsigned int count;
+};
+
+struct compiler {
+	const char *cur;
+	const char *end;
+	int line;
+	struct crush_map *map;
+	struct names item_names;	/* devices and buckets */
+	struct names type_names;
+	__u32 *weights;		/* device weights, indexed by id */
+	int weights_size;
+	int max_devices;	/* including devices not in a bucket */
+	/* the items of the bucket being parsed */
+	int *items;
+	int *item_weights;
+	int *item_pos;
+	int items_size;
+	struct crush_rule_step *steps;
+	int steps_size;
+	char *error;
+	size_t error_size;
+	int error_line;
+};
+
+static int fail(struct compiler *c, int line, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (c->error && c->error_size) {
+		n = snprintf(c->error, c->error_size, "line %d: ", line);
+		if (n >= 0 && (size_t)n < c->error_size) {
+			va_start(ap, fmt);
+			vsnprintf(c->error + n, c->error_size - n, fmt, ap);
+			va_end(ap);
+		}
+	}
+	return -EINVAL;
+}
+
+/************************************************/
+
+static unsigned int name_hash(const char *p, int len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*p++) * 16777619u;
+	return h;
+}
+
+static struct name *names_find(const struct names *n, const char *p, int len)
+{
+	unsigned int i;
+
+	if (!n->table)
+		return NULL;
+	for (i = name_hash(p, len) & n->mask; n->table[i].p;
+	     i = (i + 1) & n->mask)
+		if (n->table[i].len == len && !memcmp(n->table[i].p, p, len))
+			return &n->table[i];
+	return NULL;
+}
+
+static int names_add(struct names *n, const char *p, int len, int value)
+{
+	unsigned int i;
+
+	if (2 * (n->count + 1) > n->mask + 1 || !n->table) {
+		unsigned int size = n->table ? 2 * (n->mask + 1) : 64;
+		struct name *old = n->table;
+		unsigned int old_size = old ? n->mask + 1 : 0;
+
+		n->table = calloc(size, sizeof(*n->table));
+		if (!n->table) {
+			n->table = old;
+			return -ENOMEM;
+		}
+		n->mask = size - 1;
+		for (i = 0; i < old_size; i++) {
+			unsigned int j;
+
+			if (!old[i].p)
+				continue;
+			for (j = name_hash(old[i].p, old[i].len) & n->mask;
+			     n->table[j].p; j = (j + 1) & n->mask)
+				;
+			n->table[j] = old[i];
+		}
+		free(old);
+	}
+	for (i = name_hash(p, len) & n->mask; n->table[i].p;
+	     i = (i + 1) & n->mask)
+		;
+	n->table[i].p = p;
+	n->table[i].len = len;
+	n->table[i].value = value;
+	n->count++;
+	return 0;
+}
+
+/************************************************/
+
+static int is_space(char ch)
+{
+	return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r' ||
+		ch == '\f' || ch == '\v';
+}
+
+/* returns 0 at the end of the text */
+static int next_token(struct compiler *c, struct token *t)
+{
+	const char *p = c->cur;
+
+	for (;;) {
+		while (p < c->end && is_space(*p)) {
+			if (*p == '\n')
+				c->line++;
+			p++;
+		}
+		if (p < c->end && *p == '#') {
+			while (p < c->end && *p != '\n')
+				p++;
+			continue;
+		}
+		break;
+	}
+	t->p = p;
+	t->line = c->line;
+	if (p == c->end) {
+		t->len = 0;
+		c->cur = p;
+		return 0;
+	}
+	if (*p == '{' || *p == '}') {
+		p++;
+	} else {
+		while (p < c->end && !is_space(*p) && *p != '{' && *p != '}' &&
+		       *p != '#')
+			p++;
+	}
+	t->len = p - t->p;
+	c->cur = p;
+	return 1;
+}
+
+static int peek_token(struct compiler *c, struct token *t)
+{
+	const char *cur = c->cur;
+	int line = c->line;
+	int r = next_token(c, t);
+
+	c->cur = cur;
+	c->line = line;
+	return r;
+}
+
+static int token_is(const struct token *t, const char *word)
+{
+	return (size_t)t->len == strlen(word) && !memcmp(t->p, word, t->len);
+}
+
+static int expect_token(struct compiler *c, struct token *t, const char *what)
+{
+	if (!next_token(c, t))
+		return fail(c, c->line, "unexpected end of file, expected %s",
+			    what);
+	return 0;
+}
+
+static int expect_word(struct compiler *c, const char *word)
+{
+	struct token t;
+	int r = expect_token(c, &t, word);
+
+	if (r < 0)
+		return r;
+	if (!token_is(&t, word))
+		return fail(c, t.line, "expected '%s' instead of '%.*s'",
+			    word, t.len, t.p);
+	return 0;
+}
+
+static int parse_int(struct compiler *c, int *value)
+{
+	struct token t;
+	char buf[32];
+	char *end;
+	long v;
+	int r = expect_token(c, &t, "an integer");
+
+	if (r < 0)
+		return r;
+	if (t.len >= (int)sizeof(buf))
+		return fail(c, t.line, "'%.*s' is not an integer", t.len, t.p);
+	memcpy(buf, t.p, t.len);
+	buf[t.len] = '\0';
+	errno = 0;
+	v = strtol(buf, &end, 0);
+	if (*end || end == buf || errno || v < INT_MIN || v > INT_MAX)
+		return fail(c, t.line, "'%s' is not an integer", buf);
+	*value = v;
+	return 0;
+}
+
+static int parse_double(struct compiler *c, double *value)
+{
+	struct token t;
+	char buf[64];
+	char *end;
+	int r = expect_token(c, &t, "a number");
+
+	if (r < 0)
+		return r;
+	if (t.len >= (int)sizeof(buf))
+		return fail(c, t.line, "'%.*s' is not a number", t.len, t.p);
+	memcpy(buf, t.p, t.len);
+	buf[t.len] = '\0';
+	*value = strtod(buf, &end);
+	if (*end || end == buf)
+		return fail(c, t.line, "'%s' is not a number", buf);
+	return 0;
+}
+
+/* a 16.16 fixed point weight */
+static int parse_weight(struct compiler *c, int *weight)
+{
+	double w;
+	int r = parse_double(c, &w);
+
+	if (r < 0)
+		return r;
+	if (!(w >= 0) || w * 0x10000 > INT_MAX)
+		return fail(c, c->line, "weight %g out of range", w);
+	*weight = (int)(w * 0x10000 + 0.5);
+	return 0;
+}
+
+static int parse_type(struct compiler *c, int *type)
+{
+	struct token t;
+	struct name *n;
+	int r = expect_token(c, &t, "a type");
+
+	if (r < 0)
+		return r;
+	n = names_find(&c->type_names, t.p, t.len);
+	if (!n)
+		return fail(c, t.line, "unknown type '%.*s'", t.len, t.p);
+	*type = n->value;
+	return 0;
+}
+
+static int parse_item(struct compiler *c, int *item)
+{
+	struct token t;
+	struct name *n;
+	int r = expect_token(c, &t, "an item");
+
+	if (r < 0)
+		return r;
+	n = names_find(&c->item_names, t.p, t.len);
+	if (!n)
+		return fail(c, t.line, "unknown item '%.*s'", t.len, t.p);
+	*item = n->value;
+	return 0;
+}
+
+/************************************************/
+
+static int parse_tunable(struct compiler *c)
+{
+	struct crush_map *map = c->map;
+	struct token t;
+	int value;
+	int r = expect_token(c, &t, "a tunable");
+
+	if (r < 0)
+		return r;
+	r = parse_int(c, &value);
+	if (r < 0)
+		return r;
+	if (token_is(&t, "choose_local_tries"))
+		map->choose_local_tries = value;
+	else if (token_is(&t, "choose_local_fallback_tries"))
+		map->choose_local_fallback_tries = value;
+	else if (token_is(&t, "choose_total_tries"))
+		map->choose_total_tries = value;
+	else if (token_is(&t, "chooseleaf_descend_once"))
+		map->chooseleaf_descend_once = value;
+	else if (token_is(&t, "chooseleaf_vary_r"))
+		map->chooseleaf_vary_r = value;
+	else if (token_is(&t, "chooseleaf_stable"))
+		map->chooseleaf_stable = value;
+	else if (token_is(&t, "straw_calc_version"))
+		map->straw_calc_version = value;
+	else if (token_is(&t, "allowed_bucket_algs"))
+		map->allowed_bucket_algs = value;
+	else
+		return fail(c, t.line, "unknown tunable '%.*s'", t.len, t.p);
+	return 0;
+}
+
+static int parse_device(struct compiler *c)
+{
+	struct token t, class;
+	int id, weight = 0x10000;
+	double offload;
+	int r;
+
+	r = parse_int(c, &id);
+	if (r < 0)
+		return r;
+	if (id < 0)
+		return fail(c, c->line, "device id %d must not be negative", id);
+	r = expect_token(c, &t, "a device name");
+	if (r < 0)
+		return r;
+	for (;;) {
+		struct token option;
+
+		if (!peek_token(c, &option))
+			break;
+		if (token_is(&option, "class")) {
+			next_token(c, &option);
+			r = expect_token(c, &class, "a device class");
+			if (r < 0)
+				return r;
+		} else if (token_is(&option, "down")) {
+			next_token(c, &option);
+			weight = 0;
+		} else if (token_is(&option, "offload")) {
+			next_token(c, &option);
+			r = parse_double(c, &offload);
+			if (r < 0)
+				return r;
+			if (!(offload >= 0 && offload <= 1))
+				return fail(c, option.line,
+					    "offload %g is not in [0,1]", offload);
+			weight = (int)((1 - offload) * 0x10000 + 0.5);
+		} else {
+			break;
+		}
+	}
+	if (names_find(&c->item_names, t.p, t.len))
+		return fail(c, t.line, "item '%.*s' already defined",
+			    t.len, t.p);
+	r = names_add(&c->item_names, t.p, t.len, id);
+	if (r < 0)
+		return r;
+	if (id >= c->weights_size) {
+		int size = c->weights_size ? c->weights_size : 1024;
+		__u32 *weights;
+		int i;
+
+		while (size <= id)
+			size *= 2;
+		weights = realloc(c->weights, size * sizeof(*weights));
+		if (!weights)
+			return -ENOMEM;
+		for (i = c->weights_size; i < size; i++)
+			weights[i] = 0x10000;
+		c->weights = weights;
+		c->weights_size = size;
+	}
+	c->weights[id] = weight;
+	if (id >= c->max_devices)
+		c->max_devices = id + 1;
+	return 0;
+}
+
+static int parse_type_definition(struct compiler *c)
+{
+	struct token t;
+	int id;
+	int r = parse_int(c, &id);
+
+	if (r < 0)
+		return r;
+	r = expect_token(c, &t, "a type name");
+	if (r < 0)
+		return r;
+	if (names_find(&c->type_names, t.p, t.len))
+		return fail(c, t.line, "type '%.*s' already defined",
+			    t.len, t.p);
+	return names_add(&c->type_names, t.p, t.len, id);
+}
+
+static int grow_items(struct compiler *c, int size)
+{
+	int n = c->items_size ? c->items_size : 64;
+	void *p;
+
+	if (size <= c->items_size)
+		return 0;
+	while (n < size)
+		n *= 2;
+	if (!(p = realloc(c->items, n * sizeof(int))))
+		return -ENOMEM;
+	c->items = p;
+	if (!(p = realloc(c->item_weights, n * sizeof(int))))
+		return -ENOMEM;
+	c->item_weights = p;
+	if (!(p = realloc(c->item_pos, n * sizeof(int))))
+		return -ENOMEM;
+	c->item_pos = p;
+	c->items_size = n;
+	return 0;
+}
+
+static int parse_alg(struct compiler *c, int *alg)
+{
+	struct token t;
+	int r = expect_token(c, &t, "a bucket algorithm");
+
+	if (r < 0)
+		return r;
+	if (token_is(&t, "uniform"))
+		*alg = CRUSH_BUCKET_UNIFORM;
+	else if (token_is(&t, "list"))
+		*alg = CRUSH_BUCKET_LIST;
+	else if (token_is(&t, "tree"))
+		*alg = CRUSH_BUCKET_TREE;
+	else if (token_is(&t, "straw"))
+		*alg = CRUSH_BUCKET_STRAW;
+	else if (token_is(&t, "straw2"))
+		*alg = CRUSH_BUCKET_STRAW2;
+	else if (token_is(&t, "straw2_tree"))
+		*alg = CRUSH_BUCKET_STRAW2_TREE;
+	else
+		return fail(c, t.line, "unknown bucket algorithm '%.*s'",
+			    t.len, t.p);
+	return 0;
+}
+
+/*
+ * Move the items with a pos to their position and the others, in
+ * order, to the positions left.
+ */
+static int place_items(struct compiler *c, int size, int line)
+{
+	int *items, *weights;
+	int i, free_pos = 0;
+	int r = grow_items(c, 2 * size);
+
+	if (r < 0)
+		return r;
+	items = c->items + size;
+	weights = c->item_weights + size;
+	for (i = 0; i < size; i++)
+		items[i] = INT_MIN;
+	for (i = 0; i < size; i++) {
+		int pos = c->item_pos[i];
+
+		if (pos < 0)
+			continue;
+		if (pos >= size)
+			return fail(c, line, "position %d out of range", pos);
+		if (items[pos] != INT_MIN)
+			return fail(c, line, "position %d used twice", pos);
+		items[pos] = c->items[i];
+		weights[pos] = c->item_weights[i];
+	}
+	for (i = 0; i < size; i++) {
+		if (c->item_pos[i] >= 0)
+			continue;
+		while (items[free_pos] != INT_MIN)
+			free_pos++;
+		items[free_pos] = c->items[i];
+		weights[free_pos] = c->item_weights[i];
+	}
+	memcpy(c->items, items, size * sizeof(int));
+	memcpy(c->item_weights, weights, size * sizeof(int));
+	return 0;
+}
+
+static int parse_bucket(struct compiler *c, int type)
+{
+	struct crush_bucket *bucket;
+	struct token name, t;
+	int id = 0, alg = CRUSH_BUCKET_STRAW2, hash = CRUSH_HASH_DEFAULT;
+	int size = 0, has_pos = 0;
+	int i, r;
+
+	r = expect_token(c, &name, "a bucket name");
+	if (r < 0)
+		return r;
+	if (names_find(&c->item_names, name.p, name.len))
+		return fail(c, name.line, "item '%.*s' already defined",
+			    name.len, name.p);
+	r = expect_word(c, "{");
+	if (r < 0)
+		return r;
+	for (;;) {
+		r = expect_token(c, &t, "}");
+		if (r < 0)
+			return r;
+		if (token_is(&t, "}"))
+			break;
+		if (token_is(&t, "id")) {
+			struct token option;
+
+			r = parse_int(c, &id);
+			if (r < 0)
+				return r;
+			if (id >= 0)
+				return fail(c, t.line,
+					    "bucket id %d must be negative", id);
+			/* per class shadow ids are not supported, ignore */
+			if (peek_token(c, &option) && token_is(&option, "class")) {
+				next_token(c, &option);
+				r = expect_token(c, &option, "a device class");
+				if (r < 0)
+					return r;
+			}
+		} else if (token_is(&t, "alg")) {
+			r = parse_alg(c, &alg);
+			if (r < 0)
+				return r;
+		} else if (token_is(&t, "hash")) {
+			struct token h;
+
+			r = expect_token(c, &h, "a hash");
+			if (r < 0)
+				return r;
+			if (!token_is(&h, "0") && !token_is(&h, "rjenkins1"))
+				return fail(c, h.line, "unknown hash '%.*s'",
+					    h.len, h.p);
+			hash = CRUSH_HASH_RJENKINS1;
+		} else if (token_is(&t, "item")) {
+			struct token option;
+			int item;
+
+			r = grow_items(c, size + 1);
+			if (r < 0)
+				return r;
+			r = parse_item(c, &item);
+			if (r < 0)
+				return r;
+			c->items[size] = item;
+			if (item >= 0)
+				c->item_weights[size] = 0x10000;
+			else
+				c->item_weights[size] =
+					c->map->buckets[-1-item]->weight;
+			c->item_pos[size] = -1;
+			for (;;) {
+				if (!peek_token(c, &option))
+					break;
+				if (token_is(&option, "weight")) {
+					next_token(c, &option);
+					r = parse_weight(c, &c->item_weights[size]);
+				} else if (token_is(&option, "pos")) {
+					next_token(c, &option);
+					r = parse_int(c, &c->item_pos[size]);
+					has_pos = 1;
+				} else {
+					break;
+				}
+				if (r < 0)
+					return r;
+			}
+			size++;
+		} else {
+			return fail(c, t.line, "unexpected '%.*s' in bucket %.*s",
+				    t.len, t.p, name.len, name.p);
+		}
+	}
+	if (has_pos) {
+		r = place_items(c, size, name.line);
+		if (r < 0)
+			return r;
+	}
+	if (alg == CRUSH_BUCKET_UNIFORM)
+		for (i = 1; i < size; i++)
+			if (c->item_weights[i] != c->item_weights[0])
+				return fail(c, name.line,
+					    "the items of uniform bucket %.*s "
+					    "must have the same weight",
+					    name.len, name.p);
+	/* the text chooses the algorithms, allow them */
+	c->map->allowed_bucket_algs |= 1 << alg;
+	bucket = crush_make_bucket(c->map, alg, hash, type, size,
+				   c->items, c->item_weights);
+	if (!bucket)
+		return -ENOMEM;
+	r = crush_add_bucket(c->map, id, bucket, &id);
+	if (r < 0) {
+		crush_release_bucket(c->map, bucket);
+		if (r == -EEXIST)
+			return fail(c, name.line, "bucket id %d already used",
+				    id);
+		return r;
+	}
+	return names_add(&c->item_names, name.p, name.len, id);
+}
+
+static int parse_step(struct compiler *c, struct crush_rule_step *step)
+{
+	struct token t;
+	int r = expect_token(c, &t, "a step");
+
+	if (r < 0)
+		return r;
+	step->arg1 = 0;
+	step->arg2 = 0;
+	if (token_is(&t, "take")) {
+		step->op = CRUSH_RULE_TAKE;
+		return parse_item(c, &step->arg1);
+	} else if (token_is(&t, "emit")) {
+		step->op = CRUSH_RULE_EMIT;
+		return 0;
+	} else if (token_is(&t, "noop")) {
+		step->op = CRUSH_RULE_NOOP;
+		return 0;
+	} else if (token_is(&t, "choose") || token_is(&t, "chooseleaf")) {
+		int leaf = token_is(&t, "chooseleaf");
+		struct token mode;
+
+		r = expect_token(c, &mode, "firstn or indep");
+		if (r < 0)
+			return r;
+		if (token_is(&mode, "firstn"))
+			step->op = leaf ? CRUSH_RULE_CHOOSELEAF_FIRSTN :
+				CRUSH_RULE_CHOOSE_FIRSTN;
+		else if (token_is(&mode, "indep"))
+			step->op = leaf ? CRUSH_RULE_CHOOSELEAF_INDEP :
+				CRUSH_RULE_CHOOSE_INDEP;
+		else
+			return fail(c, mode.line,
+				    "expected firstn or indep instead of '%.*s'",
+				    mode.len, mode.p);
+		r = parse_int(c, &step->arg1);
+		if (r < 0)
+			return r;
+		r = expect_word(c, "type");
+		if (r < 0)
+			return r;
+		return parse_type(c, &step->arg2);
+	}
+	if (token_is(&t, "set_choose_tries"))
+		step->op = CRUSH_RULE_SET_CHOOSE_TRIES;
+	else if (token_is(&t, "set_chooseleaf_tries"))
+		step->op = CRUSH_RULE_SET_CHOOSELEAF_TRIES;
+	else if (token_is(&t, "set_choose_local_tries"))
+		step->op = CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES;
+	else if (token_is(&t, "set_choose_local_fallback_tries"))
+		step->op = CRUSH_RULE_SET_CHOOSE_LOCAL_FALLBACK_TRIES;
+	else if (token_is(&t, "set_chooseleaf_vary_r"))
+		step->op = CRUSH_RULE_SET_CHOOSELEAF_VARY_R;
+	else if (token_is(&t, "set_chooseleaf_stable"))
+		step->op = CRUSH_RULE_SET_CHOOSELEAF_STABLE;
+	else
+		return fail(c, t.line, "unknown step '%.*s'", t.len, t.p);
+	return parse_int(c, &step->arg1);
+}
+
+static int parse_rule(struct compiler *c)
+{
+	struct crush_rule *rule;
+	struct token t;
+	int ruleno = -1, ruleset = -1, type = 1, min_size = 1, max_size = 10;
+	int len = 0, line = c->line;
+	int i, r;
+
+	if (!peek_token(c, &t))
+		return fail(c, c->line, "unexpected end of file, expected {");
+	if (!token_is(&t, "{"))
+		next_token(c, &t);	/* the name of the rule */
+	r = expect_word(c, "{");
+	if (r < 0)
+		return r;
+	for (;;) {
+		r = expect_token(c, &t, "}");
+		if (r < 0)
+			return r;
+		if (token_is(&t, "}"))
+			break;
+		if (token_is(&t, "id")) {
+			r = parse_int(c, &ruleno);
+		} else if (token_is(&t, "ruleset") || token_is(&t, "pool")) {
+			r = parse_int(c, &ruleset);
+		} else if (token_is(&t, "type")) {
+			struct token name;
+
+			if (!peek_token(c, &name))
+				return fail(c, c->line, "expected a rule type");
+			if (token_is(&name, "replicated"))
+				type = 1;
+			else if (token_is(&name, "raid4"))
+				type = 2;
+			else if (token_is(&name, "erasure"))
+				type = 3;
+			else {
+				r = parse_int(c, &type);
+				if (r < 0)
+					return r;
+				continue;
+			}
+			next_token(c, &name);
+		} else if (token_is(&t, "min_size")) {
+			r = parse_int(c, &min_size);
+		} else if (token_is(&t, "max_size")) {
+			r = parse_int(c, &max_size);
+		} else if (token_is(&t, "step")) {
+			if (len == c->steps_size) {
+				int size = c->steps_size ? 2 * c->steps_size : 16;
+				void *p = realloc(c->steps,
+						  size * sizeof(*c->steps));
+
+				if (!p)
+					return -ENOMEM;
+				c->steps = p;
+				c->steps_size = size;
+			}
+			r = parse_step(c, &c->steps[len++]);
+		} else {
+			return fail(c, t.line, "unexpected '%.*s' in rule",
+				    t.len, t.p);
+		}
+		if (r < 0)
+			return r;
+	}
+	if (ruleno < -1 || ruleno >= CRUSH_MAX_RULES)
+		return fail(c, line, "rule id %d out of range", ruleno);
+	if (ruleno >= 0 && (__u32)ruleno < c->map->max_rules &&
+	    c->map->rules[ruleno])
+		return fail(c, line, "rule id %d already used", ruleno);
+
+	rule = crush_make_rule(len, ruleset, type, min_size, max_size);
+	if (!rule)
+		return -ENOMEM;
+	for (i = 0; i < len; i++)
+		crush_rule_set_step(rule, i, c->steps[i].op,
+				    c->steps[i].arg1, c->steps[i].arg2);
+	r = crush_add_rule(c->map, rule, ruleno);
+	if (r < 0) {
+		crush_destroy_rule(rule);
+		if (r == -ENOSPC)
+			return fail(c, line, "too many rules");
+		return r;
+	}
+	if (ruleset < 0)
+		rule->mask.ruleset = r;
+	return 0;
+}
+
+static int parse(struct compiler *c)
+{
+	struct token t;
+	struct name *n;
+	int r;
+
+	while (next_token(c, &t)) {
+		if (token_is(&t, "device"))
+			r = parse_device(c);
+		else if (token_is(&t, "type"))
+			r = parse_type_definition(c);
+		else if (token_is(&t, "tunable"))
+			r = parse_tunable(c);
+		else if (token_is(&t, "rule"))
+			r = parse_rule(c);
+		else if ((n = names_find(&c->type_names, t.p, t.len)))
+			r = parse_bucket(c, n->value);
+		else
+			r = fail(c, t.line, "unexpected '%.*s'", t.len, t.p);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
+int crush_compile(const char *text, size_t size,
+		  struct crush_map **mapp, __u32 **weightsp,
+		  char *error, size_t error_size)
+{
+	struct compiler c;
+	int r, i;
+
+	memset(&c, 0, sizeof(c));
+	c.cur = text;
+	c.end = text + size;
+	c.line = 1;
+	c.error = error;
+	c.error_size = error_size;
+	if (error && error_size)
+		error[0] = '\0';
+	c.map = crush_create_arena(crush_arena_create(0, NULL));
+	if (!c.map)
+		return -ENOMEM;
+	r = parse(&c);
+	if (r < 0)
+		goto out;
+	crush_finalize(c.map);
+	if (c.map->max_devices < c.max_devices)
+		c.map->max_devices = c.max_devices;
+
+	if (weightsp) {
+		__u32 *weights = malloc(sizeof(*weights) *
+					(c.map->max_devices + 1));
+
+		if (!weights) {
+			r = -ENOMEM;
+			goto out;
+		}
+		for (i = 0; i < c.map->max_devices; i++)
+			weights[i] = i < c.weights_size ? c.weights[i] : 0x10000;
+		*weightsp = weights;
+	}
+	*mapp = c.map;
+	c.map = NULL;
+out:
+	if (c.map)
+		crush_destroy(c.map);
+	free(c.item_names.table);
+	free(c.type_names.table);
+	free(c.weights);
+	free(c.items);
+	free(c.item_weights);
+	free(c.item_pos);
+	free(c.steps);
+	return r;
+}
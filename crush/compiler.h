@@ -0,0 +1,73 @@
+#ifndef CEPH_CRUSH_COMPILER_H
+#define CEPH_CRUSH_COMPILER_H
+
+/*
+ * Compile the text description of a map, as in crush/sample.txt.
+ *
+ * LGPL2
+ */
+
+#include <stddef.h>
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * Parse the __size__ bytes of __text__ in a single pass and build the
+ * corresponding crush_map, finalized with crush_finalize(). The text
+ * is a sequence of the following statements, in which # starts a
+ * comment that ends with the line:
+ *
+ *     tunable <name> <value>
+ *     device <id> <name> [class <class>] [down | offload <0.0..1.0>]
+ *     type <id> <name>
+ *     <type> <name> {
+ *             id <negative id>                              # optional
+ *             alg uniform|list|tree|straw|straw2|straw2_tree # default straw2
+ *             hash 0|rjenkins1                              # optional
+ *             item <name> [weight <weight>] [pos <position>]
+ *     }
+ *     rule [<name>] {
+ *             id <rule number>                              # optional
+ *             ruleset|pool <ruleset>                        # optional
+ *             type replicated|raid4|erasure|<number>
+ *             min_size <size>
+ *             max_size <size>
+ *             step take <name>
+ *             step choose|chooseleaf firstn|indep <n> type <type>
+ *             step set_choose_tries|set_chooseleaf_tries <n>
+ *             step set_choose_local_tries|set_choose_local_fallback_tries <n>
+ *             step set_chooseleaf_vary_r|set_chooseleaf_stable <n>
+ *             step emit
+ *     }
+ *
+ * Weights are floating point numbers where 1.0 is 0x10000. An item
+ * without a weight weighs 1.0 if it is a device or the weight of the
+ * bucket otherwise. Items and rules can only reference items defined
+ * before them.
+ *
+ * If __weights__ is not NULL, it is set to a __malloc(3)__ array of
+ * __map->max_devices__ device weights, as given to crush_do_rule(),
+ * derived from __down__ (0.0) and __offload__ (1.0 - offload).
+ *
+ * If the text cannot be compiled and __error__ is not NULL, a nul
+ * terminated message starting with the line number is stored in the
+ * __error_size__ bytes of __error__.
+ *
+ * - return -EINVAL if the text cannot be compiled
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param text the description of the map
+ * @param size the size of __text__
+ * @param[out] map the compiled map, allocated in an arena, see crush_create_arena(), to be released with crush_destroy()
+ * @param[out] weights the device weights or NULL
+ * @param[out] error a buffer for the error message or NULL
+ * @param error_size the size of __error__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_compile(const char *text, size_t size,
+			 struct crush_map **map, __u32 **weights,
+			 char *error, size_t error_size);
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * A placement context owns the workspace of crush_do_rule() so that
+ * callers do not size, align and initialize it themselves.
+ *
+ * The workspace is allocated on a cache line and kept when the context
+ * is bound to another map it fits in. The stats and the weight summary
+ * are attached again to each new workspace since crush_init_workspace()
+ * detaches them.
+ *
+ * LGPL2
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "crush_compat.h"
+#include "mapper.h"
+#include "context.h"
+
+struct crush_context {
+	const struct crush_map *map;	/* NULL if not bound */
+	__u32 epoch;
+	int result_max;
+	void *cwin;
+	size_t cwin_size;		/* bytes allocated for cwin */
+	struct crush_stats *stats;
+	const struct crush_weight_summary *summary;
+	struct crush_cache *cache;
+	__u32 generation;
+};
+
+struct crush_context *crush_context_create(void)
+{
+	return calloc(1, sizeof(struct crush_context));
+}
+
+void crush_context_destroy(struct crush_context *ctx)
+{
+	if (!ctx)
+		return;
+	free(ctx->cwin);
+	free(ctx);
+}
+
+int crush_context_bind(struct crush_context *ctx,
+		       const struct crush_map *map, __u32 epoch,
+		       int result_max)
+{
+	size_t size;
+	int r;
+
+	if (result_max < 1)
+		return -EINVAL;
+	if (ctx->map == map && ctx->epoch == epoch &&
+	    ctx->result_max >= result_max)
+		return 0;
+	size = crush_work_size(map, result_max);
+	if (size > ctx->cwin_size) {
+		free(ctx->cwin);
+		ctx->map = NULL;
+		ctx->cwin_size = 0;
+		if (posix_memalign(&ctx->cwin, L1_CACHE_BYTES,
+				   crush_work_align(size))) {
+			ctx->cwin = NULL;
+			return -ENOMEM;
+		}
+		ctx->cwin_size = crush_work_align(size);
+	}
+	crush_init_workspace(map, ctx->cwin);
+	ctx->map = map;
+	ctx->epoch = epoch;
+	ctx->result_max = result_max;
+	crush_set_weight_summary(ctx->cwin, ctx->summary);
+	if (ctx->stats) {
+		r = crush_set_stats(map, ctx->cwin, ctx->stats);
+		if (r < 0) {
+			ctx->stats = NULL;
+			return r;
+		}
+	}
+	return 0;
+}
+
+int crush_context_set_stats(struct crush_context *ctx,
+			    struct crush_stats *stats)
+{
+	int r;
+
+	if (!ctx->map)
+		return -EINVAL;
+	r = crush_set_stats(ctx->map, ctx->cwin, stats);
+	if (r < 0)
+		return r;
+	ctx->stats = stats;
+	return 0;
+}
+
+int crush_context_set_weight_summary(struct crush_context *ctx,
+				     const struct crush_weight_summary *summary)
+{
+	if (!ctx->map)
+		return -EINVAL;
+	crush_set_weight_summary(ctx->cwin, summary);
+	ctx->summary = summary;
+	return 0;
+}
+
+void crush_context_set_cache(struct crush_context *ctx,
+			     struct crush_cache *cache, __u32 generation)
+{
+	ctx->cache = cache;
+	ctx->generation = generation;
+}
+
+int crush_context_do_rule(struct crush_context *ctx, int ruleno,
+			  int x, int *result, int result_max,
+			  const __u32 *weights, int weight_max,
+			  const struct crush_choose_arg *choose_args)
+{
+	if (!ctx->map || result_max > ctx->result_max)
+		return 0;
+	if (ctx->cache && !choose_args)
+		return crush_cache_do_rule(ctx->cache, ctx->map, ctx->epoch,
+					   ruleno, x, result, result_max,
+					   weights, weight_max,
+					   ctx->generation, ctx->cwin);
+	return crush_do_rule(ctx->map, ruleno, x, result, result_max,
+			     weights, weight_max, ctx->cwin, choose_args);
+}
+
+void *crush_context_workspace(struct crush_context *ctx)
+{
+	return ctx->map ? ctx->cwin : NULL;
+}
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static int thread_key_error;
+
+static void thread_destroy(void *ctx)
+{
+	crush_context_destroy(ctx);
+}
+
+static void thread_init(void)
+{
+	thread_key_error = pthread_key_create(&thread_key, thread_destroy);
+}
+
+struct crush_context *crush_context_thread(void)
+{
+	static __thread struct crush_context *ctx;
+
+	if (ctx)
+		return ctx;
+	pthread_once(&thread_once, thread_init);
+	if (thread_key_error)
+		return NULL;
+	ctx = crush_context_create();
+	if (ctx && pthread_setspecific(thread_key, ctx)) {
+		crush_context_destroy(ctx);
+		ctx = NULL;
+	}
+	return ctx;
+}
@@ -0,0 +1,166 @@
+#ifndef CEPH_CRUSH_CONTEXT_H
+#define CEPH_CRUSH_CONTEXT_H
+
+/*
+ * A placement context owns the workspace of crush_do_rule() so that
+ * callers do not size, align and initialize it themselves.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+#include "mapper.h"
+#include "stats.h"
+#include "cache.h"
+
+struct crush_context;
+
+/** @ingroup API
+ *
+ * Allocate a context that is not bound to a map: crush_context_bind()
+ * must be called before mapping with it. A context is used by one
+ * thread at a time, see also crush_context_thread().
+ *
+ * @returns a context to be released with crush_context_destroy() or NULL if __malloc(3)__ fails
+ */
+extern struct crush_context *crush_context_create(void);
+
+/** @ingroup API
+ *
+ * Release __ctx__ and its workspace. The stats, the weight summary and
+ * the cache given to __ctx__ are not released.
+ *
+ * @param ctx the context or NULL
+ */
+extern void crush_context_destroy(struct crush_context *ctx);
+
+/** @ingroup API
+ *
+ * Bind __ctx__ to the version __epoch__ of __map__ for mappings of up
+ * to __result_max__ items. The workspace is initialized again unless
+ * __ctx__ is already bound to the same __map__ and __epoch__ with a
+ * __result_max__ at least as large, and it is only reallocated when
+ * it is smaller than crush_work_size(). The caller binds again, with
+ * another __epoch__, after __map__ is modified or replaced.
+ *
+ * The workspace is aligned on a cache line, so that no two buckets
+ * share the cache lines of their permutations.
+ *
+ * The stats given to crush_context_set_stats() keep counting with the
+ * new map, unless they have fewer rules or buckets: they are then
+ * detached from __ctx__ and -EINVAL is returned, the context being
+ * bound nonetheless.
+ *
+ * - return -ENOMEM if __malloc(3)__ fails, __ctx__ is then unbound
+ * - return -EINVAL if __result_max__ < 1 or if the stats do not fit __map__
+ *
+ * @param ctx the context
+ * @param map the crush_map
+ * @param epoch the version of __map__
+ * @param result_max the maximum number of items of a mapping
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_context_bind(struct crush_context *ctx,
+			      const struct crush_map *map, __u32 epoch,
+			      int result_max);
+
+/** @ingroup API
+ *
+ * Count the events of the mappings done with __ctx__ in __stats__, or
+ * stop counting if __stats__ is NULL, see crush_set_stats(). The
+ * __stats__ remain attached when __ctx__ is bound to another map.
+ *
+ * - return -EINVAL if __ctx__ is not bound to a map
+ * - return the error of crush_set_stats() otherwise
+ *
+ * @param ctx a bound context
+ * @param stats counters returned by crush_stats_create() or NULL
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_context_set_stats(struct crush_context *ctx,
+				   struct crush_stats *stats);
+
+/** @ingroup API
+ *
+ * Use __summary__ when mapping with __ctx__ and the weight vector it
+ * summarizes, see crush_set_weight_summary(). The __summary__ remains
+ * attached when __ctx__ is bound to another map and can be shared by
+ * the contexts of many threads.
+ *
+ * - return -EINVAL if __ctx__ is not bound to a map
+ *
+ * @param ctx a bound context
+ * @param summary the value returned by crush_make_weight_summary() or NULL
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_context_set_weight_summary(struct crush_context *ctx,
+					    const struct crush_weight_summary *summary);
+
+/** @ingroup API
+ *
+ * Look up and store the mappings of crush_context_do_rule() in
+ * __cache__, with the epoch of the map __ctx__ is bound to and
+ * __generation__ as the version of the weights, see
+ * crush_cache_do_rule(). The __cache__ is not used if __cache__ is
+ * NULL or for mappings with choose_args.
+ *
+ * @param ctx the context
+ * @param cache a cache from crush_cache_create() or NULL
+ * @param generation the version of the weights given to crush_context_do_rule()
+ */
+extern void crush_context_set_cache(struct crush_context *ctx,
+				    struct crush_cache *cache,
+				    __u32 generation);
+
+/** @ingroup API
+ *
+ * Map __x__ with crush_do_rule(), or crush_cache_do_rule() if a cache
+ * was given to crush_context_set_cache(), using the map and the
+ * workspace of __ctx__.
+ *
+ * - return 0 if __ctx__ is not bound or was bound with a result_max
+ *   smaller than __result_max__
+ *
+ * @param ctx a bound context
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param x the value to map to __result_max__ items
+ * @param result an array of items of size __result_max__
+ * @param result_max the size of the __result__ array
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param choose_args an array of __map->max_buckets__ crush_choose_arg or NULL
+ *
+ * @return 0 on error or the size of __result__ on success
+ */
+extern int crush_context_do_rule(struct crush_context *ctx, int ruleno,
+				 int x, int *result, int result_max,
+				 const __u32 *weights, int weight_max,
+				 const struct crush_choose_arg *choose_args);
+
+/** @ingroup API
+ *
+ * Return the workspace of __ctx__, initialized for the map it is bound
+ * to, to be given as __cwin__ to the other functions mapping with it,
+ * for instance crush_do_rule_batch() or crush_take_visited(). It
+ * remains valid until __ctx__ is bound again or destroyed.
+ *
+ * @param ctx a context
+ *
+ * @returns the workspace or NULL if __ctx__ is not bound
+ */
+extern void *crush_context_workspace(struct crush_context *ctx);
+
+/** @ingroup API
+ *
+ * Return the context of the calling thread, allocated at the first
+ * call and released when the thread exits. Binding it once per map
+ * epoch lets a thread map without allocating.
+ *
+ * @returns the context of the thread or NULL if __malloc(3)__ fails
+ */
+extern struct crush_context *crush_context_thread(void);
+
+#endif
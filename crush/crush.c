@@ -4,6 +4,7 @@
 #else
 # include "crush_compat.h"
 # include "crush.h"
+# include "arena.h"
 #endif
 
 const char *crush_bucket_alg_name(int alg)
@@ -14,6 +15,7 @@ const char *crush_bucket_alg_name(int alg)
 	case CRUSH_BUCKET_TREE: return "tree";
 	case CRUSH_BUCKET_STRAW: return "straw";
 	case CRUSH_BUCKET_STRAW2: return "straw2";
+	case CRUSH_BUCKET_STRAW2_TREE: return "straw2_tree";
 	default: return "unknown";
 	}
 }
@@ -39,6 +41,8 @@ int crush_get_bucket_item_weight(const struct crush_bucket *b, int p)
 		return ((struct crush_bucket_straw *)b)->item_weights[p];
 	case CRUSH_BUCKET_STRAW2:
 		return ((struct crush_bucket_straw2 *)b)->item_weights[p];
+	case CRUSH_BUCKET_STRAW2_TREE:
+		return ((struct crush_bucket_straw2_tree *)b)->item_weights[p];
 	}
 	return 0;
 }
@@ -61,6 +65,7 @@ void crush_destroy_bucket_tree(struct crush_bucket_tree *b)
 {
 	kfree(b->h.items);
 	kfree(b->node_weights);
+	kfree(b->descent_weights);
 	kfree(b);
 }
 
@@ -74,6 +79,15 @@ void crush_destroy_bucket_straw(struct crush_bucket_straw *b)
 
 void crush_destroy_bucket_straw2(struct crush_bucket_straw2 *b)
 {
+	kfree(b->item_reciprocals);
+	kfree(b->item_weights);
+	kfree(b->h.items);
+	kfree(b);
+}
+
+void crush_destroy_bucket_straw2_tree(struct crush_bucket_straw2_tree *b)
+{
+	kfree(b->node_weights);
 	kfree(b->item_weights);
 	kfree(b->h.items);
 	kfree(b);
@@ -97,6 +111,9 @@ void crush_destroy_bucket(struct crush_bucket *b)
 	case CRUSH_BUCKET_STRAW2:
 		crush_destroy_bucket_straw2((struct crush_bucket_straw2 *)b);
 		break;
+	case CRUSH_BUCKET_STRAW2_TREE:
+		crush_destroy_bucket_straw2_tree((struct crush_bucket_straw2_tree *)b);
+		break;
 	}
 }
 
@@ -106,6 +123,32 @@ void crush_destroy_bucket(struct crush_bucket *b)
  */
 void crush_destroy(struct crush_map *map)
 {
+#ifndef __KERNEL__
+	/* a frozen map is a single block */
+	if (map->frozen_size) {
+		kfree(map);
+		return;
+	}
+	/* the arena holds the map, its arrays and the buckets made for
+	   it: only the buckets and rules allocated elsewhere are
+	   released one by one */
+	if (map->arena) {
+		struct crush_arena *arena = map->arena;
+		__s32 b;
+		__u32 r;
+
+		for (b = 0; b < map->max_buckets; b++)
+			if (map->buckets[b] &&
+			    !crush_arena_owns(arena, map->buckets[b]))
+				crush_destroy_bucket(map->buckets[b]);
+		for (r = 0; r < map->max_rules; r++)
+			if (!crush_arena_owns(arena, map->rules[r]))
+				crush_destroy_rule(map->rules[r]);
+		crush_arena_destroy(arena);
+		return;
+	}
+#endif
+
 	/* buckets */
 	if (map->buckets) {
 		__s32 b;
@@ -126,7 +169,9 @@ void crush_destroy(struct crush_map *map)
 	}
 
 #ifndef __KERNEL__
-	kfree(map->choose_tries);
+	kfree(map->bucket_parents);
+	kfree(map->device_parents);
+	kfree(map->rule_table);
 #endif
 	kfree(map);
 }
@@ -157,8 +157,18 @@ enum crush_algorithm {
          * circumstances in which they never (or very rarely) shrink.
          */
 	CRUSH_BUCKET_LIST = 2,
-        /*! @cond INTERNAL */
+        /*!
+         * Tree buckets are binary trees whose leaves are the items
+         * and whose nodes weigh the sum of the weights of their
+         * children. To place a replica, a random point is drawn in the
+         * weight of the root and the descent goes left or right
+         * depending on the weight of the left child, down to a
+         * leaf. The selection is logarithmic in the number of items
+         * and adding or removing an item at the end of the bucket
+         * only modifies the weights of its ancestors.
+         */
 	CRUSH_BUCKET_TREE = 3,
+        /*! @cond INTERNAL */
 	CRUSH_BUCKET_STRAW = 4,
 	/*! @endcond */
         /*!
@@ -188,6 +198,40 @@ enum crush_algorithm {
          * optimal data movement between nested items when modified.
          */
 	CRUSH_BUCKET_STRAW2 = 5,
+        /*!
+         * A straw2_tree bucket draws straws as a straw2 bucket does,
+         * but among ::CRUSH_STRAW2_TREE_FANOUT candidates at a time.
+         * Its items are grouped, in order, by ::CRUSH_STRAW2_TREE_FANOUT
+         * and each group is a node whose weight is the sum of the
+         * weights of its items. The nodes are grouped the same way until
+         * there are no more than ::CRUSH_STRAW2_TREE_FANOUT of them. To
+         * place a replica, a straw is drawn for each of the top nodes,
+         * then for each node of the winning group and so on down to the
+         * items, which makes the selection logarithmic in the number of
+         * items, with each item chosen in proportion of its weight.
+         *
+         * Changing the weight of an item only changes the weight of the
+         * nodes above it: data moves to or from these nodes, as it does
+         * between the items of a straw2 bucket, and then between the
+         * items of the group that contains the item. The data moved is
+         * bounded by the number of levels, which is 3 for 4096 items,
+         * times the optimum. Items are added at the end and an item
+         * removed is replaced by the last item, so that the groups of
+         * the other items do not change: the data of the removed item
+         * and of the last item moves, the latter because it changes
+         * group. A bucket of no more than ::CRUSH_STRAW2_TREE_FANOUT
+         * items maps as a straw2 bucket with the same items.
+         *
+         * The levels are numbered from the items and the straw of a
+         * node only depends on its level and its position. When the
+         * size grows past a power of ::CRUSH_STRAW2_TREE_FANOUT, a
+         * level is added above the others and the previous top nodes
+         * are the first group of the new level: the draws below do not
+         * change and only the data won by the new top node, i.e. by the
+         * new item, moves. Shrinking back removes that level the same
+         * way.
+         */
+	CRUSH_BUCKET_STRAW2_TREE = 6,
 };
 extern const char *crush_bucket_alg_name(int alg);
 
@@ -218,10 +262,12 @@ extern const char *crush_bucket_alg_name(int alg);
  * - __alg__ == ::CRUSH_BUCKET_UNIFORM cast to crush_bucket_uniform
  * - __alg__ == ::CRUSH_BUCKET_LIST cast to crush_bucket_list
  * - __alg__ == ::CRUSH_BUCKET_STRAW2 cast to crush_bucket_straw2
+ * - __alg__ == ::CRUSH_BUCKET_STRAW2_TREE cast to crush_bucket_straw2_tree
  *
  * The weight of each item depends on the algorithm and the
  * information about it is available in the corresponding structure
- * (crush_bucket_uniform, crush_bucket_list or crush_bucket_straw2).
+ * (crush_bucket_uniform, crush_bucket_list, crush_bucket_straw2 or
+ * crush_bucket_straw2_tree).
  *
  * See crush_map for more information on how __id__ is used
  * to reference the bucket.
@@ -262,11 +308,34 @@ struct crush_bucket_list {
 	__u32 *sum_weights;   /*!< 16.16 fixed point sum of the weights */
 };
 
+/** @ingroup API
+ * The weight of each item and node in the bucket when
+ * __h.alg__ == ::CRUSH_BUCKET_TREE.
+ *
+ * The __num_nodes__ nodes are numbered in order: __h.items[i]__ is the
+ * leaf crush_calc_tree_node(i), the odd nodes are leaves and the node
+ * n whose lowest bit set is 1 << h is the parent of n - (1 << (h - 1))
+ * and n + (1 << (h - 1)). The root is __num_nodes__ / 2. The weight
+ * of the node n is __node_weights[n]__. The node numbers are hashed
+ * when descending the tree.
+ *
+ * If __descent_weights__ is not NULL, it holds, for each node that is
+ * not a leaf, its weight followed by the weight of its left child, in
+ * breadth first (Eytzinger) order from the root: the pair of the
+ * n-th node, counting from zero, is at 2n and the pairs of its
+ * children are those of the nodes 2n + 1 and 2n + 2. The top levels
+ * of the tree share a few cache lines and crush_do_rule() uses it
+ * instead of __node_weights__. It is set by the builder, see
+ * crush_calc_tree_descent().
+ *
+ * Note: __h.size__ is the number of leaves in use, some of which may
+ * be holes of weight 0 left by crush_bucket_remove_item().
+ */
 struct crush_bucket_tree {
-	struct crush_bucket h;  /* note: h.size is _tree_ size, not number of
-				   actual items */
-	__u8 num_nodes;
-	__u32 *node_weights;
+	struct crush_bucket h;  /*!< generic bucket information */
+	__u32 num_nodes;        /*!< size of the __node_weights__ array, a power of two */
+	__u32 *node_weights;    /*!< 16.16 fixed point weight of each node, in order */
+	__u32 *descent_weights; /*!< node and left child weights in breadth first order or NULL */
 };
 
 struct crush_bucket_straw {
@@ -281,10 +350,94 @@ struct crush_bucket_straw {
  *
  * The weight of __h.items[i]__ is __item_weights[i]__ for i in
  * [0,__h.size__[.
+ *
+ * If __item_reciprocals__ is not NULL, __item_reciprocals[i]__ is the
+ * multiply-shift form of __item_weights[i]__ and crush_do_rule() uses
+ * it instead of dividing by the weight. It is set by the builder when
+ * crush_map.straw2_reciprocals is true.
  */
 struct crush_bucket_straw2 {
         struct crush_bucket h; /*!< generic bucket information */
 	__u32 *item_weights;   /*!< 16.16 fixed point weight for each item */
+	__u64 *item_reciprocals; /*!< multiply-shift form of item_weights or NULL */
+};
+
+/** @ingroup API
+ *
+ * The number of nodes or items of a group of a
+ * ::CRUSH_BUCKET_STRAW2_TREE bucket.
+ */
+#define CRUSH_STRAW2_TREE_FANOUT 16
+/* enough levels of nodes for 2^32 items */
+#define CRUSH_STRAW2_TREE_MAX_LEVELS 8
+
+/** @ingroup API
+ * The weight of each item and node in the bucket when
+ * __h.alg__ == ::CRUSH_BUCKET_STRAW2_TREE.
+ *
+ * The weight of __h.items[i]__ is __item_weights[i]__ for i in
+ * [0,__h.size__[. The items i such that i / ::CRUSH_STRAW2_TREE_FANOUT
+ * == n are the children of the node n of the first level, the nodes n
+ * of a level such that n / ::CRUSH_STRAW2_TREE_FANOUT == m are the
+ * children of the node m of the next level, and so on, see
+ * crush_straw2_tree_levels(). The __node_weights__ of the first level
+ * come first, followed by those of the next level, etc. The last level
+ * has no more than ::CRUSH_STRAW2_TREE_FANOUT nodes and its nodes have
+ * no parent. A bucket of no more than ::CRUSH_STRAW2_TREE_FANOUT
+ * items has no nodes.
+ */
+struct crush_bucket_straw2_tree {
+	struct crush_bucket h; /*!< generic bucket information */
+	__u32 *item_weights;   /*!< 16.16 fixed point weight for each item */
+	__u32 *node_weights;   /*!< 16.16 fixed point sum of the weights of the children of each node */
+	__u32 num_nodes;       /*!< size of the __node_weights__ array */
+};
+
+/*
+ * The multiply-shift form of a weight w packs a multiplier m < 2^51 and
+ * a shift s such that (a * m) >> s == a / w for all 0 <= a <= 2^48,
+ * which covers every value of -ln in bucket_straw2_choose().
+ */
+#define CRUSH_RECIPROCAL_SHIFT_BITS 56
+#define crush_reciprocal_multiplier(r) \
+	((r) & ((1ull << CRUSH_RECIPROCAL_SHIFT_BITS) - 1))
+#define crush_reciprocal_shift(r) ((unsigned int)((r) >> CRUSH_RECIPROCAL_SHIFT_BITS))
+
+/** @ingroup API
+ *
+ * Replacement weights for the items of a straw2 bucket: __weights[i]__
+ * is used instead of __item_weights[i]__ for i in [0,__size__[. The
+ * __size__ must be the size of the bucket.
+ */
+struct crush_weight_set {
+	__u32 *weights; /*!< 16.16 fixed point weight for each item */
+	__u32 size;     /*!< size of the __weights__ array */
+};
+
+/** @ingroup API
+ *
+ * Replacement weights and ids for the items of a straw2 bucket, given
+ * to crush_do_rule() to draw with alternate weights, for instance a
+ * weight set per pool, without modifying the crush_map.
+ *
+ * If __weight_set__ is not NULL, the item chosen for the replica at
+ * position __p__ of the result is drawn with the weights of
+ * __weight_set[p]__, or of __weight_set[weight_set_size - 1]__ if __p__
+ * is beyond the end. A single weight set applies to all positions.
+ * A CRUSH_RULE_*_INDEP step uses the position of its first replica for
+ * all of them, as the kernel does.
+ *
+ * If __ids__ is not NULL, __ids[i]__ is hashed instead of __items[i]__
+ * when drawing. It must be of the size of the bucket. The chosen item
+ * is still __items[i]__.
+ *
+ * Either of them NULL means the bucket uses its own.
+ */
+struct crush_choose_arg {
+	__s32 *ids;                         /*!< ids to hash or NULL */
+	__u32 ids_size;                     /*!< size of the __ids__ array */
+	struct crush_weight_set *weight_set; /*!< weights per position or NULL */
+	__u32 weight_set_size;              /*!< size of the __weight_set__ array */
 };
 
 
@@ -369,7 +522,44 @@ struct crush_map {
 	 */
 	__u32 allowed_bucket_algs;
 
-	__u32 *choose_tries;
+	/*
+	 * if true, the builder stores the multiply-shift form of the
+	 * item weights of straw2 buckets (see crush_bucket_straw2) so
+	 * that the mapper does not need a 64 bits division per draw.
+	 * It costs 8 bytes per item.
+	 */
+	__u8 straw2_reciprocals;
+
+	/*
+	 * if not zero, the map was packed by crush_map_freeze() in a
+	 * single block of frozen_size bytes and must not be modified.
+	 */
+	size_t frozen_size;
+
+	/*
+	 * if not NULL, the arena the map, its buckets and their arrays
+	 * are allocated in, see crush_create_arena().
+	 */
+	struct crush_arena *arena;
+
+	/*
+	 * the bucket containing each item, set by crush_finalize() and
+	 * maintained by crush_map_add_item() etc. The parent of bucket
+	 * id is bucket_parents[-1-id] and the parent of device id is
+	 * device_parents[id]. It is 0 if the item is in no bucket and
+	 * CRUSH_PARENT_MANY if it is in more than one.
+	 */
+	__s32 *bucket_parents;
+	__u32 max_bucket_parents;
+	__s32 *device_parents;
+	__u32 max_device_parents;
+
+	/*
+	 * the rules indexed by mask for crush_find_rule(), set by
+	 * crush_finalize() and released by crush_add_rule(). If NULL,
+	 * crush_find_rule() scans the rules.
+	 */
+	struct crush_rule_table *rule_table;
 #endif
 	/*! @endcond */
 };
@@ -382,6 +572,7 @@ extern void crush_destroy_bucket_list(struct crush_bucket_list *b);
 extern void crush_destroy_bucket_tree(struct crush_bucket_tree *b);
 extern void crush_destroy_bucket_straw(struct crush_bucket_straw *b);
 extern void crush_destroy_bucket_straw2(struct crush_bucket_straw2 *b);
+extern void crush_destroy_bucket_straw2_tree(struct crush_bucket_straw2_tree *b);
 extern void crush_destroy_bucket(struct crush_bucket *b);
 extern void crush_destroy_rule(struct crush_rule *r);
 /** @ingroup API
@@ -397,6 +588,25 @@ static inline int crush_calc_tree_node(int i)
 	return ((i+1) << 1)-1;
 }
 
+/*
+ * Set @sizes[0] to @size and @sizes[l] to the number of nodes of the
+ * level l of a straw2_tree bucket of @size items. Returns the number
+ * of levels of nodes.
+ */
+static inline int crush_straw2_tree_levels(__u32 size, __u32 *sizes)
+{
+	int levels = 0;
+
+	sizes[0] = size;
+	while (sizes[levels] > CRUSH_STRAW2_TREE_FANOUT) {
+		sizes[levels + 1] = (sizes[levels] +
+				     CRUSH_STRAW2_TREE_FANOUT - 1) /
+			CRUSH_STRAW2_TREE_FANOUT;
+		levels++;
+	}
+	return levels;
+}
+
 /* ---------------------------------------------------------------------
 			       Private
    --------------------------------------------------------------------- */
@@ -409,14 +619,78 @@ static inline int crush_calc_tree_node(int i)
    immutable within the mapper and removes the requirement for a CRUSH
    map lock. */
 
+#ifndef __KERNEL__
+/* the sizes a rule mask can accept */
+#define CRUSH_RULE_TABLE_SIZES 256
+
+/* A row for each (ruleset, type) of the rule masks of a map, the rows
+   of ruleset s being [first[s], first[s + 1]). rules[row][size] is the
+   lowest rule whose mask has the ruleset and the type of the row and
+   accepts size, or -1. */
+struct crush_rule_table {
+	__u16 first[CRUSH_MAX_RULESET + 1];
+	__u8 types[CRUSH_MAX_RULES];
+	__s16 rules[][CRUSH_RULE_TABLE_SIZES];
+};
+
+#define crush_rule_table_size(rows) (sizeof(struct crush_rule_table) + \
+				     (rows)*sizeof(__s16[CRUSH_RULE_TABLE_SIZES]))
+#endif
+
 struct crush_work_bucket {
 	__u32 perm_x; /* @x for which *perm is defined */
 	__u32 perm_n; /* num elements of *perm that are permuted/defined */
 	__u32 *perm;  /* Permutation of the bucket's items */
+	__u32 perm_swapped; /* entries of *perm moved past perm_n or ~0 */
 };
 
+#ifndef __KERNEL__
+#define CRUSH_TRACK_VISITED 1	/* see crush_set_track_visited() */
+#define CRUSH_TRACK_STATS 2	/* see crush_set_stats() */
+#endif
+
 struct crush_work {
 	struct crush_work_bucket **work; /* Per-bucket working store */
+#ifndef __KERNEL__
+	/* histogram of the tries needed to choose an item, or NULL,
+	   see crush_set_choose_tries() */
+	__u32 *choose_tries;
+	__u32 choose_tries_size;
+	/* counters of the mapper or NULL, see crush_set_stats() */
+	struct crush_stats *stats;
+	struct crush_rule_stats *rule_stats; /* of the rule being mapped */
+	/* the CRUSH_TRACK_* the mapper does on each choice */
+	__u8 track;
+	/* the buckets chosen from, see crush_take_visited() */
+	__u64 visited;
+	/* the devices not fully in or NULL, see crush_set_weight_summary() */
+	const struct crush_weight_summary *weight_summary;
+#endif
 };
 
+/*
+ * Outside of the kernel, the array of bucket workspaces and each
+ * bucket workspace, permutation included, start at a multiple of
+ * CRUSH_WORK_ALIGN bytes from the beginning of the workspace. The
+ * crush_work_bucket are aligned and, when the workspace is allocated
+ * on a cache line, no two buckets share one, see crush_context_create().
+ */
+#ifndef __KERNEL__
+#define CRUSH_WORK_ALIGN 64
+#else
+#define CRUSH_WORK_ALIGN 1
+#endif
+
+static inline size_t crush_work_align(size_t size)
+{
+	return (size + CRUSH_WORK_ALIGN - 1) & ~(size_t)(CRUSH_WORK_ALIGN - 1);
+}
+
+/* the workspace of a bucket of @size items in crush_init_workspace() */
+static inline size_t crush_work_bucket_size(__u32 size)
+{
+	return crush_work_align(sizeof(struct crush_work_bucket) +
+				size * sizeof(__u32));
+}
+
 #endif
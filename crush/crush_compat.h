@@ -27,10 +27,42 @@
 #define S64_MAX		((__s64)(U64_MAX>>1))
 #define S64_MIN		((__s64)(-S64_MAX - 1))
 
+/* linux/compiler.h */
+
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+
 /* linux/math64.h */
 
 #define div64_s64(dividend, divisor) ((dividend) / (divisor))
 
+#if defined(__SIZEOF_INT128__)
+static inline __u64 mul_u64_u64_shr(__u64 a, __u64 b, unsigned int shift)
+{
+	return (__u64)(((unsigned __int128)a * b) >> shift);
+}
+#else
+static inline __u64 mul_u64_u64_shr(__u64 a, __u64 b, unsigned int shift)
+{
+	__u64 al = a & U32_MAX, ah = a >> 32;
+	__u64 bl = b & U32_MAX, bh = b >> 32;
+	__u64 ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+	__u64 mid = (ll >> 32) + (lh & U32_MAX) + (hl & U32_MAX);
+	__u64 lo = (mid << 32) | (ll & U32_MAX);
+	__u64 hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+
+	if (shift == 0)
+		return lo;
+	if (shift >= 64)
+		return hi >> (shift - 64);
+	return (hi << (64 - shift)) | (lo >> shift);
+}
+#endif
+
+/* linux/cache.h */
+
+#define L1_CACHE_BYTES 64
+
 /* linux/slab.h */
 
 #define kmalloc(size, flags) malloc(size)
@@ -0,0 +1,601 @@
+/*
+ * Compute the inputs whose mapping differs between two maps.
+ *
+ * The buckets of the two maps are compared once. The buckets of the
+ * old map that differ, or that contain an item that differs, are
+ * watched: the workspace records the buckets the mapper chooses from,
+ * see crush_take_visited(), and an input whose old mapping did not
+ * choose from a watched bucket is not mapped again with the new map.
+ *
+ * The inputs are split in batches mapped by a crush_pool, created with
+ * the diff, each thread collecting the changes of a contiguous range
+ * of inputs, so that the changes are returned in order.
+ *
+ * LGPL2
+ */
+
+#include <errno.h>
+
+#include "crush_compat.h"
+#include "crush.h"
+#include "mapper.h"
+#include "parallel.h"
+#include "diff.h"
+
+/* the number of inputs mapped by a thread at a time */
+#define CRUSH_DIFF_CHUNK 16384
+
+struct diff_worker {
+	__u32 begin;
+	__u32 end;
+	void *old_work;
+	void *new_work;
+	/* the changes, each made of x, old_len, new_len, the old and
+	   the new results */
+	int *changes;
+	__u32 count;
+	__u32 allocated;
+	__u64 skipped;
+	int error;
+};
+
+struct diff_move_slot {
+	int from;
+	int to;
+	__u32 count;		/* 0 if the slot is free */
+};
+
+struct crush_diff {
+	const struct crush_map *old_map;
+	const __u32 *old_weights;
+	int old_weight_max;
+	const struct crush_map *new_map;
+	const __u32 *new_weights;
+	int new_weight_max;
+	int ruleno;
+	int result_max;
+	__u32 next;		/* the first input of the next batch */
+	__u32 end;
+	int skip;		/* if unchanged inputs can be detected */
+	int positional;		/* if the rule has an indep step */
+	__u64 watched;		/* crush_visited_bit() of the watched buckets */
+	struct crush_pool *pool;
+	int threads;
+	struct diff_worker *workers;
+	int current;		/* the worker whose changes are returned */
+	__u32 position;		/* the next change of the current worker */
+	__u64 skipped;
+	struct diff_move_slot *moves;
+	__u32 moves_mask;
+	__u32 moves_count;
+};
+
+/************************************************/
+
+static int same_u32(const __u32 *a, const __u32 *b, __u32 n)
+{
+	return a == b || !memcmp(a, b, n * sizeof(*a));
+}
+
+static int same_bucket(const struct crush_bucket *a,
+		       const struct crush_bucket *b)
+{
+	if (a == b)
+		return 1;
+	if (a->id != b->id || a->type != b->type || a->alg != b->alg ||
+	    a->hash != b->hash || a->weight != b->weight ||
+	    a->size != b->size ||
+	    !same_u32((const __u32 *)a->items, (const __u32 *)b->items,
+		      a->size))
+		return 0;
+
+	/* what the bucket choose functions read */
+	switch (a->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		return 1;
+	case CRUSH_BUCKET_LIST: {
+		const struct crush_bucket_list *x = (const void *)a;
+		const struct crush_bucket_list *y = (const void *)b;
+
+		return same_u32(x->item_weights, y->item_weights, a->size) &&
+			same_u32(x->sum_weights, y->sum_weights, a->size);
+	}
+	case CRUSH_BUCKET_TREE: {
+		const struct crush_bucket_tree *x = (const void *)a;
+		const struct crush_bucket_tree *y = (const void *)b;
+
+		return x->num_nodes == y->num_nodes &&
+			same_u32(x->node_weights, y->node_weights,
+				 x->num_nodes);
+	}
+	case CRUSH_BUCKET_STRAW: {
+		const struct crush_bucket_straw *x = (const void *)a;
+		const struct crush_bucket_straw *y = (const void *)b;
+
+		return same_u32(x->straws, y->straws, a->size);
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		const struct crush_bucket_straw2 *x = (const void *)a;
+		const struct crush_bucket_straw2 *y = (const void *)b;
+
+		return same_u32(x->item_weights, y->item_weights, a->size);
+	}
+	case CRUSH_BUCKET_STRAW2_TREE: {
+		const struct crush_bucket_straw2_tree *x = (const void *)a;
+		const struct crush_bucket_straw2_tree *y = (const void *)b;
+
+		return same_u32(x->item_weights, y->item_weights, a->size) &&
+			x->num_nodes == y->num_nodes &&
+			same_u32(x->node_weights, y->node_weights,
+				 x->num_nodes);
+	}
+	default:
+		return 0;
+	}
+}
+
+static const struct crush_bucket *get_bucket(const struct crush_map *map,
+					     int b)
+{
+	return b < map->max_buckets ? map->buckets[b] : NULL;
+}
+
+static int bucket_changed(const struct crush_diff *diff, int b)
+{
+	const struct crush_bucket *a = get_bucket(diff->old_map, b);
+	const struct crush_bucket *n = get_bucket(diff->new_map, b);
+
+	if (!a || !n)
+		return a != n;
+	return !same_bucket(a, n);
+}
+
+static __u32 device_weight(const __u32 *weights, int weight_max, int item)
+{
+	/* is_out() considers the devices beyond weight_max out */
+	return item < weight_max ? weights[item] : 0;
+}
+
+static int item_changed(const struct crush_diff *diff, const char *changed,
+			int max_buckets, int item)
+{
+	if (item < 0)
+		return -1-item < max_buckets && changed[-1-item];
+	return device_weight(diff->old_weights, diff->old_weight_max, item) !=
+		device_weight(diff->new_weights, diff->new_weight_max, item);
+}
+
+static int same_rule(const struct crush_rule *a, const struct crush_rule *b)
+{
+	if (!a || !b)
+		return a == b;
+	return a->len == b->len &&
+		!memcmp(a->steps, b->steps, a->len * sizeof(a->steps[0]));
+}
+
+static int same_tunables(const struct crush_map *a, const struct crush_map *b)
+{
+	return a->choose_local_tries == b->choose_local_tries &&
+		a->choose_local_fallback_tries ==
+		b->choose_local_fallback_tries &&
+		a->choose_total_tries == b->choose_total_tries &&
+		a->chooseleaf_descend_once == b->chooseleaf_descend_once &&
+		a->chooseleaf_vary_r == b->chooseleaf_vary_r &&
+		a->chooseleaf_stable == b->chooseleaf_stable;
+}
+
+static const struct crush_rule *get_rule(const struct crush_map *map,
+					 int ruleno)
+{
+	if (ruleno < 0 || (__u32)ruleno >= map->max_rules)
+		return NULL;
+	return map->rules[ruleno];
+}
+
+/*
+ * Find the buckets of the old map to watch, or clear diff->skip if
+ * all inputs must be mapped twice.
+ */
+static int diff_watch(struct crush_diff *diff)
+{
+	const struct crush_map *map = diff->old_map;
+	const struct crush_rule *rule = get_rule(map, diff->ruleno);
+	int max_buckets = map->max_buckets > diff->new_map->max_buckets ?
+		map->max_buckets : diff->new_map->max_buckets;
+	char *changed;
+	__u32 i;
+	int b;
+
+	diff->skip = rule &&
+		same_rule(rule, get_rule(diff->new_map, diff->ruleno)) &&
+		same_tunables(map, diff->new_map);
+	if (!diff->skip)
+		return 0;
+
+	changed = calloc(max_buckets ? max_buckets : 1, 1);
+	if (!changed)
+		return -ENOMEM;
+	for (b = 0; b < max_buckets; b++)
+		changed[b] = bucket_changed(diff, b);
+
+	/* the mapper does not choose from the bucket of a take step,
+	   it may emit it */
+	for (i = 0; i < rule->len; i++) {
+		int arg1 = rule->steps[i].arg1;
+
+		if (rule->steps[i].op != CRUSH_RULE_TAKE)
+			continue;
+		if (arg1 >= 0 || -1-arg1 >= max_buckets || changed[-1-arg1])
+			diff->skip = 0;
+	}
+
+	/* the items of a bucket that is chosen from are read */
+	for (b = 0; b < map->max_buckets; b++) {
+		const struct crush_bucket *bucket = map->buckets[b];
+		int watch;
+
+		if (!bucket)
+			continue;
+		watch = changed[b];
+		for (i = 0; i < bucket->size && !watch; i++)
+			watch = item_changed(diff, changed, max_buckets,
+					     bucket->items[i]);
+		if (watch)
+			diff->watched |= crush_visited_bit(-1-b);
+	}
+	free(changed);
+	return 0;
+}
+
+/************************************************/
+
+static int worker_add(const struct crush_diff *diff, struct diff_worker *w,
+		      __u32 x, const int *old_result, int old_len,
+		      const int *new_result, int new_len)
+{
+	int record = 3 + 2 * diff->result_max;
+	int *change;
+
+	if (w->count == w->allocated) {
+		__u32 allocated = w->allocated ? 2 * w->allocated : 64;
+		int *changes = realloc(w->changes,
+				       (size_t)allocated * record * sizeof(int));
+
+		if (!changes)
+			return -ENOMEM;
+		w->changes = changes;
+		w->allocated = allocated;
+	}
+	change = w->changes + (size_t)w->count++ * record;
+	change[0] = x;
+	change[1] = old_len;
+	change[2] = new_len;
+	memcpy(change + 3, old_result, old_len * sizeof(int));
+	memcpy(change + 3 + diff->result_max, new_result,
+	       new_len * sizeof(int));
+	return 0;
+}
+
+static void worker_run(void *arg, int worker)
+{
+	const struct crush_diff *diff = arg;
+	struct diff_worker *w = &diff->workers[worker];
+	int old_result[diff->result_max];
+	int new_result[diff->result_max];
+	int old_len, new_len;
+	__u32 x;
+
+	w->count = 0;
+	w->skipped = 0;
+	w->error = 0;
+	for (x = w->begin; x != w->end; x++) {
+		old_len = crush_do_rule(diff->old_map, diff->ruleno, x,
+					old_result, diff->result_max,
+					diff->old_weights, diff->old_weight_max,
+					w->old_work, NULL);
+		if (diff->skip &&
+		    !(crush_take_visited(w->old_work) & diff->watched)) {
+			w->skipped++;
+			continue;
+		}
+		new_len = crush_do_rule(diff->new_map, diff->ruleno, x,
+					new_result, diff->result_max,
+					diff->new_weights, diff->new_weight_max,
+					w->new_work, NULL);
+		if (old_len == new_len &&
+		    !memcmp(old_result, new_result, old_len * sizeof(int)))
+			continue;
+		w->error = worker_add(diff, w, x, old_result, old_len,
+				      new_result, new_len);
+		if (w->error < 0)
+			break;
+	}
+}
+
+/* map the next batch of inputs */
+static int diff_batch(struct crush_diff *diff)
+{
+	int t, r = 0;
+
+	for (t = 0; t < diff->threads; t++) {
+		struct diff_worker *w = &diff->workers[t];
+		__u32 left = diff->end - diff->next;
+
+		w->begin = diff->next;
+		w->end = w->begin + (left < CRUSH_DIFF_CHUNK ?
+				     left : CRUSH_DIFF_CHUNK);
+		diff->next = w->end;
+	}
+	crush_pool_run(diff->pool, worker_run, diff);
+
+	for (t = 0; t < diff->threads; t++) {
+		diff->skipped += diff->workers[t].skipped;
+		if (diff->workers[t].error < 0)
+			r = diff->workers[t].error;
+	}
+	diff->current = 0;
+	diff->position = 0;
+	return r;
+}
+
+struct crush_diff *crush_diff_create(const struct crush_map *old_map,
+				     const __u32 *old_weights,
+				     int old_weight_max,
+				     const struct crush_map *new_map,
+				     const __u32 *new_weights,
+				     int new_weight_max,
+				     int ruleno, int result_max,
+				     __u32 begin, __u32 end,
+				     int threads)
+{
+	struct crush_diff *diff;
+	const struct crush_rule *rule;
+	__u32 i;
+	int t;
+
+	if (result_max < 1)
+		return NULL;
+	diff = calloc(1, sizeof(*diff));
+	if (!diff)
+		return NULL;
+	diff->old_map = old_map;
+	diff->old_weights = old_weights;
+	diff->old_weight_max = old_weight_max;
+	diff->new_map = new_map;
+	diff->new_weights = new_weights;
+	diff->new_weight_max = new_weight_max;
+	diff->ruleno = ruleno;
+	diff->result_max = result_max;
+	diff->next = begin;
+	diff->end = end > begin ? end : begin;
+	if (diff_watch(diff) < 0)
+		goto fail;
+
+	rule = get_rule(new_map, ruleno);
+	for (i = 0; rule && i < rule->len; i++)
+		if (rule->steps[i].op == CRUSH_RULE_CHOOSE_INDEP ||
+		    rule->steps[i].op == CRUSH_RULE_CHOOSELEAF_INDEP)
+			diff->positional = 1;
+
+	/* the threads are kept for all the batches */
+	diff->pool = crush_pool_create(threads,
+				       ((__u64)diff->end - diff->next +
+					CRUSH_DIFF_CHUNK - 1) / CRUSH_DIFF_CHUNK);
+	if (!diff->pool)
+		goto fail;
+	diff->threads = crush_pool_threads(diff->pool);
+	diff->workers = calloc(diff->threads, sizeof(*diff->workers));
+	if (!diff->workers)
+		goto fail;
+	for (t = 0; t < diff->threads; t++) {
+		struct diff_worker *w = &diff->workers[t];
+
+		w->old_work = malloc(crush_work_size(old_map, diff->result_max));
+		w->new_work = malloc(crush_work_size(new_map, diff->result_max));
+		if (!w->old_work || !w->new_work)
+			goto fail;
+		crush_init_workspace(old_map, w->old_work);
+		crush_set_track_visited(w->old_work, diff->skip);
+		crush_init_workspace(new_map, w->new_work);
+	}
+	/* nothing to return until the first batch */
+	diff->current = diff->threads;
+	return diff;
+
+fail:
+	crush_diff_destroy(diff);
+	return NULL;
+}
+
+void crush_diff_destroy(struct crush_diff *diff)
+{
+	int t;
+
+	crush_pool_destroy(diff->pool);
+	if (diff->workers) {
+		for (t = 0; t < diff->threads; t++) {
+			free(diff->workers[t].old_work);
+			free(diff->workers[t].new_work);
+			free(diff->workers[t].changes);
+		}
+	}
+	free(diff->workers);
+	free(diff->moves);
+	free(diff);
+}
+
+/************************************************/
+
+static __u32 move_hash(int from, int to)
+{
+	__u32 h = (__u32)from * 0x9e3779b1u ^ (__u32)to * 0x85ebca6bu;
+
+	return h ^ (h >> 16);
+}
+
+static int add_move(struct crush_diff *diff, int from, int to)
+{
+	struct diff_move_slot *slot;
+	__u32 i;
+
+	if (2 * (diff->moves_count + 1) > diff->moves_mask + 1 ||
+	    !diff->moves) {
+		__u32 size = diff->moves ? 2 * (diff->moves_mask + 1) : 256;
+		struct diff_move_slot *old = diff->moves;
+		__u32 old_size = old ? diff->moves_mask + 1 : 0;
+
+		diff->moves = calloc(size, sizeof(*diff->moves));
+		if (!diff->moves) {
+			diff->moves = old;
+			return -ENOMEM;
+		}
+		diff->moves_mask = size - 1;
+		for (i = 0; i < old_size; i++) {
+			__u32 j;
+
+			if (!old[i].count)
+				continue;
+			for (j = move_hash(old[i].from, old[i].to) &
+				     diff->moves_mask;
+			     diff->moves[j].count;
+			     j = (j + 1) & diff->moves_mask)
+				;
+			diff->moves[j] = old[i];
+		}
+		free(old);
+	}
+	for (i = move_hash(from, to) & diff->moves_mask;
+	     diff->moves[i].count; i = (i + 1) & diff->moves_mask) {
+		slot = &diff->moves[i];
+		if (slot->from == from && slot->to == to) {
+			slot->count++;
+			return 0;
+		}
+	}
+	slot = &diff->moves[i];
+	slot->from = from;
+	slot->to = to;
+	slot->count = 1;
+	diff->moves_count++;
+	return 0;
+}
+
+static int add_moves(struct crush_diff *diff,
+		     const struct crush_diff_change *change)
+{
+	int i = 0, j = 0, r, from, to;
+	int len = change->old_len > change->new_len ?
+		change->old_len : change->new_len;
+
+	if (diff->positional) {
+		for (i = 0; i < len; i++) {
+			from = i < change->old_len ?
+				change->old_result[i] : CRUSH_ITEM_NONE;
+			to = i < change->new_len ?
+				change->new_result[i] : CRUSH_ITEM_NONE;
+			if (from != to && (r = add_move(diff, from, to)) < 0)
+				return r;
+		}
+		return 0;
+	}
+
+	/* pair the items only in the old mapping with the items only in
+	   the new mapping */
+	for (;;) {
+		while (i < change->old_len &&
+		       crush_result_contains(change->new_result,
+					     change->new_len,
+					     change->old_result[i]))
+			i++;
+		while (j < change->new_len &&
+		       crush_result_contains(change->old_result,
+					     change->old_len,
+					     change->new_result[j]))
+			j++;
+		if (i == change->old_len && j == change->new_len)
+			return 0;
+		from = i < change->old_len ?
+			change->old_result[i++] : CRUSH_ITEM_NONE;
+		to = j < change->new_len ?
+			change->new_result[j++] : CRUSH_ITEM_NONE;
+		r = add_move(diff, from, to);
+		if (r < 0)
+			return r;
+	}
+}
+
+int crush_diff_next(struct crush_diff *diff, struct crush_diff_change *change)
+{
+	int record = 3 + 2 * diff->result_max;
+	const int *c;
+	int r;
+
+	for (;;) {
+		while (diff->current < diff->threads &&
+		       diff->position == diff->workers[diff->current].count) {
+			diff->current++;
+			diff->position = 0;
+		}
+		if (diff->current < diff->threads)
+			break;
+		if (diff->next == diff->end)
+			return 0;
+		r = diff_batch(diff);
+		if (r < 0)
+			return r;
+	}
+
+	c = diff->workers[diff->current].changes +
+		(size_t)diff->position++ * record;
+	change->x = c[0];
+	change->old_len = c[1];
+	change->new_len = c[2];
+	change->old_result = c + 3;
+	change->new_result = c + 3 + diff->result_max;
+	r = add_moves(diff, change);
+	return r < 0 ? r : 1;
+}
+
+/************************************************/
+
+static int move_cmp(const void *a, const void *b)
+{
+	const struct crush_diff_move *x = a, *y = b;
+
+	if (x->from != y->from)
+		return x->from < y->from ? -1 : 1;
+	if (x->to != y->to)
+		return x->to < y->to ? -1 : 1;
+	return 0;
+}
+
+int crush_diff_movement(const struct crush_diff *diff,
+			struct crush_diff_move *moves, int moves_max)
+{
+	struct crush_diff_move *all;
+	__u32 i, n = 0;
+
+	if (!diff->moves_count || moves_max <= 0)
+		return diff->moves_count;
+	all = malloc(diff->moves_count * sizeof(*all));
+	if (!all)
+		return -ENOMEM;
+	for (i = 0; i <= diff->moves_mask; i++) {
+		if (!diff->moves[i].count)
+			continue;
+		all[n].from = diff->moves[i].from;
+		all[n].to = diff->moves[i].to;
+		all[n].count = diff->moves[i].count;
+		n++;
+	}
+	qsort(all, n, sizeof(*all), move_cmp);
+	memcpy(moves, all, (n < (__u32)moves_max ? n : (__u32)moves_max) *
+	       sizeof(*all));
+	free(all);
+	return n;
+}
+
+__u64 crush_diff_skipped(const struct crush_diff *diff)
+{
+	return diff->skipped;
+}
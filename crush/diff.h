@@ -0,0 +1,166 @@
+#ifndef CEPH_CRUSH_DIFF_H
+#define CEPH_CRUSH_DIFF_H
+
+/*
+ * Compute the inputs whose mapping differs between two maps.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+struct crush_diff;
+
+/** @ingroup API
+ *
+ * An input for which crush_do_rule() returns different results with
+ * the old and the new map, see crush_diff_next().
+ */
+struct crush_diff_change {
+	__u32 x;		/*!< the input */
+	int old_len;		/*!< the number of items in __old_result__ */
+	int new_len;		/*!< the number of items in __new_result__ */
+	const int *old_result;	/*!< the mapping with the old map */
+	const int *new_result;	/*!< the mapping with the new map */
+};
+
+/** @ingroup API
+ *
+ * Return 1 if __item__ is one of the __len__ items of __result__, for
+ * instance __change->old_result__, and 0 otherwise.
+ *
+ * @param result a mapping
+ * @param len the number of items in __result__
+ * @param item the item to look for
+ *
+ * @returns 1 if __result__ contains __item__, 0 otherwise
+ */
+static inline int crush_result_contains(const int *result, int len, int item)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		if (result[i] == item)
+			return 1;
+	return 0;
+}
+
+/** @ingroup API
+ *
+ * The number of replicas that moved from one device to another, see
+ * crush_diff_movement().
+ */
+struct crush_diff_move {
+	int from;		/*!< the old device or ::CRUSH_ITEM_NONE */
+	int to;			/*!< the new device or ::CRUSH_ITEM_NONE */
+	__u32 count;		/*!< the number of replicas */
+};
+
+/** @ingroup API
+ *
+ * Prepare the comparison of the mappings of the inputs in the range
+ * [__begin__, __end__) by the rule __ruleno__ of __old_map__ with
+ * __old_weights__ and of __new_map__ with __new_weights__, as
+ * crush_do_rule() would compute them. The maps must be finalized and
+ * must not be modified until the comparison is released with
+ * crush_diff_destroy().
+ *
+ * The buckets, device weights, rules and tunables of the two maps are
+ * compared first. An input is only mapped with __new_map__ if its
+ * mapping with __old_map__ chose from a bucket that differs or that
+ * contains an item that differs: the other inputs cannot have moved.
+ * If the rules or the tunables differ, all inputs are mapped twice.
+ *
+ * The inputs are mapped by __threads__ threads, in batches that are
+ * returned in order by crush_diff_next(). If __threads__ is 0, one
+ * thread per online CPU is used.
+ *
+ * If __result_max__ is lower than 1 or __malloc(3)__ fails, return NULL.
+ *
+ * @param old_map the map before the change
+ * @param old_weights the device weights before the change
+ * @param old_weight_max the size of __old_weights__
+ * @param new_map the map after the change
+ * @param new_weights the device weights after the change
+ * @param new_weight_max the size of __new_weights__
+ * @param ruleno the rule to compare, in both maps
+ * @param result_max the maximum number of items in a mapping
+ * @param begin the first input
+ * @param end the input after the last one
+ * @param threads the number of threads or 0
+ *
+ * @returns a comparison to be released with crush_diff_destroy() or NULL
+ */
+extern struct crush_diff *crush_diff_create(const struct crush_map *old_map,
+					    const __u32 *old_weights,
+					    int old_weight_max,
+					    const struct crush_map *new_map,
+					    const __u32 *new_weights,
+					    int new_weight_max,
+					    int ruleno, int result_max,
+					    __u32 begin, __u32 end,
+					    int threads);
+
+/** @ingroup API
+ *
+ * Store in __change__ the next input, in increasing order, whose
+ * mapping differs. The results pointed to by __change__ are valid
+ * until the next call. The movement of the replicas of __change__ is
+ * added to crush_diff_movement().
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param diff the comparison returned by crush_diff_create()
+ * @param[out] change the next input that moved
+ *
+ * @returns 1 if __change__ is set, 0 after the last input, < 0 on error
+ */
+extern int crush_diff_next(struct crush_diff *diff,
+			   struct crush_diff_change *change);
+
+/** @ingroup API
+ *
+ * Store in __moves__, sorted by __from__ then __to__, at most
+ * __moves_max__ of the (__from__, __to__) device pairs of the changes
+ * returned so far by crush_diff_next(), with the number of replicas
+ * that moved from __from__ to __to__.
+ *
+ * If the rule has a CRUSH_RULE_*_INDEP step, the position of an item
+ * in the mapping is significant: each position whose item differs is
+ * a move. Otherwise the items that are only in the old mapping are
+ * paired, in order, with the items that are only in the new mapping.
+ * A replica that is added or removed without a counterpart moves from
+ * or to ::CRUSH_ITEM_NONE.
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param diff the comparison returned by crush_diff_create()
+ * @param[out] moves the device pairs and their counts
+ * @param moves_max the size of __moves__
+ *
+ * @returns the number of device pairs, which may be more than __moves_max__, or < 0 on error
+ */
+extern int crush_diff_movement(const struct crush_diff *diff,
+			       struct crush_diff_move *moves, int moves_max);
+
+/** @ingroup API
+ *
+ * Return the number of inputs, among the batches mapped so far by
+ * crush_diff_next(), that were only mapped with the old map because
+ * they could not have moved.
+ *
+ * @param diff the comparison returned by crush_diff_create()
+ *
+ * @returns the number of inputs mapped once
+ */
+extern __u64 crush_diff_skipped(const struct crush_diff *diff);
+
+/** @ingroup API
+ *
+ * Release a comparison returned by crush_diff_create().
+ *
+ * @param diff the comparison
+ */
+extern void crush_diff_destroy(struct crush_diff *diff);
+
+#endif
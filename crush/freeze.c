@@ -0,0 +1,600 @@
+/*
+ * Pack a finalized crush_map into a single contiguous block.
+ *
+ * The maps built with builder.c allocate each bucket and each of its
+ * arrays separately and a descent through the hierarchy touches as
+ * many unrelated cache lines. crush_map_freeze() copies everything in
+ * one block, in breadth first order, with the structures containing
+ * pointers first so that rebasing them only touches the beginning of
+ * the block.
+ *
+ * LGPL2
+ */
+
+#include <errno.h>
+
+#include "crush_compat.h"
+#include "freeze.h"
+
+static size_t frozen_align(size_t size)
+{
+	return (size + CRUSH_FROZEN_ALIGN - 1) &
+		~(size_t)(CRUSH_FROZEN_ALIGN - 1);
+}
+
+/* the last ruleset ends after the last row */
+static size_t rule_table_size(const struct crush_rule_table *table)
+{
+	return crush_rule_table_size(table->first[CRUSH_MAX_RULESET]);
+}
+
+static size_t frozen_bucket_size(const struct crush_bucket *b)
+{
+	switch (b->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		return sizeof(struct crush_bucket_uniform);
+	case CRUSH_BUCKET_LIST:
+		return sizeof(struct crush_bucket_list);
+	case CRUSH_BUCKET_TREE:
+		return sizeof(struct crush_bucket_tree);
+	case CRUSH_BUCKET_STRAW:
+		return sizeof(struct crush_bucket_straw);
+	case CRUSH_BUCKET_STRAW2:
+		return sizeof(struct crush_bucket_straw2);
+	case CRUSH_BUCKET_STRAW2_TREE:
+		return sizeof(struct crush_bucket_straw2_tree);
+	default:
+		return 0;
+	}
+}
+
+/* the size of the arrays of @b, including their alignment */
+static size_t frozen_arrays_size(const struct crush_bucket *b)
+{
+	size_t items = frozen_align(b->size * sizeof(__u32));
+
+	switch (b->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		return items;
+	case CRUSH_BUCKET_LIST:
+		return 3 * items;
+	case CRUSH_BUCKET_TREE:
+		if (((struct crush_bucket_tree *)b)->descent_weights)
+			items += frozen_align(
+				(((struct crush_bucket_tree *)b)->num_nodes - 2) *
+				sizeof(__u32));
+		return items + frozen_align(
+			((struct crush_bucket_tree *)b)->num_nodes *
+			sizeof(__u32));
+	case CRUSH_BUCKET_STRAW:
+		return 3 * items;
+	case CRUSH_BUCKET_STRAW2:
+		if (((struct crush_bucket_straw2 *)b)->item_reciprocals)
+			return 2 * items + b->size * sizeof(__u64);
+		return 2 * items;
+	case CRUSH_BUCKET_STRAW2_TREE:
+		return 2 * items + frozen_align(
+			((struct crush_bucket_straw2_tree *)b)->num_nodes *
+			sizeof(__u32));
+	default:
+		return 0;
+	}
+}
+
+/* copy @size bytes of @src at @*cursor and move it past them */
+static void *frozen_copy(char **cursor, const void *src, size_t size)
+{
+	void *dst = *cursor;
+
+	if (size)
+		memcpy(dst, src, size);
+	*cursor += frozen_align(size);
+	return dst;
+}
+
+/* copy the arrays of @b at @*cursor and set the pointers of @f */
+static void frozen_copy_arrays(char **cursor, struct crush_bucket *f,
+			       const struct crush_bucket *b)
+{
+	size_t size = b->size * sizeof(__u32);
+
+	f->items = frozen_copy(cursor, b->items, size);
+	switch (b->alg) {
+	case CRUSH_BUCKET_LIST: {
+		const struct crush_bucket_list *l =
+			(const struct crush_bucket_list *)b;
+		struct crush_bucket_list *fl = (struct crush_bucket_list *)f;
+
+		fl->item_weights = frozen_copy(cursor, l->item_weights, size);
+		fl->sum_weights = frozen_copy(cursor, l->sum_weights, size);
+		break;
+	}
+	case CRUSH_BUCKET_TREE: {
+		const struct crush_bucket_tree *t =
+			(const struct crush_bucket_tree *)b;
+		struct crush_bucket_tree *ft = (struct crush_bucket_tree *)f;
+
+		ft->node_weights = frozen_copy(cursor, t->node_weights,
+					       t->num_nodes * sizeof(__u32));
+		if (t->descent_weights)
+			ft->descent_weights =
+				frozen_copy(cursor, t->descent_weights,
+					    (t->num_nodes - 2) * sizeof(__u32));
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		const struct crush_bucket_straw *s =
+			(const struct crush_bucket_straw *)b;
+		struct crush_bucket_straw *fs = (struct crush_bucket_straw *)f;
+
+		fs->item_weights = frozen_copy(cursor, s->item_weights, size);
+		fs->straws = frozen_copy(cursor, s->straws, size);
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		const struct crush_bucket_straw2 *s =
+			(const struct crush_bucket_straw2 *)b;
+		struct crush_bucket_straw2 *fs = (struct crush_bucket_straw2 *)f;
+
+		fs->item_weights = frozen_copy(cursor, s->item_weights, size);
+		if (s->item_reciprocals)
+			fs->item_reciprocals =
+				frozen_copy(cursor, s->item_reciprocals,
+					    b->size * sizeof(__u64));
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2_TREE: {
+		const struct crush_bucket_straw2_tree *t =
+			(const struct crush_bucket_straw2_tree *)b;
+		struct crush_bucket_straw2_tree *ft =
+			(struct crush_bucket_straw2_tree *)f;
+
+		ft->item_weights = frozen_copy(cursor, t->item_weights, size);
+		ft->node_weights = frozen_copy(cursor, t->node_weights,
+					       t->num_nodes * sizeof(__u32));
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+/*
+ * Store in @order the positions of the buckets of @map in breadth
+ * first order from the buckets no other bucket references, followed
+ * by the buckets that could not be reached. Returns the number of
+ * buckets.
+ */
+static int frozen_order(const struct crush_map *map, int *order, char *seen)
+{
+	int head = 0, tail = 0;
+	int b;
+	__u32 i;
+
+	memset(seen, 0, map->max_buckets);
+	for (b = 0; b < map->max_buckets; b++) {
+		const struct crush_bucket *bucket = map->buckets[b];
+
+		if (!bucket)
+			continue;
+		for (i = 0; i < bucket->size; i++) {
+			int child = -1 - bucket->items[i];
+
+			if (child >= 0 && child < map->max_buckets)
+				seen[child] = 1;
+		}
+	}
+	for (b = 0; b < map->max_buckets; b++) {
+		if (map->buckets[b] && !seen[b])
+			order[tail++] = b;
+		seen[b] = 0;
+	}
+	for (b = 0; b < tail; b++)
+		seen[order[b]] = 1;
+	for (;;) {
+		while (head < tail) {
+			const struct crush_bucket *bucket =
+				map->buckets[order[head++]];
+
+			for (i = 0; i < bucket->size; i++) {
+				int child = -1 - bucket->items[i];
+
+				if (child < 0 || child >= map->max_buckets ||
+				    !map->buckets[child] || seen[child])
+					continue;
+				seen[child] = 1;
+				order[tail++] = child;
+			}
+		}
+		/* only cycles are left, start from the first of them */
+		for (b = 0; b < map->max_buckets; b++)
+			if (map->buckets[b] && !seen[b])
+				break;
+		if (b == map->max_buckets)
+			return tail;
+		seen[b] = 1;
+		order[tail++] = b;
+	}
+}
+
+struct crush_map *crush_map_freeze(const struct crush_map *map)
+{
+	struct crush_map *frozen = NULL;
+	int *order;
+	char *seen;
+	int count, b, n;
+	__u32 r;
+	size_t size;
+	char *cursor;
+
+	order = malloc(sizeof(*order) * (map->max_buckets + 1));
+	seen = malloc(map->max_buckets + 1);
+	if (!order || !seen)
+		goto out;
+	count = frozen_order(map, order, seen);
+
+	size = frozen_align(sizeof(*map));
+	size += frozen_align(map->max_buckets * sizeof(map->buckets[0]));
+	size += frozen_align(map->max_rules * sizeof(map->rules[0]));
+	for (r = 0; r < map->max_rules; r++)
+		if (map->rules[r])
+			size += frozen_align(crush_rule_size(map->rules[r]->len));
+	if (map->rule_table)
+		size += frozen_align(rule_table_size(map->rule_table));
+	for (n = 0; n < count; n++) {
+		const struct crush_bucket *bucket = map->buckets[order[n]];
+
+		if (!frozen_bucket_size(bucket))
+			goto out;
+		size += frozen_align(frozen_bucket_size(bucket));
+		size += frozen_arrays_size(bucket);
+	}
+
+	/* zeroed so that the padding is deterministic, see crush_map_save() */
+	frozen = calloc(1, size);
+	if (!frozen)
+		goto out;
+	cursor = (char *)frozen;
+	frozen_copy(&cursor, map, sizeof(*map));
+	frozen->buckets = frozen_copy(&cursor, map->buckets,
+				      map->max_buckets * sizeof(map->buckets[0]));
+	frozen->rules = frozen_copy(&cursor, map->rules,
+				    map->max_rules * sizeof(map->rules[0]));
+	for (r = 0; r < map->max_rules; r++)
+		if (map->rules[r])
+			frozen->rules[r] =
+				frozen_copy(&cursor, map->rules[r],
+					    crush_rule_size(map->rules[r]->len));
+	if (map->rule_table)
+		frozen->rule_table =
+			frozen_copy(&cursor, map->rule_table,
+				    rule_table_size(map->rule_table));
+	for (n = 0; n < count; n++) {
+		b = order[n];
+		frozen->buckets[b] =
+			frozen_copy(&cursor, map->buckets[b],
+				    frozen_bucket_size(map->buckets[b]));
+	}
+	for (n = 0; n < count; n++) {
+		b = order[n];
+		frozen_copy_arrays(&cursor, frozen->buckets[b],
+				   map->buckets[b]);
+	}
+	BUG_ON((size_t)(cursor - (char *)frozen) != size);
+	/* a frozen map is not modified, it needs no back-links */
+	frozen->bucket_parents = NULL;
+	frozen->max_bucket_parents = 0;
+	frozen->device_parents = NULL;
+	frozen->max_device_parents = 0;
+	frozen->arena = NULL;
+	frozen->frozen_size = size;
+out:
+	free(seen);
+	free(order);
+	return frozen;
+}
+
+/* where @p, set when the block was at @from, now is */
+#define frozen_at(frozen, from, p) \
+	((__typeof__(p))((char *)(frozen) + ((uintptr_t)(p) - (from))))
+
+#define frozen_rebase(p, from, to) \
+	((p) = (p) ? (__typeof__(p))((uintptr_t)(p) - (from) + (to)) : NULL)
+
+/*
+ * the @count elements of @elem bytes at @offset, aligned on @align,
+ * are inside a block of @size bytes: offset 0 is NULL and only holds
+ * no elements since the crush_map is there
+ */
+static int frozen_extent(uintptr_t offset, size_t count, size_t elem,
+			 size_t align, size_t size)
+{
+	if (!offset)
+		return count == 0;
+	return offset % align == 0 && offset <= size &&
+		(size - offset) / elem >= count;
+}
+
+#define frozen_inside(p, count, size)				\
+	frozen_extent((uintptr_t)(p), (count), sizeof(*(p)),	\
+		      __alignof__(*(p)), (size))
+
+/* the number of nodes of a tree bucket of @size items, see calc_depth() */
+static __u32 frozen_tree_nodes(__u32 size)
+{
+	__u32 nodes = 2, t;
+
+	if (!size)
+		return 0;
+	for (t = size - 1; t; t >>= 1)
+		nodes <<= 1;
+	return nodes;
+}
+
+/* @item is a device or a bucket of the map with the @buckets array */
+static int frozen_check_item(const struct crush_map *frozen,
+			     struct crush_bucket *const *buckets, int item)
+{
+	return item >= 0 ||
+		(-1-item < frozen->max_buckets && buckets[-1-item]);
+}
+
+static int frozen_check_bucket(const struct crush_map *frozen,
+			       struct crush_bucket *const *buckets,
+			       const struct crush_bucket *p, int b)
+{
+	const size_t size = frozen->frozen_size;
+	const struct crush_bucket *bucket;
+	const __s32 *items;
+	__u32 sizes[CRUSH_STRAW2_TREE_MAX_LEVELS + 1];
+	__u32 num_nodes = 0, i;
+	int levels, l;
+
+	if (!frozen_extent((uintptr_t)p, 1, sizeof(*p), CRUSH_FROZEN_ALIGN,
+			   size))
+		return -EINVAL;
+	bucket = frozen_at(frozen, 0, p);
+	if (bucket->id != -1-b || !frozen_bucket_size(bucket) ||
+	    !frozen_extent((uintptr_t)p, 1, frozen_bucket_size(bucket),
+			   CRUSH_FROZEN_ALIGN, size) ||
+	    !frozen_inside(bucket->items, bucket->size, size))
+		return -EINVAL;
+	items = frozen_at(frozen, 0, bucket->items);
+	for (i = 0; i < bucket->size; i++)
+		if (!frozen_check_item(frozen, buckets, items[i]))
+			return -EINVAL;
+
+	switch (bucket->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		return 0;
+	case CRUSH_BUCKET_LIST: {
+		const struct crush_bucket_list *l =
+			(const struct crush_bucket_list *)bucket;
+
+		if (!frozen_inside(l->item_weights, bucket->size, size) ||
+		    !frozen_inside(l->sum_weights, bucket->size, size))
+			return -EINVAL;
+		return 0;
+	}
+	case CRUSH_BUCKET_TREE: {
+		const struct crush_bucket_tree *t =
+			(const struct crush_bucket_tree *)bucket;
+
+		if (t->num_nodes != frozen_tree_nodes(bucket->size) ||
+		    !frozen_inside(t->node_weights, t->num_nodes, size))
+			return -EINVAL;
+		if (t->descent_weights &&
+		    (t->num_nodes <= 2 ||
+		     !frozen_inside(t->descent_weights, t->num_nodes - 2, size)))
+			return -EINVAL;
+		return 0;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		const struct crush_bucket_straw *s =
+			(const struct crush_bucket_straw *)bucket;
+
+		if (!frozen_inside(s->item_weights, bucket->size, size) ||
+		    !frozen_inside(s->straws, bucket->size, size))
+			return -EINVAL;
+		return 0;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		const struct crush_bucket_straw2 *s =
+			(const struct crush_bucket_straw2 *)bucket;
+
+		if (!frozen_inside(s->item_weights, bucket->size, size) ||
+		    (s->item_reciprocals &&
+		     !frozen_inside(s->item_reciprocals, bucket->size, size)))
+			return -EINVAL;
+		return 0;
+	}
+	case CRUSH_BUCKET_STRAW2_TREE: {
+		const struct crush_bucket_straw2_tree *t =
+			(const struct crush_bucket_straw2_tree *)bucket;
+
+		levels = crush_straw2_tree_levels(bucket->size, sizes);
+		for (l = 1; l <= levels; l++)
+			num_nodes += sizes[l];
+		if (!frozen_inside(t->item_weights, bucket->size, size) ||
+		    t->num_nodes != num_nodes ||
+		    !frozen_inside(t->node_weights, t->num_nodes, size))
+			return -EINVAL;
+		return 0;
+	}
+	default:
+		return -EINVAL;
+	}
+}
+
+static int frozen_check_rule_table(const struct crush_map *frozen)
+{
+	const size_t size = frozen->frozen_size;
+	const struct crush_rule_table *table;
+	int s, row, rows, i;
+
+	if (!frozen_extent((uintptr_t)frozen->rule_table, 1, sizeof(*table),
+			   CRUSH_FROZEN_ALIGN, size))
+		return -EINVAL;
+	table = frozen_at(frozen, 0, frozen->rule_table);
+	rows = table->first[CRUSH_MAX_RULESET];
+	if (rows > CRUSH_MAX_RULES ||
+	    !frozen_extent((uintptr_t)frozen->rule_table, 1,
+			   crush_rule_table_size(rows), CRUSH_FROZEN_ALIGN,
+			   size))
+		return -EINVAL;
+	for (s = 0; s < CRUSH_MAX_RULESET; s++)
+		if (table->first[s] > table->first[s + 1])
+			return -EINVAL;
+	for (row = 0; row < rows; row++)
+		for (i = 0; i < CRUSH_RULE_TABLE_SIZES; i++)
+			if (table->rules[row][i] < -1 ||
+			    table->rules[row][i] >= (int)frozen->max_rules)
+				return -EINVAL;
+	return 0;
+}
+
+int crush_map_frozen_check(const struct crush_map *frozen)
+{
+	const size_t size = frozen->frozen_size;
+	struct crush_bucket *const *buckets;
+	struct crush_rule *const *rules;
+	const struct crush_rule *rule;
+	int b;
+	__u32 r, s;
+
+	if (size < sizeof(*frozen) || frozen->max_buckets < 0 ||
+	    frozen->arena || frozen->bucket_parents ||
+	    frozen->device_parents ||
+	    !frozen_inside(frozen->buckets, frozen->max_buckets, size) ||
+	    !frozen_inside(frozen->rules, frozen->max_rules, size))
+		return -EINVAL;
+	buckets = frozen_at(frozen, 0, frozen->buckets);
+	rules = frozen_at(frozen, 0, frozen->rules);
+
+	for (b = 0; b < frozen->max_buckets; b++)
+		if (buckets[b] &&
+		    frozen_check_bucket(frozen, buckets, buckets[b], b) < 0)
+			return -EINVAL;
+	for (r = 0; r < frozen->max_rules; r++) {
+		if (!rules[r])
+			continue;
+		if (!frozen_extent((uintptr_t)rules[r], 1, crush_rule_size(0),
+				   CRUSH_FROZEN_ALIGN, size))
+			return -EINVAL;
+		rule = frozen_at(frozen, 0, rules[r]);
+		if (!frozen_extent((uintptr_t)rules[r], 1,
+				   crush_rule_size((size_t)rule->len),
+				   CRUSH_FROZEN_ALIGN, size))
+			return -EINVAL;
+		for (s = 0; s < rule->len; s++)
+			if (rule->steps[s].op == CRUSH_RULE_TAKE &&
+			    !frozen_check_item(frozen, buckets,
+					       rule->steps[s].arg1))
+				return -EINVAL;
+	}
+	if (frozen->rule_table && frozen_check_rule_table(frozen) < 0)
+		return -EINVAL;
+	return 0;
+}
+
+/* @end, or the end of the @size bytes at the offset @p if it is after */
+static size_t frozen_end(size_t end, const void *p, size_t size)
+{
+	size_t e = (uintptr_t)p + frozen_align(size);
+
+	return e > end ? e : end;
+}
+
+size_t crush_map_frozen_structs_size(const struct crush_map *frozen)
+{
+	struct crush_bucket *const *buckets = frozen_at(frozen, 0, frozen->buckets);
+	struct crush_rule *const *rules = frozen_at(frozen, 0, frozen->rules);
+	size_t end = frozen_align(sizeof(*frozen));
+	int b;
+	__u32 r;
+
+	end = frozen_end(end, frozen->buckets,
+			 frozen->max_buckets * sizeof(buckets[0]));
+	end = frozen_end(end, frozen->rules,
+			 frozen->max_rules * sizeof(rules[0]));
+	for (r = 0; r < frozen->max_rules; r++)
+		if (rules[r])
+			end = frozen_end(end, rules[r], crush_rule_size(
+				frozen_at(frozen, 0, rules[r])->len));
+	if (frozen->rule_table)
+		end = frozen_end(end, frozen->rule_table, rule_table_size(
+			frozen_at(frozen, 0, frozen->rule_table)));
+	for (b = 0; b < frozen->max_buckets; b++)
+		if (buckets[b])
+			end = frozen_end(end, buckets[b], frozen_bucket_size(
+				frozen_at(frozen, 0, buckets[b])));
+	return end;
+}
+
+void crush_map_frozen_rebase(struct crush_map *frozen,
+			     uintptr_t from, uintptr_t to)
+{
+	struct crush_bucket **buckets = frozen_at(frozen, from, frozen->buckets);
+	struct crush_rule **rules = frozen_at(frozen, from, frozen->rules);
+	int b;
+	__u32 r;
+
+	for (b = 0; b < frozen->max_buckets; b++) {
+		struct crush_bucket *bucket;
+
+		if (!buckets[b])
+			continue;
+		bucket = frozen_at(frozen, from, buckets[b]);
+		frozen_rebase(bucket->items, from, to);
+		switch (bucket->alg) {
+		case CRUSH_BUCKET_LIST: {
+			struct crush_bucket_list *l =
+				(struct crush_bucket_list *)bucket;
+
+			frozen_rebase(l->item_weights, from, to);
+			frozen_rebase(l->sum_weights, from, to);
+			break;
+		}
+		case CRUSH_BUCKET_TREE: {
+			struct crush_bucket_tree *t =
+				(struct crush_bucket_tree *)bucket;
+
+			frozen_rebase(t->node_weights, from, to);
+			frozen_rebase(t->descent_weights, from, to);
+			break;
+		}
+		case CRUSH_BUCKET_STRAW: {
+			struct crush_bucket_straw *s =
+				(struct crush_bucket_straw *)bucket;
+
+			frozen_rebase(s->item_weights, from, to);
+			frozen_rebase(s->straws, from, to);
+			break;
+		}
+		case CRUSH_BUCKET_STRAW2: {
+			struct crush_bucket_straw2 *s =
+				(struct crush_bucket_straw2 *)bucket;
+
+			frozen_rebase(s->item_weights, from, to);
+			frozen_rebase(s->item_reciprocals, from, to);
+			break;
+		}
+		case CRUSH_BUCKET_STRAW2_TREE: {
+			struct crush_bucket_straw2_tree *t =
+				(struct crush_bucket_straw2_tree *)bucket;
+
+			frozen_rebase(t->item_weights, from, to);
+			frozen_rebase(t->node_weights, from, to);
+			break;
+		}
+		default:
+			break;
+		}
+		frozen_rebase(buckets[b], from, to);
+	}
+	for (r = 0; r < frozen->max_rules; r++)
+		frozen_rebase(rules[r], from, to);
+	frozen_rebase(frozen->buckets, from, to);
+	frozen_rebase(frozen->rules, from, to);
+	frozen_rebase(frozen->rule_table, from, to);
+}
@@ -0,0 +1,103 @@
+#ifndef CEPH_CRUSH_FREEZE_H
+#define CEPH_CRUSH_FREEZE_H
+
+/*
+ * Pack a finalized crush_map into a single contiguous block.
+ *
+ * LGPL2
+ */
+
+#include <stdint.h>
+
+#include "crush.h"
+
+/*
+ * Alignment of every structure and array in the block, enough for
+ * the pointers and __u64 arrays it contains.
+ */
+#define CRUSH_FROZEN_ALIGN 8
+
+/** @ingroup API
+ *
+ * Return a copy of __map__ packed in a single __malloc(3)__ block of
+ * __frozen_size__ bytes, which crush_do_rule() and all other read
+ * only functions can use as any other map. The block contains, in
+ * this order:
+ *
+ * - the crush_map, the __buckets__ and __rules__ arrays, the rules and
+ *   the buckets: all the structures that contain pointers
+ * - the per bucket arrays (items, weights, etc.)
+ *
+ * The buckets and their arrays are both laid out in breadth first
+ * order from the roots of the hierarchy, so that the buckets visited
+ * by a descent and their siblings are close to each other. Buckets
+ * that cannot be reached from a root come last.
+ *
+ * The frozen map must not be modified: no item can be added, removed
+ * or reweighted and crush_finalize() must not be called on it. It is
+ * deallocated with crush_destroy() as any other map.
+ *
+ * The __map__ must have been finalized with crush_finalize(). It is
+ * not modified.
+ *
+ * @param map the crush_map to copy
+ *
+ * @returns a frozen copy of __map__ or NULL on error
+ */
+extern struct crush_map *crush_map_freeze(const struct crush_map *map);
+
+/** @ingroup API
+ *
+ * Rebase all the pointers of the __frozen__ map, assuming the block
+ * was at address __from__ when they were set, so that they are valid
+ * if the block is at address __to__. The block itself is not moved:
+ * the __frozen__ map must be at its start.
+ *
+ * To move a frozen map, copy its __frozen_size__ bytes and rebase the
+ * copy from the address of the original to the address of the copy.
+ * Rebasing to 0 turns all pointers into offsets from the start of the
+ * block, which is how they can be stored in a file.
+ *
+ * @param frozen a map returned by crush_map_freeze(), or a copy of it
+ * @param from the address of the block when the pointers were set
+ * @param to the address the pointers are rebased to
+ */
+extern void crush_map_frozen_rebase(struct crush_map *frozen,
+				    uintptr_t from, uintptr_t to);
+
+/** @ingroup API
+ *
+ * Check that the __frozen__ map, with its pointers rebased to 0, only
+ * points inside its __frozen_size__ bytes: each bucket and rule, and
+ * each of their arrays, must fit in the block with the extent given
+ * by its __size__, __num_nodes__ or __len__, and be aligned. The
+ * buckets must also have a known __alg__ and the id matching their
+ * position, the rule table must only refer to rules of the map, and
+ * the items of the buckets and of the TAKE steps must be devices or
+ * buckets of the map.
+ * No pointer is followed before it is checked, so that a map read
+ * from an untrusted file can be checked before
+ * crush_map_frozen_rebase().
+ *
+ * - return -EINVAL if a pointer or a size is not valid
+ *
+ * @param frozen a frozen map whose pointers are offsets
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_map_frozen_check(const struct crush_map *frozen);
+
+/** @ingroup API
+ *
+ * Return the size of the structures at the beginning of the
+ * __frozen__ map, up to its first bucket array: the bytes
+ * crush_map_frozen_rebase() modifies.
+ *
+ * @param frozen a frozen map whose pointers are offsets, checked
+ *        with crush_map_frozen_check() if it is not trusted
+ *
+ * @returns the size of the structures of __frozen__
+ */
+extern size_t crush_map_frozen_structs_size(const struct crush_map *frozen);
+
+#endif
@@ -1,39 +1,190 @@
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "builder.h"
 #include "helpers.h"
 
 int crush_find_roots(struct crush_map *map, int **buckets)
 {
-  int ref[map->max_buckets];
-  memset(ref, '\0', sizeof(ref));
-  int root_count = map->max_buckets;
-  for (int pos = 0; pos < map->max_buckets; pos++) {
-    struct crush_bucket *b = map->buckets[pos];
-    if (b == NULL) {
-      root_count--;
-      continue;
-    }
-    for (int i = 0; i < b->size; i++) {
-      if (b->items[i] >= 0)
-        continue;
-      int item = -1-b->items[i];
-      if (item >= map->max_buckets)
-        return -EINVAL;
-      if (ref[item] == 0)
-        root_count--;
-      ref[item]++;
-    }
-  }
-
-  int *roots = (int*)malloc(root_count * sizeof(int));
-  if (roots == NULL)
-    return -ENOMEM;
-  int roots_length = 0;
-  for (int pos = 0; pos < map->max_buckets; pos++) {
-    if (map->buckets[pos] != NULL && ref[pos] == 0)
-      roots[roots_length++] = -1-pos;
-  }
-  assert(roots_length == root_count);
-  *buckets = roots;
-  return root_count;
+	int *roots;
+	int count = 0, pos;
+	__u32 i;
+
+	/* the array returned marks the buckets that are items first, the
+	   roots are then stored in place, each before its mark */
+	roots = calloc(map->max_buckets ? map->max_buckets : 1, sizeof(*roots));
+	if (!roots)
+		return -ENOMEM;
+	for (pos = 0; pos < map->max_buckets; pos++) {
+		const struct crush_bucket *b = map->buckets[pos];
+
+		if (!b)
+			continue;
+		for (i = 0; i < b->size; i++) {
+			int item = -1-b->items[i];
+
+			if (b->items[i] >= 0)
+				continue;
+			if (item >= map->max_buckets) {
+				free(roots);
+				return -EINVAL;
+			}
+			roots[item] = 1;
+		}
+	}
+	for (pos = 0; pos < map->max_buckets; pos++)
+		if (map->buckets[pos] && !roots[pos])
+			roots[count++] = -1-pos;
+	*buckets = roots;
+	return count;
+}
+
+/** analysis **/
+
+static void *zalloc(size_t count, size_t size)
+{
+	return calloc(count ? count : 1, size);
+}
+
+static void link_parent(__s32 *link, int parent)
+{
+	*link = *link ? CRUSH_PARENT_MANY : parent;
+}
+
+/* the position of the bucket @item or -1 if it is not a bucket of @map */
+static int bucket_position(const struct crush_map *map, int item)
+{
+	int pos = -1-item;
+
+	if (item >= 0 || pos >= map->max_buckets || !map->buckets[pos])
+		return -1;
+	return pos;
+}
+
+int crush_analyze(const struct crush_map *map, struct crush_analysis *analysis)
+{
+	/* the number of items of a bucket not yet in order */
+	__s32 *pending;
+	int pos, head, child;
+	__u32 i;
+
+	memset(analysis, 0, sizeof(*analysis));
+	analysis->max_buckets = map->max_buckets;
+	for (pos = 0; pos < map->max_buckets; pos++) {
+		const struct crush_bucket *b = map->buckets[pos];
+
+		if (!b)
+			continue;
+		for (i = 0; i < b->size; i++)
+			if (b->items[i] >= analysis->max_devices)
+				analysis->max_devices = b->items[i] + 1;
+	}
+
+	pending = zalloc(map->max_buckets, sizeof(*pending));
+	analysis->order = zalloc(map->max_buckets, sizeof(*analysis->order));
+	analysis->bucket_parents = zalloc(map->max_buckets,
+					  sizeof(*analysis->bucket_parents));
+	analysis->device_parents = zalloc(analysis->max_devices,
+					  sizeof(*analysis->device_parents));
+	analysis->depth = zalloc(map->max_buckets, sizeof(*analysis->depth));
+	analysis->devices = zalloc(map->max_buckets,
+				   sizeof(*analysis->devices));
+	if (!pending || !analysis->order || !analysis->bucket_parents ||
+	    !analysis->device_parents || !analysis->depth ||
+	    !analysis->devices) {
+		free(pending);
+		crush_analysis_release(analysis);
+		return -ENOMEM;
+	}
+
+	/* the parents of the items and the number of parents of each
+	   bucket */
+	for (pos = 0; pos < map->max_buckets; pos++) {
+		const struct crush_bucket *b = map->buckets[pos];
+
+		analysis->depth[pos] = -1;
+		if (!b)
+			continue;
+		if (!b->size)
+			analysis->empty++;
+		for (i = 0; i < b->size; i++) {
+			const int item = b->items[i];
+
+			if (item >= 0) {
+				link_parent(&analysis->device_parents[item],
+					    b->id);
+				continue;
+			}
+			child = bucket_position(map, item);
+			if (child < 0) {
+				analysis->dangling++;
+				continue;
+			}
+			link_parent(&analysis->bucket_parents[child], b->id);
+			pending[child]++;
+		}
+	}
+
+	/* a bucket is in order once all its parents are: the buckets on
+	   a cycle and under it never are */
+	for (pos = 0; pos < map->max_buckets; pos++) {
+		if (map->buckets[pos] && !pending[pos]) {
+			analysis->order[analysis->order_count++] = -1-pos;
+			analysis->depth[pos] = 0;
+		}
+	}
+	analysis->roots_count = analysis->order_count;
+	for (head = 0; head < analysis->order_count; head++) {
+		const struct crush_bucket *b =
+			map->buckets[-1-analysis->order[head]];
+		const __s32 depth = analysis->depth[-1-b->id] + 1;
+
+		for (i = 0; i < b->size; i++) {
+			child = bucket_position(map, b->items[i]);
+			if (child < 0)
+				continue;
+			if (analysis->depth[child] < depth)
+				analysis->depth[child] = depth;
+			if (!--pending[child])
+				analysis->order[analysis->order_count++] =
+					-1-child;
+		}
+	}
+	for (pos = 0; pos < map->max_buckets; pos++) {
+		if (map->buckets[pos] && pending[pos]) {
+			analysis->depth[pos] = -1;
+			analysis->cyclic++;
+		}
+	}
+
+	/* the children of a bucket come after it in order */
+	for (head = analysis->order_count - 1; head >= 0; head--) {
+		const struct crush_bucket *b =
+			map->buckets[-1-analysis->order[head]];
+		__u64 devices = 0;
+
+		for (i = 0; i < b->size; i++) {
+			if (b->items[i] >= 0) {
+				devices++;
+				continue;
+			}
+			child = bucket_position(map, b->items[i]);
+			if (child >= 0)
+				devices += analysis->devices[child];
+		}
+		analysis->devices[-1-b->id] = devices;
+	}
+	free(pending);
+	return analysis->cyclic || analysis->dangling ? -EINVAL : 0;
+}
+
+void crush_analysis_release(struct crush_analysis *analysis)
+{
+	free(analysis->order);
+	free(analysis->bucket_parents);
+	free(analysis->device_parents);
+	free(analysis->depth);
+	free(analysis->devices);
+	memset(analysis, 0, sizeof(*analysis));
 }
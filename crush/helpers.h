@@ -24,4 +24,65 @@
  */
 extern int crush_find_roots(struct crush_map *map, int **buckets);
 
+/** @ingroup API
+ *
+ * The structure of the buckets of a map, see crush_analyze(). The
+ * arrays of buckets are indexed by -1-id, as crush_map.buckets.
+ */
+struct crush_analysis {
+	__s32 max_buckets;	/*!< the size of the arrays of buckets */
+	__s32 max_devices;	/*!< the highest device in a bucket + 1 */
+	/*! The buckets, each before its children: the __roots_count__
+	    roots, in increasing position, then the buckets under them.
+	    The buckets on or under a cycle are not in __order__. */
+	__s32 *order;
+	__s32 order_count;	/*!< the number of buckets in __order__ */
+	__s32 roots_count;	/*!< the number of buckets in no bucket */
+	/*! The bucket containing each bucket, 0 if none or
+	    ::CRUSH_PARENT_MANY if more than one, as crush_get_parent() */
+	__s32 *bucket_parents;
+	/*! The bucket containing each device, of size __max_devices__ */
+	__s32 *device_parents;
+	/*! The length of the longest path from a root to each bucket, 0
+	    for a root and -1 for a bucket not in __order__ */
+	__s32 *depth;
+	/*! The number of devices under each bucket, a device being counted
+	    once per path, 0 for a bucket not in __order__ */
+	__u64 *devices;
+	__s32 cyclic;		/*!< the number of buckets on or under a cycle */
+	__s32 dangling;		/*!< the number of items that are missing buckets */
+	__s32 empty;		/*!< the number of buckets with no item */
+};
+
+/** @ingroup API
+ *
+ * Analyze the buckets of __map__ in a single pass over their items:
+ * find the roots, the parents of each item, the depth of each bucket
+ * and the number of devices under it and count the buckets on a
+ * cycle, the items that are missing buckets and the empty buckets.
+ * The map does not need to be finalized and is not modified.
+ *
+ * The arrays of __analysis__ are allocated with __malloc(3)__ and
+ * must be released with crush_analysis_release().
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ * - return -EINVAL if the map has a cycle or an item that is missing
+ *   a bucket, __analysis__ being set and to be released nevertheless
+ *
+ * @param[in] map the crush_map
+ * @param[out] analysis the structure of __map__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_analyze(const struct crush_map *map,
+			 struct crush_analysis *analysis);
+
+/** @ingroup API
+ *
+ * Release the arrays set by crush_analyze().
+ *
+ * @param analysis the structure set by crush_analyze()
+ */
+extern void crush_analysis_release(struct crush_analysis *analysis);
+
 #endif
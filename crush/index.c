@@ -0,0 +1,458 @@
+/*
+ * Find the inputs mapped to a device or a bucket.
+ *
+ * The inputs of a device are stored as their offsets from the first
+ * input of the index, in increasing order, each encoded as the
+ * difference with the previous one in 7 bits per byte, the high bit
+ * of a byte being set if more follow.
+ *
+ * An update is logged as one operation per device that is added to
+ * or removed from a mapping. The log is sorted by device, offset and
+ * order of arrival before a lookup and each device list it touches is
+ * merged with its operations into a new list, the last operation on
+ * an offset deciding if it is kept.
+ *
+ * LGPL2
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crush_compat.h"
+#include "index.h"
+
+/* the maximum size of an encoded offset */
+#define CRUSH_INDEX_VARINT_MAX 5
+
+struct index_list {
+	unsigned char *data;
+	__u32 size;		/* the bytes used in data */
+	__u32 count;		/* the number of offsets */
+};
+
+struct index_op {
+	int device;
+	__u32 offset;
+	__u32 seq;		/* the order of arrival */
+	int add;		/* 1 to add offset, 0 to remove it */
+};
+
+struct crush_index {
+	__u32 x_begin;
+	__u32 x_count;
+	struct index_list *lists;
+	int lists_count;
+	struct index_op *ops;
+	__u32 ops_count;
+	__u32 ops_allocated;
+};
+
+/************************************************/
+
+static int varint_size(__u32 value)
+{
+	int size = 1;
+
+	while (value >= 0x80) {
+		value >>= 7;
+		size++;
+	}
+	return size;
+}
+
+static unsigned char *varint_put(unsigned char *p, __u32 value)
+{
+	while (value >= 0x80) {
+		*p++ = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	*p++ = value;
+	return p;
+}
+
+static const unsigned char *varint_get(const unsigned char *p, __u32 *value)
+{
+	__u32 v = 0;
+	int shift = 0;
+
+	while (*p & 0x80) {
+		v |= (__u32)(*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+	*value = v | (__u32)*p++ << shift;
+	return p;
+}
+
+struct crush_index *crush_index_create(int max_devices,
+				       __u32 x_begin, __u32 x_count,
+				       const int *result, int result_max,
+				       int result_stride,
+				       const int *result_len)
+{
+	struct crush_index *index;
+	__u32 *last = NULL;
+	__u32 i;
+	int d, j;
+
+	if (max_devices < 0 || result_max < 0 || result_stride < result_max)
+		return NULL;
+	index = calloc(1, sizeof(*index));
+	if (!index)
+		return NULL;
+	index->x_begin = x_begin;
+	index->x_count = x_count;
+	index->lists_count = max_devices;
+	if (max_devices) {
+		index->lists = calloc(max_devices, sizeof(*index->lists));
+		last = malloc(max_devices * sizeof(*last));
+		if (!index->lists || !last)
+			goto fail;
+	}
+
+	/* the size of each list, an item repeated in a row counting once */
+	for (i = 0; i < x_count; i++) {
+		const int *row = result + (size_t)i * result_stride;
+		int len = result_len ? result_len[i] : result_max;
+
+		for (j = 0; j < len; j++) {
+			struct index_list *list;
+
+			d = row[j];
+			if (d < 0 || d >= max_devices)
+				continue;
+			list = &index->lists[d];
+			if (list->count && last[d] == i)
+				continue;
+			list->size += varint_size(list->count ? i - last[d] : i);
+			list->count++;
+			last[d] = i;
+		}
+	}
+	for (d = 0; d < max_devices; d++) {
+		struct index_list *list = &index->lists[d];
+
+		if (!list->count)
+			continue;
+		list->data = malloc(list->size);
+		if (!list->data)
+			goto fail;
+		list->size = 0;
+		list->count = 0;
+	}
+
+	for (i = 0; i < x_count; i++) {
+		const int *row = result + (size_t)i * result_stride;
+		int len = result_len ? result_len[i] : result_max;
+
+		for (j = 0; j < len; j++) {
+			struct index_list *list;
+			unsigned char *end;
+
+			d = row[j];
+			if (d < 0 || d >= max_devices)
+				continue;
+			list = &index->lists[d];
+			if (list->count && last[d] == i)
+				continue;
+			end = varint_put(list->data + list->size,
+					 list->count ? i - last[d] : i);
+			list->size = end - list->data;
+			list->count++;
+			last[d] = i;
+		}
+	}
+	free(last);
+	return index;
+
+fail:
+	free(last);
+	crush_index_destroy(index);
+	return NULL;
+}
+
+void crush_index_destroy(struct crush_index *index)
+{
+	int d;
+
+	if (!index)
+		return;
+	for (d = 0; d < index->lists_count; d++)
+		free(index->lists[d].data);
+	free(index->lists);
+	free(index->ops);
+	free(index);
+}
+
+/************************************************/
+
+static void log_op(struct crush_index *index, int device, __u32 offset,
+		   int add)
+{
+	struct index_op *op = &index->ops[index->ops_count];
+
+	op->device = device;
+	op->offset = offset;
+	op->seq = index->ops_count++;
+	op->add = add;
+}
+
+int crush_index_update(struct crush_index *index,
+		       const struct crush_diff_change *change)
+{
+	__u32 offset = change->x - index->x_begin;
+	__u32 needed;
+	int i, d;
+
+	if (offset >= index->x_count)
+		return -EINVAL;
+	needed = index->ops_count + change->old_len + change->new_len;
+	if (needed > index->ops_allocated) {
+		__u32 allocated = index->ops_allocated ?
+			index->ops_allocated : 64;
+		struct index_op *ops;
+
+		while (allocated < needed)
+			allocated *= 2;
+		ops = realloc(index->ops, allocated * sizeof(*ops));
+		if (!ops)
+			return -ENOMEM;
+		index->ops = ops;
+		index->ops_allocated = allocated;
+	}
+
+	for (i = 0; i < change->old_len; i++) {
+		d = change->old_result[i];
+		if (d >= 0 && d != CRUSH_ITEM_NONE &&
+		    !crush_result_contains(change->new_result,
+					   change->new_len, d))
+			log_op(index, d, offset, 0);
+	}
+	for (i = 0; i < change->new_len; i++) {
+		d = change->new_result[i];
+		if (d >= 0 && d != CRUSH_ITEM_NONE &&
+		    !crush_result_contains(change->old_result,
+					   change->old_len, d))
+			log_op(index, d, offset, 1);
+	}
+	return 0;
+}
+
+static int op_cmp(const void *a, const void *b)
+{
+	const struct index_op *x = a, *y = b;
+
+	if (x->device != y->device)
+		return x->device < y->device ? -1 : 1;
+	if (x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
+	if (x->seq != y->seq)
+		return x->seq < y->seq ? -1 : 1;
+	return 0;
+}
+
+/* decode the offset after *offset in [*p, end), return 0 at the end */
+static int list_next(const unsigned char **p, const unsigned char *end,
+		     __u32 *offset)
+{
+	__u32 delta;
+
+	if (*p >= end)
+		return 0;
+	*p = varint_get(*p, &delta);
+	*offset += delta;
+	return 1;
+}
+
+/* merge the sorted operations ops[0..n) on the device of ops[0] */
+static int merge_ops(struct index_list *list, const struct index_op *ops,
+		     __u32 n)
+{
+	const unsigned char *p = list->data, *end = list->data + list->size;
+	unsigned char *data, *q;
+	__u32 offset = 0, previous = 0, count = 0, i = 0;
+	int has_offset;
+
+	data = malloc(list->size + n * CRUSH_INDEX_VARINT_MAX);
+	if (!data)
+		return -ENOMEM;
+	q = data;
+	has_offset = list_next(&p, end, &offset);
+	while (has_offset || i < n) {
+		__u32 next;
+		int keep;
+
+		if (i < n && (!has_offset || ops[i].offset <= offset)) {
+			next = ops[i].offset;
+			/* the last operation on next decides */
+			while (i + 1 < n && ops[i + 1].offset == next)
+				i++;
+			keep = ops[i++].add;
+			if (has_offset && offset == next)
+				has_offset = list_next(&p, end, &offset);
+		} else {
+			next = offset;
+			keep = 1;
+			has_offset = list_next(&p, end, &offset);
+		}
+		if (!keep)
+			continue;
+		q = varint_put(q, count ? next - previous : next);
+		previous = next;
+		count++;
+	}
+	free(list->data);
+	list->data = count ? data : NULL;
+	list->size = q - data;
+	list->count = count;
+	if (!count)
+		free(data);
+	return 0;
+}
+
+/* apply the logged operations to the lists */
+static int flush_ops(struct crush_index *index)
+{
+	__u32 i, j;
+	int max_device;
+
+	if (!index->ops_count)
+		return 0;
+	qsort(index->ops, index->ops_count, sizeof(*index->ops), op_cmp);
+	max_device = index->ops[index->ops_count - 1].device;
+	if (max_device >= index->lists_count) {
+		struct index_list *lists;
+
+		lists = realloc(index->lists,
+				(size_t)(max_device + 1) * sizeof(*lists));
+		if (!lists)
+			return -ENOMEM;
+		memset(lists + index->lists_count, 0,
+		       (max_device + 1 - index->lists_count) * sizeof(*lists));
+		index->lists = lists;
+		index->lists_count = max_device + 1;
+	}
+	for (i = 0; i < index->ops_count; i = j) {
+		for (j = i + 1; j < index->ops_count; j++)
+			if (index->ops[j].device != index->ops[i].device)
+				break;
+		if (merge_ops(&index->lists[index->ops[i].device],
+			      index->ops + i, j - i) < 0) {
+			/* keep the operations not applied, still sorted */
+			memmove(index->ops, index->ops + i,
+				(index->ops_count - i) * sizeof(*index->ops));
+			index->ops_count -= i;
+			return -ENOMEM;
+		}
+	}
+	index->ops_count = 0;
+	return 0;
+}
+
+/************************************************/
+
+int crush_index_device(struct crush_index *index, int device,
+		       __u32 *xs, int xs_max)
+{
+	const struct index_list *list;
+	const unsigned char *p;
+	__u32 offset = 0, delta, i;
+	int r;
+
+	r = flush_ops(index);
+	if (r < 0)
+		return r;
+	if (device < 0 || device >= index->lists_count)
+		return 0;
+	list = &index->lists[device];
+	p = list->data;
+	for (i = 0; i < list->count && (int)i < xs_max; i++) {
+		p = varint_get(p, &delta);
+		offset += delta;
+		xs[i] = index->x_begin + offset;
+	}
+	return list->count;
+}
+
+/* mark in bits the inputs of the devices under bucketno */
+static void mark_bucket(const struct crush_index *index,
+			const struct crush_map *map, int bucketno,
+			__u64 *bits, unsigned char *visited)
+{
+	const struct crush_bucket *b = map->buckets[-1-bucketno];
+	__u32 i;
+
+	visited[-1-bucketno] = 1;
+	for (i = 0; i < b->size; i++) {
+		const int item = b->items[i];
+
+		if (item < 0) {
+			if (-1-item < map->max_buckets &&
+			    map->buckets[-1-item] && !visited[-1-item])
+				mark_bucket(index, map, item, bits, visited);
+		} else if (item < index->lists_count) {
+			const struct index_list *list = &index->lists[item];
+			const unsigned char *p = list->data;
+			__u32 offset = 0, delta, k;
+
+			for (k = 0; k < list->count; k++) {
+				p = varint_get(p, &delta);
+				offset += delta;
+				bits[offset / 64] |= 1ULL << (offset % 64);
+			}
+		}
+	}
+}
+
+int crush_index_bucket(struct crush_index *index,
+		       const struct crush_map *map, int bucketno,
+		       __u32 *xs, int xs_max)
+{
+	__u64 *bits;
+	unsigned char *visited;
+	__u32 words, w;
+	int r, count = 0;
+
+	if (bucketno >= 0 || -1-bucketno >= map->max_buckets ||
+	    !map->buckets[-1-bucketno])
+		return -ENOENT;
+	r = flush_ops(index);
+	if (r < 0)
+		return r;
+	words = index->x_count / 64 + 1;
+	bits = calloc(words, sizeof(*bits));
+	visited = calloc(map->max_buckets, 1);
+	if (!bits || !visited) {
+		free(bits);
+		free(visited);
+		return -ENOMEM;
+	}
+	mark_bucket(index, map, bucketno, bits, visited);
+	for (w = 0; w < words; w++) {
+		__u64 word = bits[w];
+
+		while (word) {
+			if (count < xs_max)
+				xs[count] = index->x_begin + w * 64 +
+					__builtin_ctzll(word);
+			count++;
+			word &= word - 1;
+		}
+	}
+	free(bits);
+	free(visited);
+	return count;
+}
+
+long crush_index_size(struct crush_index *index)
+{
+	long size = 0;
+	int d, r;
+
+	r = flush_ops(index);
+	if (r < 0)
+		return r;
+	for (d = 0; d < index->lists_count; d++)
+		size += index->lists[d].size;
+	return size;
+}
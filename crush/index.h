@@ -0,0 +1,127 @@
+#ifndef CEPH_CRUSH_INDEX_H
+#define CEPH_CRUSH_INDEX_H
+
+/*
+ * Find the inputs mapped to a device or a bucket.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+#include "diff.h"
+
+struct crush_index;
+
+/** @ingroup API
+ *
+ * Index the mappings of the __x_count__ consecutive inputs starting at
+ * __x_begin__ by device, for instance the result of
+ * crush_do_rule_parallel(): row i of the __result__ matrix holds the
+ * mapping of __x_begin__ + i and, if __result_len__ is not NULL,
+ * __result_len[i]__ its size. The items that are not devices in
+ * [0, __max_devices__), e.g. ::CRUSH_ITEM_NONE, are ignored.
+ *
+ * The inputs of each device are stored in increasing order, each as
+ * the difference with the previous one in as few bytes as it needs:
+ * about one byte per replica when the devices have more than a
+ * hundredth of the inputs.
+ *
+ * An index is not safe to use by many threads at the same time since
+ * the lookups apply the updates first.
+ *
+ * - return NULL if __max_devices__ < 0, if __result_max__ < 0, if
+ *   __result_stride__ < __result_max__ or if __malloc(3)__ fails
+ *
+ * @param max_devices the number of devices, e.g. __map->max_devices__
+ * @param x_begin the first input
+ * @param x_count the number of inputs
+ * @param result a matrix of __x_count__ rows of __result_stride__ items
+ * @param result_max the maximum number of items in a row
+ * @param result_stride the number of items between two rows
+ * @param result_len an array of __x_count__ row sizes or NULL
+ *
+ * @returns an index to be released with crush_index_destroy() or NULL
+ */
+extern struct crush_index *crush_index_create(int max_devices,
+					      __u32 x_begin, __u32 x_count,
+					      const int *result, int result_max,
+					      int result_stride,
+					      const int *result_len);
+
+/** @ingroup API
+ *
+ * Release an index returned by crush_index_create().
+ *
+ * @param index the index or NULL
+ */
+extern void crush_index_destroy(struct crush_index *index);
+
+/** @ingroup API
+ *
+ * Record that the mapping of __change->x__ went from
+ * __change->old_result__ to __change->new_result__, as returned by
+ * crush_diff_next(). __change__ is copied and can be modified after
+ * the call. The changes are applied all at once by the next lookup,
+ * each device list being rewritten once.
+ *
+ * - return -EINVAL if __change->x__ is not an input of __index__
+ * - return -ENOMEM if __malloc(3)__ fails, __index__ is then unchanged
+ *
+ * @param index the index
+ * @param change the mapping change of an input
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_index_update(struct crush_index *index,
+			      const struct crush_diff_change *change);
+
+/** @ingroup API
+ *
+ * Store in __xs__, in increasing order, at most __xs_max__ of the
+ * inputs mapped to __device__.
+ *
+ * - return -ENOMEM if applying the updates fails with __malloc(3)__
+ *
+ * @param index the index
+ * @param device the device
+ * @param[out] xs the inputs
+ * @param xs_max the size of __xs__
+ *
+ * @returns the number of inputs, which may be more than __xs_max__, or < 0 on error
+ */
+extern int crush_index_device(struct crush_index *index, int device,
+			      __u32 *xs, int xs_max);
+
+/** @ingroup API
+ *
+ * Store in __xs__, in increasing order and once each, at most
+ * __xs_max__ of the inputs mapped to a device under the bucket
+ * __bucketno__ of __map__, for instance a failed host.
+ *
+ * - return -ENOENT if __bucketno__ is not a bucket of __map__
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param index the index
+ * @param map the crush_map of the mappings
+ * @param bucketno the bucket id
+ * @param[out] xs the inputs
+ * @param xs_max the size of __xs__
+ *
+ * @returns the number of inputs, which may be more than __xs_max__, or < 0 on error
+ */
+extern int crush_index_bucket(struct crush_index *index,
+			      const struct crush_map *map, int bucketno,
+			      __u32 *xs, int xs_max);
+
+/** @ingroup API
+ *
+ * Return the bytes used by the lists of __index__, once its updates
+ * are applied.
+ *
+ * @param index the index
+ *
+ * @returns the size of the lists in bytes or < 0 on error
+ */
+extern long crush_index_size(struct crush_index *index);
+
+#endif
@@ -0,0 +1,690 @@
+/*
+ * Map several inputs with a plan at a time, interleaved.
+ *
+ * crush_do_plan_interleaved() maps CRUSH_INTERLEAVE_LANES inputs at a
+ * time, one per lane. Each lane runs crush_choose_firstn() or
+ * crush_choose_indep() as a state machine in a frame, and the
+ * recursion to the leaves in a second frame. Before reading a bucket
+ * or a weight that may not be in the cache, the machine prefetches it
+ * and returns so that the other lanes run while it is loaded.
+ *
+ * The draws, the retry decisions and the plan steps are those of
+ * mapper.c, see choose.h: only the order in which the states run is
+ * specific to the lanes, and it must be kept in sync with the loops
+ * of crush_choose_firstn() and crush_choose_indep().
+ *
+ * It is not part of the kernel sources.
+ *
+ * LGPL2
+ */
+
+#include "crush_compat.h"
+#include "crush.h"
+#include "mapper.h"
+#include "choose.h"
+
+#define dprintk(args...) /* printf(args) */
+
+#define CRUSH_INTERLEAVE_LANES 8
+/* the largest part of an array of a bucket that is prefetched */
+#define CRUSH_PREFETCH_MAX 256
+
+enum crush_lane_state {
+	LANE_START,
+	LANE_REP,		/* choose the replica rep */
+	LANE_ROUND,		/* indep: start the round ftotal */
+	LANE_DESCENT,		/* firstn: descend from the first bucket */
+	LANE_CHOOSE,		/* choose an item from in */
+	LANE_ITEM,		/* check the item, once prefetched */
+	LANE_LEAF,		/* the chooseleaf frame returned */
+	LANE_OUT,		/* check that the item is not out */
+	LANE_REJECT,		/* firstn: keep the item or retry */
+	LANE_SKIP,		/* firstn: give up the replica rep */
+};
+
+enum {
+	LANE_YIELD,		/* a prefetch is pending */
+	LANE_CALL,		/* frame + 1 is the chooseleaf frame */
+	LANE_RETURN,		/* the frame is done */
+};
+
+/* the arguments and the locals of crush_choose_firstn/indep */
+struct crush_lane_frame {
+	int firstn;
+	int state;
+	int fetch;		/* prefetches done for item */
+	const struct crush_bucket *bucket;
+	const struct crush_bucket *in;
+	int numrep;
+	int type;
+	int *out;
+	int outpos;
+	int count;		/* firstn: out_size */
+	int left;		/* indep */
+	int endpos;		/* indep */
+	int out_size;		/* indep: left when called */
+	unsigned int tries;
+	unsigned int recurse_tries;
+	unsigned int local_retries;
+	unsigned int local_fallback_retries;
+	int recurse_to_leaf;
+	unsigned int vary_r;
+	unsigned int stable;
+	int *out2;
+	int parent_r;
+	int rep;
+	unsigned int ftotal;
+	unsigned int flocal;
+	int r;
+	int item;
+	int itemtype;
+	int collide;
+	int reject;
+	int leaf;		/* firstn: returned by the chooseleaf frame */
+	__u64 chosen;		/* firstn: see crush_item_bit() */
+};
+
+/* the locals of crush_do_plan() for one input */
+struct crush_lane {
+	int index;		/* of the input in x or -1 if idle */
+	int x;
+	int *result;
+	int result_len;
+	int step;
+	int i;			/* in w or -1 before a choose step */
+	int *w;
+	int *o;
+	int *c;
+	int *scratch;		/* 3 * result_max items */
+	int wsize;
+	int osize;
+	int depth;		/* of the running frame or -1 */
+	struct crush_lane_frame frames[2];
+};
+
+struct crush_interleave {
+	const struct crush_plan *plan;
+	/*
+	 * shared by the lanes, including the permutation of each bucket:
+	 * a lane drawing from a bucket with another x than the last one
+	 * restarts its permutation, see bucket_perm_choose(). The draws
+	 * are the same, only the permutation is computed again.
+	 */
+	struct crush_work *work;
+	const __u32 *weight;
+	int weight_max;
+	const struct crush_choose_arg *choose_args;
+};
+
+size_t crush_interleave_work_size(const struct crush_plan *plan)
+{
+	return plan->map->working_size + CRUSH_INTERLEAVE_LANES *
+		(sizeof(struct crush_lane) +
+		 plan->result_max * 3 * sizeof(int));
+}
+
+static void crush_prefetch_array(const void *p, size_t size)
+{
+	size_t offset;
+
+	if (!p)
+		return;
+	if (size > CRUSH_PREFETCH_MAX)
+		size = CRUSH_PREFETCH_MAX;
+	for (offset = 0; offset < size; offset += 64)
+		__builtin_prefetch((const char *)p + offset);
+}
+
+/* the arrays crush_bucket_choose() reads first */
+static void crush_prefetch_bucket(const struct crush_bucket *b,
+				  const struct crush_work_bucket *w)
+{
+	crush_prefetch_array(b->items, b->size * sizeof(__s32));
+	switch (b->alg) {
+	case CRUSH_BUCKET_UNIFORM:
+		__builtin_prefetch(w->perm, 1);
+		break;
+	case CRUSH_BUCKET_LIST: {
+		const struct crush_bucket_list *l =
+			(const struct crush_bucket_list *)b;
+
+		crush_prefetch_array(l->item_weights, b->size * sizeof(__u32));
+		crush_prefetch_array(l->sum_weights, b->size * sizeof(__u32));
+		break;
+	}
+	case CRUSH_BUCKET_TREE: {
+		const struct crush_bucket_tree *t =
+			(const struct crush_bucket_tree *)b;
+
+		if (t->descent_weights)
+			crush_prefetch_array(t->descent_weights,
+					     2 * t->num_nodes * sizeof(__u32));
+		break;
+	}
+	case CRUSH_BUCKET_STRAW: {
+		const struct crush_bucket_straw *s =
+			(const struct crush_bucket_straw *)b;
+
+		crush_prefetch_array(s->straws, b->size * sizeof(__u32));
+		break;
+	}
+	case CRUSH_BUCKET_STRAW2: {
+		const struct crush_bucket_straw2 *s =
+			(const struct crush_bucket_straw2 *)b;
+
+		crush_prefetch_array(s->item_weights, b->size * sizeof(__u32));
+		crush_prefetch_array(s->item_reciprocals,
+				     b->size * sizeof(__u64));
+		break;
+	}
+	}
+}
+
+/*
+ * Prefetch what checking f->item reads, one dependent load at a time:
+ * return 1 after each prefetch and 0 once there is nothing left to
+ * prefetch.
+ */
+static int lane_prefetch(const struct crush_interleave *ctx,
+			 struct crush_lane_frame *f)
+{
+	const struct crush_map *map = ctx->plan->map;
+	const struct crush_bucket *b;
+	int id = -1 - f->item;
+
+	if (f->item >= 0) {
+		if (f->fetch++ == 0 && f->item < ctx->weight_max) {
+			__builtin_prefetch(&ctx->weight[f->item]);
+			return 1;
+		}
+	} else if (id < map->max_buckets) {
+		switch (f->fetch++) {
+		case 0:
+			__builtin_prefetch(&map->buckets[id]);
+			__builtin_prefetch(&ctx->work->work[id]);
+			return 1;
+		case 1:
+			b = map->buckets[id];
+			if (!b)
+				break;
+			__builtin_prefetch(b);
+			__builtin_prefetch(ctx->work->work[id], 1);
+			return 1;
+		case 2:
+			b = map->buckets[id];
+			if (!b)
+				break;
+			crush_prefetch_bucket(b, ctx->work->work[id]);
+			return 1;
+		}
+	}
+	f->fetch = 0;
+	return 0;
+}
+
+/* see crush_choose_firstn() */
+static int lane_choose_firstn(const struct crush_interleave *ctx,
+			      struct crush_lane *lane,
+			      struct crush_lane_frame *f)
+{
+	const struct crush_map *map = ctx->plan->map;
+	struct crush_work *work = ctx->work;
+	struct crush_lane_frame *leaf;
+	int i;
+
+	for (;;) {
+		switch (f->state) {
+		case LANE_START:
+			for (i = 0; i < f->outpos; i++)
+				f->chosen |= crush_item_bit(f->out[i]);
+			f->rep = f->stable ? 0 : f->outpos;
+			/* fall through */
+		case LANE_REP:
+			if (f->rep >= f->numrep || f->count <= 0)
+				return LANE_RETURN;
+			f->ftotal = 0;
+			/* fall through */
+		case LANE_DESCENT:
+			f->in = f->bucket;
+			crush_stat(work, descents);
+			f->flocal = 0;
+			/* fall through */
+		case LANE_CHOOSE:
+			f->collide = 0;
+			f->r = f->rep + f->parent_r + f->ftotal;
+			crush_visit(work, f->in);
+			if (f->in->size == 0) {
+				f->reject = 1;
+				f->state = LANE_REJECT;
+				break;
+			}
+			f->item = crush_lane_choose_item(
+				work, f->in, lane->x, f->r, f->flocal,
+				f->local_fallback_retries, ctx->choose_args,
+				f->outpos);
+			if (f->item >= map->max_devices) {
+				f->state = LANE_SKIP;
+				break;
+			}
+			f->state = LANE_ITEM;
+			/* fall through */
+		case LANE_ITEM:
+			if (lane_prefetch(ctx, f))
+				return LANE_YIELD;
+			f->itemtype = crush_item_type(map, f->item);
+			if (f->itemtype != f->type) {
+				if (f->item >= 0 ||
+				    (-1-f->item) >= map->max_buckets) {
+					f->state = LANE_SKIP;
+					break;
+				}
+				f->in = map->buckets[-1-f->item];
+				f->state = LANE_CHOOSE;
+				break;
+			}
+			if (crush_collides(f->out, f->outpos, f->chosen,
+					   f->item)) {
+				f->collide = 1;
+				crush_stat(work, collisions);
+			}
+			f->reject = 0;
+			f->state = LANE_OUT;
+			if (!f->collide && f->recurse_to_leaf) {
+				if (f->item < 0) {
+					leaf = f + 1;
+					memset(leaf, 0, sizeof(*leaf));
+					leaf->firstn = 1;
+					leaf->bucket = map->buckets[-1-f->item];
+					leaf->numrep = f->stable ? 1 : f->outpos+1;
+					leaf->out = f->out2;
+					leaf->outpos = f->outpos;
+					leaf->count = f->count;
+					leaf->tries = f->recurse_tries;
+					leaf->local_retries = f->local_retries;
+					leaf->local_fallback_retries =
+						f->local_fallback_retries;
+					leaf->vary_r = f->vary_r;
+					leaf->stable = f->stable;
+					leaf->parent_r = f->vary_r ?
+						f->r >> (f->vary_r-1) : 0;
+					f->state = LANE_LEAF;
+					return LANE_CALL;
+				}
+				f->out2[f->outpos] = f->item;
+			}
+			break;
+		case LANE_LEAF:
+			if (f->leaf <= f->outpos)
+				/* didn't get leaf */
+				f->reject = 1;
+			/* fall through */
+		case LANE_OUT:
+			if (!f->reject && !f->collide && f->itemtype == 0 &&
+			    crush_lane_is_out(map, work, ctx->weight,
+					      ctx->weight_max, f->item,
+					      lane->x)) {
+				f->reject = 1;
+				crush_stat(work, rejects);
+			}
+			/* fall through */
+		case LANE_REJECT:
+			if (f->reject || f->collide) {
+				switch (crush_firstn_retry(
+						work, f->in, f->collide,
+						&f->ftotal, &f->flocal,
+						f->tries, f->local_retries,
+						f->local_fallback_retries)) {
+				case CRUSH_RETRY_BUCKET:
+					f->state = LANE_CHOOSE;
+					break;
+				case CRUSH_RETRY_DESCENT:
+					f->state = LANE_DESCENT;
+					break;
+				default:
+					f->state = LANE_SKIP;
+					break;
+				}
+				break;
+			}
+			f->out[f->outpos] = f->item;
+			f->chosen |= crush_item_bit(f->item);
+			f->outpos++;
+			f->count--;
+			crush_count_tries(work, f->ftotal);
+			f->rep++;
+			f->state = LANE_REP;
+			break;
+		case LANE_SKIP:
+			crush_stat(work, skip_reps);
+			f->rep++;
+			f->state = LANE_REP;
+			break;
+		}
+	}
+}
+
+/* see crush_choose_indep() */
+static int lane_choose_indep(const struct crush_interleave *ctx,
+			     struct crush_lane *lane,
+			     struct crush_lane_frame *f)
+{
+	const struct crush_map *map = ctx->plan->map;
+	struct crush_work *work = ctx->work;
+	struct crush_lane_frame *leaf;
+	int rep, i;
+
+	for (;;) {
+		switch (f->state) {
+		case LANE_START:
+			f->endpos = f->outpos + f->left;
+			for (rep = f->outpos; rep < f->endpos; rep++) {
+				f->out[rep] = CRUSH_ITEM_UNDEF;
+				if (f->out2)
+					f->out2[rep] = CRUSH_ITEM_UNDEF;
+			}
+			f->ftotal = 0;
+			/* fall through */
+		case LANE_ROUND:
+			if (f->left <= 0 || f->ftotal >= f->tries) {
+				crush_indep_finish(work, f->out, f->out2,
+						   f->outpos, f->endpos,
+						   f->ftotal);
+				return LANE_RETURN;
+			}
+			f->rep = f->outpos;
+			/* fall through */
+		case LANE_REP:
+			f->state = LANE_REP;
+			if (f->rep >= f->endpos) {
+				f->ftotal++;
+				f->state = LANE_ROUND;
+				break;
+			}
+			if (f->out[f->rep] != CRUSH_ITEM_UNDEF) {
+				f->rep++;
+				break;
+			}
+			f->in = f->bucket;
+			crush_stat(work, descents);
+			if (f->ftotal)
+				crush_stat(work, descent_retries);
+			/* fall through */
+		case LANE_CHOOSE:
+			f->r = crush_indep_r(f->in, f->rep, f->parent_r,
+					     f->numrep, f->ftotal);
+			crush_visit(work, f->in);
+			if (f->in->size == 0) {
+				crush_bucket_stat(work, f->in, retries);
+				goto next_rep;
+			}
+			f->item = crush_lane_choose_item(
+				work, f->in, lane->x, f->r, 0, 0,
+				ctx->choose_args, f->outpos);
+			if (f->item >= map->max_devices)
+				goto none;
+			f->state = LANE_ITEM;
+			/* fall through */
+		case LANE_ITEM:
+			if (lane_prefetch(ctx, f))
+				return LANE_YIELD;
+			f->itemtype = crush_item_type(map, f->item);
+			if (f->itemtype != f->type) {
+				if (f->item >= 0 ||
+				    (-1-f->item) >= map->max_buckets)
+					goto none;
+				f->in = map->buckets[-1-f->item];
+				f->state = LANE_CHOOSE;
+				break;
+			}
+			for (i = f->outpos; i < f->endpos; i++) {
+				if (f->out[i] == f->item) {
+					crush_stat(work, collisions);
+					crush_bucket_stat(work, f->in, retries);
+					goto next_rep;
+				}
+			}
+			f->state = LANE_OUT;
+			if (f->recurse_to_leaf) {
+				if (f->item < 0) {
+					leaf = f + 1;
+					memset(leaf, 0, sizeof(*leaf));
+					leaf->bucket = map->buckets[-1-f->item];
+					leaf->left = 1;
+					leaf->numrep = f->numrep;
+					leaf->out = f->out2;
+					leaf->outpos = f->rep;
+					leaf->tries = f->recurse_tries;
+					leaf->parent_r = f->r;
+					f->state = LANE_LEAF;
+					return LANE_CALL;
+				}
+				f->out2[f->rep] = f->item;
+			}
+			break;
+		case LANE_LEAF:
+			if (f->out2[f->rep] == CRUSH_ITEM_NONE) {
+				/* placed nothing; no leaf */
+				crush_bucket_stat(work, f->in, retries);
+				goto next_rep;
+			}
+			/* fall through */
+		case LANE_OUT:
+			if (f->itemtype == 0 &&
+			    crush_lane_is_out(map, work, ctx->weight,
+					      ctx->weight_max, f->item,
+					      lane->x)) {
+				crush_stat(work, rejects);
+				crush_bucket_stat(work, f->in, retries);
+				goto next_rep;
+			}
+			f->out[f->rep] = f->item;
+			f->left--;
+			goto next_rep;
+		none:
+			f->out[f->rep] = CRUSH_ITEM_NONE;
+			if (f->out2)
+				f->out2[f->rep] = CRUSH_ITEM_NONE;
+			f->left--;
+		next_rep:
+			f->rep++;
+			f->state = LANE_REP;
+			break;
+		}
+	}
+}
+
+/* start the choose @s of @lane from @bucket, see crush_do_plan() */
+static void lane_call(const struct crush_interleave *ctx,
+		      struct crush_lane *lane,
+		      const struct crush_plan_step *s,
+		      const struct crush_bucket *bucket)
+{
+	const int result_max = ctx->plan->result_max;
+	struct crush_lane_frame *f = &lane->frames[0];
+
+	memset(f, 0, sizeof(*f));
+	f->bucket = bucket;
+	f->numrep = s->numrep;
+	f->type = s->arg;
+	f->out = lane->o + lane->osize;
+	f->tries = s->tries;
+	f->recurse_tries = s->recurse_tries;
+	f->recurse_to_leaf = s->recurse_to_leaf;
+	f->out2 = lane->c + lane->osize;
+	if (s->op == CRUSH_PLAN_CHOOSE_FIRSTN) {
+		f->firstn = 1;
+		f->count = result_max - lane->osize;
+		f->local_retries = s->local_retries;
+		f->local_fallback_retries = s->local_fallback_retries;
+		f->vary_r = s->vary_r;
+		f->stable = s->stable;
+	} else {
+		f->left = crush_plan_indep_size(s, result_max, lane->osize);
+		f->out_size = f->left;
+	}
+	lane->depth = 0;
+}
+
+/*
+ * Run the steps of the plan for @lane until a frame is called or the
+ * mapping is done, see crush_do_plan(). Return 1 when it is done.
+ */
+static int lane_plan(const struct crush_interleave *ctx,
+		     struct crush_lane *lane)
+{
+	const struct crush_plan *plan = ctx->plan;
+	const struct crush_map *map = plan->map;
+	const struct crush_plan_step *s;
+	int bno;
+
+	for (; lane->step < plan->len; lane->step++) {
+		s = &plan->steps[lane->step];
+		switch (s->op) {
+		case CRUSH_PLAN_TAKE:
+			lane->w[0] = s->arg;
+			lane->wsize = 1;
+			break;
+
+		case CRUSH_PLAN_CHOOSE_FIRSTN:
+		case CRUSH_PLAN_CHOOSE_INDEP:
+			if (lane->wsize == 0)
+				break;
+			if (lane->i < 0) {
+				lane->i = 0;
+				lane->osize = 0;
+			}
+			for (; s->numrep > 0 && lane->i < lane->wsize;
+			     lane->i++) {
+				bno = -1 - lane->w[lane->i];
+				if (bno < 0 || bno >= map->max_buckets) {
+					dprintk("  bad w[i] %d\n", lane->w[lane->i]);
+					continue;
+				}
+				lane_call(ctx, lane, s, map->buckets[bno]);
+				return 0;
+			}
+			lane->i = -1;
+			crush_plan_chosen(s, &lane->w, &lane->wsize, &lane->o,
+					  lane->c, lane->osize);
+			break;
+
+		case CRUSH_PLAN_EMIT:
+			lane->result_len = crush_plan_emit(
+				lane->result, lane->result_len,
+				plan->result_max, lane->w, lane->wsize);
+			lane->wsize = 0;
+			break;
+		}
+	}
+	return 1;
+}
+
+/* run @lane until it waits for a prefetch, return 1 once it is mapped */
+static int lane_run(const struct crush_interleave *ctx,
+		    struct crush_lane *lane)
+{
+	struct crush_lane_frame *f;
+	int ret;
+
+	for (;;) {
+		if (lane->depth < 0) {
+			if (lane_plan(ctx, lane))
+				return 1;
+			continue;
+		}
+		f = &lane->frames[lane->depth];
+		if (f->firstn)
+			ret = lane_choose_firstn(ctx, lane, f);
+		else
+			ret = lane_choose_indep(ctx, lane, f);
+		if (ret == LANE_YIELD)
+			return 0;
+		if (ret == LANE_CALL) {
+			lane->depth++;
+			continue;
+		}
+		if (lane->depth > 0) {
+			lane->depth--;
+			lane->frames[lane->depth].leaf = f->outpos;
+			continue;
+		}
+		lane->depth = -1;
+		lane->osize += f->firstn ? f->outpos : f->out_size;
+		lane->i++;
+	}
+}
+
+static void lane_start(const struct crush_interleave *ctx,
+		       struct crush_lane *lane, int index, int x,
+		       int *result)
+{
+	const int result_max = ctx->plan->result_max;
+
+	crush_stat(ctx->work, mappings);
+	lane->index = index;
+	lane->x = x;
+	lane->result = result;
+	lane->result_len = 0;
+	lane->step = 0;
+	lane->i = -1;
+	lane->w = lane->scratch;
+	lane->o = lane->scratch + result_max;
+	lane->c = lane->scratch + 2 * result_max;
+	lane->wsize = 0;
+	lane->osize = 0;
+	lane->depth = -1;
+}
+
+int crush_do_plan_interleaved(const struct crush_plan *plan,
+			      const int *x, int x_count,
+			      int *result, int result_stride,
+			      int *result_len,
+			      const __u32 *weight, int weight_max,
+			      void *cwin,
+			      const struct crush_choose_arg *choose_args)
+{
+	struct crush_interleave ctx;
+	struct crush_lane *lanes;
+	struct crush_lane *lane;
+	int *scratch;
+	int lanes_count, active, next, l;
+
+	if (result_stride < plan->result_max) {
+		dprintk(" bad result_stride %d\n", result_stride);
+		return 0;
+	}
+	ctx.plan = plan;
+	ctx.work = cwin;
+	ctx.weight = weight;
+	ctx.weight_max = weight_max;
+	ctx.choose_args = choose_args;
+	crush_stats_rule(cwin, plan->ruleno);
+
+	lanes = (struct crush_lane *)((char *)cwin + plan->map->working_size);
+	scratch = (int *)(lanes + CRUSH_INTERLEAVE_LANES);
+	lanes_count = x_count < CRUSH_INTERLEAVE_LANES ?
+		x_count : CRUSH_INTERLEAVE_LANES;
+	for (next = 0; next < lanes_count; next++) {
+		lanes[next].scratch = scratch + next * 3 * plan->result_max;
+		lane_start(&ctx, &lanes[next], next, x[next],
+			   result + next * result_stride);
+	}
+	for (active = lanes_count; active > 0; ) {
+		for (l = 0; l < lanes_count; l++) {
+			lane = &lanes[l];
+			if (lane->index < 0 || !lane_run(&ctx, lane))
+				continue;
+			if (result_len)
+				result_len[lane->index] = lane->result_len;
+			if (next < x_count) {
+				lane_start(&ctx, lane, next, x[next],
+					   result + next * result_stride);
+				next++;
+			} else {
+				lane->index = -1;
+				active--;
+			}
+		}
+	}
+	return x_count;
+}
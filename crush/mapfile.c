@@ -0,0 +1,319 @@
+/*
+ * A binary file format for frozen maps.
+ *
+ * The file is a header followed by the block of crush_map_freeze()
+ * with its pointers turned into offsets. Loading it only rebases the
+ * pointers, which are all at the beginning of the block: there is no
+ * parsing and no allocation, and the bucket arrays are used from the
+ * page cache. Only the structures are checksummed when loading: of
+ * the arrays, only the items are read, by crush_map_frozen_check().
+ *
+ * LGPL2
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crush_compat.h"
+#include "freeze.h"
+#include "mapfile.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+# define CRUSH_CRC32C_SSE42 1
+# include <immintrin.h>
+#endif
+
+#define CRUSH_MAP_FILE_BYTE_ORDER 0x01020304
+
+/* crc32c (Castagnoli), reflected, as used by iSCSI and ext4 */
+static const __u32 crush_crc32c_table[256] = {
+	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4,
+	0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+	0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+	0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+	0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b,
+	0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+	0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54,
+	0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+	0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+	0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+	0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5,
+	0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+	0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45,
+	0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+	0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+	0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+	0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48,
+	0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+	0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687,
+	0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+	0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+	0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+	0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8,
+	0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+	0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096,
+	0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+	0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+	0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+	0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9,
+	0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+	0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36,
+	0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+	0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+	0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+	0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043,
+	0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+	0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3,
+	0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+	0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+	0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+	0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652,
+	0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+	0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d,
+	0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+	0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+	0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+	0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2,
+	0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+	0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530,
+	0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+	0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+	0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+	0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f,
+	0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+	0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90,
+	0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+	0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+	0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+	0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321,
+	0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+	0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81,
+	0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+	0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+	0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+
+static __u32 crc32c_bytes(__u32 crc, const unsigned char *p, size_t size)
+{
+	while (size--)
+		crc = crush_crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef CRUSH_CRC32C_SSE42
+/* the crc32 instruction computes crc32c, eight bytes at a time */
+__attribute__((target("sse4.2")))
+static __u32 crc32c_sse42(__u32 crc, const unsigned char *p, size_t size)
+{
+	__u64 crc64 = crc, v;
+
+	for (; size >= sizeof(v); size -= sizeof(v), p += sizeof(v)) {
+		memcpy(&v, p, sizeof(v));
+		crc64 = _mm_crc32_u64(crc64, v);
+	}
+	crc = crc64;
+	while (size--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+/*
+ * Add the @size bytes at @data to @crc, which is ~0 before the first
+ * bytes. The crc32c is the inverse of the result once all are added.
+ */
+static __u32 crush_crc32c(__u32 crc, const void *data, size_t size)
+{
+#ifdef CRUSH_CRC32C_SSE42
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc32c_sse42(crc, data, size);
+#endif
+	return crc32c_bytes(crc, data, size);
+}
+
+/* the crc32c of the header up to its checksum and of the structures */
+static __u32 crush_map_file_checksum(const struct crush_map_file_header *h,
+				     const void *arena)
+{
+	__u32 crc = ~0u;
+
+	crc = crush_crc32c(crc, h,
+			   offsetof(struct crush_map_file_header, checksum));
+	return ~crush_crc32c(crc, arena, h->structs_size);
+}
+
+/* the crc32c of the arrays following the structures */
+static __u32 crush_map_file_arrays_checksum(
+	const struct crush_map_file_header *h, const void *arena)
+{
+	return ~crush_crc32c(~0u, (const char *)arena + h->structs_size,
+			     h->arena_size - h->structs_size);
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (size > 0) {
+		n = write(fd, p, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += n;
+		size -= n;
+	}
+	return 0;
+}
+
+int crush_map_save(const struct crush_map *map, const char *path)
+{
+	struct crush_map *frozen = NULL;
+	struct crush_map *copy;
+	char header[CRUSH_MAP_FILE_ARENA_OFFSET];
+	struct crush_map_file_header *h = (struct crush_map_file_header *)header;
+	int fd, r;
+
+	if (!map->frozen_size) {
+		frozen = crush_map_freeze(map);
+		if (!frozen)
+			return -ENOMEM;
+		map = frozen;
+	}
+	copy = malloc(map->frozen_size);
+	if (!copy) {
+		r = -ENOMEM;
+		goto out;
+	}
+	memcpy(copy, map, map->frozen_size);
+	crush_map_frozen_rebase(copy, (uintptr_t)map, 0);
+
+	memset(header, 0, sizeof(header));
+	memcpy(h->magic, CRUSH_MAP_FILE_MAGIC, sizeof(h->magic));
+	h->version = CRUSH_MAP_FILE_VERSION;
+	h->byte_order = CRUSH_MAP_FILE_BYTE_ORDER;
+	h->pointer_size = sizeof(void *);
+	h->map_size = sizeof(struct crush_map);
+	h->arena_size = copy->frozen_size;
+	h->structs_size = crush_map_frozen_structs_size(copy);
+	h->checksum = crush_map_file_checksum(h, copy);
+	h->arrays_checksum = crush_map_file_arrays_checksum(h, copy);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		r = -errno;
+		goto out;
+	}
+	r = write_all(fd, header, sizeof(header));
+	if (r == 0)
+		r = write_all(fd, copy, copy->frozen_size);
+	if (close(fd) < 0 && r == 0)
+		r = -errno;
+out:
+	free(copy);
+	if (frozen)
+		crush_destroy(frozen);
+	return r;
+}
+
+int crush_map_decode(void *buf, size_t size, struct crush_map **mapp)
+{
+	const struct crush_map_file_header *h = buf;
+	struct crush_map *map;
+
+	if (size < CRUSH_MAP_FILE_ARENA_OFFSET ||
+	    memcmp(h->magic, CRUSH_MAP_FILE_MAGIC, sizeof(h->magic)))
+		return -EINVAL;
+	if (h->version != CRUSH_MAP_FILE_VERSION ||
+	    h->byte_order != CRUSH_MAP_FILE_BYTE_ORDER ||
+	    h->pointer_size != sizeof(void *) ||
+	    h->map_size != sizeof(struct crush_map))
+		return -ENOTSUP;
+	if (h->structs_size < sizeof(struct crush_map) ||
+	    h->structs_size > h->arena_size ||
+	    h->arena_size > size - CRUSH_MAP_FILE_ARENA_OFFSET)
+		return -EINVAL;
+	map = (struct crush_map *)((char *)buf + CRUSH_MAP_FILE_ARENA_OFFSET);
+	/* the arrays are only read when the map is used, see crush_map_verify() */
+	if (crush_map_file_checksum(h, map) != h->checksum)
+		return -EBADMSG;
+
+	/*
+	 * every pointer must be inside the arena before it is rebased and
+	 * every structure must be covered by the checksum
+	 */
+	if (map->frozen_size != h->arena_size ||
+	    crush_map_frozen_check(map) < 0 ||
+	    crush_map_frozen_structs_size(map) != h->structs_size)
+		return -EINVAL;
+
+	crush_map_frozen_rebase(map, 0, (uintptr_t)map);
+	*mapp = map;
+	return 0;
+}
+
+int crush_map_mmap(const char *path, struct crush_map **map)
+{
+	struct stat st;
+	void *buf;
+	int fd, r;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+	if ((size_t)st.st_size < CRUSH_MAP_FILE_ARENA_OFFSET) {
+		close(fd);
+		return -EINVAL;
+	}
+	/* writable so that the pointers can be rebased, copy on write */
+	buf = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		   fd, 0);
+	r = buf == MAP_FAILED ? -errno : 0;
+	close(fd);
+	if (r < 0)
+		return r;
+
+	r = crush_map_decode(buf, st.st_size, map);
+	/* crush_map_munmap() derives the size of the mapping from the map */
+	if (r == 0 && (*map)->frozen_size + CRUSH_MAP_FILE_ARENA_OFFSET !=
+	    (size_t)st.st_size)
+		r = -EINVAL;
+	if (r < 0) {
+		munmap(buf, st.st_size);
+		return r;
+	}
+	if (mprotect(buf, st.st_size, PROT_READ) < 0) {
+		r = -errno;
+		munmap(buf, st.st_size);
+		return r;
+	}
+	return 0;
+}
+
+int crush_map_verify(const struct crush_map *map)
+{
+	const struct crush_map_file_header *h =
+		(const void *)((const char *)map - CRUSH_MAP_FILE_ARENA_OFFSET);
+
+	if (crush_map_file_arrays_checksum(h, map) != h->arrays_checksum)
+		return -EBADMSG;
+	return 0;
+}
+
+void crush_map_munmap(struct crush_map *map)
+{
+	munmap((char *)map - CRUSH_MAP_FILE_ARENA_OFFSET,
+	       CRUSH_MAP_FILE_ARENA_OFFSET + map->frozen_size);
+}
@@ -0,0 +1,132 @@
+#ifndef CEPH_CRUSH_MAPFILE_H
+#define CEPH_CRUSH_MAPFILE_H
+
+/*
+ * A binary file format for frozen maps that can be mapped in memory
+ * and used in place.
+ *
+ * LGPL2
+ */
+
+#include <stddef.h>
+
+#include "crush.h"
+
+#define CRUSH_MAP_FILE_MAGIC "CRUSHMAP"
+/* 2: crush_bucket_tree has a __u32 num_nodes and descent_weights */
+/* 3: crush_map has a rule_table */
+/* 4: the checksum only covers the structures, the arrays have their own */
+#define CRUSH_MAP_FILE_VERSION 4
+/* the frozen map starts at this offset in the file */
+#define CRUSH_MAP_FILE_ARENA_OFFSET 64
+
+/** @ingroup API
+ *
+ * The header of a map file. It is followed, at offset
+ * ::CRUSH_MAP_FILE_ARENA_OFFSET, by __arena_size__ bytes which are the
+ * map returned by crush_map_freeze() with all its pointers rebased to
+ * offsets from the beginning of the map.
+ *
+ * The first __structs_size__ bytes of the map, the structures that
+ * contain pointers, are covered by __checksum__ and verified by
+ * crush_map_decode(). The bucket arrays that follow are covered by
+ * __arrays_checksum__, which is only verified by crush_map_verify()
+ * so that loading a map does not read all of it.
+ *
+ * The file uses the byte order, the pointer size and the structure
+ * layout of the host that wrote it. A file written on an incompatible
+ * host is rejected.
+ */
+struct crush_map_file_header {
+	char magic[8];		/*!< ::CRUSH_MAP_FILE_MAGIC, not nul terminated */
+	__u32 version;		/*!< ::CRUSH_MAP_FILE_VERSION */
+	__u32 byte_order;	/*!< 0x01020304 in the byte order of the writer */
+	__u32 pointer_size;	/*!< sizeof(void *) */
+	__u32 map_size;		/*!< sizeof(struct crush_map) */
+	__u64 arena_size;	/*!< the size of the frozen map */
+	__u64 structs_size;	/*!< the size of its structures, see crush_map_frozen_structs_size() */
+	__u32 checksum;		/*!< crc32c of the header up to here and of the structures */
+	__u32 arrays_checksum;	/*!< crc32c of the arrays after the structures */
+};
+
+/** @ingroup API
+ *
+ * Write __map__ to the file __path__, which is created or truncated.
+ * If __map__ is not frozen, a frozen copy is made with
+ * crush_map_freeze() and released once written. The __map__ must have
+ * been finalized with crush_finalize().
+ *
+ * - return -ENOMEM if the frozen copy cannot be allocated
+ * - return -errno if the file cannot be written
+ *
+ * @param map the crush_map to write
+ * @param path the name of the file
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_map_save(const struct crush_map *map, const char *path);
+
+/** @ingroup API
+ *
+ * Use the __size__ bytes at __buf__, the content of a file written by
+ * crush_map_save(), as a map. No memory is allocated and the map is
+ * not copied: its pointers are rebased in place, which only modifies
+ * the beginning of __buf__. The map is valid as long as __buf__ is
+ * and must not be released with crush_destroy().
+ *
+ * - return -EINVAL if __buf__ is not a map file or is truncated
+ * - return -ENOTSUP if the version or the layout of the file is not supported
+ * - return -EBADMSG if the checksum of the structures does not match
+ *
+ * @param buf the content of a map file, aligned on ::CRUSH_FROZEN_ALIGN
+ * @param size the size of __buf__
+ * @param[out] map the map, inside __buf__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_map_decode(void *buf, size_t size, struct crush_map **map);
+
+/** @ingroup API
+ *
+ * Map the file __path__, written by crush_map_save(), in memory and
+ * use it in place as with crush_map_decode(). The mapping is private
+ * and read only: the processes mapping the same file share the pages
+ * holding the bucket arrays, only the pages holding the structures
+ * with pointers are copied. The map must be released with
+ * crush_map_munmap().
+ *
+ * - return -errno if the file cannot be opened or mapped
+ * - return the errors of crush_map_decode()
+ *
+ * @param path the name of the file
+ * @param[out] map the map
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_map_mmap(const char *path, struct crush_map **map);
+
+/** @ingroup API
+ *
+ * Verify the checksum of the bucket arrays of a __map__ returned by
+ * crush_map_decode() or crush_map_mmap(). The structures are verified
+ * when the map is loaded but the arrays are not, since it would read
+ * the whole file: this is the opt-in full verification, e.g. after a
+ * map was copied or before it is trusted for a long time.
+ *
+ * - return -EBADMSG if the checksum does not match
+ *
+ * @param map a map inside a map file
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_map_verify(const struct crush_map *map);
+
+/** @ingroup API
+ *
+ * Release a __map__ returned by crush_map_mmap().
+ *
+ * @param map the map to release
+ */
+extern void crush_map_munmap(struct crush_map *map);
+
+#endif
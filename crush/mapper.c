@@ -21,12 +21,25 @@
 # include "crush_compat.h"
 # include "crush.h"
 # include "hash.h"
+# include "simd.h"
+# include "stats.h"
 #endif
 #include "crush_ln_table.h"
 #include "mapper.h"
+#include "choose.h"
 
 #define dprintk(args...) /* printf(args) */
 
+#ifndef __KERNEL__
+void crush_track_visit(struct crush_work *work,
+		       const struct crush_bucket *bucket)
+{
+	if (work->track & CRUSH_TRACK_VISITED)
+		work->visited |= crush_visited_bit(bucket->id);
+	crush_bucket_stat(work, bucket, visits);
+}
+#endif
+
 /*
  * Implement the core CRUSH mapping algorithm.
  */
@@ -42,6 +55,22 @@ int crush_find_rule(const struct crush_map *map, int ruleset, int type, int size
 {
 	__u32 i;
 
+#ifndef __KERNEL__
+	const struct crush_rule_table *table = map->rule_table;
+
+	if (table) {
+		int row;
+
+		if ((__u32)ruleset >= CRUSH_MAX_RULESET ||
+		    (__u32)size >= CRUSH_RULE_TABLE_SIZES)
+			return -1;
+		for (row = table->first[ruleset];
+		     row < table->first[ruleset + 1]; row++)
+			if (table->types[row] == type)
+				return table->rules[row][size];
+		return -1;
+	}
+#endif
 	for (i = 0; i < map->max_rules; i++) {
 		if (map->rules[i] &&
 		    map->rules[i]->mask.ruleset == ruleset &&
@@ -69,7 +98,86 @@ int crush_find_rule(const struct crush_map *map, int ruleset, int type, int size
  * calculate an actual random permutation of the bucket members.
  * Since this is expensive, we optimize for the r=0 case, which
  * captures the vast majority of calls.
+ *
+ * The permutation is computed lazily: the first perm_n entries of
+ * *perm are defined and, while perm_swapped is not CRUSH_PERM_DENSE,
+ * the entries past perm_n are i except for the perm_swapped ones moved
+ * by the swaps. Those are kept as (position, item) pairs at the end of
+ * *perm, so that starting a permutation for a new @x and each of its
+ * steps cost the same whatever the size of the bucket. The whole
+ * permutation is only written down when more than
+ * CRUSH_PERM_SWAPPED_MAX entries were moved, when the pairs would
+ * overwrite the defined entries or, for buckets of less than
+ * CRUSH_PERM_LAZY_SIZE items, from the second step on.
  */
+#define CRUSH_PERM_DENSE 0xffffffff
+#define CRUSH_PERM_SWAPPED_MAX 16
+#define CRUSH_PERM_LAZY_SIZE 64
+
+/* the pair of the @n-th swapped entry of a bucket of @size items */
+#define perm_swapped_pos(work, size, n) ((work)->perm[(size) - 1 - 2 * (n)])
+#define perm_swapped_item(work, size, n) ((work)->perm[(size) - 2 - 2 * (n)])
+
+/* the pair of position @pos past perm_n or perm_swapped if it has none */
+static unsigned int perm_swapped_find(const struct crush_work_bucket *work,
+				      unsigned int size, unsigned int pos)
+{
+	unsigned int n;
+
+	for (n = 0; n < work->perm_swapped; n++)
+		if (perm_swapped_pos(work, size, n) == pos)
+			break;
+	return n;
+}
+
+/* write down the whole permutation from its defined and swapped entries */
+static void perm_expand(struct crush_work_bucket *work, unsigned int size)
+{
+	__u32 pairs[2 * CRUSH_PERM_SWAPPED_MAX];
+	unsigned int n, i;
+
+	for (n = 0; n < work->perm_swapped; n++) {
+		pairs[2 * n] = perm_swapped_pos(work, size, n);
+		pairs[2 * n + 1] = perm_swapped_item(work, size, n);
+	}
+	for (i = work->perm_n; i < size; i++)
+		work->perm[i] = i;
+	for (n = 0; n < work->perm_swapped; n++)
+		work->perm[pairs[2 * n]] = pairs[2 * n + 1];
+	work->perm_swapped = CRUSH_PERM_DENSE;
+}
+
+/* swap the entries @p = perm_n and @p + @i of a lazy permutation */
+static void perm_swap_lazy(struct crush_work_bucket *work, unsigned int size,
+			   unsigned int p, unsigned int i)
+{
+	unsigned int n = perm_swapped_find(work, size, p);
+	__u32 item = p;
+
+	if (n < work->perm_swapped) {
+		/* @p is defined now, move the last pair in its place */
+		item = perm_swapped_item(work, size, n);
+		work->perm_swapped--;
+		perm_swapped_pos(work, size, n) =
+			perm_swapped_pos(work, size, work->perm_swapped);
+		perm_swapped_item(work, size, n) =
+			perm_swapped_item(work, size, work->perm_swapped);
+	}
+	if (i) {
+		n = perm_swapped_find(work, size, p + i);
+		work->perm[p] = n < work->perm_swapped ?
+			perm_swapped_item(work, size, n) : p + i;
+		/* items only move forward, @item is never at its own place */
+		if (n == work->perm_swapped) {
+			work->perm_swapped++;
+			perm_swapped_pos(work, size, n) = p + i;
+		}
+		perm_swapped_item(work, size, n) = item;
+	} else {
+		work->perm[p] = item;
+	}
+}
+
 static int bucket_perm_choose(const struct crush_bucket *bucket,
 			      struct crush_work_bucket *work,
 			      int x, int r)
@@ -87,19 +195,21 @@ static int bucket_perm_choose(const struct crush_bucket *bucket,
 			s = crush_hash32_3(bucket->hash, x, bucket->id, 0) %
 				bucket->size;
 			work->perm[0] = s;
-			work->perm_n = 0xffff;   /* magic value, see below */
+			work->perm_n = 1;
+			work->perm_swapped = 0;
+			if (s && bucket->size >= 3) {
+				work->perm_swapped = 1;
+				perm_swapped_pos(work, bucket->size, 0) = s;
+				perm_swapped_item(work, bucket->size, 0) = 0;
+			} else if (s) {
+				perm_expand(work, bucket->size);
+				work->perm[s] = 0;
+			}
 			goto out;
 		}
 
-		for (i = 0; i < bucket->size; i++)
-			work->perm[i] = i;
 		work->perm_n = 0;
-	} else if (work->perm_n == 0xffff) {
-		/* clean up after the r=0 case above */
-		for (i = 1; i < bucket->size; i++)
-			work->perm[i] = i;
-		work->perm[work->perm[0]] = 0;
-		work->perm_n = 1;
+		work->perm_swapped = 0;
 	}
 
 	/* calculate permutation up to pr */
@@ -107,11 +217,21 @@ static int bucket_perm_choose(const struct crush_bucket *bucket,
 		dprintk(" perm_choose have %d: %d\n", i, work->perm[i]);
 	while (work->perm_n <= pr) {
 		unsigned int p = work->perm_n;
+
+		/* room for this entry and one more pair, never left
+		   for the final entry */
+		if (work->perm_swapped != CRUSH_PERM_DENSE &&
+		    (bucket->size < CRUSH_PERM_LAZY_SIZE ||
+		     work->perm_swapped == CRUSH_PERM_SWAPPED_MAX ||
+		     p + 1 + 2 * (work->perm_swapped + 1) > bucket->size))
+			perm_expand(work, bucket->size);
 		/* no point in swapping the final entry */
 		if (p < bucket->size - 1) {
 			i = crush_hash32_3(bucket->hash, x, bucket->id, p) %
 				(bucket->size - p);
-			if (i) {
+			if (work->perm_swapped != CRUSH_PERM_DENSE) {
+				perm_swap_lazy(work, bucket->size, p, i);
+			} else if (i) {
 				unsigned int t = work->perm[p + i];
 				work->perm[p + i] = work->perm[p];
 				work->perm[p] = t;
@@ -120,7 +240,7 @@ static int bucket_perm_choose(const struct crush_bucket *bucket,
 		}
 		work->perm_n++;
 	}
-	for (i = 0; i < bucket->size; i++)
+	for (i = 0; i < work->perm_n; i++)
 		dprintk(" perm_choose  %d: %d\n", i, work->perm[i]);
 
 	s = work->perm[pr];
@@ -192,6 +312,32 @@ static int terminal(int x)
 	return x & 1;
 }
 
+/*
+ * Descend the breadth first copy of the weights: the pair of the node
+ * p is its weight and the weight of its left child, the pairs of its
+ * children are 2p + 1 and 2p + 2. The in order number n of the node
+ * is hashed as the legacy descent does and moves by half of its
+ * lowest bit set to the left or to the right without branching.
+ */
+static int bucket_tree_descend(const struct crush_bucket_tree *bucket,
+			       int x, int r)
+{
+	const __u32 *dw = bucket->descent_weights;
+	int n = bucket->num_nodes >> 1;
+	int h = height(n);
+	__u32 p = 0;
+
+	for (; h > 0; h--) {
+		__u64 t = (__u64)crush_hash32_4(bucket->h.hash, x, n, r,
+						bucket->h.id) * (__u64)dw[2*p];
+		int dir = (t >> 32) >= dw[2*p+1];
+
+		n += (dir << h) - (1 << (h-1));
+		p = 2*p + 1 + dir;
+	}
+	return n;
+}
+
 static int bucket_tree_choose(const struct crush_bucket_tree *bucket,
 			      int x, int r)
 {
@@ -199,25 +345,33 @@ static int bucket_tree_choose(const struct crush_bucket_tree *bucket,
 	__u32 w;
 	__u64 t;
 
-	/* start at root */
-	n = bucket->num_nodes >> 1;
-
-	while (!terminal(n)) {
-		int l;
-		/* pick point in [0, w) */
-		w = bucket->node_weights[n];
-		t = (__u64)crush_hash32_4(bucket->h.hash, x, n, r,
-					  bucket->h.id) * (__u64)w;
-		t = t >> 32;
-
-		/* descend to the left or right? */
-		l = left(n);
-		if (t < bucket->node_weights[l])
-			n = l;
-		else
-			n = right(n);
+	if (bucket->descent_weights) {
+		n = bucket_tree_descend(bucket, x, r);
+	} else {
+		/* start at root */
+		n = bucket->num_nodes >> 1;
+
+		while (!terminal(n)) {
+			int l;
+			/* pick point in [0, w) */
+			w = bucket->node_weights[n];
+			t = (__u64)crush_hash32_4(bucket->h.hash, x, n, r,
+						  bucket->h.id) * (__u64)w;
+			t = t >> 32;
+
+			/* descend to the left or right? */
+			l = left(n);
+			if (t < bucket->node_weights[l])
+				n = l;
+			else
+				n = right(n);
+		}
 	}
 
+	/* only a bucket of weight 0 descends to the right of the last
+	   item */
+	if ((__u32)(n >> 1) >= bucket->h.size)
+		return bucket->h.items[bucket->h.size - 1];
 	return bucket->h.items[n >> 1];
 }
 
@@ -244,52 +398,6 @@ static int bucket_straw_choose(const struct crush_bucket_straw *bucket,
 	return bucket->h.items[high];
 }
 
-/* compute 2^44*log2(input+1) */
-static __u64 crush_ln(unsigned int xin)
-{
-	unsigned int x = xin;
-	int iexpon, index1, index2;
-	__u64 RH, LH, LL, xl64, result;
-
-	x++;
-
-	/* normalize input */
-	iexpon = 15;
-
-	// figure out number of bits we need to shift and
-	// do it in one step instead of iteratively
-	if (!(x & 0x18000)) {
-	  int bits = __builtin_clz(x & 0x1FFFF) - 16;
-	  x <<= bits;
-	  iexpon = 15 - bits;
-	}
-
-	index1 = (x >> 8) << 1;
-	/* RH ~ 2^56/index1 */
-	RH = __RH_LH_tbl[index1 - 256];
-	/* LH ~ 2^48 * log2(index1/256) */
-	LH = __RH_LH_tbl[index1 + 1 - 256];
-
-	/* RH*x ~ 2^48 * (2^15 + xf), xf<2^8 */
-	xl64 = (__s64)x * RH;
-	xl64 >>= 48;
-
-	result = iexpon;
-	result <<= (12 + 32);
-
-	index2 = xl64 & 0xff;
-	/* LL ~ 2^48*log2(1.0+index2/2^15) */
-	LL = __LL_tbl[index2];
-
-	LH = LH + LL;
-
-	LH >>= (48 - 12 - 32);
-	result += LH;
-
-	return result;
-}
-
-
 /*
  * straw2
  *
@@ -299,19 +407,53 @@ static __u64 crush_ln(unsigned int xin)
  *
  */
 
+static const __u32 *get_choose_arg_weights(const struct crush_bucket_straw2 *bucket,
+					   const struct crush_choose_arg *arg,
+					   int position)
+{
+	if (!arg || !arg->weight_set)
+		return bucket->item_weights;
+	if ((__u32)position >= arg->weight_set_size)
+		position = arg->weight_set_size - 1;
+	return arg->weight_set[position].weights;
+}
+
+static const __s32 *get_choose_arg_ids(const struct crush_bucket_straw2 *bucket,
+				       const struct crush_choose_arg *arg)
+{
+	if (!arg || !arg->ids)
+		return bucket->h.items;
+	return arg->ids;
+}
+
 static int bucket_straw2_choose(const struct crush_bucket_straw2 *bucket,
-				int x, int r)
+				int x, int r,
+				const struct crush_choose_arg *arg,
+				int position)
 {
 	unsigned int i, high = 0;
 	unsigned int u;
 	unsigned int w;
 	__s64 ln, draw, high_draw = 0;
+	const __u32 *weights = get_choose_arg_weights(bucket, arg, position);
+	const __s32 *ids = get_choose_arg_ids(bucket, arg);
+	/* the reciprocals are those of the weights of the bucket */
+	const __u64 *reciprocals = weights == bucket->item_weights ?
+		bucket->item_reciprocals : NULL;
+
+#ifndef __KERNEL__
+	if (bucket->h.hash == CRUSH_HASH_RJENKINS1 &&
+	    weights == bucket->item_weights && ids == bucket->h.items) {
+		int simd_high = crush_straw2_simd_choose(bucket, x, r);
+		if (simd_high >= 0)
+			return bucket->h.items[simd_high];
+	}
+#endif
 
 	for (i = 0; i < bucket->h.size; i++) {
-		w = bucket->item_weights[i];
+		w = weights[i];
 		if (w) {
-			u = crush_hash32_3(bucket->h.hash, x,
-					   bucket->h.items[i], r);
+			u = crush_hash32_3(bucket->h.hash, x, ids[i], r);
 			u &= 0xffff;
 
 			/*
@@ -332,7 +474,14 @@ static int bucket_straw2_choose(const struct crush_bucket_straw2 *bucket,
 			 * weight means a larger (less negative) value
 			 * for draw.
 			 */
-			draw = div64_s64(ln, w);
+			if (reciprocals) {
+				__u64 rcp = reciprocals[i];
+				draw = -(__s64)mul_u64_u64_shr(
+					-ln, crush_reciprocal_multiplier(rcp),
+					crush_reciprocal_shift(rcp));
+			} else {
+				draw = div64_s64(ln, w);
+			}
 		} else {
 			draw = S64_MIN;
 		}
@@ -346,10 +495,79 @@ static int bucket_straw2_choose(const struct crush_bucket_straw2 *bucket,
 	return bucket->h.items[high];
 }
 
+/*
+ * straw2_tree
+ *
+ * a straw2 draw among the items of a group, and the nodes of each
+ * level above. The straws of the items are those of a straw2 bucket.
+ */
+
+static inline __s64 straw2_tree_draw(unsigned int u, __u32 w)
+{
+	__s64 ln;
+
+	if (!w)
+		return S64_MIN;
+	ln = crush_ln(u & 0xffff) - 0x1000000000000ll;
+	return div64_s64(ln, w);
+}
+
+static int bucket_straw2_tree_choose(const struct crush_bucket_straw2_tree *bucket,
+				     int x, int r)
+{
+	__u32 sizes[CRUSH_STRAW2_TREE_MAX_LEVELS + 1];
+	const __u32 *nodes = bucket->node_weights;
+	int level = crush_straw2_tree_levels(bucket->h.size, sizes);
+	__u32 first = 0, end, high, i;
+	__s64 draw, high_draw;
+	int l;
+
+	/* the weights of the last level */
+	for (l = 1; l < level; l++)
+		nodes += sizes[l];
+	end = sizes[level];
+	for (; level > 0; level--) {
+		high = first;
+		high_draw = 0;
+		for (i = first; i < end; i++) {
+			draw = straw2_tree_draw(
+				crush_hash32_5(bucket->h.hash, x, i, r,
+					       bucket->h.id, level),
+				nodes[i]);
+			if (i == first || draw > high_draw) {
+				high = i;
+				high_draw = draw;
+			}
+		}
+		/* the children of the winner */
+		first = high * CRUSH_STRAW2_TREE_FANOUT;
+		end = first + CRUSH_STRAW2_TREE_FANOUT;
+		if (end > sizes[level - 1])
+			end = sizes[level - 1];
+		if (level > 1)
+			nodes -= sizes[level - 1];
+	}
+
+	high = first;
+	high_draw = 0;
+	for (i = first; i < end; i++) {
+		draw = straw2_tree_draw(
+			crush_hash32_3(bucket->h.hash, x, bucket->h.items[i], r),
+			bucket->item_weights[i]);
+		if (i == first || draw > high_draw) {
+			high = i;
+			high_draw = draw;
+		}
+	}
+	return bucket->h.items[high];
+}
+
 
 static int crush_bucket_choose(const struct crush_bucket *in,
 			       struct crush_work_bucket *work,
-			       int x, int r)
+			       int x, int r,
+			       const struct crush_choose_arg *arg,
+			       int position)
 {
 	dprintk(" crush_bucket_choose %d x=%d r=%d\n", in->id, x, r);
 	BUG_ON(in->size == 0);
@@ -371,6 +589,10 @@ static int crush_bucket_choose(const struct crush_bucket *in,
 	case CRUSH_BUCKET_STRAW2:
 		return bucket_straw2_choose(
 			(const struct crush_bucket_straw2 *)in,
+			x, r, arg, position);
+	case CRUSH_BUCKET_STRAW2_TREE:
+		return bucket_straw2_tree_choose(
+			(const struct crush_bucket_straw2_tree *)in,
 			x, r);
 	default:
 		dprintk("unknown bucket %d alg %d\n", in->id, in->alg);
@@ -383,11 +605,23 @@ static int crush_bucket_choose(const struct crush_bucket *in,
  * of the cluster
  */
 static int is_out(const struct crush_map *map,
+		  const struct crush_work *work,
 		  const __u32 *weight, int weight_max,
 		  int item, int x)
 {
 	if (item >= weight_max)
 		return 1;
+#ifndef __KERNEL__
+	{
+		const struct crush_weight_summary *s = work->weight_summary;
+
+		/* a device whose bit is clear is fully in */
+		if (s && s->weights == weight && s->weight_max == weight_max &&
+		    (!s->reweighted ||
+		     !(s->bits[item >> 6] & (1ULL << (item & 63)))))
+			return 0;
+	}
+#endif
 	if (weight[item] >= 0x10000)
 		return 0;
 	if (weight[item] == 0)
@@ -398,6 +632,70 @@ static int is_out(const struct crush_map *map,
 	return 1;
 }
 
+/*
+ * Choose an item from @in for crush_choose_firstn(), by an exhaustive
+ * search of its permutation once half of it was tried locally, and
+ * for crush_choose_indep(), with @local_fallback_retries = 0.
+ */
+static int crush_choose_item(struct crush_work *work,
+			     const struct crush_bucket *in,
+			     int x, int r,
+			     unsigned int flocal,
+			     unsigned int local_fallback_retries,
+			     const struct crush_choose_arg *choose_args,
+			     int position)
+{
+	if (local_fallback_retries > 0 &&
+	    flocal >= (in->size>>1) &&
+	    flocal > local_fallback_retries) {
+		crush_stat(work, perm_fallbacks);
+		return bucket_perm_choose(in, work->work[-1-in->id], x, r);
+	}
+	return crush_bucket_choose(in, work->work[-1-in->id], x, r,
+				   (choose_args ?
+				    &choose_args[-1-in->id] : NULL),
+				   position);
+}
+
+/*
+ * The first attempt of the recursive crush_choose_firstn() of a
+ * chooseleaf, which succeeds for most replicas: a single draw in
+ * @bucket with r = @rep + @parent_r that gives a device neither
+ * colliding with the @outpos leaves of @out2 nor out. On success the
+ * device is stored in @out2[@outpos], accounted for as the recursive
+ * call does and 1 is returned. Otherwise nothing is modified and 0 is
+ * returned: the caller then goes through crush_choose_firstn(), which
+ * draws the same item again and retries.
+ */
+static int crush_choose_leaf_first(const struct crush_map *map,
+				   struct crush_work *work,
+				   const struct crush_bucket *bucket,
+				   const __u32 *weight, int weight_max,
+				   int x, int rep, int parent_r,
+				   int *out2, int outpos, __u64 leaves,
+				   const struct crush_choose_arg *choose_args)
+{
+	int item;
+
+	if (bucket->size == 0)
+		return 0;
+	item = crush_bucket_choose(bucket, work->work[-1-bucket->id],
+				   x, rep + parent_r,
+				   (choose_args ?
+				    &choose_args[-1-bucket->id] : NULL),
+				   outpos);
+	if (item < 0 || item >= map->max_devices ||
+	    crush_collides(out2, outpos, leaves, item) ||
+	    is_out(map, work, weight, weight_max, item, x))
+		return 0;
+
+	crush_stat(work, descents);
+	crush_visit(work, bucket);
+	crush_count_tries(work, 0);
+	out2[outpos] = item;
+	return 1;
+}
+
 /**
  * crush_choose_firstn - choose numrep distinct items of given type
  * @map: the crush_map
@@ -433,11 +731,12 @@ static int crush_choose_firstn(const struct crush_map *map,
 			       unsigned int vary_r,
 			       unsigned int stable,
 			       int *out2,
-			       int parent_r)
+			       int parent_r,
+			       const struct crush_choose_arg *choose_args)
 {
 	int rep;
 	unsigned int ftotal, flocal;
-	int retry_descent, retry_bucket, skip_rep;
+	int retry_descent, retry_bucket, skip_rep, retry;
 	const struct crush_bucket *in = bucket;
 	int r;
 	int i;
@@ -445,6 +744,7 @@ static int crush_choose_firstn(const struct crush_map *map,
 	int itemtype;
 	int collide, reject;
 	int count = out_size;
+	__u64 chosen = 0, leaves = 0;
 
 	dprintk("CHOOSE%s bucket %d x %d outpos %d numrep %d tries %d \
 recurse_tries %d local_retries %d local_fallback_retries %d \
@@ -454,6 +754,12 @@ parent_r %d stable %d\n",
 		tries, recurse_tries, local_retries, local_fallback_retries,
 		parent_r, stable);
 
+	for (i = 0; i < outpos; i++) {
+		chosen |= crush_item_bit(out[i]);
+		if (recurse_to_leaf)
+			leaves |= crush_item_bit(out2[i]);
+	}
+
 	for (rep = stable ? 0 : outpos; rep < numrep && count > 0 ; rep++) {
 		/* keep trying until we get a non-out, non-colliding item */
 		ftotal = 0;
@@ -461,6 +767,7 @@ parent_r %d stable %d\n",
 		do {
 			retry_descent = 0;
 			in = bucket;              /* initial bucket */
+			crush_stat(work, descents);
 
 			/* choose through intervening buckets */
 			flocal = 0;
@@ -472,20 +779,15 @@ parent_r %d stable %d\n",
 				r += ftotal;
 
 				/* bucket choose */
+				crush_visit(work, in);
 				if (in->size == 0) {
 					reject = 1;
 					goto reject;
 				}
-				if (local_fallback_retries > 0 &&
-				    flocal >= (in->size>>1) &&
-				    flocal > local_fallback_retries)
-					item = bucket_perm_choose(
-						in, work->work[-1-in->id],
-						x, r);
-				else
-					item = crush_bucket_choose(
-						in, work->work[-1-in->id],
-						x, r);
+				item = crush_choose_item(work, in, x, r,
+							 flocal,
+							 local_fallback_retries,
+							 choose_args, outpos);
 				if (item >= map->max_devices) {
 					dprintk("   bad item %d\n", item);
 					skip_rep = 1;
@@ -493,10 +795,7 @@ parent_r %d stable %d\n",
 				}
 
 				/* desired type? */
-				if (item < 0)
-					itemtype = map->buckets[-1-item]->type;
-				else
-					itemtype = 0;
+				itemtype = crush_item_type(map, item);
 				dprintk("  item %d type %d\n", item, itemtype);
 
 				/* keep going? */
@@ -513,11 +812,9 @@ parent_r %d stable %d\n",
 				}
 
 				/* collision? */
-				for (i = 0; i < outpos; i++) {
-					if (out[i] == item) {
-						collide = 1;
-						break;
-					}
+				if (crush_collides(out, outpos, chosen, item)) {
+					collide = 1;
+					crush_stat(work, collisions);
 				}
 
 				reject = 0;
@@ -528,7 +825,15 @@ parent_r %d stable %d\n",
 							sub_r = r >> (vary_r-1);
 						else
 							sub_r = 0;
-						if (crush_choose_firstn(
+						if (!crush_choose_leaf_first(
+							    map, work,
+							    map->buckets[-1-item],
+							    weight, weight_max,
+							    x, stable ? 0 : outpos,
+							    sub_r,
+							    out2, outpos, leaves,
+							    choose_args) &&
+						    crush_choose_firstn(
 							    map,
 							    work,
 							    map->buckets[-1-item],
@@ -542,7 +847,8 @@ parent_r %d stable %d\n",
 							    vary_r,
 							    stable,
 							    NULL,
-							    sub_r) <= outpos)
+							    sub_r,
+							    choose_args) <= outpos)
 							/* didn't get leaf */
 							reject = 1;
 					} else {
@@ -553,30 +859,24 @@ parent_r %d stable %d\n",
 
 				if (!reject && !collide) {
 					/* out? */
-					if (itemtype == 0)
-						reject = is_out(map, weight,
-								weight_max,
-								item, x);
+					if (itemtype == 0 &&
+					    is_out(map, work, weight, weight_max,
+						   item, x)) {
+						reject = 1;
+						crush_stat(work, rejects);
+					}
 				}
 
 reject:
 				if (reject || collide) {
-					ftotal++;
-					flocal++;
-
-					if (collide && flocal <= local_retries)
-						/* retry locally a few times */
-						retry_bucket = 1;
-					else if (local_fallback_retries > 0 &&
-						 flocal <= in->size + local_fallback_retries)
-						/* exhaustive bucket search */
-						retry_bucket = 1;
-					else if (ftotal < tries)
-						/* then retry descent */
-						retry_descent = 1;
-					else
-						/* else give up */
-						skip_rep = 1;
+					retry = crush_firstn_retry(
+						work, in, collide,
+						&ftotal, &flocal, tries,
+						local_retries,
+						local_fallback_retries);
+					retry_bucket = retry == CRUSH_RETRY_BUCKET;
+					retry_descent = retry == CRUSH_RETRY_DESCENT;
+					skip_rep = retry == CRUSH_RETRY_SKIP;
 					dprintk("  reject %d  collide %d  "
 						"ftotal %u  flocal %u\n",
 						reject, collide, ftotal,
@@ -587,17 +887,18 @@ reject:
 
 		if (skip_rep) {
 			dprintk("skip rep\n");
+			crush_stat(work, skip_reps);
 			continue;
 		}
 
 		dprintk("CHOOSE got %d\n", item);
 		out[outpos] = item;
+		chosen |= crush_item_bit(item);
+		if (recurse_to_leaf)
+			leaves |= crush_item_bit(out2[outpos]);
 		outpos++;
 		count--;
-#ifndef __KERNEL__
-		if (map->choose_tries && ftotal <= map->choose_total_tries)
-			map->choose_tries[ftotal]++;
-#endif
+		crush_count_tries(work, ftotal);
 	}
 
 	dprintk("CHOOSE returns %d\n", outpos);
@@ -619,7 +920,8 @@ static void crush_choose_indep(const struct crush_map *map,
 			       unsigned int recurse_tries,
 			       int recurse_to_leaf,
 			       int *out2,
-			       int parent_r)
+			       int parent_r,
+			       const struct crush_choose_arg *choose_args)
 {
 	const struct crush_bucket *in = bucket;
 	int endpos = outpos + left;
@@ -661,37 +963,25 @@ static void crush_choose_indep(const struct crush_map *map,
 				continue;
 
 			in = bucket;  /* initial bucket */
+			crush_stat(work, descents);
+			if (ftotal)
+				crush_stat(work, descent_retries);
 
 			/* choose through intervening buckets */
 			for (;;) {
-				/* note: we base the choice on the position
-				 * even in the nested call.  that means that
-				 * if the first layer chooses the same bucket
-				 * in a different position, we will tend to
-				 * choose a different item in that bucket.
-				 * this will involve more devices in data
-				 * movement and tend to distribute the load.
-				 */
-				r = rep + parent_r;
-
-				/* be careful */
-				if (in->alg == CRUSH_BUCKET_UNIFORM &&
-				    in->size % numrep == 0)
-					/* r'=r+(n+1)*f_total */
-					r += (numrep+1) * ftotal;
-				else
-					/* r' = r + n*f_total */
-					r += numrep * ftotal;
+				r = crush_indep_r(in, rep, parent_r, numrep,
+						  ftotal);
 
 				/* bucket choose */
+				crush_visit(work, in);
 				if (in->size == 0) {
 					dprintk("   empty bucket\n");
+					crush_bucket_stat(work, in, retries);
 					break;
 				}
 
-				item = crush_bucket_choose(
-					in, work->work[-1-in->id],
-					x, r);
+				item = crush_choose_item(work, in, x, r, 0, 0,
+							 choose_args, outpos);
 				if (item >= map->max_devices) {
 					dprintk("   bad item %d\n", item);
 					out[rep] = CRUSH_ITEM_NONE;
@@ -702,10 +992,7 @@ static void crush_choose_indep(const struct crush_map *map,
 				}
 
 				/* desired type? */
-				if (item < 0)
-					itemtype = map->buckets[-1-item]->type;
-				else
-					itemtype = 0;
+				itemtype = crush_item_type(map, item);
 				dprintk("  item %d type %d\n", item, itemtype);
 
 				/* keep going? */
@@ -732,8 +1019,11 @@ static void crush_choose_indep(const struct crush_map *map,
 						break;
 					}
 				}
-				if (collide)
+				if (collide) {
+					crush_stat(work, collisions);
+					crush_bucket_stat(work, in, retries);
 					break;
+				}
 
 				if (recurse_to_leaf) {
 					if (item < 0) {
@@ -745,9 +1035,12 @@ static void crush_choose_indep(const struct crush_map *map,
 							x, 1, numrep, 0,
 							out2, rep,
 							recurse_tries, 0,
-							0, NULL, r);
+							0, NULL, r,
+							choose_args);
 						if (out2[rep] == CRUSH_ITEM_NONE) {
 							/* placed nothing; no leaf */
+							crush_bucket_stat(work, in,
+									  retries);
 							break;
 						}
 					} else {
@@ -758,8 +1051,11 @@ static void crush_choose_indep(const struct crush_map *map,
 
 				/* out? */
 				if (itemtype == 0 &&
-				    is_out(map, weight, weight_max, item, x))
+				    is_out(map, work, weight, weight_max, item, x)) {
+					crush_stat(work, rejects);
+					crush_bucket_stat(work, in, retries);
 					break;
+				}
 
 				/* yay! */
 				out[rep] = item;
@@ -768,18 +1064,7 @@ static void crush_choose_indep(const struct crush_map *map,
 			}
 		}
 	}
-	for (rep = outpos; rep < endpos; rep++) {
-		if (out[rep] == CRUSH_ITEM_UNDEF) {
-			out[rep] = CRUSH_ITEM_NONE;
-		}
-		if (out2 && out2[rep] == CRUSH_ITEM_UNDEF) {
-			out2[rep] = CRUSH_ITEM_NONE;
-		}
-	}
-#ifndef __KERNEL__
-	if (map->choose_tries && ftotal <= map->choose_total_tries)
-		map->choose_tries[ftotal]++;
-#endif
+	crush_indep_finish(work, out, out2, outpos, endpos, ftotal);
 #ifdef DEBUG_INDEP
 	if (out2) {
 		dprintk("%u %d a: ", ftotal, left);
@@ -819,9 +1104,19 @@ void crush_init_workspace(const struct crush_map *m, void *v) {
 	struct crush_work *w = (struct crush_work *)v;
 	char *point = (char *)v;
 	__s32 b;
-	point += sizeof(struct crush_work *);
+	point += sizeof(struct crush_work);
+#ifndef __KERNEL__
+	w->choose_tries = NULL;
+	w->choose_tries_size = 0;
+	w->stats = NULL;
+	w->rule_stats = NULL;
+	w->track = 0;
+	w->visited = 0;
+	w->weight_summary = NULL;
+#endif
 	w->work = (struct crush_work_bucket **)point;
 	point += m->max_buckets * sizeof(struct crush_work_bucket *);
+	point = (char *)v + crush_work_align(point - (char *)v);
 	for (b = 0; b < m->max_buckets; ++b) {
 		if (m->buckets[b] == 0)
 			continue;
@@ -834,30 +1129,98 @@ void crush_init_workspace(const struct crush_map *m, void *v) {
 		}
 		w->work[b]->perm_x = 0;
 		w->work[b]->perm_n = 0;
+		w->work[b]->perm_swapped = 0;
 		w->work[b]->perm = (__u32 *)point;
 		point += m->buckets[b]->size * sizeof(__u32);
+		point = (char *)v + crush_work_align(point - (char *)v);
 	}
 	BUG_ON((char *)point - (char *)w != m->working_size);
 }
 
-/**
- * crush_do_rule - calculate a mapping with the given input and rule
- * @map: the crush_map
- * @ruleno: the rule id
- * @x: hash input
- * @result: pointer to result vector
- * @result_max: maximum result size
- * @weight: weight vector (for map leaves)
- * @weight_max: size of weight vector
- * @cwin: Pointer to at least map->working_size bytes of memory or NULL.
+/*
+ * The tunables a rule starts with before any CRUSH_RULE_SET_* step
+ * overrides them. They only depend on the map and can be derived
+ * once for any number of inputs.
  */
-int crush_do_rule(const struct crush_map *map,
-		  int ruleno, int x, int *result, int result_max,
-		  const __u32 *weight, int weight_max,
-		  void *cwin)
+struct crush_rule_tunables {
+	int choose_tries;
+	int choose_leaf_tries;
+	int choose_local_retries;
+	int choose_local_fallback_retries;
+	int vary_r;
+	int stable;
+};
+
+static void crush_init_rule_tunables(const struct crush_map *map,
+				     struct crush_rule_tunables *t)
+{
+	/*
+	 * the original choose_total_tries value was off by one (it
+	 * counted "retries" and not "tries").  add one.
+	 */
+	t->choose_tries = map->choose_total_tries + 1;
+	t->choose_leaf_tries = 0;
+	/*
+	 * the local tries values were counted as "retries", though,
+	 * and need no adjustment
+	 */
+	t->choose_local_retries = map->choose_local_tries;
+	t->choose_local_fallback_retries = map->choose_local_fallback_tries;
+
+	t->vary_r = map->chooseleaf_vary_r;
+	t->stable = map->chooseleaf_stable;
+}
+
+static int crush_valid_take(const struct crush_map *map, int arg1)
+{
+	return (arg1 >= 0 && arg1 < map->max_devices) ||
+		(-1-arg1 >= 0 && -1-arg1 < map->max_buckets &&
+		 map->buckets[-1-arg1]);
+}
+
+/*
+ * true if every TAKE step of @rule designates an existing item, in
+ * which case crush_rule_map() does not need to check them again.
+ */
+static int crush_rule_takes_valid(const struct crush_map *map,
+				  const struct crush_rule *rule)
+{
+	__u32 step;
+
+	for (step = 0; step < rule->len; step++)
+		if (rule->steps[step].op == CRUSH_RULE_TAKE &&
+		    !crush_valid_take(map, rule->steps[step].arg1))
+			return 0;
+	return 1;
+}
+
+static const struct crush_rule *crush_get_rule(const struct crush_map *map,
+					       int ruleno)
+{
+	if ((__u32)ruleno >= map->max_rules || !map->rules[ruleno]) {
+		dprintk(" bad ruleno %d\n", ruleno);
+		return NULL;
+	}
+	return map->rules[ruleno];
+}
+
+/*
+ * crush_rule_map - run the steps of @rule for a single input @x
+ *
+ * @tunables are the values derived by crush_init_rule_tunables() and
+ * are not modified. If @takes_valid is set, the caller checked all
+ * TAKE steps with crush_rule_takes_valid().
+ */
+static int crush_rule_map(const struct crush_map *map,
+			  const struct crush_rule *rule,
+			  const struct crush_rule_tunables *tunables,
+			  int takes_valid,
+			  int x, int *result, int result_max,
+			  const __u32 *weight, int weight_max,
+			  struct crush_work *cw,
+			  const struct crush_choose_arg *choose_args)
 {
 	int result_len;
-	struct crush_work *cw = cwin;
 	int *a = (int *)((char *)cw + map->working_size);
 	int *b = a + result_max;
 	int *c = b + result_max;
@@ -867,33 +1230,20 @@ int crush_do_rule(const struct crush_map *map,
 	int wsize = 0;
 	int osize;
 	int *tmp;
-	const struct crush_rule *rule;
 	__u32 step;
 	int i, j;
 	int numrep;
 	int out_size;
-	/*
-	 * the original choose_total_tries value was off by one (it
-	 * counted "retries" and not "tries").  add one.
-	 */
-	int choose_tries = map->choose_total_tries + 1;
-	int choose_leaf_tries = 0;
-	/*
-	 * the local tries values were counted as "retries", though,
-	 * and need no adjustment
-	 */
-	int choose_local_retries = map->choose_local_tries;
-	int choose_local_fallback_retries = map->choose_local_fallback_tries;
+	int choose_tries = tunables->choose_tries;
+	int choose_leaf_tries = tunables->choose_leaf_tries;
+	int choose_local_retries = tunables->choose_local_retries;
+	int choose_local_fallback_retries =
+		tunables->choose_local_fallback_retries;
 
-	int vary_r = map->chooseleaf_vary_r;
-	int stable = map->chooseleaf_stable;
+	int vary_r = tunables->vary_r;
+	int stable = tunables->stable;
 
-	if ((__u32)ruleno >= map->max_rules) {
-		dprintk(" bad ruleno %d\n", ruleno);
-		return 0;
-	}
-
-	rule = map->rules[ruleno];
+	crush_stat(cw, mappings);
 	result_len = 0;
 
 	for (step = 0; step < rule->len; step++) {
@@ -902,18 +1252,13 @@ int crush_do_rule(const struct crush_map *map,
 
 		switch (curstep->op) {
 		case CRUSH_RULE_TAKE:
-			if ((curstep->arg1 >= 0 &&
-			     curstep->arg1 < map->max_devices) ||
-			    (-1-curstep->arg1 >= 0 &&
-			     -1-curstep->arg1 < map->max_buckets &&
-			     map->buckets[-1-curstep->arg1])) {
+			if (takes_valid || crush_valid_take(map, curstep->arg1)) {
 				w[0] = curstep->arg1;
 				wsize = 1;
 			} else {
 				dprintk(" bad take value %d\n", curstep->arg1);
 			}
 			break;
-
 		case CRUSH_RULE_SET_CHOOSE_TRIES:
 			if (curstep->arg1 > 0)
 				choose_tries = curstep->arg1;
@@ -1009,7 +1354,8 @@ int crush_do_rule(const struct crush_map *map,
 						vary_r,
 						stable,
 						c+osize,
-						0);
+						0,
+						choose_args);
 				} else {
 					out_size = ((numrep < (result_max-osize)) ?
 						    numrep : (result_max-osize));
@@ -1026,7 +1372,8 @@ int crush_do_rule(const struct crush_map *map,
 						   choose_leaf_tries : 1,
 						recurse_to_leaf,
 						c+osize,
-						0);
+						0,
+						choose_args);
 					osize += out_size;
 				}
 			}
@@ -1060,3 +1407,418 @@ int crush_do_rule(const struct crush_map *map,
 
 	return result_len;
 }
+
+/**
+ * crush_do_rule - calculate a mapping with the given input and rule
+ * @map: the crush_map
+ * @ruleno: the rule id
+ * @x: hash input
+ * @result: pointer to result vector
+ * @result_max: maximum result size
+ * @weight: weight vector (for map leaves)
+ * @weight_max: size of weight vector
+ * @cwin: Pointer to at least map->working_size bytes of memory or NULL.
+ * @choose_args: weights and ids to use instead of those of the buckets, or NULL
+ */
+int crush_do_rule(const struct crush_map *map,
+		  int ruleno, int x, int *result, int result_max,
+		  const __u32 *weight, int weight_max,
+		  void *cwin, const struct crush_choose_arg *choose_args)
+{
+	const struct crush_rule *rule;
+	struct crush_rule_tunables tunables;
+
+	rule = crush_get_rule(map, ruleno);
+	if (!rule)
+		return 0;
+
+	crush_init_rule_tunables(map, &tunables);
+	crush_stats_rule(cwin, ruleno);
+	return crush_rule_map(map, rule, &tunables, 0,
+			      x, result, result_max,
+			      weight, weight_max, cwin, choose_args);
+}
+
+/**
+ * crush_do_rule_batch - calculate the mappings of many inputs
+ * @map: the crush_map
+ * @ruleno: the rule id
+ * @x: array of @x_count hash inputs
+ * @x_count: number of inputs
+ * @result: result matrix, row i holds the mapping of x[i]
+ * @result_max: maximum result size of each row
+ * @result_stride: distance, in items, between two rows of @result
+ * @result_len: array of @x_count result sizes, or NULL
+ * @weight: weight vector (for map leaves)
+ * @weight_max: size of weight vector
+ * @cwin: workspace of crush_work_size(@map, @result_max) bytes
+ * @choose_args: weights and ids to use instead of those of the buckets, or NULL
+ */
+int crush_do_rule_batch(const struct crush_map *map,
+			int ruleno, const int *x, int x_count,
+			int *result, int result_max, int result_stride,
+			int *result_len,
+			const __u32 *weight, int weight_max,
+			void *cwin, const struct crush_choose_arg *choose_args)
+{
+	const struct crush_rule *rule;
+	struct crush_rule_tunables tunables;
+	int takes_valid;
+	int i, len;
+
+	if (result_stride < result_max) {
+		dprintk(" bad result_stride %d\n", result_stride);
+		return 0;
+	}
+	rule = crush_get_rule(map, ruleno);
+	if (!rule)
+		return 0;
+
+	crush_init_rule_tunables(map, &tunables);
+	takes_valid = crush_rule_takes_valid(map, rule);
+	crush_stats_rule(cwin, ruleno);
+
+	for (i = 0; i < x_count; i++) {
+		len = crush_rule_map(map, rule, &tunables, takes_valid,
+				     x[i], result, result_max,
+				     weight, weight_max, cwin, choose_args);
+		if (result_len)
+			result_len[i] = len;
+		result += result_stride;
+	}
+	return x_count;
+}
+
+#ifndef __KERNEL__
+void crush_set_choose_tries(void *cwin, __u32 *choose_tries, unsigned int size)
+{
+	struct crush_work *w = (struct crush_work *)cwin;
+
+	w->choose_tries = choose_tries;
+	w->choose_tries_size = choose_tries ? size : 0;
+}
+
+void crush_merge_choose_tries(__u32 *total, const __u32 *choose_tries,
+			      unsigned int size)
+{
+	unsigned int i;
+
+	for (i = 0; i < size; i++)
+		total[i] += choose_tries[i];
+}
+
+void crush_set_track_visited(void *cwin, int track)
+{
+	struct crush_work *w = (struct crush_work *)cwin;
+
+	if (track)
+		w->track |= CRUSH_TRACK_VISITED;
+	else
+		w->track &= ~CRUSH_TRACK_VISITED;
+	w->visited = 0;
+}
+
+__u64 crush_take_visited(void *cwin)
+{
+	struct crush_work *w = (struct crush_work *)cwin;
+	__u64 visited = w->visited;
+
+	w->visited = 0;
+	return visited;
+}
+
+struct crush_weight_summary *crush_make_weight_summary(const __u32 *weights,
+						       int weight_max)
+{
+	struct crush_weight_summary *summary;
+	size_t words = (weight_max + 63) / 64;
+	int i;
+
+	if (weight_max < 0)
+		return NULL;
+	summary = malloc(sizeof(*summary) + words * sizeof(__u64));
+	if (!summary)
+		return NULL;
+	summary->weights = weights;
+	summary->weight_max = weight_max;
+	summary->reweighted = 0;
+	summary->bits = (__u64 *)(summary + 1);
+	memset(summary->bits, 0, words * sizeof(__u64));
+	for (i = 0; i < weight_max; i++)
+		if (weights[i] < 0x10000) {
+			summary->bits[i >> 6] |= 1ULL << (i & 63);
+			summary->reweighted++;
+		}
+	return summary;
+}
+
+void crush_update_weight_summary(struct crush_weight_summary *summary,
+				 int device)
+{
+	__u64 bit = 1ULL << (device & 63);
+	__u64 *word = &summary->bits[device >> 6];
+
+	if (*word & bit)
+		summary->reweighted--;
+	*word &= ~bit;
+	if (summary->weights[device] < 0x10000) {
+		*word |= bit;
+		summary->reweighted++;
+	}
+}
+
+void crush_destroy_weight_summary(struct crush_weight_summary *summary)
+{
+	free(summary);
+}
+
+void crush_set_weight_summary(void *cwin,
+			      const struct crush_weight_summary *summary)
+{
+	struct crush_work *w = (struct crush_work *)cwin;
+
+	w->weight_summary = summary;
+}
+
+struct crush_plan *crush_compile_rule(const struct crush_map *map,
+				      int ruleno, int result_max)
+{
+	const struct crush_rule *rule;
+	struct crush_rule_tunables t;
+	struct crush_plan *plan;
+	struct crush_plan_step *s;
+	__u32 step;
+
+	/* a TAKE step stores its item in the scratch vector */
+	if (result_max < 1)
+		return NULL;
+	rule = crush_get_rule(map, ruleno);
+	if (!rule)
+		return NULL;
+	plan = malloc(sizeof(*plan) + rule->len * sizeof(plan->steps[0]));
+	if (!plan)
+		return NULL;
+	plan->map = map;
+	plan->ruleno = ruleno;
+	plan->result_max = result_max;
+	plan->len = 0;
+
+	crush_init_rule_tunables(map, &t);
+	for (step = 0; step < rule->len; step++) {
+		const struct crush_rule_step *curstep = &rule->steps[step];
+
+		switch (curstep->op) {
+		case CRUSH_RULE_TAKE:
+			/* a bad take leaves the working vector as is */
+			if (!crush_valid_take(map, curstep->arg1)) {
+				dprintk(" bad take value %d\n", curstep->arg1);
+				break;
+			}
+			s = &plan->steps[plan->len++];
+			memset(s, 0, sizeof(*s));
+			s->op = CRUSH_PLAN_TAKE;
+			s->arg = curstep->arg1;
+			break;
+
+		case CRUSH_RULE_SET_CHOOSE_TRIES:
+			if (curstep->arg1 > 0)
+				t.choose_tries = curstep->arg1;
+			break;
+
+		case CRUSH_RULE_SET_CHOOSELEAF_TRIES:
+			if (curstep->arg1 > 0)
+				t.choose_leaf_tries = curstep->arg1;
+			break;
+
+		case CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES:
+			if (curstep->arg1 >= 0)
+				t.choose_local_retries = curstep->arg1;
+			break;
+
+		case CRUSH_RULE_SET_CHOOSE_LOCAL_FALLBACK_TRIES:
+			if (curstep->arg1 >= 0)
+				t.choose_local_fallback_retries = curstep->arg1;
+			break;
+
+		case CRUSH_RULE_SET_CHOOSELEAF_VARY_R:
+			if (curstep->arg1 >= 0)
+				t.vary_r = curstep->arg1;
+			break;
+
+		case CRUSH_RULE_SET_CHOOSELEAF_STABLE:
+			if (curstep->arg1 >= 0)
+				t.stable = curstep->arg1;
+			break;
+
+		case CRUSH_RULE_CHOOSELEAF_FIRSTN:
+		case CRUSH_RULE_CHOOSE_FIRSTN:
+		case CRUSH_RULE_CHOOSELEAF_INDEP:
+		case CRUSH_RULE_CHOOSE_INDEP:
+			s = &plan->steps[plan->len++];
+			memset(s, 0, sizeof(*s));
+			s->arg = curstep->arg2;
+			s->recurse_to_leaf =
+				curstep->op == CRUSH_RULE_CHOOSELEAF_FIRSTN ||
+				curstep->op == CRUSH_RULE_CHOOSELEAF_INDEP;
+			s->numrep = curstep->arg1;
+			if (s->numrep <= 0)
+				s->numrep += result_max;
+			/*
+			 * with no replica the step only clears the
+			 * working vector, see crush_rule_map()
+			 */
+			if (s->numrep < 0)
+				s->numrep = 0;
+			s->tries = t.choose_tries;
+			if (curstep->op == CRUSH_RULE_CHOOSELEAF_FIRSTN ||
+			    curstep->op == CRUSH_RULE_CHOOSE_FIRSTN) {
+				s->op = CRUSH_PLAN_CHOOSE_FIRSTN;
+				if (t.choose_leaf_tries)
+					s->recurse_tries = t.choose_leaf_tries;
+				else if (map->chooseleaf_descend_once)
+					s->recurse_tries = 1;
+				else
+					s->recurse_tries = t.choose_tries;
+				s->local_retries = t.choose_local_retries;
+				s->local_fallback_retries =
+					t.choose_local_fallback_retries;
+				s->vary_r = t.vary_r;
+				s->stable = t.stable;
+			} else {
+				s->op = CRUSH_PLAN_CHOOSE_INDEP;
+				s->recurse_tries = t.choose_leaf_tries ?
+					t.choose_leaf_tries : 1;
+			}
+			break;
+
+		case CRUSH_RULE_EMIT:
+			s = &plan->steps[plan->len++];
+			memset(s, 0, sizeof(*s));
+			s->op = CRUSH_PLAN_EMIT;
+			break;
+
+		default:
+			dprintk(" unknown op %d at step %d\n",
+				curstep->op, step);
+			break;
+		}
+	}
+	return plan;
+}
+
+int crush_do_plan(const struct crush_plan *plan,
+		  int x, int *result,
+		  const __u32 *weight, int weight_max,
+		  void *cwin, const struct crush_choose_arg *choose_args)
+{
+	const struct crush_map *map = plan->map;
+	const int result_max = plan->result_max;
+	struct crush_work *cw = cwin;
+	int result_len = 0;
+	int *a = (int *)((char *)cw + map->working_size);
+	int *b = a + result_max;
+	int *c = b + result_max;
+	int *w = a;
+	int *o = b;
+	int wsize = 0;
+	int osize;
+	int step;
+	int i;
+	int out_size;
+
+	crush_stats_rule(cw, plan->ruleno);
+	crush_stat(cw, mappings);
+	for (step = 0; step < plan->len; step++) {
+		const struct crush_plan_step *s = &plan->steps[step];
+
+		switch (s->op) {
+		case CRUSH_PLAN_TAKE:
+			w[0] = s->arg;
+			wsize = 1;
+			break;
+
+		case CRUSH_PLAN_CHOOSE_FIRSTN:
+		case CRUSH_PLAN_CHOOSE_INDEP:
+			if (wsize == 0)
+				break;
+			osize = 0;
+			for (i = 0; s->numrep > 0 && i < wsize; i++) {
+				int bno = -1 - w[i];
+
+				if (bno < 0 || bno >= map->max_buckets) {
+					dprintk("  bad w[i] %d\n", w[i]);
+					continue;
+				}
+				if (s->op == CRUSH_PLAN_CHOOSE_FIRSTN) {
+					osize += crush_choose_firstn(
+						map, cw, map->buckets[bno],
+						weight, weight_max,
+						x, s->numrep, s->arg,
+						o+osize, 0,
+						result_max-osize,
+						s->tries,
+						s->recurse_tries,
+						s->local_retries,
+						s->local_fallback_retries,
+						s->recurse_to_leaf,
+						s->vary_r,
+						s->stable,
+						c+osize,
+						0,
+						choose_args);
+				} else {
+					out_size = crush_plan_indep_size(
+						s, result_max, osize);
+					crush_choose_indep(
+						map, cw, map->buckets[bno],
+						weight, weight_max,
+						x, out_size, s->numrep, s->arg,
+						o+osize, 0,
+						s->tries,
+						s->recurse_tries,
+						s->recurse_to_leaf,
+						c+osize,
+						0,
+						choose_args);
+					osize += out_size;
+				}
+			}
+			crush_plan_chosen(s, &w, &wsize, &o, c, osize);
+			break;
+
+		case CRUSH_PLAN_EMIT:
+			result_len = crush_plan_emit(result, result_len,
+						     result_max, w, wsize);
+			wsize = 0;
+			break;
+		}
+	}
+	return result_len;
+}
+
+void crush_destroy_plan(struct crush_plan *plan)
+{
+	free(plan);
+}
+
+int crush_lane_choose_item(struct crush_work *work,
+			   const struct crush_bucket *in,
+			   int x, int r,
+			   unsigned int flocal,
+			   unsigned int local_fallback_retries,
+			   const struct crush_choose_arg *choose_args,
+			   int position)
+{
+	return crush_choose_item(work, in, x, r, flocal,
+				 local_fallback_retries, choose_args,
+				 position);
+}
+
+int crush_lane_is_out(const struct crush_map *map,
+		      const struct crush_work *work,
+		      const __u32 *weight, int weight_max,
+		      int item, int x)
+{
+	return is_out(map, work, weight, weight_max, item, x);
+}
+#endif
@@ -10,7 +10,27 @@
 
 #include "crush.h"
 
+/** @ingroup API
+ *
+ * Return the lowest rule of __map__ whose mask has the __ruleset__ and
+ * the __type__ and accepts __size__ items, i.e. __min_size__ <=
+ * __size__ <= __max_size__.
+ *
+ * crush_finalize() indexes the rule masks so that the lookup only
+ * compares the types of the masks of __ruleset__, usually one, instead
+ * of scanning all the rules of the map. A rule added by
+ * crush_add_rule() releases the index: the rules are then scanned
+ * until crush_finalize() is called again.
+ *
+ * @param map the crush_map
+ * @param ruleset the ruleset of the rule, see crush_make_rule()
+ * @param type the type of the rule
+ * @param size the number of items to map
+ *
+ * @returns the rule identifier or -1 if no rule matches
+ */
 extern int crush_find_rule(const struct crush_map *map, int ruleset, int type, int size);
+
 /** @ingroup API
  *
  * Map __x__ to __result_max__ items and store them in the __result__
@@ -60,6 +80,13 @@ extern int crush_find_rule(const struct crush_map *map, int ruleset, int type, i
  *         char __cwin__[crush_work_size(__map__, __result_max__)];
  *         crush_init_workspace(__map__, __cwin__);
  *
+ * If __choose_args__ is not NULL, it is an array of __map->max_buckets__
+ * crush_choose_arg indexed like __map->buckets__, for instance
+ * allocated with crush_make_choose_args(). The straw2 buckets draw
+ * their items with the weights and ids it provides instead of their
+ * own, see crush_choose_arg. The __map__ is not modified and can be
+ * shared by threads mapping with different __choose_args__.
+ *
  * @param map the crush_map
  * @param ruleno a positive integer < __CRUSH_MAX_RULES__
  * @param x the value to map to __result_max__ items
@@ -68,6 +95,7 @@ extern int crush_find_rule(const struct crush_map *map, int ruleset, int type, i
  * @param weights an array of weights of size __weight_max__
  * @param weight_max the size of the __weights__ array
  * @param cwin must be the value of crush_work_size(__map__, __result_max__)
+ * @param choose_args an array of __map->max_buckets__ crush_choose_arg or NULL
  *
  * @return 0 on error or the size of __result__ on success
  */
@@ -75,7 +103,345 @@ extern int crush_do_rule(const struct crush_map *map,
 			 int ruleno,
 			 int x, int *result, int result_max,
 			 const __u32 *weights, int weight_max,
-			 void *cwin);
+			 void *cwin, const struct crush_choose_arg *choose_args);
+/** @ingroup API
+ *
+ * Map each of the __x_count__ values of the __x__ array with the rule
+ * __ruleno__, as crush_do_rule() would. The rule and the tunables of
+ * the __map__ are decoded once for the whole batch.
+ *
+ * The items for __x[i]__ are stored in the __result_max__ first
+ * elements of the __result__ row starting at
+ * __result[i * result_stride]__ and the number of items in that row is
+ * stored in __result_len[i]__. For example, with __result_max__ == 3 and
+ * __result_stride__ == 4:
+ *
+ *     crush_do_rule_batch(map, ruleno, x, x_count=2, result, 3, 4, len, ...)
+ *     result[0..2] is the mapping of x[0], len[0] its size
+ *     result[3] is not modified
+ *     result[4..6] is the mapping of x[1], len[1] its size
+ *
+ * The __cwin__ workspace is the same as for crush_do_rule() and must
+ * be at least crush_work_size(__map__, __result_max__) bytes long. It
+ * is reused for every input of the batch.
+ *
+ * @param map the crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param x an array of __x_count__ values to map
+ * @param x_count the size of the __x__ array
+ * @param result a matrix of __x_count__ rows of __result_stride__ items
+ * @param result_max the maximum number of items in a row
+ * @param result_stride the number of items between two rows, >= __result_max__
+ * @param result_len an array of __x_count__ row sizes or NULL
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param cwin must be the value of crush_work_size(__map__, __result_max__)
+ * @param choose_args an array of __map->max_buckets__ crush_choose_arg or NULL, see crush_do_rule()
+ *
+ * @return 0 on error or __x_count__ on success
+ */
+extern int crush_do_rule_batch(const struct crush_map *map,
+			       int ruleno,
+			       const int *x, int x_count,
+			       int *result, int result_max, int result_stride,
+			       int *result_len,
+			       const __u32 *weights, int weight_max,
+			       void *cwin,
+			       const struct crush_choose_arg *choose_args);
+
+#ifndef __KERNEL__
+/** @ingroup API
+ *
+ * Count in __choose_tries__ the tries needed by crush_do_rule() to
+ * choose each item when using the workspace __cwin__: if an item is
+ * chosen after n failed tries, __choose_tries[n]__ is incremented,
+ * provided n < __size__. The counts are only written by the thread
+ * using __cwin__ and the histograms of several workspaces can be
+ * added with crush_merge_choose_tries(). A NULL __choose_tries__
+ * stops counting, which is the default after crush_init_workspace().
+ *
+ * The __choose_tries__ array is owned by the caller and must remain
+ * valid for as long as it is set in __cwin__. A __size__ of
+ * __map->choose_total_tries__ + 1 is enough unless a rule raises the
+ * number of tries with a ::CRUSH_RULE_SET_CHOOSE_TRIES step.
+ *
+ * @param cwin a workspace initialized with crush_init_workspace()
+ * @param choose_tries an array of __size__ counts or NULL
+ * @param size the size of __choose_tries__
+ */
+extern void crush_set_choose_tries(void *cwin, __u32 *choose_tries,
+				   unsigned int size);
+/** @ingroup API
+ *
+ * Add the __size__ counts of __choose_tries__ to __total__, for
+ * instance to merge the histograms of crush_set_choose_tries()
+ * collected by several threads.
+ *
+ * @param total the histogram to add to
+ * @param choose_tries the histogram to add
+ * @param size the size of both histograms
+ */
+extern void crush_merge_choose_tries(__u32 *total, const __u32 *choose_tries,
+				     unsigned int size);
+
+/** @ingroup API
+ *
+ * The bit of the bucket __id__ in the masks returned by
+ * crush_take_visited(). Buckets whose index are equal modulo 64 share
+ * the same bit.
+ *
+ * @param id a bucket id, < 0
+ *
+ * @returns a mask with a single bit set
+ */
+static inline __u64 crush_visited_bit(int id)
+{
+	return 1ULL << ((-1-id) & 63);
+}
+/** @ingroup API
+ *
+ * Start recording, if __track__ is not zero, or stop recording the
+ * buckets crush_do_rule() chooses from when using the workspace
+ * __cwin__, see crush_take_visited(). The record is cleared. A
+ * workspace does not record them after crush_init_workspace(), which
+ * saves a store on each choice.
+ *
+ * @param cwin a workspace initialized with crush_init_workspace()
+ * @param track 1 to record the buckets, 0 to stop
+ */
+extern void crush_set_track_visited(void *cwin, int track);
+
+/** @ingroup API
+ *
+ * Return the crush_visited_bit() of all the buckets crush_do_rule()
+ * chose from when using the workspace __cwin__ since the previous call
+ * or crush_set_track_visited(), and clear them. An input whose mask does
+ * not intersect the mask of the buckets modified since it was mapped
+ * is mapped to the same items, which is cheaper to check than mapping
+ * it again.
+ *
+ * @param cwin a workspace initialized with crush_init_workspace()
+ *
+ * @returns a mask of crush_visited_bit()
+ */
+extern __u64 crush_take_visited(void *cwin);
+
+/** @ingroup API
+ *
+ * Which devices of a weight vector are not fully in, so that mapping
+ * with it tests a bit instead of loading a weight for each device
+ * considered. It is built by crush_make_weight_summary() and can be
+ * shared by the workspaces of many threads.
+ */
+struct crush_weight_summary {
+	const __u32 *weights;	/*!< the weight vector summarized */
+	int weight_max;		/*!< the size of the __weights__ array */
+	int reweighted;		/*!< the number of weights < 0x10000 */
+	__u64 *bits;		/*!< bit i is set if weights[i] < 0x10000 */
+};
+
+/** @ingroup API
+ *
+ * Summarize the __weight_max__ __weights__ in a single allocation. The
+ * __weights__ array is owned by the caller, must remain valid for as
+ * long as the summary is used and crush_update_weight_summary() must
+ * be called when one of its weights is modified.
+ *
+ * @param weights the weight vector given to crush_do_rule()
+ * @param weight_max the size of the __weights__ array
+ *
+ * @returns a summary to be released with crush_destroy_weight_summary() or NULL if __malloc(3)__ fails
+ */
+extern struct crush_weight_summary *crush_make_weight_summary(const __u32 *weights,
+							      int weight_max);
+
+/** @ingroup API
+ *
+ * Update __summary__ after the weight of __device__ was modified.
+ *
+ * @param summary the value returned by crush_make_weight_summary()
+ * @param device a device < __summary->weight_max__
+ */
+extern void crush_update_weight_summary(struct crush_weight_summary *summary,
+					int device);
+
+/** @ingroup API
+ *
+ * Release a __summary__ returned by crush_make_weight_summary().
+ *
+ * @param summary the summary or NULL
+ */
+extern void crush_destroy_weight_summary(struct crush_weight_summary *summary);
+
+/** @ingroup API
+ *
+ * Use __summary__ when mapping with its weight vector and the
+ * workspace __cwin__: crush_do_rule(), crush_do_rule_batch() and
+ * crush_do_plan() then know that a device whose bit is clear is in
+ * without loading its weight and, if no device is reweighted, only
+ * compare a device with the size of the vector. Mapping with another
+ * weight vector, or with a different size, does not use __summary__.
+ * A NULL __summary__, the default after crush_init_workspace(), stops
+ * using it. The mappings are the same with or without a summary.
+ *
+ * @param cwin a workspace initialized with crush_init_workspace()
+ * @param summary the value returned by crush_make_weight_summary() or NULL
+ */
+extern void crush_set_weight_summary(void *cwin,
+				     const struct crush_weight_summary *summary);
+
+/** @ingroup API
+ *
+ * The operation of a ::crush_plan_step.
+ */
+enum crush_plan_op {
+	/*! the working vector is set to the item __arg__ */
+	CRUSH_PLAN_TAKE = 0,
+	/*! like ::CRUSH_RULE_CHOOSE_FIRSTN or ::CRUSH_RULE_CHOOSELEAF_FIRSTN */
+	CRUSH_PLAN_CHOOSE_FIRSTN = 1,
+	/*! like ::CRUSH_RULE_CHOOSE_INDEP or ::CRUSH_RULE_CHOOSELEAF_INDEP */
+	CRUSH_PLAN_CHOOSE_INDEP = 2,
+	/*! like ::CRUSH_RULE_EMIT */
+	CRUSH_PLAN_EMIT = 3,
+};
+
+/** @ingroup API
+ *
+ * A step of a ::crush_plan. The tunables in effect at this step of the
+ * rule and the number of replicas are resolved when the plan is
+ * compiled.
+ */
+struct crush_plan_step {
+	int op;			/*!< a ::crush_plan_op */
+	int arg;		/*!< the item to take or the type to choose */
+	int numrep;		/*!< the number of replicas, >= 0, a rule argument <= 0 being resolved against __result_max__ */
+	int recurse_to_leaf;	/*!< true for CHOOSELEAF steps */
+	unsigned int tries;
+	unsigned int recurse_tries;
+	unsigned int local_retries;
+	unsigned int local_fallback_retries;
+	unsigned int vary_r;
+	unsigned int stable;
+};
+
+/** @ingroup API
+ *
+ * A rule compiled by crush_compile_rule() for one __map__ and one
+ * __result_max__. It is immutable and can be shared by threads, each
+ * with its own workspace.
+ */
+struct crush_plan {
+	const struct crush_map *map;	/*!< the map the plan was compiled for */
+	int ruleno;			/*!< the rule the plan was compiled from */
+	int result_max;			/*!< the size of the result */
+	int len;			/*!< the number of steps */
+	struct crush_plan_step steps[0];
+};
+
+/** @ingroup API
+ *
+ * Compile the rule __ruleno__ of __map__ into a plan that
+ * crush_do_plan() runs with the same result as crush_do_rule() with
+ * the same __result_max__. The __CRUSH_RULE_SET_*__ steps are folded
+ * into the choose steps that follow them, __TAKE__ steps are checked
+ * and the number of replicas is resolved against __result_max__.
+ *
+ * The plan must be compiled again if the rules or the tunables of the
+ * __map__ change, or if a bucket used by a TAKE step is removed.
+ * Changes to the buckets themselves do not require a new plan.
+ *
+ * The plan must be deallocated with crush_destroy_plan().
+ *
+ * @param map the crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param result_max the size of the result passed to crush_do_plan(), > 0
+ *
+ * @returns a plan or NULL if __ruleno__ does not exist or on error
+ */
+extern struct crush_plan *crush_compile_rule(const struct crush_map *map,
+					     int ruleno, int result_max);
+
+/** @ingroup API
+ *
+ * Map __x__ to at most __plan->result_max__ items stored in
+ * __result__, as crush_do_rule() would with the rule the __plan__ was
+ * compiled from.
+ *
+ * @param plan the value returned by crush_compile_rule()
+ * @param x the value to map to __plan->result_max__ items
+ * @param result an array of items of size __plan->result_max__
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param cwin must be the value of crush_work_size(__plan->map__, __plan->result_max__)
+ * @param choose_args an array of __plan->map->max_buckets__ crush_choose_arg or NULL, see crush_do_rule()
+ *
+ * @return the size of __result__
+ */
+extern int crush_do_plan(const struct crush_plan *plan,
+			 int x, int *result,
+			 const __u32 *weights, int weight_max,
+			 void *cwin, const struct crush_choose_arg *choose_args);
+
+/** @ingroup API
+ *
+ * Return the size of the workspace of crush_do_plan_interleaved() for
+ * __plan__. It is initialized with crush_init_workspace(plan->map, cwin).
+ *
+ * @param plan the value returned by crush_compile_rule()
+ *
+ * @returns the size of the workspace in bytes
+ */
+extern size_t crush_interleave_work_size(const struct crush_plan *plan);
+
+/** @ingroup API
+ *
+ * Map each of the __x_count__ values of the __x__ array with the
+ * __plan__, as crush_do_plan() would, and store them like
+ * crush_do_rule_batch(): row i of the __result__ matrix holds the
+ * mapping of __x[i]__ and __result_len[i]__ its size.
+ *
+ * Eight inputs are mapped at a time, interleaved: before reading a
+ * bucket or a weight, the mapping of an input prefetches it and the
+ * next input runs while it is loaded. On maps that do not fit in the
+ * cache, the loads of the descents of several inputs overlap instead
+ * of stalling each descent in turn. On smaller maps, crush_do_plan()
+ * is as fast or faster.
+ *
+ * The inputs share the workspace: the permutation a uniform bucket,
+ * or the exhaustive search of a rule with local fallback retries,
+ * draws from is restarted each time an input uses the bucket after
+ * another. The mappings are the same but such rules gain little from
+ * interleaving.
+ *
+ * @param plan the value returned by crush_compile_rule()
+ * @param x an array of __x_count__ values to map
+ * @param x_count the size of the __x__ array
+ * @param result a matrix of __x_count__ rows of __result_stride__ items
+ * @param result_stride the number of items between two rows, >= __plan->result_max__
+ * @param result_len an array of __x_count__ row sizes or NULL
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param cwin must be the value of crush_interleave_work_size(__plan__)
+ * @param choose_args an array of __plan->map->max_buckets__ crush_choose_arg or NULL, see crush_do_rule()
+ *
+ * @return 0 on error or __x_count__ on success
+ */
+extern int crush_do_plan_interleaved(const struct crush_plan *plan,
+				     const int *x, int x_count,
+				     int *result, int result_stride,
+				     int *result_len,
+				     const __u32 *weights, int weight_max,
+				     void *cwin,
+				     const struct crush_choose_arg *choose_args);
+
+/** @ingroup API
+ *
+ * Deallocate a __plan__ returned by crush_compile_rule().
+ *
+ * @param plan the plan to deallocate, may be NULL
+ */
+extern void crush_destroy_plan(struct crush_plan *plan);
+#endif
 
 /* Returns the exact amount of workspace that will need to be used
    for a given combination of crush_map and result_max. The caller can
@@ -0,0 +1,287 @@
+/*
+ * Map a range of inputs with a pool of threads.
+ *
+ * The range is cut in chunks and a shared counter designates the next
+ * chunk: each thread increments it to take a chunk, maps it with its
+ * own workspace and takes another one until none is left. The chunks
+ * are large enough for the counter to be rarely contended and the
+ * threads write to disjoint rows of the result matrix.
+ *
+ * The threads are those of a crush_pool, which crush_diff and
+ * crush_balance() also use: they are created once and wait for the
+ * next run on a condition variable.
+ *
+ * LGPL2
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "crush_compat.h"
+#include "crush.h"
+#include "mapper.h"
+#include "context.h"
+#include "parallel.h"
+
+struct pool_thread {
+	struct crush_pool *pool;
+	pthread_t thread;
+	int worker;
+};
+
+struct crush_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t start;	/* a run begins or the pool is destroyed */
+	pthread_cond_t done;	/* the last worker of a run returned */
+	int threads;
+	int started;		/* the threads created, the caller included */
+	__u64 generation;	/* the number of runs */
+	int running;		/* the created threads still in the run */
+	int stop;
+	void (*run)(void *arg, int worker);
+	void *arg;
+	struct pool_thread *slots;
+};
+
+static void *pool_thread(void *arg)
+{
+	struct pool_thread *slot = arg;
+	struct crush_pool *pool = slot->pool;
+	__u64 generation = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && pool->generation == generation)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->stop)
+			break;
+		generation = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+		pool->run(pool->arg, slot->worker);
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->running)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct crush_pool *crush_pool_create(int threads, int jobs)
+{
+	struct crush_pool *pool;
+
+	if (threads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if (threads > jobs)
+		threads = jobs > 0 ? jobs : 1;
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->slots = calloc(threads, sizeof(*pool->slots));
+	if (!pool->slots) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->threads = threads;
+	/* the calling thread is the first worker */
+	for (pool->started = 1; pool->started < threads; pool->started++) {
+		struct pool_thread *slot = &pool->slots[pool->started];
+
+		slot->pool = pool;
+		slot->worker = pool->started;
+		if (pthread_create(&slot->thread, NULL, pool_thread, slot))
+			break;
+	}
+	return pool;
+}
+
+void crush_pool_destroy(struct crush_pool *pool)
+{
+	int t;
+
+	if (!pool)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (t = 1; t < pool->started; t++)
+		pthread_join(pool->slots[t].thread, NULL);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->slots);
+	free(pool);
+}
+
+int crush_pool_threads(const struct crush_pool *pool)
+{
+	return pool->threads;
+}
+
+void crush_pool_run(struct crush_pool *pool,
+		    void (*run)(void *arg, int worker), void *arg)
+{
+	int t;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->run = run;
+	pool->arg = arg;
+	pool->running = pool->started - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	run(arg, 0);
+	/* the workers whose thread could not be created */
+	for (t = pool->started; t < pool->threads; t++)
+		run(arg, t);
+	pthread_mutex_lock(&pool->lock);
+	while (pool->running)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void crush_chunks_init(struct crush_chunks *chunks, int count, int size)
+{
+	chunks->count = count;
+	chunks->size = size;
+	chunks->next = 0;
+}
+
+int crush_chunks_count(const struct crush_chunks *chunks)
+{
+	return (chunks->count + chunks->size - 1) / chunks->size;
+}
+
+int crush_chunks_take(struct crush_chunks *chunks, int *begin, int *end)
+{
+	int chunk = __atomic_fetch_add(&chunks->next, 1, __ATOMIC_RELAXED);
+
+	if (chunk >= crush_chunks_count(chunks))
+		return 0;
+	*begin = chunk * chunks->size;
+	*end = *begin + chunks->size;
+	if (*end > chunks->count)
+		*end = chunks->count;
+	return 1;
+}
+
+/************************************************/
+
+/* the number of inputs a thread takes at a time */
+#define CRUSH_PARALLEL_CHUNK 1024
+
+struct parallel {
+	const struct crush_map *map;
+	int ruleno;
+	int x_begin;
+	int x_count;
+	int *result;
+	int result_max;
+	int result_stride;
+	int *result_len;
+	const __u32 *weights;
+	int weight_max;
+	const struct crush_choose_arg *choose_args;
+	struct crush_chunks chunks;
+	struct parallel_worker *workers;
+};
+
+struct parallel_worker {
+	struct crush_context *ctx;
+	void *cwin;
+};
+
+static void worker_run(void *arg, int worker)
+{
+	struct parallel *p = arg;
+	struct parallel_worker *w = &p->workers[worker];
+	int x[CRUSH_PARALLEL_CHUNK];
+	int begin, end, count, i;
+
+	while (crush_chunks_take(&p->chunks, &begin, &end)) {
+		count = end - begin;
+		for (i = 0; i < count; i++)
+			x[i] = p->x_begin + begin + i;
+		crush_do_rule_batch(p->map, p->ruleno, x, count,
+				    p->result + (size_t)begin * p->result_stride,
+				    p->result_max, p->result_stride,
+				    p->result_len ? p->result_len + begin : NULL,
+				    p->weights, p->weight_max, w->cwin,
+				    p->choose_args);
+	}
+}
+
+int crush_do_rule_parallel(const struct crush_map *map, int ruleno,
+			   int x_begin, int x_count,
+			   int *result, int result_max,
+			   int result_stride, int *result_len,
+			   const __u32 *weights, int weight_max,
+			   const struct crush_choose_arg *choose_args,
+			   int threads)
+{
+	struct parallel p;
+	struct parallel_worker *workers = NULL;
+	struct crush_weight_summary *summary;
+	struct crush_pool *pool;
+	int t, r = x_count;
+
+	if ((__u32)ruleno >= map->max_rules || !map->rules[ruleno] ||
+	    result_max < 1 || result_stride < result_max || x_count < 0)
+		return -EINVAL;
+
+	p.map = map;
+	p.ruleno = ruleno;
+	p.x_begin = x_begin;
+	p.x_count = x_count;
+	p.result = result;
+	p.result_max = result_max;
+	p.result_stride = result_stride;
+	p.result_len = result_len;
+	p.weights = weights;
+	p.weight_max = weight_max;
+	p.choose_args = choose_args;
+	crush_chunks_init(&p.chunks, x_count, CRUSH_PARALLEL_CHUNK);
+
+	/* shared by the workers, it spares them the weight of most devices */
+	summary = crush_make_weight_summary(weights, weight_max);
+	pool = crush_pool_create(threads, crush_chunks_count(&p.chunks));
+	if (pool) {
+		threads = crush_pool_threads(pool);
+		workers = calloc(threads, sizeof(*workers));
+	}
+	if (!summary || !workers) {
+		r = -ENOMEM;
+		goto out;
+	}
+	p.workers = workers;
+	for (t = 0; t < threads; t++) {
+		workers[t].ctx = crush_context_create();
+		if (!workers[t].ctx ||
+		    crush_context_bind(workers[t].ctx, map, 0, result_max)) {
+			r = -ENOMEM;
+			goto out;
+		}
+		crush_context_set_weight_summary(workers[t].ctx, summary);
+		workers[t].cwin = crush_context_workspace(workers[t].ctx);
+	}
+
+	crush_pool_run(pool, worker_run, &p);
+
+out:
+	if (workers)
+		for (t = 0; t < threads; t++)
+			crush_context_destroy(workers[t].ctx);
+	free(workers);
+	crush_pool_destroy(pool);
+	crush_destroy_weight_summary(summary);
+	return r;
+}
@@ -0,0 +1,155 @@
+#ifndef CEPH_CRUSH_PARALLEL_H
+#define CEPH_CRUSH_PARALLEL_H
+
+/*
+ * Map a range of inputs with a pool of threads.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+struct crush_pool;
+
+/** @ingroup API
+ *
+ * Create a pool of __threads__ threads, the calling thread included, or
+ * of one thread per online CPU if __threads__ is 0, but no more than
+ * __jobs__ and at least one. The threads wait for crush_pool_run()
+ * until the pool is destroyed. If a thread cannot be created, the
+ * calling thread does its work.
+ *
+ * - return NULL if __malloc(3)__ fails
+ *
+ * @param threads the number of threads or 0
+ * @param jobs the number of jobs the threads share, there is no use for more threads
+ *
+ * @returns a pool to be released with crush_pool_destroy() or NULL
+ */
+extern struct crush_pool *crush_pool_create(int threads, int jobs);
+
+/** @ingroup API
+ *
+ * Release a __pool__ returned by crush_pool_create() and join its threads.
+ *
+ * @param pool the pool or NULL
+ */
+extern void crush_pool_destroy(struct crush_pool *pool);
+
+/** @ingroup API
+ *
+ * Return the number of threads of __pool__, the calling thread
+ * included: the workers of crush_pool_run() are numbered from 0 to this
+ * number - 1.
+ *
+ * @param pool the pool
+ *
+ * @returns the number of threads, >= 1
+ */
+extern int crush_pool_threads(const struct crush_pool *pool);
+
+/** @ingroup API
+ *
+ * Call __run(arg, worker)__ once for each worker of __pool__, each in
+ * its own thread, and return when all calls returned. The calling
+ * thread is worker 0. Only one thread may run a pool at a time.
+ *
+ * @param pool the pool
+ * @param run the function of the workers
+ * @param arg the first argument of __run__
+ */
+extern void crush_pool_run(struct crush_pool *pool,
+			   void (*run)(void *arg, int worker), void *arg);
+
+/** @ingroup API
+ *
+ * The __count__ jobs, e.g. consecutive inputs, that the workers of
+ * crush_pool_run() take in chunks of __size__ jobs until none is left.
+ * It is initialized by crush_chunks_init() before each run.
+ */
+struct crush_chunks {
+	int count;		/*!< the number of jobs */
+	int size;		/*!< the number of jobs of a chunk */
+	int next;		/*!< the next chunk, taken with __atomic_fetch_add */
+};
+
+/** @ingroup API
+ *
+ * Cut __count__ jobs in __chunks__ of __size__ jobs, the last one
+ * possibly smaller, none of them taken yet.
+ *
+ * @param chunks the chunks to initialize
+ * @param count the number of jobs, >= 0
+ * @param size the number of jobs of a chunk, > 0
+ */
+extern void crush_chunks_init(struct crush_chunks *chunks,
+			      int count, int size);
+
+/** @ingroup API
+ *
+ * Return the number of chunks of __chunks__, the __jobs__ of
+ * crush_pool_create().
+ *
+ * @param chunks the chunks initialized by crush_chunks_init()
+ *
+ * @returns the number of chunks
+ */
+extern int crush_chunks_count(const struct crush_chunks *chunks);
+
+/** @ingroup API
+ *
+ * Take the next chunk of __chunks__, if any is left, and store its
+ * jobs, from __*begin__ included to __*end__ excluded. Any number of
+ * workers can take chunks at the same time, each chunk is taken once.
+ *
+ * @param chunks the chunks initialized by crush_chunks_init()
+ * @param[out] begin the first job of the chunk
+ * @param[out] end the job after the last one of the chunk
+ *
+ * @returns 1 if a chunk is taken, 0 if none is left
+ */
+extern int crush_chunks_take(struct crush_chunks *chunks,
+			     int *begin, int *end);
+
+/** @ingroup API
+ *
+ * Map the __x_count__ consecutive inputs starting at __x_begin__ with
+ * the rule __ruleno__, as crush_do_rule_batch() would: row i of the
+ * __result__ matrix holds the mapping of __x_begin__ + i and, if
+ * __result_len__ is not NULL, __result_len[i]__ its size.
+ *
+ * The inputs are split in chunks that __threads__ threads, each with
+ * its own workspace, take in turn until none is left: a thread that
+ * maps faster takes more chunks. If __threads__ is 0, one thread per
+ * online CPU is used. The calling thread maps chunks too and the
+ * function returns when all inputs are mapped. If threads cannot be
+ * created, the calling thread maps the chunks they would have taken.
+ *
+ * - return -EINVAL if __ruleno__ is not a rule of __map__, if
+ *   __result_max__ < 1 or if __result_stride__ < __result_max__
+ * - return -ENOMEM if __malloc(3)__ fails
+ *
+ * @param map the crush_map
+ * @param ruleno a positive integer < __CRUSH_MAX_RULES__
+ * @param x_begin the first input
+ * @param x_count the number of inputs
+ * @param result a matrix of __x_count__ rows of __result_stride__ items
+ * @param result_max the maximum number of items in a row
+ * @param result_stride the number of items between two rows, >= __result_max__
+ * @param result_len an array of __x_count__ row sizes or NULL
+ * @param weights an array of weights of size __weight_max__
+ * @param weight_max the size of the __weights__ array
+ * @param choose_args an array of __map->max_buckets__ crush_choose_arg or NULL, see crush_do_rule()
+ * @param threads the number of threads or 0
+ *
+ * @returns __x_count__ on success, < 0 on error
+ */
+extern int crush_do_rule_parallel(const struct crush_map *map, int ruleno,
+				  int x_begin, int x_count,
+				  int *result, int result_max,
+				  int result_stride, int *result_len,
+				  const __u32 *weights, int weight_max,
+				  const struct crush_choose_arg *choose_args,
+				  int threads);
+
+#endif
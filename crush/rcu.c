@@ -0,0 +1,409 @@
+/*
+ * Publish the versions of a map to readers that map with them while
+ * it is updated.
+ *
+ * Each version is a copy of the crush_map and of its array of bucket
+ * pointers. An update copies a bucket the first time it modifies it or
+ * one of its descendants, the copies being recorded with the epoch of
+ * the version in stamps[], and keeps the buckets they replace to be
+ * released with the previous version.
+ *
+ * A reader announces the version it uses in its slot and checks that
+ * it is still the current one, as with hazard pointers: a version
+ * retired by a publication after the check is seen in the slot by the
+ * writer. A bucket replaced by a version is shared by all the older
+ * ones, so the retired versions are released in order, each once no
+ * slot holds it or an older one. The loads and
+ * stores of current and of the slots are sequentially consistent so
+ * that either the reader sees the new version or the writer sees the
+ * slot.
+ *
+ * LGPL2
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crush_compat.h"
+#include "builder.h"
+#include "rcu.h"
+
+struct crush_rcu_version {
+	struct crush_map *map;
+	__u32 epoch;
+	/* the buckets of map replaced by the next version */
+	struct crush_bucket **replaced;
+	int replaced_count;
+	struct crush_rcu_version *retired;	/* the next newer retired version */
+};
+
+struct crush_rcu_slot {
+	struct crush_rcu_version *version;	/* NULL if none is held */
+	int used;				/* taken by crush_rcu_register() */
+	char pad[L1_CACHE_BYTES - sizeof(void *) - sizeof(int)];
+};
+
+struct crush_rcu {
+	struct crush_rcu_version *current;
+	struct crush_rcu_slot *slots;
+	int readers;
+	/* held from crush_rcu_begin() to crush_rcu_publish() */
+	pthread_mutex_t lock;
+	struct crush_rcu_version *pending;	/* NULL outside of an update */
+	__u32 *stamps;			/* the epoch each bucket was copied at */
+	__s32 max_stamps;
+	struct crush_bucket **replaced;	/* by pending */
+	int replaced_count;
+	int replaced_max;
+	struct crush_rcu_version *retired;	/* the oldest first */
+	struct crush_rcu_version **retired_tail;
+	/* the back-links of the last version */
+	__s32 *bucket_parents;
+	__u32 max_bucket_parents;
+	__s32 *device_parents;
+	__u32 max_device_parents;
+};
+
+struct crush_rcu *crush_rcu_create(struct crush_map *map, int readers)
+{
+	struct crush_rcu *rcu;
+
+	if (map->frozen_size || map->arena || !map->bucket_parents ||
+	    readers < 1)
+		return NULL;
+	rcu = calloc(1, sizeof(*rcu));
+	if (!rcu)
+		return NULL;
+	rcu->current = calloc(1, sizeof(*rcu->current));
+	if (!rcu->current)
+		goto nomem;
+	if (posix_memalign((void **)&rcu->slots, L1_CACHE_BYTES,
+			   readers * sizeof(*rcu->slots))) {
+		rcu->slots = NULL;
+		goto nomem;
+	}
+	memset(rcu->slots, 0, readers * sizeof(*rcu->slots));
+	if (pthread_mutex_init(&rcu->lock, NULL))
+		goto nomem;
+	rcu->readers = readers;
+	rcu->retired_tail = &rcu->retired;
+	rcu->current->map = map;
+	rcu->current->epoch = 1;
+	/* the back-links are only used by the updates */
+	rcu->bucket_parents = map->bucket_parents;
+	rcu->max_bucket_parents = map->max_bucket_parents;
+	rcu->device_parents = map->device_parents;
+	rcu->max_device_parents = map->max_device_parents;
+	map->bucket_parents = map->device_parents = NULL;
+	map->max_bucket_parents = map->max_device_parents = 0;
+	return rcu;
+
+nomem:
+	free(rcu->slots);
+	free(rcu->current);
+	free(rcu);
+	return NULL;
+}
+
+static void release_version(struct crush_rcu_version *v)
+{
+	int i;
+
+	for (i = 0; i < v->replaced_count; i++)
+		crush_destroy_bucket(v->replaced[i]);
+	free(v->replaced);
+	free(v->map->buckets);
+	free(v->map);
+	free(v);
+}
+
+/* true if a reader holds @v */
+static int held(const struct crush_rcu *rcu, const struct crush_rcu_version *v)
+{
+	int i;
+
+	for (i = 0; i < rcu->readers; i++)
+		if (__atomic_load_n(&rcu->slots[i].version,
+				    __ATOMIC_SEQ_CST) == v)
+			return 1;
+	return 0;
+}
+
+/*
+ * Release the retired versions, oldest first, until one is held since
+ * the buckets it shares with the older ones are replaced by the newer
+ * ones. Return how many remain.
+ */
+static int reclaim(struct crush_rcu *rcu)
+{
+	struct crush_rcu_version *v;
+	int remaining = 0;
+
+	while ((v = rcu->retired) && !held(rcu, v)) {
+		rcu->retired = v->retired;
+		release_version(v);
+	}
+	if (!rcu->retired)
+		rcu->retired_tail = &rcu->retired;
+	for (v = rcu->retired; v; v = v->retired)
+		remaining++;
+	return remaining;
+}
+
+void crush_rcu_destroy(struct crush_rcu *rcu)
+{
+	struct crush_rcu_version *v;
+
+	if (!rcu)
+		return;
+	while ((v = rcu->retired)) {
+		rcu->retired = v->retired;
+		release_version(v);
+	}
+	v = rcu->current;
+	v->map->bucket_parents = rcu->bucket_parents;
+	v->map->max_bucket_parents = rcu->max_bucket_parents;
+	v->map->device_parents = rcu->device_parents;
+	v->map->max_device_parents = rcu->max_device_parents;
+	crush_destroy(v->map);
+	free(v);
+	free(rcu->replaced);
+	free(rcu->stamps);
+	free(rcu->slots);
+	pthread_mutex_destroy(&rcu->lock);
+	free(rcu);
+}
+
+int crush_rcu_register(struct crush_rcu *rcu)
+{
+	int i;
+
+	for (i = 0; i < rcu->readers; i++) {
+		int used = 0;
+
+		if (__atomic_compare_exchange_n(&rcu->slots[i].used, &used, 1,
+						0, __ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			return i;
+	}
+	return -ENOSPC;
+}
+
+void crush_rcu_unregister(struct crush_rcu *rcu, int reader)
+{
+	__atomic_store_n(&rcu->slots[reader].used, 0, __ATOMIC_RELEASE);
+}
+
+const struct crush_map *crush_rcu_read_lock(struct crush_rcu *rcu,
+					    int reader, __u32 *epoch)
+{
+	struct crush_rcu_slot *slot = &rcu->slots[reader];
+	struct crush_rcu_version *v, *again;
+
+	v = __atomic_load_n(&rcu->current, __ATOMIC_SEQ_CST);
+	for (;;) {
+		__atomic_store_n(&slot->version, v, __ATOMIC_SEQ_CST);
+		again = __atomic_load_n(&rcu->current, __ATOMIC_SEQ_CST);
+		if (again == v)
+			break;
+		v = again;
+	}
+	*epoch = v->epoch;
+	return v->map;
+}
+
+void crush_rcu_read_unlock(struct crush_rcu *rcu, int reader)
+{
+	__atomic_store_n(&rcu->slots[reader].version, NULL, __ATOMIC_RELEASE);
+}
+
+struct crush_map *crush_rcu_begin(struct crush_rcu *rcu)
+{
+	const struct crush_map *current;
+	struct crush_rcu_version *v;
+	struct crush_map *map;
+
+	pthread_mutex_lock(&rcu->lock);
+	current = rcu->current->map;
+	v = calloc(1, sizeof(*v));
+	map = malloc(sizeof(*map));
+	if (!v || !map)
+		goto nomem;
+	*map = *current;
+	map->buckets = NULL;
+	if (current->max_buckets) {
+		map->buckets = malloc(current->max_buckets *
+				      sizeof(*map->buckets));
+		if (!map->buckets)
+			goto nomem;
+		memcpy(map->buckets, current->buckets,
+		       current->max_buckets * sizeof(*map->buckets));
+	}
+	map->bucket_parents = rcu->bucket_parents;
+	map->max_bucket_parents = rcu->max_bucket_parents;
+	map->device_parents = rcu->device_parents;
+	map->max_device_parents = rcu->max_device_parents;
+	v->map = map;
+	v->epoch = rcu->current->epoch + 1;
+	rcu->pending = v;
+	rcu->replaced_count = 0;
+	return map;
+
+nomem:
+	free(map);
+	free(v);
+	pthread_mutex_unlock(&rcu->lock);
+	return NULL;
+}
+
+/* mark the bucket @id as copied by the pending version */
+static void stamp(struct crush_rcu *rcu, int id)
+{
+	__s32 pos = -1-id;
+
+	if (pos >= rcu->max_stamps) {
+		__s32 size = rcu->pending->map->max_buckets;
+		__u32 *stamps;
+
+		if (size <= pos)
+			size = pos + 1;
+		stamps = realloc(rcu->stamps, size * sizeof(*stamps));
+		/* without a stamp, the bucket is copied again if modified */
+		if (!stamps)
+			return;
+		memset(stamps + rcu->max_stamps, 0,
+		       (size - rcu->max_stamps) * sizeof(*stamps));
+		rcu->stamps = stamps;
+		rcu->max_stamps = size;
+	}
+	rcu->stamps[pos] = rcu->pending->epoch;
+}
+
+/* copy the bucket @id and its ancestors unless they already are */
+static int copy_path(struct crush_rcu *rcu, int id)
+{
+	struct crush_map *map = rcu->pending->map;
+	struct crush_bucket *copy;
+	int depth;
+
+	for (depth = 0; depth <= map->max_buckets; depth++) {
+		__s32 pos = -1-id;
+
+		if (id >= 0 || pos >= map->max_buckets || !map->buckets[pos])
+			return 0;
+		if (pos >= rcu->max_stamps ||
+		    rcu->stamps[pos] != rcu->pending->epoch) {
+			if (rcu->replaced_count == rcu->replaced_max) {
+				int max = rcu->replaced_max ?
+					2 * rcu->replaced_max : 8;
+				struct crush_bucket **replaced =
+					realloc(rcu->replaced,
+						max * sizeof(*replaced));
+
+				if (!replaced)
+					return -ENOMEM;
+				rcu->replaced = replaced;
+				rcu->replaced_max = max;
+			}
+			copy = crush_clone_bucket(map->buckets[pos]);
+			if (!copy)
+				return -ENOMEM;
+			rcu->replaced[rcu->replaced_count++] = map->buckets[pos];
+			map->buckets[pos] = copy;
+			stamp(rcu, id);
+		}
+		id = crush_get_parent(map, id);
+	}
+	return 0;
+}
+
+int crush_rcu_add_bucket(struct crush_rcu *rcu, int bucketno,
+			 struct crush_bucket *bucket, int *idout)
+{
+	int r;
+
+	if (!rcu->pending)
+		return -EINVAL;
+	r = crush_map_add_bucket(rcu->pending->map, bucketno, bucket, idout);
+	if (r < 0)
+		return r;
+	stamp(rcu, bucket->id);
+	return 0;
+}
+
+int crush_rcu_add_item(struct crush_rcu *rcu, int bucketno,
+		       int item, int weight)
+{
+	int r;
+
+	if (!rcu->pending)
+		return -EINVAL;
+	r = copy_path(rcu, bucketno);
+	if (r < 0)
+		return r;
+	return crush_map_add_item(rcu->pending->map, bucketno, item, weight);
+}
+
+int crush_rcu_adjust_item_weight(struct crush_rcu *rcu, int item, int weight)
+{
+	int r;
+
+	if (!rcu->pending)
+		return -EINVAL;
+	r = copy_path(rcu, crush_get_parent(rcu->pending->map, item));
+	if (r < 0)
+		return r;
+	return crush_map_adjust_item_weight(rcu->pending->map, item, weight);
+}
+
+int crush_rcu_remove_item(struct crush_rcu *rcu, int item)
+{
+	int r;
+
+	if (!rcu->pending)
+		return -EINVAL;
+	r = copy_path(rcu, crush_get_parent(rcu->pending->map, item));
+	if (r < 0)
+		return r;
+	return crush_map_remove_item(rcu->pending->map, item);
+}
+
+__u32 crush_rcu_publish(struct crush_rcu *rcu)
+{
+	struct crush_rcu_version *v = rcu->pending;
+	struct crush_rcu_version *previous = rcu->current;
+	__u32 epoch = v->epoch;
+
+	/* the back-links may have been reallocated by the update */
+	rcu->bucket_parents = v->map->bucket_parents;
+	rcu->max_bucket_parents = v->map->max_bucket_parents;
+	rcu->device_parents = v->map->device_parents;
+	rcu->max_device_parents = v->map->max_device_parents;
+	v->map->bucket_parents = v->map->device_parents = NULL;
+	v->map->max_bucket_parents = v->map->max_device_parents = 0;
+
+	/* the replaced buckets go with the version they belong to */
+	previous->replaced = rcu->replaced;
+	previous->replaced_count = rcu->replaced_count;
+	rcu->replaced = NULL;
+	rcu->replaced_count = rcu->replaced_max = 0;
+
+	__atomic_store_n(&rcu->current, v, __ATOMIC_SEQ_CST);
+	rcu->pending = NULL;
+	*rcu->retired_tail = previous;
+	rcu->retired_tail = &previous->retired;
+	reclaim(rcu);
+	pthread_mutex_unlock(&rcu->lock);
+	return epoch;
+}
+
+void crush_rcu_synchronize(struct crush_rcu *rcu)
+{
+	pthread_mutex_lock(&rcu->lock);
+	while (reclaim(rcu) > 0)
+		sched_yield();
+	pthread_mutex_unlock(&rcu->lock);
+}
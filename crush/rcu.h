@@ -0,0 +1,216 @@
+#ifndef CEPH_CRUSH_RCU_H
+#define CEPH_CRUSH_RCU_H
+
+/*
+ * Publish the versions of a map to readers that map with them while
+ * it is updated.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+struct crush_rcu;
+
+/** @ingroup API
+ *
+ * Take __map__ as the first version of a map to be read by up to
+ * __readers__ threads at the same time with crush_rcu_read_lock() and
+ * updated with crush_rcu_begin() and crush_rcu_publish(). The epoch
+ * of __map__ is 1 and each publication increments it.
+ *
+ * An update copies the array of bucket pointers of the map and only
+ * the buckets it modifies and their ancestors: the other buckets and
+ * the rules are shared by all the versions. A version is published by
+ * storing a single pointer, so that a reader never waits. It is
+ * released once the readers that were using it or an older version
+ * are done, at a later publication or crush_rcu_synchronize().
+ *
+ * The back-links of the map, see crush_get_parent(), are kept for the
+ * updates and are not in the published versions.
+ *
+ * - return NULL if __map__ is frozen, is in an arena or has no back-links
+ * - return NULL if __readers__ < 1 or if __malloc(3)__ fails
+ *
+ * @param map a finalized crush_map, released by crush_rcu_destroy()
+ * @param readers the maximum number of readers
+ *
+ * @returns the published map to be released with crush_rcu_destroy() or NULL
+ */
+extern struct crush_rcu *crush_rcu_create(struct crush_map *map, int readers);
+
+/** @ingroup API
+ *
+ * Release __rcu__ and all the versions of its map, buckets and rules
+ * included. There must be no reader and no update in progress.
+ *
+ * @param rcu the value returned by crush_rcu_create() or NULL
+ */
+extern void crush_rcu_destroy(struct crush_rcu *rcu);
+
+/** @ingroup API
+ *
+ * Reserve a reader of __rcu__ for the calling thread, to be given to
+ * crush_rcu_read_lock() by this thread only. Each reader has its own
+ * cache line.
+ *
+ * - return -ENOSPC if all the readers given to crush_rcu_create() are in use
+ *
+ * @param rcu the published map
+ *
+ * @returns the reader >= 0 on success, < 0 on error
+ */
+extern int crush_rcu_register(struct crush_rcu *rcu);
+
+/** @ingroup API
+ *
+ * Give back a __reader__ returned by crush_rcu_register(). It must not
+ * hold a version.
+ *
+ * @param rcu the published map
+ * @param reader the value returned by crush_rcu_register()
+ */
+extern void crush_rcu_unregister(struct crush_rcu *rcu, int reader);
+
+/** @ingroup API
+ *
+ * Return the last version of the map published in __rcu__, which
+ * remains valid and unchanged until crush_rcu_read_unlock(). It does
+ * not lock nor wait for the writer: a version published meanwhile is
+ * returned by the next call.
+ *
+ * The workspace of crush_do_rule() must be initialized for each new
+ * version, e.g. with crush_context_bind() and __epoch__.
+ *
+ * @param rcu the published map
+ * @param reader the value returned by crush_rcu_register()
+ * @param[out] epoch the epoch of the version returned
+ *
+ * @returns the crush_map, not to be modified
+ */
+extern const struct crush_map *crush_rcu_read_lock(struct crush_rcu *rcu,
+						   int reader, __u32 *epoch);
+
+/** @ingroup API
+ *
+ * Release the version returned by crush_rcu_read_lock() to __reader__.
+ *
+ * @param rcu the published map
+ * @param reader the value returned by crush_rcu_register()
+ */
+extern void crush_rcu_read_unlock(struct crush_rcu *rcu, int reader);
+
+/** @ingroup API
+ *
+ * Start an update of the map of __rcu__, waiting for the update of
+ * another thread to be published. The update is made with
+ * crush_rcu_add_bucket(), crush_rcu_add_item(),
+ * crush_rcu_adjust_item_weight() and crush_rcu_remove_item() and
+ * becomes visible to the readers with crush_rcu_publish(), which must
+ * be called by the same thread once crush_rcu_begin() succeeded. An
+ * update cannot be abandoned.
+ *
+ * The map returned is the version being updated: it is given as the
+ * __map__ argument of crush_make_bucket() and read, but not modified
+ * otherwise.
+ *
+ * @param rcu the published map
+ *
+ * @returns the version being updated or NULL if __malloc(3)__ fails
+ */
+extern struct crush_map *crush_rcu_begin(struct crush_rcu *rcu);
+
+/** @ingroup API
+ *
+ * Add __bucket__ to the map with crush_map_add_bucket(). The map then
+ * owns __bucket__.
+ *
+ * - return -EINVAL if no update is in progress
+ * - return the errors of crush_map_add_bucket()
+ *
+ * @param[in] rcu the published map being updated
+ * @param[in] bucketno the bucket unique identifer or 0
+ * @param[in] bucket the bucket made for the version being updated
+ * @param[out] idout a pointer to the bucket identifier
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_rcu_add_bucket(struct crush_rcu *rcu, int bucketno,
+				struct crush_bucket *bucket, int *idout);
+
+/** @ingroup API
+ *
+ * Add __item__ to the bucket __bucketno__ with crush_map_add_item(),
+ * after copying __bucketno__ and its ancestors.
+ *
+ * - return -EINVAL if no update is in progress
+ * - return -ENOMEM if __malloc(3)__ fails
+ * - return the errors of crush_map_add_item()
+ *
+ * @param rcu the published map being updated
+ * @param bucketno the bucket to add __item__ to
+ * @param item the device or bucket id to add
+ * @param weight the weight of __item__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_rcu_add_item(struct crush_rcu *rcu, int bucketno,
+			      int item, int weight);
+
+/** @ingroup API
+ *
+ * Set the __weight__ of __item__ with crush_map_adjust_item_weight(),
+ * after copying the bucket containing __item__ and its ancestors.
+ *
+ * - return -EINVAL if no update is in progress
+ * - return -ENOMEM if __malloc(3)__ fails
+ * - return the errors of crush_map_adjust_item_weight()
+ *
+ * @param rcu the published map being updated
+ * @param item the device or bucket id
+ * @param weight the new weight of __item__
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_rcu_adjust_item_weight(struct crush_rcu *rcu, int item,
+					int weight);
+
+/** @ingroup API
+ *
+ * Remove __item__ with crush_map_remove_item(), after copying the
+ * bucket containing __item__ and its ancestors.
+ *
+ * - return -EINVAL if no update is in progress
+ * - return -ENOMEM if __malloc(3)__ fails
+ * - return the errors of crush_map_remove_item()
+ *
+ * @param rcu the published map being updated
+ * @param item the device or bucket id
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_rcu_remove_item(struct crush_rcu *rcu, int item);
+
+/** @ingroup API
+ *
+ * Publish the version being updated as the next epoch and end the
+ * update. The previous versions are released, oldest first, up to
+ * the first one a reader still holds.
+ *
+ * @param rcu the published map being updated
+ *
+ * @returns the epoch published
+ */
+extern __u32 crush_rcu_publish(struct crush_rcu *rcu);
+
+/** @ingroup API
+ *
+ * Wait until all the versions but the last published are released,
+ * i.e. until each reader that holds one calls crush_rcu_read_unlock().
+ * The calling thread must not hold a version nor update the map.
+ *
+ * @param rcu the published map
+ */
+extern void crush_rcu_synchronize(struct crush_rcu *rcu);
+
+#endif
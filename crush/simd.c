@@ -0,0 +1,895 @@
+/*
+ * Vectorized rjenkins1 hash and straw2 draw.
+ *
+ * crush_hash32_2_x*() and crush_hash32_3_x*() compute the hash of
+ * independent inputs in the lanes of a vector.
+ *
+ * For each item, bucket_straw2_choose() computes
+ *
+ *     draw = (crush_ln(hash(x, item, r) & 0xffff) - 2^48) / weight
+ *
+ * and keeps the first item with the largest draw. The kernels below
+ * compute the same values for 4 or 8 items at once and must return
+ * exactly the item the scalar loop would return: a different item
+ * means data movement.
+ *
+ * LGPL2
+ */
+
+#include <errno.h>
+
+#include "crush_compat.h"
+#include "hash.h"
+#include "crush_ln_table.h"
+#include "simd.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+# define CRUSH_SIMD_X86 1
+# include <immintrin.h>
+# define CRUSH_TARGET_SSE42 __attribute__((target("sse4.2")))
+# define CRUSH_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+# define CRUSH_SIMD_ARM 1
+# include <arm_neon.h>
+#endif
+
+/*
+ * crush_hashmix() from hash.h, for any vector type providing the
+ * VSUB, VXOR, VSRL and VSLL operations on 32 bits lanes.
+ */
+#define crush_hashmix_vec(a, b, c) do {					\
+		a = VSUB(a, b); a = VSUB(a, c); a = VXOR(a, VSRL(c, 13)); \
+		b = VSUB(b, c); b = VSUB(b, a); b = VXOR(b, VSLL(a, 8)); \
+		c = VSUB(c, a); c = VSUB(c, b); c = VXOR(c, VSRL(b, 13)); \
+		a = VSUB(a, b); a = VSUB(a, c); a = VXOR(a, VSRL(c, 12)); \
+		b = VSUB(b, c); b = VSUB(b, a); b = VXOR(b, VSLL(a, 16)); \
+		c = VSUB(c, a); c = VSUB(c, b); c = VXOR(c, VSRL(b, 5)); \
+		a = VSUB(a, b); a = VSUB(a, c); a = VXOR(a, VSRL(c, 3)); \
+		b = VSUB(b, c); b = VSUB(b, a); b = VXOR(b, VSLL(a, 10)); \
+		c = VSUB(c, a); c = VSUB(c, b); c = VXOR(c, VSRL(b, 15)); \
+	} while (0)
+
+/* crush_hash32_rjenkins1_2() from hash.h, with the same VSET1 */
+#define crush_hash32_rjenkins1_2_vec(hash, a, b) do {			\
+		__typeof__(a) _x = VSET1(231232);			\
+		__typeof__(a) _y = VSET1(1232);				\
+		hash = VXOR(VXOR(VSET1(crush_hash_seed), a), b);	\
+		crush_hashmix_vec(a, b, hash);				\
+		crush_hashmix_vec(_x, a, hash);				\
+		crush_hashmix_vec(b, _y, hash);				\
+	} while (0)
+
+/* crush_hash32_rjenkins1_3() from hash.h, with the same VSET1 */
+#define crush_hash32_rjenkins1_3_vec(hash, a, b, c) do {		\
+		__typeof__(a) _x = VSET1(231232);			\
+		__typeof__(a) _y = VSET1(1232);				\
+		hash = VXOR(VXOR(VXOR(VSET1(crush_hash_seed), a), b), c); \
+		crush_hashmix_vec(a, b, hash);				\
+		crush_hashmix_vec(c, _x, hash);				\
+		crush_hashmix_vec(_y, a, hash);				\
+		crush_hashmix_vec(b, _x, hash);				\
+		crush_hashmix_vec(_y, c, hash);				\
+	} while (0)
+
+/* the scalar draw of bucket_straw2_choose(), for the remaining items */
+static inline __s64 straw2_draw(const struct crush_bucket_straw2 *bucket,
+				int x, int r, unsigned int i)
+{
+	unsigned int w = bucket->item_weights[i];
+	unsigned int u;
+	__s64 ln;
+
+	if (!w)
+		return S64_MIN;
+	u = crush_hash32_rjenkins1_3(x, bucket->h.items[i], r);
+	u &= 0xffff;
+	ln = crush_ln(u) - 0x1000000000000ll;
+	if (bucket->item_reciprocals) {
+		__u64 rcp = bucket->item_reciprocals[i];
+		return -(__s64)mul_u64_u64_shr(-ln,
+					       crush_reciprocal_multiplier(rcp),
+					       crush_reciprocal_shift(rcp));
+	}
+	return div64_s64(ln, w);
+}
+
+/*
+ * Pick the winner among per lane winners: the largest draw and, if
+ * several lanes have it, the lowest position, as the scalar loop
+ * would. Then draw the items that do not fill a vector.
+ */
+static int straw2_finish(const struct crush_bucket_straw2 *bucket,
+			 int x, int r, unsigned int i,
+			 const __s64 *lane_draw, const __s64 *lane_high,
+			 int lanes)
+{
+	unsigned int high = lane_high[0];
+	__s64 high_draw = lane_draw[0];
+	__s64 draw;
+	int l;
+
+	for (l = 1; l < lanes; l++) {
+		if (lane_draw[l] > high_draw ||
+		    (lane_draw[l] == high_draw && lane_high[l] < high)) {
+			high = lane_high[l];
+			high_draw = lane_draw[l];
+		}
+	}
+	for (; i < bucket->h.size; i++) {
+		draw = straw2_draw(bucket, x, r, i);
+		if (draw > high_draw) {
+			high = i;
+			high_draw = draw;
+		}
+	}
+	return high;
+}
+
+#ifdef CRUSH_SIMD_X86
+
+/*
+ * The division of a 64 bits ln by a 32 bits weight has no vector
+ * instruction. Both are converted to double (ln is at most 2^48 in
+ * absolute value and therefore exact), divided and truncated. The
+ * relative error of the division is at most 2^-53, which makes the
+ * truncated quotient off by at most one: it is fixed with an integer
+ * multiplication so that the result is the exact integer quotient.
+ */
+#define CRUSH_2P52 0x4330000000000000ll /* 2^52 as a double */
+
+/* @v < 2^52 */
+CRUSH_TARGET_SSE42
+static inline __m128d u52_to_pd_sse42(__m128i v)
+{
+	const __m128i magic = _mm_set1_epi64x(CRUSH_2P52);
+	return _mm_sub_pd(_mm_castsi128_pd(_mm_or_si128(v, magic)),
+			  _mm_castsi128_pd(magic));
+}
+
+/* @d is an integer < 2^52 */
+CRUSH_TARGET_SSE42
+static inline __m128i pd_to_u52_sse42(__m128d d)
+{
+	const __m128d magic = _mm_castsi128_pd(_mm_set1_epi64x(CRUSH_2P52));
+	return _mm_xor_si128(_mm_castpd_si128(_mm_add_pd(d, magic)),
+			     _mm_castpd_si128(magic));
+}
+
+/* (-ln) / w for 2 lanes, with 0 <= -ln <= 2^48 and 0 < w < 2^32 */
+CRUSH_TARGET_SSE42
+static inline __m128i div_x2_sse42(__m128i a, __m128i w)
+{
+	__m128i q, p, over, under;
+
+	q = pd_to_u52_sse42(_mm_round_pd(
+		_mm_div_pd(u52_to_pd_sse42(a), u52_to_pd_sse42(w)),
+		_MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC));
+	p = _mm_add_epi64(_mm_mul_epu32(q, w),
+			  _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(q, 32), w),
+					 32));
+	over = _mm_cmpgt_epi64(p, a);
+	q = _mm_add_epi64(q, over);
+	p = _mm_sub_epi64(p, _mm_and_si128(over, w));
+	under = _mm_cmpgt_epi64(_mm_sub_epi64(a, p),
+				_mm_sub_epi64(w, _mm_set1_epi64x(1)));
+	return _mm_sub_epi64(q, under);
+}
+
+/* draws of 2 lanes given their ln - 2^48 and their weight */
+CRUSH_TARGET_SSE42
+static inline __m128i draw_x2_sse42(__m128i ln, __m128i w)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i out = _mm_cmpeq_epi64(w, zero);
+	__m128i q = div_x2_sse42(_mm_sub_epi64(zero, ln),
+				 _mm_or_si128(w, _mm_and_si128(out,
+							       _mm_set1_epi64x(1))));
+	return _mm_blendv_epi8(_mm_sub_epi64(zero, q),
+			       _mm_set1_epi64x(S64_MIN), out);
+}
+
+CRUSH_TARGET_SSE42
+static int straw2_choose_sse42(const struct crush_bucket_straw2 *bucket,
+			       int x, int r)
+{
+	const unsigned int vsize = bucket->h.size & ~3u;
+	const __m128i vx = _mm_set1_epi32(x);
+	const __m128i vr = _mm_set1_epi32(r);
+	__m128i pos_lo = _mm_set_epi64x(1, 0);
+	__m128i pos_hi = _mm_set_epi64x(3, 2);
+	__m128i best_lo = pos_lo, best_hi = pos_hi;
+	__m128i high_lo = pos_lo, high_hi = pos_hi;
+	__m128i draw_lo, draw_hi, gt;
+	__s64 lane_draw[4], lane_high[4];
+	__u32 u[4];
+	unsigned int i;
+
+	for (i = 0; i < vsize; i += 4) {
+		__m128i a = vx, b, c = vr, hash, w;
+
+		b = _mm_loadu_si128((const __m128i *)(bucket->h.items + i));
+		w = _mm_loadu_si128((const __m128i *)(bucket->item_weights + i));
+#define VSET1 _mm_set1_epi32
+#define VSUB _mm_sub_epi32
+#define VXOR _mm_xor_si128
+#define VSRL _mm_srli_epi32
+#define VSLL _mm_slli_epi32
+		crush_hash32_rjenkins1_3_vec(hash, a, b, c);
+#undef VSET1
+#undef VSUB
+#undef VXOR
+#undef VSRL
+#undef VSLL
+		_mm_storeu_si128((__m128i *)u,
+				 _mm_and_si128(hash, _mm_set1_epi32(0xffff)));
+		/* no gather instruction, table lookups are scalar */
+		draw_lo = draw_x2_sse42(
+			_mm_set_epi64x(crush_ln(u[1]) - 0x1000000000000ll,
+				       crush_ln(u[0]) - 0x1000000000000ll),
+			_mm_cvtepu32_epi64(w));
+		draw_hi = draw_x2_sse42(
+			_mm_set_epi64x(crush_ln(u[3]) - 0x1000000000000ll,
+				       crush_ln(u[2]) - 0x1000000000000ll),
+			_mm_cvtepu32_epi64(_mm_srli_si128(w, 8)));
+		if (i == 0) {
+			best_lo = draw_lo;
+			best_hi = draw_hi;
+			high_lo = pos_lo;
+			high_hi = pos_hi;
+		} else {
+			gt = _mm_cmpgt_epi64(draw_lo, best_lo);
+			best_lo = _mm_blendv_epi8(best_lo, draw_lo, gt);
+			high_lo = _mm_blendv_epi8(high_lo, pos_lo, gt);
+			gt = _mm_cmpgt_epi64(draw_hi, best_hi);
+			best_hi = _mm_blendv_epi8(best_hi, draw_hi, gt);
+			high_hi = _mm_blendv_epi8(high_hi, pos_hi, gt);
+		}
+		pos_lo = _mm_add_epi64(pos_lo, _mm_set1_epi64x(4));
+		pos_hi = _mm_add_epi64(pos_hi, _mm_set1_epi64x(4));
+	}
+	_mm_storeu_si128((__m128i *)lane_draw, best_lo);
+	_mm_storeu_si128((__m128i *)(lane_draw + 2), best_hi);
+	_mm_storeu_si128((__m128i *)lane_high, high_lo);
+	_mm_storeu_si128((__m128i *)(lane_high + 2), high_hi);
+	return straw2_finish(bucket, x, r, i, lane_draw, lane_high, 4);
+}
+
+CRUSH_TARGET_AVX2
+static inline __m256d u52_to_pd_avx2(__m256i v)
+{
+	const __m256i magic = _mm256_set1_epi64x(CRUSH_2P52);
+	return _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(v, magic)),
+			     _mm256_castsi256_pd(magic));
+}
+
+CRUSH_TARGET_AVX2
+static inline __m256i pd_to_u52_avx2(__m256d d)
+{
+	const __m256d magic =
+		_mm256_castsi256_pd(_mm256_set1_epi64x(CRUSH_2P52));
+	return _mm256_xor_si256(_mm256_castpd_si256(_mm256_add_pd(d, magic)),
+				_mm256_castpd_si256(magic));
+}
+
+/* see div_x2_sse42() */
+CRUSH_TARGET_AVX2
+static inline __m256i div_x4_avx2(__m256i a, __m256i w)
+{
+	__m256i q, p, over, under;
+
+	q = pd_to_u52_avx2(_mm256_round_pd(
+		_mm256_div_pd(u52_to_pd_avx2(a), u52_to_pd_avx2(w)),
+		_MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC));
+	p = _mm256_add_epi64(_mm256_mul_epu32(q, w),
+			     _mm256_slli_epi64(
+				     _mm256_mul_epu32(_mm256_srli_epi64(q, 32), w),
+				     32));
+	over = _mm256_cmpgt_epi64(p, a);
+	q = _mm256_add_epi64(q, over);
+	p = _mm256_sub_epi64(p, _mm256_and_si256(over, w));
+	under = _mm256_cmpgt_epi64(_mm256_sub_epi64(a, p),
+				   _mm256_sub_epi64(w, _mm256_set1_epi64x(1)));
+	return _mm256_sub_epi64(q, under);
+}
+
+/* shift the lanes of @x below @limit by @shift bits, see crush_ln() */
+CRUSH_TARGET_AVX2
+static inline __m128i ln_normalize_avx2(__m128i x, int limit, int shift,
+					__m128i *bits)
+{
+	__m128i s = _mm_and_si128(_mm_cmpgt_epi32(_mm_set1_epi32(limit), x),
+				  _mm_set1_epi32(shift));
+	*bits = _mm_add_epi32(*bits, s);
+	return _mm_sllv_epi32(x, s);
+}
+
+/* crush_ln(u) - 2^48 for 4 lanes */
+CRUSH_TARGET_AVX2
+static inline __m256i ln_x4_avx2(__m128i u)
+{
+	__m128i x = _mm_add_epi32(u, _mm_set1_epi32(1));
+	__m128i bits = _mm_setzero_si128();
+	__m256i x64, index, RH, LH, LL, lo, hi, xl64, result;
+
+	/* move the highest bit of x, at most 16, to bit 15 */
+	x = ln_normalize_avx2(x, 1 << 8, 8, &bits);
+	x = ln_normalize_avx2(x, 1 << 12, 4, &bits);
+	x = ln_normalize_avx2(x, 1 << 14, 2, &bits);
+	x = ln_normalize_avx2(x, 1 << 15, 1, &bits);
+
+	x64 = _mm256_cvtepu32_epi64(x);
+	index = _mm256_sub_epi64(
+		_mm256_slli_epi64(_mm256_srli_epi64(x64, 8), 1),
+		_mm256_set1_epi64x(256));
+	RH = _mm256_i64gather_epi64((const long long *)__RH_LH_tbl, index, 8);
+	LH = _mm256_i64gather_epi64((const long long *)(__RH_LH_tbl + 1),
+				    index, 8);
+
+	/* x * RH modulo 2^64, x has 17 bits and RH 49 */
+	lo = _mm256_mul_epu32(x64, RH);
+	hi = _mm256_mul_epu32(x64, _mm256_srli_epi64(RH, 32));
+	xl64 = _mm256_srli_epi64(
+		_mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32)), 48);
+
+	LL = _mm256_i64gather_epi64(
+		(const long long *)__LL_tbl,
+		_mm256_and_si256(xl64, _mm256_set1_epi64x(0xff)), 8);
+
+	result = _mm256_slli_epi64(
+		_mm256_cvtepu32_epi64(_mm_sub_epi32(_mm_set1_epi32(15), bits)),
+		12 + 32);
+	result = _mm256_add_epi64(
+		result,
+		_mm256_srli_epi64(_mm256_add_epi64(LH, LL), 48 - 12 - 32));
+	return _mm256_sub_epi64(result, _mm256_set1_epi64x(0x1000000000000ll));
+}
+
+/* draws of 4 lanes given their hash & 0xffff and their weight */
+CRUSH_TARGET_AVX2
+static inline __m256i draw_x4_avx2(__m128i u, __m128i w32)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i w = _mm256_cvtepu32_epi64(w32);
+	__m256i out = _mm256_cmpeq_epi64(w, zero);
+	__m256i q = div_x4_avx2(
+		_mm256_sub_epi64(zero, ln_x4_avx2(u)),
+		_mm256_or_si256(w, _mm256_and_si256(out,
+						    _mm256_set1_epi64x(1))));
+	return _mm256_blendv_epi8(_mm256_sub_epi64(zero, q),
+				  _mm256_set1_epi64x(S64_MIN), out);
+}
+
+/*
+ * (a * m) >> s for 4 lanes of a < 2^49 and of the multiply-shift form
+ * rcp = (s << 56) | m of their weight, see crush_reciprocal_multiplier().
+ * The 100 bits product is computed from 32 bits halves. The variable
+ * shifts give 0 for counts of 64 or more, including the negative ones,
+ * which leaves only the terms that apply to s in [49, 81].
+ */
+CRUSH_TARGET_AVX2
+static inline __m256i mul_shr_x4_avx2(__m256i a, __m256i rcp)
+{
+	const __m256i low32 = _mm256_set1_epi64x(0xffffffffll);
+	const __m256i m = _mm256_and_si256(
+		rcp, _mm256_set1_epi64x((1ll << CRUSH_RECIPROCAL_SHIFT_BITS) - 1));
+	const __m256i s = _mm256_srli_epi64(rcp, CRUSH_RECIPROCAL_SHIFT_BITS);
+	const __m256i a1 = _mm256_srli_epi64(a, 32);
+	const __m256i m1 = _mm256_srli_epi64(m, 32);
+	__m256i p00 = _mm256_mul_epu32(a, m);
+	__m256i mid, lo, hi;
+
+	mid = _mm256_add_epi64(
+		_mm256_add_epi64(_mm256_mul_epu32(a, m1),
+				 _mm256_mul_epu32(a1, m)),
+		_mm256_srli_epi64(p00, 32));
+	lo = _mm256_or_si256(_mm256_slli_epi64(mid, 32),
+			     _mm256_and_si256(p00, low32));
+	hi = _mm256_add_epi64(_mm256_mul_epu32(a1, m1),
+			      _mm256_srli_epi64(mid, 32));
+	return _mm256_or_si256(
+		_mm256_or_si256(_mm256_srlv_epi64(lo, s),
+				_mm256_sllv_epi64(
+					hi, _mm256_sub_epi64(
+						_mm256_set1_epi64x(64), s))),
+		_mm256_srlv_epi64(hi, _mm256_sub_epi64(
+					  s, _mm256_set1_epi64x(64))));
+}
+
+/* draw_x4_avx2() with the reciprocals of the weights */
+CRUSH_TARGET_AVX2
+static inline __m256i draw_rcp_x4_avx2(__m128i u, __m128i w32,
+				       const __u64 *rcp)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i out = _mm256_cmpeq_epi64(_mm256_cvtepu32_epi64(w32), zero);
+	__m256i q = mul_shr_x4_avx2(
+		_mm256_sub_epi64(zero, ln_x4_avx2(u)),
+		_mm256_loadu_si256((const __m256i *)rcp));
+	return _mm256_blendv_epi8(_mm256_sub_epi64(zero, q),
+				  _mm256_set1_epi64x(S64_MIN), out);
+}
+
+CRUSH_TARGET_AVX2
+static int straw2_choose_avx2(const struct crush_bucket_straw2 *bucket,
+			      int x, int r)
+{
+	const unsigned int vsize = bucket->h.size & ~7u;
+	const __m256i vx = _mm256_set1_epi32(x);
+	const __m256i vr = _mm256_set1_epi32(r);
+	__m256i pos_lo = _mm256_set_epi64x(3, 2, 1, 0);
+	__m256i pos_hi = _mm256_set_epi64x(7, 6, 5, 4);
+	__m256i best_lo = pos_lo, best_hi = pos_hi;
+	__m256i high_lo = pos_lo, high_hi = pos_hi;
+	__m256i draw_lo, draw_hi, gt;
+	__s64 lane_draw[8], lane_high[8];
+	unsigned int i;
+
+	for (i = 0; i < vsize; i += 8) {
+		__m256i a = vx, b, c = vr, hash, u, w;
+
+		b = _mm256_loadu_si256((const __m256i *)(bucket->h.items + i));
+		w = _mm256_loadu_si256(
+			(const __m256i *)(bucket->item_weights + i));
+#define VSET1 _mm256_set1_epi32
+#define VSUB _mm256_sub_epi32
+#define VXOR _mm256_xor_si256
+#define VSRL _mm256_srli_epi32
+#define VSLL _mm256_slli_epi32
+		crush_hash32_rjenkins1_3_vec(hash, a, b, c);
+#undef VSET1
+#undef VSUB
+#undef VXOR
+#undef VSRL
+#undef VSLL
+		u = _mm256_and_si256(hash, _mm256_set1_epi32(0xffff));
+		if (bucket->item_reciprocals) {
+			draw_lo = draw_rcp_x4_avx2(
+				_mm256_castsi256_si128(u),
+				_mm256_castsi256_si128(w),
+				bucket->item_reciprocals + i);
+			draw_hi = draw_rcp_x4_avx2(
+				_mm256_extracti128_si256(u, 1),
+				_mm256_extracti128_si256(w, 1),
+				bucket->item_reciprocals + i + 4);
+		} else {
+			draw_lo = draw_x4_avx2(_mm256_castsi256_si128(u),
+					       _mm256_castsi256_si128(w));
+			draw_hi = draw_x4_avx2(
+				_mm256_extracti128_si256(u, 1),
+				_mm256_extracti128_si256(w, 1));
+		}
+		if (i == 0) {
+			best_lo = draw_lo;
+			best_hi = draw_hi;
+			high_lo = pos_lo;
+			high_hi = pos_hi;
+		} else {
+			gt = _mm256_cmpgt_epi64(draw_lo, best_lo);
+			best_lo = _mm256_blendv_epi8(best_lo, draw_lo, gt);
+			high_lo = _mm256_blendv_epi8(high_lo, pos_lo, gt);
+			gt = _mm256_cmpgt_epi64(draw_hi, best_hi);
+			best_hi = _mm256_blendv_epi8(best_hi, draw_hi, gt);
+			high_hi = _mm256_blendv_epi8(high_hi, pos_hi, gt);
+		}
+		pos_lo = _mm256_add_epi64(pos_lo, _mm256_set1_epi64x(8));
+		pos_hi = _mm256_add_epi64(pos_hi, _mm256_set1_epi64x(8));
+	}
+	_mm256_storeu_si256((__m256i *)lane_draw, best_lo);
+	_mm256_storeu_si256((__m256i *)(lane_draw + 4), best_hi);
+	_mm256_storeu_si256((__m256i *)lane_high, high_lo);
+	_mm256_storeu_si256((__m256i *)(lane_high + 4), high_hi);
+	/*
+	 * the compiler does not clear the upper halves before the call:
+	 * the SSE code that runs after would pay for each instruction
+	 */
+	_mm256_zeroupper();
+	return straw2_finish(bucket, x, r, i, lane_draw, lane_high, 8);
+}
+
+CRUSH_TARGET_SSE42
+static void hash32_2_sse42(const __u32 *a, const __u32 *b, __u32 *hash,
+			   int n)
+{
+	int i;
+
+	for (i = 0; i < n; i += 4) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i vhash;
+#define VSET1 _mm_set1_epi32
+#define VSUB _mm_sub_epi32
+#define VXOR _mm_xor_si128
+#define VSRL _mm_srli_epi32
+#define VSLL _mm_slli_epi32
+		crush_hash32_rjenkins1_2_vec(vhash, va, vb);
+#undef VSET1
+#undef VSUB
+#undef VXOR
+#undef VSRL
+#undef VSLL
+		_mm_storeu_si128((__m128i *)(hash + i), vhash);
+	}
+}
+
+CRUSH_TARGET_SSE42
+static void hash32_3_sse42(const __u32 *a, const __u32 *b, const __u32 *c,
+			   __u32 *hash, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i += 4) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i vc = _mm_loadu_si128((const __m128i *)(c + i));
+		__m128i vhash;
+#define VSET1 _mm_set1_epi32
+#define VSUB _mm_sub_epi32
+#define VXOR _mm_xor_si128
+#define VSRL _mm_srli_epi32
+#define VSLL _mm_slli_epi32
+		crush_hash32_rjenkins1_3_vec(vhash, va, vb, vc);
+#undef VSET1
+#undef VSUB
+#undef VXOR
+#undef VSRL
+#undef VSLL
+		_mm_storeu_si128((__m128i *)(hash + i), vhash);
+	}
+}
+
+CRUSH_TARGET_AVX2
+static void hash32_2_avx2(const __u32 *a, const __u32 *b, __u32 *hash,
+			  int n)
+{
+	int i;
+
+	for (i = 0; i < n; i += 8) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		__m256i vhash;
+#define VSET1 _mm256_set1_epi32
+#define VSUB _mm256_sub_epi32
+#define VXOR _mm256_xor_si256
+#define VSRL _mm256_srli_epi32
+#define VSLL _mm256_slli_epi32
+		crush_hash32_rjenkins1_2_vec(vhash, va, vb);
+#undef VSET1
+#undef VSUB
+#undef VXOR
+#undef VSRL
+#undef VSLL
+		_mm256_storeu_si256((__m256i *)(hash + i), vhash);
+	}
+}
+
+CRUSH_TARGET_AVX2
+static void hash32_3_avx2(const __u32 *a, const __u32 *b, const __u32 *c,
+			  __u32 *hash, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i += 8) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		__m256i vc = _mm256_loadu_si256((const __m256i *)(c + i));
+		__m256i vhash;
+#define VSET1 _mm256_set1_epi32
+#define VSUB _mm256_sub_epi32
+#define VXOR _mm256_xor_si256
+#define VSRL _mm256_srli_epi32
+#define VSLL _mm256_slli_epi32
+		crush_hash32_rjenkins1_3_vec(vhash, va, vb, vc);
+#undef VSET1
+#undef VSUB
+#undef VXOR
+#undef VSRL
+#undef VSLL
+		_mm256_storeu_si256((__m256i *)(hash + i), vhash);
+	}
+}
+
+#endif /* CRUSH_SIMD_X86 */
+
+#ifdef CRUSH_SIMD_ARM
+
+/*
+ * NEON has no gather and no 64 bits division: only the hash is
+ * vectorized, which is the larger part of the cost of a draw.
+ */
+static int straw2_choose_neon(const struct crush_bucket_straw2 *bucket,
+			      int x, int r)
+{
+	const unsigned int vsize = bucket->h.size & ~3u;
+	const uint32x4_t vx = vdupq_n_u32(x);
+	const uint32x4_t vr = vdupq_n_u32(r);
+	unsigned int i, l, high = 0;
+	__s64 draw, high_draw = 0;
+	__u32 u[4];
+
+	for (i = 0; i < vsize; i += 4) {
+		uint32x4_t a = vx, b, c = vr, hash;
+
+		b = vld1q_u32((const __u32 *)(bucket->h.items + i));
+#define VSET1 vdupq_n_u32
+#define VSUB vsubq_u32
+#define VXOR veorq_u32
+#define VSRL vshrq_n_u32
+#define VSLL vshlq_n_u32
+		crush_hash32_rjenkins1_3_vec(hash, a, b, c);
+#undef VSET1
+#undef VSUB
+#undef VXOR
+#undef VSRL
+#undef VSLL
+		vst1q_u32(u, vandq_u32(hash, vdupq_n_u32(0xffff)));
+		for (l = 0; l < 4; l++) {
+			unsigned int w = bucket->item_weights[i + l];
+			if (w)
+				draw = div64_s64((__s64)(crush_ln(u[l]) -
+							 0x1000000000000ll), w);
+			else
+				draw = S64_MIN;
+			if (i + l == 0 || draw > high_draw) {
+				high = i + l;
+				high_draw = draw;
+			}
+		}
+	}
+	for (; i < bucket->h.size; i++) {
+		draw = straw2_draw(bucket, x, r, i);
+		if (draw > high_draw) {
+			high = i;
+			high_draw = draw;
+		}
+	}
+	return high;
+}
+
+static void hash32_2_neon(const __u32 *a, const __u32 *b, __u32 *hash,
+			  int n)
+{
+	int i;
+
+	for (i = 0; i < n; i += 4) {
+		uint32x4_t va = vld1q_u32(a + i);
+		uint32x4_t vb = vld1q_u32(b + i);
+		uint32x4_t vhash;
+#define VSET1 vdupq_n_u32
+#define VSUB vsubq_u32
+#define VXOR veorq_u32
+#define VSRL vshrq_n_u32
+#define VSLL vshlq_n_u32
+		crush_hash32_rjenkins1_2_vec(vhash, va, vb);
+#undef VSET1
+#undef VSUB
+#undef VXOR
+#undef VSRL
+#undef VSLL
+		vst1q_u32(hash + i, vhash);
+	}
+}
+
+static void hash32_3_neon(const __u32 *a, const __u32 *b, const __u32 *c,
+			  __u32 *hash, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i += 4) {
+		uint32x4_t va = vld1q_u32(a + i);
+		uint32x4_t vb = vld1q_u32(b + i);
+		uint32x4_t vc = vld1q_u32(c + i);
+		uint32x4_t vhash;
+#define VSET1 vdupq_n_u32
+#define VSUB vsubq_u32
+#define VXOR veorq_u32
+#define VSRL vshrq_n_u32
+#define VSLL vshlq_n_u32
+		crush_hash32_rjenkins1_3_vec(vhash, va, vb, vc);
+#undef VSET1
+#undef VSUB
+#undef VXOR
+#undef VSRL
+#undef VSLL
+		vst1q_u32(hash + i, vhash);
+	}
+}
+
+#endif /* CRUSH_SIMD_ARM */
+
+/************************************************/
+
+static int crush_simd_impl = CRUSH_SIMD_AUTO;
+
+static int crush_simd_supported(int impl)
+{
+	switch (impl) {
+	case CRUSH_SIMD_SCALAR:
+		return 1;
+#ifdef CRUSH_SIMD_X86
+	case CRUSH_SIMD_SSE42:
+		return __builtin_cpu_supports("sse4.2");
+	case CRUSH_SIMD_AVX2:
+		return __builtin_cpu_supports("avx2") &&
+			__builtin_cpu_supports("sse4.2");
+#endif
+#ifdef CRUSH_SIMD_ARM
+	case CRUSH_SIMD_NEON:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+int crush_simd_set_impl(int impl)
+{
+	if (impl == CRUSH_SIMD_AUTO) {
+		if (crush_simd_supported(CRUSH_SIMD_AVX2))
+			impl = CRUSH_SIMD_AVX2;
+		else if (crush_simd_supported(CRUSH_SIMD_SSE42))
+			impl = CRUSH_SIMD_SSE42;
+		else if (crush_simd_supported(CRUSH_SIMD_NEON))
+			impl = CRUSH_SIMD_NEON;
+		else
+			impl = CRUSH_SIMD_SCALAR;
+	}
+	if (!crush_simd_supported(impl))
+		return -ENOTSUP;
+	__atomic_store_n(&crush_simd_impl, impl, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int crush_simd_get_impl(void)
+{
+	int impl = __atomic_load_n(&crush_simd_impl, __ATOMIC_RELAXED);
+
+	if (impl == CRUSH_SIMD_AUTO) {
+		crush_simd_set_impl(CRUSH_SIMD_AUTO);
+		impl = __atomic_load_n(&crush_simd_impl, __ATOMIC_RELAXED);
+	}
+	return impl;
+}
+
+const char *crush_simd_impl_name(int impl)
+{
+	switch (impl) {
+	case CRUSH_SIMD_AUTO: return "auto";
+	case CRUSH_SIMD_SCALAR: return "scalar";
+	case CRUSH_SIMD_SSE42: return "sse4.2";
+	case CRUSH_SIMD_AVX2: return "avx2";
+	case CRUSH_SIMD_NEON: return "neon";
+	default: return "unknown";
+	}
+}
+
+int crush_straw2_simd_choose(const struct crush_bucket_straw2 *bucket,
+			     int x, int r)
+{
+	switch (crush_simd_get_impl()) {
+#ifdef CRUSH_SIMD_X86
+	case CRUSH_SIMD_AVX2:
+		if (bucket->h.size >= 8)
+			return straw2_choose_avx2(bucket, x, r);
+		/* fall through */
+	case CRUSH_SIMD_SSE42:
+		if (bucket->h.size >= 4)
+			return straw2_choose_sse42(bucket, x, r);
+		break;
+#endif
+#ifdef CRUSH_SIMD_ARM
+	case CRUSH_SIMD_NEON:
+		if (bucket->h.size >= 4)
+			return straw2_choose_neon(bucket, x, r);
+		break;
+#endif
+	default:
+		break;
+	}
+	return -1;
+}
+
+/* @n is a multiple of 4 */
+static void hash32_2_lanes(int type, const __u32 *a, const __u32 *b,
+			   __u32 *hash, int n)
+{
+	int i;
+
+	if (type != CRUSH_HASH_RJENKINS1) {
+		for (i = 0; i < n; i++)
+			hash[i] = crush_hash32_2(type, a[i], b[i]);
+		return;
+	}
+	switch (crush_simd_get_impl()) {
+#ifdef CRUSH_SIMD_X86
+	case CRUSH_SIMD_AVX2:
+		if (n % 8 == 0) {
+			hash32_2_avx2(a, b, hash, n);
+			return;
+		}
+		/* fall through */
+	case CRUSH_SIMD_SSE42:
+		hash32_2_sse42(a, b, hash, n);
+		return;
+#endif
+#ifdef CRUSH_SIMD_ARM
+	case CRUSH_SIMD_NEON:
+		hash32_2_neon(a, b, hash, n);
+		return;
+#endif
+	default:
+		for (i = 0; i < n; i++)
+			hash[i] = crush_hash32_rjenkins1_2(a[i], b[i]);
+		return;
+	}
+}
+
+/* @n is a multiple of 4 */
+static void hash32_3_lanes(int type, const __u32 *a, const __u32 *b,
+			   const __u32 *c, __u32 *hash, int n)
+{
+	int i;
+
+	if (type != CRUSH_HASH_RJENKINS1) {
+		for (i = 0; i < n; i++)
+			hash[i] = crush_hash32_3(type, a[i], b[i], c[i]);
+		return;
+	}
+	switch (crush_simd_get_impl()) {
+#ifdef CRUSH_SIMD_X86
+	case CRUSH_SIMD_AVX2:
+		if (n % 8 == 0) {
+			hash32_3_avx2(a, b, c, hash, n);
+			return;
+		}
+		/* fall through */
+	case CRUSH_SIMD_SSE42:
+		hash32_3_sse42(a, b, c, hash, n);
+		return;
+#endif
+#ifdef CRUSH_SIMD_ARM
+	case CRUSH_SIMD_NEON:
+		hash32_3_neon(a, b, c, hash, n);
+		return;
+#endif
+	default:
+		for (i = 0; i < n; i++)
+			hash[i] = crush_hash32_rjenkins1_3(a[i], b[i], c[i]);
+		return;
+	}
+}
+
+void crush_hash32_2_x4(int type, const __u32 *a, const __u32 *b,
+		       __u32 *hash)
+{
+	hash32_2_lanes(type, a, b, hash, 4);
+}
+
+void crush_hash32_2_x8(int type, const __u32 *a, const __u32 *b,
+		       __u32 *hash)
+{
+	hash32_2_lanes(type, a, b, hash, 8);
+}
+
+void crush_hash32_2_x16(int type, const __u32 *a, const __u32 *b,
+			__u32 *hash)
+{
+	hash32_2_lanes(type, a, b, hash, 16);
+}
+
+void crush_hash32_3_x4(int type, const __u32 *a, const __u32 *b,
+		       const __u32 *c, __u32 *hash)
+{
+	hash32_3_lanes(type, a, b, c, hash, 4);
+}
+
+void crush_hash32_3_x8(int type, const __u32 *a, const __u32 *b,
+		       const __u32 *c, __u32 *hash)
+{
+	hash32_3_lanes(type, a, b, c, hash, 8);
+}
+
+void crush_hash32_3_x16(int type, const __u32 *a, const __u32 *b,
+			const __u32 *c, __u32 *hash)
+{
+	hash32_3_lanes(type, a, b, c, hash, 16);
+}
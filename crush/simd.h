@@ -0,0 +1,110 @@
+#ifndef CEPH_CRUSH_SIMD_H
+#define CEPH_CRUSH_SIMD_H
+
+/*
+ * Vectorized implementations of the mapper hot paths.
+ *
+ * They are not part of the kernel sources: mapper.c only calls them
+ * when built outside of the kernel. Every implementation returns
+ * exactly the same value as the scalar code it replaces.
+ *
+ * LGPL2
+ */
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * The instruction sets the vectorized code paths can use. The best
+ * implementation supported by the CPU is selected at runtime unless
+ * another one is forced with crush_simd_set_impl().
+ */
+enum crush_simd_impl {
+	/*! the best implementation supported by the CPU */
+	CRUSH_SIMD_AUTO = 0,
+	/*! no vectorization, the reference implementation */
+	CRUSH_SIMD_SCALAR = 1,
+	/*! x86 SSE4.2, 4 lanes */
+	CRUSH_SIMD_SSE42 = 2,
+	/*! x86 AVX2, 8 lanes */
+	CRUSH_SIMD_AVX2 = 3,
+	/*! ARM NEON, 4 lanes */
+	CRUSH_SIMD_NEON = 4,
+};
+
+/** @ingroup API
+ *
+ * Use the __impl__ implementation for all vectorized code paths. If
+ * __impl__ is ::CRUSH_SIMD_AUTO, the best implementation supported by
+ * the CPU is used. The selection is global to the process and is
+ * meant to be done once, before mapping, or by tests and benchmarks.
+ *
+ * - return -ENOTSUP if the CPU or the build does not support __impl__
+ *
+ * @param impl a ::crush_simd_impl value
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_simd_set_impl(int impl);
+
+/** @ingroup API
+ *
+ * Return the ::crush_simd_impl currently used, never ::CRUSH_SIMD_AUTO.
+ *
+ * @returns the implementation in use
+ */
+extern int crush_simd_get_impl(void);
+
+/** @ingroup API
+ *
+ * Return a human readable name for __impl__, or "unknown".
+ *
+ * @param impl a ::crush_simd_impl value
+ *
+ * @returns a static string
+ */
+extern const char *crush_simd_impl_name(int impl);
+
+/** @ingroup API
+ *
+ * Compute __hash[i] = crush_hash32_2(type, a[i], b[i])__ for the 4, 8
+ * or 16 lanes i of the arrays, as many at once as the implementation
+ * in use allows. The arrays need not be aligned.
+ *
+ * @param type a hash type, for instance ::CRUSH_HASH_RJENKINS1
+ * @param a an array of 4, 8 or 16 values
+ * @param b an array of 4, 8 or 16 values
+ * @param hash the array of 4, 8 or 16 results
+ */
+extern void crush_hash32_2_x4(int type, const __u32 *a, const __u32 *b,
+			      __u32 *hash);
+extern void crush_hash32_2_x8(int type, const __u32 *a, const __u32 *b,
+			      __u32 *hash);
+extern void crush_hash32_2_x16(int type, const __u32 *a, const __u32 *b,
+			       __u32 *hash);
+
+/** @ingroup API
+ *
+ * Compute __hash[i] = crush_hash32_3(type, a[i], b[i], c[i])__ for the
+ * 4, 8 or 16 lanes i of the arrays, see crush_hash32_2_x4().
+ *
+ * @param type a hash type, for instance ::CRUSH_HASH_RJENKINS1
+ * @param a an array of 4, 8 or 16 values
+ * @param b an array of 4, 8 or 16 values
+ * @param c an array of 4, 8 or 16 values
+ * @param hash the array of 4, 8 or 16 results
+ */
+extern void crush_hash32_3_x4(int type, const __u32 *a, const __u32 *b,
+			      const __u32 *c, __u32 *hash);
+extern void crush_hash32_3_x8(int type, const __u32 *a, const __u32 *b,
+			      const __u32 *c, __u32 *hash);
+extern void crush_hash32_3_x16(int type, const __u32 *a, const __u32 *b,
+			       const __u32 *c, __u32 *hash);
+
+/* Returns the position of the item drawn by a straw2 bucket for
+   (x, r), or -1 if no vectorized implementation is in use, in which
+   case the caller must fall back to the scalar draw. */
+extern int crush_straw2_simd_choose(const struct crush_bucket_straw2 *bucket,
+				    int x, int r);
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * Count what the mapper does, per rule and per bucket.
+ *
+ * LGPL2
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crush_compat.h"
+#include "crush.h"
+#include "stats.h"
+
+struct crush_stats *crush_stats_create(const struct crush_map *map)
+{
+	struct crush_stats *stats = calloc(1, sizeof(*stats));
+
+	if (!stats)
+		return NULL;
+	stats->max_rules = map->max_rules;
+	stats->max_buckets = map->max_buckets;
+	stats->rules = calloc(map->max_rules ? map->max_rules : 1,
+			      sizeof(*stats->rules));
+	stats->buckets = calloc(map->max_buckets ? map->max_buckets : 1,
+				sizeof(*stats->buckets));
+	if (!stats->rules || !stats->buckets) {
+		crush_stats_destroy(stats);
+		return NULL;
+	}
+	return stats;
+}
+
+int crush_set_stats(const struct crush_map *map, void *cwin,
+		    struct crush_stats *stats)
+{
+#ifdef CRUSH_STATS
+	struct crush_work *work = cwin;
+
+	if (stats && (stats->max_rules < map->max_rules ||
+		      stats->max_buckets < map->max_buckets))
+		return -EINVAL;
+	work->stats = stats;
+	work->rule_stats = NULL;
+	if (stats)
+		work->track |= CRUSH_TRACK_STATS;
+	else
+		work->track &= ~CRUSH_TRACK_STATS;
+	return 0;
+#else
+	(void)map;
+	(void)cwin;
+	(void)stats;
+	return -EOPNOTSUPP;
+#endif
+}
+
+int crush_stats_merge(struct crush_stats *total,
+		      const struct crush_stats *stats)
+{
+	__u32 r;
+	int b;
+
+	if (total->max_rules != stats->max_rules ||
+	    total->max_buckets != stats->max_buckets)
+		return -EINVAL;
+	for (r = 0; r < stats->max_rules; r++) {
+		struct crush_rule_stats *t = &total->rules[r];
+		const struct crush_rule_stats *s = &stats->rules[r];
+
+		t->mappings += s->mappings;
+		t->descents += s->descents;
+		t->local_retries += s->local_retries;
+		t->descent_retries += s->descent_retries;
+		t->perm_fallbacks += s->perm_fallbacks;
+		t->collisions += s->collisions;
+		t->rejects += s->rejects;
+		t->skip_reps += s->skip_reps;
+	}
+	for (b = 0; b < stats->max_buckets; b++) {
+		total->buckets[b].visits += stats->buckets[b].visits;
+		total->buckets[b].retries += stats->buckets[b].retries;
+	}
+	return 0;
+}
+
+void crush_stats_reset(struct crush_stats *stats)
+{
+	memset(stats->rules, 0, stats->max_rules * sizeof(*stats->rules));
+	memset(stats->buckets, 0,
+	       stats->max_buckets * sizeof(*stats->buckets));
+}
+
+struct bucket_retries {
+	int id;
+	struct crush_bucket_stats stats;
+};
+
+static int compare_retries(const void *a, const void *b)
+{
+	const struct bucket_retries *x = a;
+	const struct bucket_retries *y = b;
+
+	if (x->stats.retries != y->stats.retries)
+		return x->stats.retries < y->stats.retries ? 1 : -1;
+	if (x->stats.visits != y->stats.visits)
+		return x->stats.visits < y->stats.visits ? 1 : -1;
+	return y->id - x->id;
+}
+
+int crush_stats_dump(const struct crush_stats *stats, FILE *f)
+{
+	struct bucket_retries *order;
+	int b, n = 0;
+	__u32 r;
+
+	for (r = 0; r < stats->max_rules; r++) {
+		const struct crush_rule_stats *s = &stats->rules[r];
+
+		if (!s->mappings)
+			continue;
+		fprintf(f, "rule %u mappings %" PRIu64 " descents %" PRIu64
+			" local_retries %" PRIu64 " descent_retries %" PRIu64
+			" perm_fallbacks %" PRIu64 " collisions %" PRIu64
+			" rejects %" PRIu64 " skip_reps %" PRIu64 "\n", r,
+			(uint64_t)s->mappings, (uint64_t)s->descents,
+			(uint64_t)s->local_retries,
+			(uint64_t)s->descent_retries,
+			(uint64_t)s->perm_fallbacks,
+			(uint64_t)s->collisions, (uint64_t)s->rejects,
+			(uint64_t)s->skip_reps);
+	}
+
+	order = malloc((stats->max_buckets ? stats->max_buckets : 1) *
+		       sizeof(*order));
+	if (!order)
+		return -ENOMEM;
+	for (b = 0; b < stats->max_buckets; b++) {
+		if (!stats->buckets[b].visits)
+			continue;
+		order[n].id = -1-b;
+		order[n].stats = stats->buckets[b];
+		n++;
+	}
+	qsort(order, n, sizeof(*order), compare_retries);
+	for (b = 0; b < n; b++)
+		fprintf(f, "bucket %d visits %" PRIu64 " retries %" PRIu64 "\n",
+			order[b].id, (uint64_t)order[b].stats.visits,
+			(uint64_t)order[b].stats.retries);
+	free(order);
+	return ferror(f) ? -EIO : 0;
+}
+
+void crush_stats_destroy(struct crush_stats *stats)
+{
+	if (!stats)
+		return;
+	free(stats->rules);
+	free(stats->buckets);
+	free(stats);
+}
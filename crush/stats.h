@@ -0,0 +1,138 @@
+#ifndef CEPH_CRUSH_STATS_H
+#define CEPH_CRUSH_STATS_H
+
+/*
+ * Count what the mapper does, per rule and per bucket.
+ *
+ * The counters are only compiled in the mapper when libcrush is built
+ * with -DCRUSH_STATS (cmake -DWITH_STATS=ON). Otherwise the mapper is
+ * unchanged and crush_set_stats() returns -EOPNOTSUPP.
+ *
+ * LGPL2
+ */
+
+#include <stdio.h>
+
+#include "crush.h"
+
+/** @ingroup API
+ *
+ * The events counted while mapping with a rule, see crush_set_stats().
+ */
+struct crush_rule_stats {
+	__u64 mappings;		/*!< inputs mapped */
+	__u64 descents;		/*!< descents started from the bucket of a choose step */
+	__u64 local_retries;	/*!< choices retried in the same bucket */
+	__u64 descent_retries;	/*!< descents retried from the bucket of the step */
+	__u64 perm_fallbacks;	/*!< choices made by the exhaustive permutation search */
+	__u64 collisions;	/*!< items rejected because they were already chosen */
+	__u64 rejects;		/*!< devices rejected because they are out */
+	__u64 skip_reps;	/*!< replicas given up after too many tries */
+};
+
+/** @ingroup API
+ *
+ * The events counted for a bucket, see crush_set_stats().
+ */
+struct crush_bucket_stats {
+	__u64 visits;		/*!< choices made from the bucket */
+	__u64 retries;		/*!< choices from the bucket that were rejected */
+};
+
+/** @ingroup API
+ *
+ * The counters of a map, allocated by crush_stats_create().
+ */
+struct crush_stats {
+	__u32 max_rules;			/*!< the size of __rules__ */
+	__s32 max_buckets;			/*!< the size of __buckets__ */
+	struct crush_rule_stats *rules;		/*!< indexed by rule number */
+	struct crush_bucket_stats *buckets;	/*!< indexed by -1-(bucket id) */
+};
+
+/** @ingroup API
+ *
+ * Allocate zeroed counters for the rules and buckets of __map__.
+ *
+ * @param map the crush_map the counters are for
+ *
+ * @returns counters to be released with crush_stats_destroy() or NULL if __malloc(3)__ fails
+ */
+extern struct crush_stats *crush_stats_create(const struct crush_map *map);
+
+/** @ingroup API
+ *
+ * Count in __stats__ the events of crush_do_rule(),
+ * crush_do_rule_batch() and crush_do_plan() when using the workspace
+ * __cwin__ with __map__, or stop counting if __stats__ is NULL, which
+ * is the default after crush_init_workspace(). The counters are only
+ * written by the thread using __cwin__: each thread counts in its own
+ * crush_stats and they are added with crush_stats_merge().
+ *
+ * An item rejected because it collides, is out or has no leaf is
+ * counted as a retry of the bucket it was chosen from.
+ *
+ * - return -EOPNOTSUPP if libcrush was built without __CRUSH_STATS__
+ * - return -EINVAL if __stats__ has fewer rules or buckets than __map__
+ *
+ * @param map the crush_map __cwin__ was initialized for
+ * @param cwin a workspace initialized with crush_init_workspace()
+ * @param stats counters returned by crush_stats_create() or NULL
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_set_stats(const struct crush_map *map, void *cwin,
+			   struct crush_stats *stats);
+
+/** @ingroup API
+ *
+ * Add the counters of __stats__ to __total__.
+ *
+ * - return -EINVAL if they do not have the same number of rules and buckets
+ *
+ * @param total the counters to add to
+ * @param stats the counters to add
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_stats_merge(struct crush_stats *total,
+			     const struct crush_stats *stats);
+
+/** @ingroup API
+ *
+ * Set all the counters of __stats__ to zero.
+ *
+ * @param stats the counters
+ */
+extern void crush_stats_reset(struct crush_stats *stats);
+
+/** @ingroup API
+ *
+ * Write the non zero counters of __stats__ to __f__, one line per
+ * rule and per bucket, for instance:
+ *
+ *     rule 0 mappings 1000 descents 3012 local_retries 0 ...
+ *     bucket -3 visits 1204 retries 12
+ *
+ * The buckets are sorted by decreasing number of retries, so that the
+ * buckets causing the most retries come first.
+ *
+ * - return -ENOMEM if __malloc(3)__ fails
+ * - return -EIO if writing to __f__ fails
+ *
+ * @param stats the counters
+ * @param f the stream to write to
+ *
+ * @returns 0 on success, < 0 on error
+ */
+extern int crush_stats_dump(const struct crush_stats *stats, FILE *f);
+
+/** @ingroup API
+ *
+ * Release counters returned by crush_stats_create().
+ *
+ * @param stats the counters
+ */
+extern void crush_stats_destroy(struct crush_stats *stats);
+
+#endif
@@ -0,0 +1,161 @@
+/*
+ * Compile the text description of a map into a map file.
+ *
+ *     crushc [-o map] [-w weights] description
+ *
+ * Without -o the map is compiled and a summary is printed.
+ *
+ * The map file has no room for the down and offload states of the
+ * devices: -w writes the device weights they give, as passed to
+ * crush_do_rule(), one "device weight" line per device, 0x10000 being
+ * fully in. Writing a map whose description is not fully in without
+ * -w fails, since mapping with it would not give the placement of the
+ * description.
+ *
+ * LGPL2
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "crush.h"
+#include "compiler.h"
+#include "mapfile.h"
+
+static int read_file(const char *path, char **text, size_t *size)
+{
+	FILE *f = fopen(path, "r");
+	size_t allocated = 64 * 1024, n;
+	char *buf, *p;
+
+	if (!f)
+		return -errno;
+	buf = malloc(allocated);
+	*size = 0;
+	while (buf) {
+		n = fread(buf + *size, 1, allocated - *size, f);
+		*size += n;
+		if (*size < allocated)
+			break;
+		allocated *= 2;
+		p = realloc(buf, allocated);
+		if (!p)
+			free(buf);
+		buf = p;
+	}
+	if (!buf || ferror(f)) {
+		free(buf);
+		fclose(f);
+		return buf ? -EIO : -ENOMEM;
+	}
+	fclose(f);
+	*text = buf;
+	return 0;
+}
+
+static int write_weights(const char *path, const __u32 *weights, int count)
+{
+	FILE *f = fopen(path, "w");
+	int d;
+
+	if (!f)
+		return -errno;
+	for (d = 0; d < count; d++)
+		fprintf(f, "%d %u\n", d, weights[d]);
+	if (ferror(f)) {
+		fclose(f);
+		return -EIO;
+	}
+	return fclose(f) ? -errno : 0;
+}
+
+/* true if a device of the map is down or offloaded */
+static int has_weights(const __u32 *weights, int count)
+{
+	int d;
+
+	for (d = 0; d < count; d++)
+		if (weights[d] != 0x10000)
+			return 1;
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: crushc [-o map] [-w weights] description\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *output = NULL, *weights_output = NULL;
+	struct crush_map *map;
+	__u32 *weights;
+	char error[256];
+	size_t size = 0;
+	char *text = NULL;
+	int opt, r;
+
+	while ((opt = getopt(argc, argv, "o:w:")) != -1) {
+		switch (opt) {
+		case 'o':
+			output = optarg;
+			break;
+		case 'w':
+			weights_output = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+
+	r = read_file(argv[optind], &text, &size);
+	if (r < 0) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-r));
+		return 1;
+	}
+	r = crush_compile(text, size, &map, &weights, error, sizeof(error));
+	free(text);
+	if (r < 0) {
+		fprintf(stderr, "%s: %s\n", argv[optind],
+			r == -EINVAL ? error : strerror(-r));
+		return 1;
+	}
+
+	if (output && !weights_output &&
+	    has_weights(weights, map->max_devices)) {
+		fprintf(stderr, "%s: devices are down or offloaded, "
+			"use -w to write their weights\n", argv[optind]);
+		r = -EINVAL;
+	} else if (output || weights_output) {
+		if (output) {
+			r = crush_map_save(map, output);
+			if (r < 0)
+				fprintf(stderr, "%s: %s\n", output,
+					strerror(-r));
+		}
+		if (r >= 0 && weights_output) {
+			r = write_weights(weights_output, weights,
+					  map->max_devices);
+			if (r < 0)
+				fprintf(stderr, "%s: %s\n", weights_output,
+					strerror(-r));
+		}
+	} else {
+		int b, buckets = 0;
+
+		for (b = 0; b < map->max_buckets; b++)
+			if (map->buckets[b])
+				buckets++;
+		printf("%d devices, %d buckets, %u rules\n",
+		       map->max_devices, buckets, map->max_rules);
+	}
+	free(weights);
+	crush_destroy(map);
+	return r < 0 ? 1 : 0;
+}
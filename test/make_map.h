@@ -0,0 +1,101 @@
+#ifndef CRUSH_TEST_MAKE_MAP_H
+#define CRUSH_TEST_MAKE_MAP_H
+
+/*
+ * The map the tests map with, see make_map().
+ */
+
+#include <functional>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+}
+
+/* what make_map() builds, the defaults being the most common map */
+struct test_map {
+  explicit test_map(int hosts_count) : hosts_count(hosts_count) {}
+
+  int hosts_count;
+  /* the hosts of a rack, or 0 if the hosts are in the root */
+  int hosts_per_rack = 0;
+  /* the map to add the buckets and rules to, or NULL for a new one */
+  crush_map *map = NULL;
+  /* set the optimal tunables */
+  bool tunables = true;
+  std::function<int(int host)> host_size = [](int) { return 4; };
+  std::function<int(int host)> host_alg = [](int) { return CRUSH_BUCKET_STRAW2; };
+  std::function<int(int host, int i)> weight =
+    [](int, int i) { return 0x10000 + 0x4000 * i; };
+  /* a rule TAKE root, op 0 1, EMIT for each op */
+  std::vector<int> ops = { CRUSH_RULE_CHOOSELEAF_FIRSTN, CRUSH_RULE_CHOOSELEAF_INDEP };
+};
+
+/* add the bucket of @type made of @items to @m, return its id */
+static inline int add_test_bucket(crush_map *m, int alg, int type,
+                                  const std::vector<int> &items,
+                                  const std::vector<int> &weights) {
+  crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, type, items.size(),
+                                      const_cast<int *>(&items[0]),
+                                      const_cast<int *>(&weights[0]));
+  int id;
+  EXPECT_EQ(0, crush_add_bucket(m, 0, b, &id));
+  return id;
+}
+
+/*
+ * A straw2 root of type 2, or of straw2 racks of type 2 under a root
+ * of type 3, of hosts of type 1 whose devices are numbered in order,
+ * and the rules of @spec. The id of the root and the number of the
+ * first rule are stored in @rootno and @ruleno if they are not NULL.
+ */
+static inline crush_map *make_map(const test_map &spec, int *rootno = NULL,
+                                  int *ruleno = NULL) {
+  crush_map *m = spec.map ? spec.map : crush_create();
+  if (spec.tunables) {
+    m->choose_total_tries = 50;
+    m->chooseleaf_descend_once = 1;
+    m->chooseleaf_vary_r = 1;
+    m->chooseleaf_stable = 1;
+  }
+  std::vector<int> hosts, host_weights, racks, rack_weights;
+  int device = 0;
+  for (int host = 0; host < spec.hosts_count; host++) {
+    std::vector<int> items(spec.host_size(host)), weights(items.size());
+    for (size_t i = 0; i < items.size(); i++) {
+      items[i] = device++;
+      weights[i] = spec.weight(host, i);
+    }
+    hosts.push_back(add_test_bucket(m, spec.host_alg(host), 1, items, weights));
+    host_weights.push_back(m->buckets[-1-hosts.back()]->weight);
+    if (spec.hosts_per_rack && (int)hosts.size() == spec.hosts_per_rack) {
+      racks.push_back(add_test_bucket(m, CRUSH_BUCKET_STRAW2, 2, hosts, host_weights));
+      rack_weights.push_back(m->buckets[-1-racks.back()]->weight);
+      hosts.clear();
+      host_weights.clear();
+    }
+  }
+  int root = spec.hosts_per_rack ?
+    add_test_bucket(m, CRUSH_BUCKET_STRAW2, 3, racks, rack_weights) :
+    add_test_bucket(m, CRUSH_BUCKET_STRAW2, 2, hosts, host_weights);
+  if (rootno)
+    *rootno = root;
+
+  for (size_t i = 0; i < spec.ops.size(); i++) {
+    crush_rule *r = crush_make_rule(3, 0, 1, 1, 10);
+    crush_rule_set_step(r, 0, CRUSH_RULE_TAKE, root, 0);
+    crush_rule_set_step(r, 1, spec.ops[i], 0, 1);
+    crush_rule_set_step(r, 2, CRUSH_RULE_EMIT, 0, 0);
+    int rule = crush_add_rule(m, r, -1);
+    EXPECT_LE(0, rule);
+    if (i == 0 && ruleno)
+      *ruleno = rule;
+  }
+  crush_finalize(m);
+  return m;
+}
+
+#endif
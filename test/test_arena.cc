@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/arena.h"
+}
+
+#include "make_map.h"
+
+/* malloc(3) counting the chunks in use */
+static void *counted_alloc(void *ctx, size_t size) {
+  (*(int *)ctx)++;
+  return malloc(size);
+}
+
+static void counted_free(void *ctx, void *p, size_t size) {
+  (*(int *)ctx)--;
+  free(p);
+}
+
+TEST(arena, crush_arena_alloc) {
+  int allocated = 0;
+  crush_allocator allocator = { counted_alloc, counted_free, &allocated };
+  crush_arena *arena = crush_arena_create(1024, &allocator);
+  ASSERT_TRUE(arena);
+  /* the arena itself */
+  EXPECT_EQ(1, allocated);
+  EXPECT_EQ(0, crush_arena_chunks(arena));
+
+  char *a = (char *)crush_arena_alloc(arena, 3);
+  char *b = (char *)crush_arena_alloc(arena, 8);
+  ASSERT_TRUE(a && b);
+  EXPECT_EQ(0u, (uintptr_t)a % 8);
+  EXPECT_EQ(0u, (uintptr_t)b % 8);
+  EXPECT_LE(a + 8, b);
+  EXPECT_EQ(1, crush_arena_chunks(arena));
+  EXPECT_TRUE(crush_arena_owns(arena, a));
+  EXPECT_TRUE(crush_arena_owns(arena, b + 7));
+  int local;
+  EXPECT_FALSE(crush_arena_owns(arena, &local));
+
+  /* larger than a chunk */
+  char *big = (char *)crush_arena_alloc(arena, 5000);
+  ASSERT_TRUE(big);
+  memset(big, 1, 5000);
+  EXPECT_EQ(2, crush_arena_chunks(arena));
+  EXPECT_EQ(3, allocated);
+  EXPECT_TRUE(crush_arena_owns(arena, a));
+  EXPECT_TRUE(crush_arena_owns(arena, big + 4999));
+
+  crush_arena_destroy(arena);
+  EXPECT_EQ(0, allocated);
+}
+
+TEST(arena, crush_arena_realloc) {
+  crush_arena *arena = crush_arena_create(0, NULL);
+  ASSERT_TRUE(arena);
+
+  /* the last block grows in place */
+  int *last = (int *)crush_arena_realloc(arena, NULL, sizeof(int));
+  ASSERT_TRUE(last);
+  for (int i = 0; i < 100; i++) {
+    last[i] = i;
+    EXPECT_EQ(last, crush_arena_realloc(arena, last, (i + 2) * sizeof(int)));
+  }
+
+  /* an array that is not the last block grows one element at a time
+     and moves O(log(n)) times */
+  int *items = (int *)crush_arena_alloc(arena, sizeof(int));
+  ASSERT_TRUE(items);
+  items[0] = 0;
+  int moves = 0;
+  for (int i = 1; i < 10000; i++) {
+    ASSERT_TRUE(crush_arena_alloc(arena, 8));
+    int *p = (int *)crush_arena_realloc(arena, items, (i + 1) * sizeof(int));
+    ASSERT_TRUE(p);
+    moves += p != items;
+    items = p;
+    items[i] = i;
+  }
+  EXPECT_GE(15, moves);
+  for (int i = 0; i < 10000; i++)
+    ASSERT_EQ(i, items[i]);
+  for (int i = 0; i < 100; i++)
+    ASSERT_EQ(i, last[i]);
+
+  /* shrinking keeps the block */
+  EXPECT_EQ(items, crush_arena_realloc(arena, items, 0));
+  crush_arena_destroy(arena);
+}
+
+/* @hosts_count straw2 hosts of 10 devices in a straw2 root and a rule
+   choosing 3 of them */
+static crush_map *make_map(crush_map *m, int hosts_count) {
+  test_map spec(hosts_count);
+  spec.map = m;
+  spec.host_size = [](int) { return 10; };
+  spec.weight = [](int h, int i) { return 0x10000 * (1 + (h + i) % 3); };
+  spec.ops = { CRUSH_RULE_CHOOSELEAF_FIRSTN };
+  return make_map(spec);
+}
+
+static std::vector<int> mappings(crush_map *m, int x_count) {
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<char> cwin(crush_work_size(m, 3));
+  crush_init_workspace(m, &cwin[0]);
+  std::vector<int> out(3 * x_count);
+  for (int x = 0; x < x_count; x++)
+    EXPECT_EQ(3, crush_do_rule(m, 0, x, &out[3 * x], 3, &weights[0],
+                               weights.size(), &cwin[0], NULL));
+  return out;
+}
+
+TEST(arena, crush_create_arena) {
+  const int hosts_count = 10000;
+  int allocated = 0;
+  crush_allocator allocator = { counted_alloc, counted_free, &allocated };
+  crush_map *m = crush_create_arena(crush_arena_create(0, &allocator));
+  ASSERT_TRUE(m);
+  make_map(m, hosts_count);
+  /* 100000 devices: the arena and its chunks */
+  EXPECT_GE(20, allocated);
+  EXPECT_EQ(allocated, crush_arena_chunks(m->arena) + 1);
+
+  /* the same map as with malloc(3) */
+  crush_map *reference = make_map(crush_create(), hosts_count);
+  EXPECT_EQ(mappings(reference, 1000), mappings(m, 1000));
+
+  /* modifying the map allocates in the arena */
+  EXPECT_EQ(0, crush_map_add_item(m, -1, 10 * hosts_count, 0x10000));
+  EXPECT_EQ(0, crush_map_add_item(reference, -1, 10 * hosts_count, 0x10000));
+  EXPECT_EQ(0, crush_map_remove_item(m, 5));
+  EXPECT_EQ(0, crush_map_remove_item(reference, 5));
+  crush_finalize(m);
+  crush_finalize(reference);
+  EXPECT_EQ(mappings(reference, 1000), mappings(m, 1000));
+  crush_destroy(reference);
+
+  /* a bucket made without the map is released on its own */
+  int items[] = { 10 * hosts_count + 1 };
+  int weights[] = { 0x10000 };
+  crush_bucket *outside = crush_make_bucket(NULL, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                            1, 1, items, weights);
+  ASSERT_TRUE(outside);
+  EXPECT_FALSE(crush_arena_owns(m->arena, outside));
+  int id;
+  EXPECT_EQ(0, crush_add_bucket(m, 0, outside, &id));
+  EXPECT_EQ(0, crush_bucket_add_item(m, outside, 10 * hosts_count + 2, 0x10000));
+  EXPECT_FALSE(crush_arena_owns(m->arena, outside->items));
+
+  /* a bucket of the map is not */
+  crush_bucket *inside = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                           1, 1, items, weights);
+  ASSERT_TRUE(inside);
+  EXPECT_TRUE(crush_arena_owns(m->arena, inside));
+  crush_release_bucket(m, inside);
+  inside = crush_make_bucket(m, CRUSH_BUCKET_LIST, CRUSH_HASH_DEFAULT,
+                             1, 1, items, weights);
+  EXPECT_EQ(0, crush_add_bucket(m, 0, inside, &id));
+  EXPECT_EQ(0, crush_remove_bucket(m, inside));
+
+  crush_destroy(m);
+  EXPECT_EQ(0, allocated);
+}
@@ -0,0 +1,164 @@
+#include <errno.h>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/balance.h"
+}
+
+#include "make_map.h"
+
+/* a straw2 root of @hosts_count straw2 hosts of 2 to 5 devices of
+   various weights or, if @same_hosts, of 4 devices of the same total
+   weight, rule 0 is chooseleaf firstn and rule 1 chooseleaf indep */
+static crush_map *make_map(int hosts_count, bool same_hosts = false) {
+  test_map spec(hosts_count);
+  if (same_hosts) {
+    spec.weight = [](int host, int i) { return 0x10000 + 0x10000 * ((host + i) % 2); };
+  } else {
+    spec.host_size = [](int host) { return 2 + host % 4; };
+    spec.weight = [](int host, int i) { return 0x10000 + 0x8000 * ((host + i) % 3); };
+  }
+  return make_map(spec);
+}
+
+/* the largest |count - target| / target of a device, 16.16 */
+static __u32 deviation(crush_map *m, int ruleno, int result_max, int x_count,
+                       const std::vector<__u32> &weights,
+                       const crush_choose_arg *choose_args) {
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, &cwin[0]);
+  std::vector<double> count(m->max_devices, 0);
+  double total = 0;
+  for (int x = 0; x < x_count; x++) {
+    int result[result_max];
+    int len = crush_do_rule(m, ruleno, x, result, result_max, &weights[0],
+                            weights.size(), &cwin[0], choose_args);
+    for (int i = 0; i < len; i++) {
+      if (result[i] == CRUSH_ITEM_NONE)
+        continue;
+      count[result[i]]++;
+      total++;
+    }
+  }
+  /* the hosts have a single parent: the target is proportional to the
+     weight of the device in the map */
+  double weight = 0;
+  std::vector<double> device_weight(m->max_devices, 0);
+  for (int b = 0; b < m->max_buckets; b++) {
+    crush_bucket *bucket = m->buckets[b];
+    if (!bucket || bucket->type != 1)
+      continue;
+    for (__u32 i = 0; i < bucket->size; i++) {
+      int device = bucket->items[i];
+      device_weight[device] = crush_get_bucket_item_weight(bucket, i) *
+        (weights[device] / (double)0x10000);
+      weight += device_weight[device];
+    }
+  }
+  double worst = 0;
+  for (int device = 0; device < m->max_devices; device++) {
+    double target = total * device_weight[device] / weight;
+    if (target <= 0)
+      continue;
+    double diff = count[device] > target ? count[device] - target : target - count[device];
+    if (diff / target > worst)
+      worst = diff / target;
+  }
+  return worst * 0x10000;
+}
+
+TEST(balance, crush_balance) {
+  const int result_max = 3;
+  const int x_count = 20000;
+  const __u32 tolerance = 0x10000 / 20;
+  crush_map *m = make_map(10);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  weights[7] = 0;
+
+  for (int ruleno : { 0, 1 }) {
+    crush_choose_arg *choose_args = crush_make_choose_args(m, result_max);
+    ASSERT_TRUE(choose_args);
+    __u32 before = deviation(m, ruleno, result_max, x_count, weights, NULL);
+    EXPECT_LT(tolerance, before);
+
+    crush_balance_report report;
+    EXPECT_EQ(0, crush_balance(m, ruleno, result_max, 0, x_count,
+                               &weights[0], weights.size(), choose_args,
+                               50, tolerance, 0, &report));
+    EXPECT_LT(0, report.iterations);
+    EXPECT_GE(tolerance, report.deviation);
+    EXPECT_LT((__u64)x_count, report.mapped);
+    EXPECT_GE((__u64)x_count * (report.iterations + 1), report.mapped);
+    /* the deviation is the one of crush_do_rule() with the overlay */
+    EXPECT_NEAR(report.deviation, deviation(m, ruleno, result_max, x_count,
+                                            weights, choose_args), 1);
+
+    /* the map is not modified */
+    EXPECT_EQ(before, deviation(m, ruleno, result_max, x_count, weights, NULL));
+    crush_destroy_choose_args(choose_args);
+  }
+  crush_destroy(m);
+}
+
+TEST(balance, mapped) {
+  const int result_max = 3;
+  const int x_count = 20000;
+  const __u32 tolerance = 0x10000 / 50;
+  crush_map *m = make_map(10, true);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  crush_choose_arg *choose_args = crush_make_choose_args(m, 1);
+  ASSERT_TRUE(choose_args);
+
+  crush_balance_report report;
+  EXPECT_EQ(0, crush_balance(m, 0, result_max, 0, x_count, &weights[0],
+                             weights.size(), choose_args, 50, tolerance, 2,
+                             &report));
+  EXPECT_LT(0, report.iterations);
+  /* the hosts are balanced: only the inputs that chose from an
+     adjusted host are mapped again */
+  EXPECT_GT((__u64)x_count * (report.iterations + 1), report.mapped);
+  EXPECT_NEAR(report.deviation, deviation(m, 0, result_max, x_count,
+                                          weights, choose_args), 1);
+  crush_destroy_choose_args(choose_args);
+  crush_destroy(m);
+}
+
+TEST(balance, max_iterations) {
+  const int result_max = 3;
+  const int x_count = 2000;
+  crush_map *m = make_map(4);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  crush_choose_arg *choose_args = crush_make_choose_args(m, 1);
+  ASSERT_TRUE(choose_args);
+
+  crush_balance_report report;
+  /* weights are not adjusted: the same mappings as without overlay */
+  EXPECT_EQ(1, crush_balance(m, 0, result_max, 0, x_count, &weights[0],
+                             weights.size(), choose_args, 0, 0, 3, &report));
+  EXPECT_EQ(0, report.iterations);
+  EXPECT_EQ((__u64)x_count, report.mapped);
+  EXPECT_NEAR(deviation(m, 0, result_max, x_count, weights, NULL),
+              report.deviation, 1);
+  /* the deviation cannot be 0 */
+  EXPECT_EQ(1, crush_balance(m, 0, result_max, 0, x_count, &weights[0],
+                             weights.size(), choose_args, 3, 0, 3, &report));
+  EXPECT_EQ(3, report.iterations);
+  /* a tolerance large enough is met without iterating */
+  EXPECT_EQ(0, crush_balance(m, 0, result_max, 0, x_count, &weights[0],
+                             weights.size(), choose_args, 3, 0x10000, 1, &report));
+  EXPECT_EQ(0, report.iterations);
+
+  EXPECT_EQ(-EINVAL, crush_balance(m, 5, result_max, 0, x_count, &weights[0],
+                                   weights.size(), choose_args, 3, 0, 1, NULL));
+  EXPECT_EQ(-EINVAL, crush_balance(m, 0, 0, 0, x_count, &weights[0],
+                                   weights.size(), choose_args, 3, 0, 1, NULL));
+  EXPECT_EQ(-EINVAL, crush_balance(m, 0, result_max, 0, x_count, &weights[0],
+                                   weights.size(), NULL, 3, 0, 1, NULL));
+  crush_destroy_choose_args(choose_args);
+  crush_destroy(m);
+}
@@ -1,6 +1,11 @@
+#include <string.h>
+#include <vector>
+
 #include <gtest/gtest.h>
 
 extern "C" {
+#include "crush/crush_compat.h"
+#include "crush/hash.h"
 #include "crush/builder.h"
 }
 
@@ -19,7 +24,8 @@ TEST(builder, crush_make_bucket) {
   int items[1] = { 1 };
   crush_bucket *b;
 
-  for(auto alg : { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_STRAW2 }) {
+  for(auto alg : { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_STRAW2,
+                   CRUSH_BUCKET_STRAW2_TREE }) {
     b = crush_make_bucket(m, alg, hash, type, size, items, weights);
     ASSERT_TRUE(b);
     EXPECT_EQ(alg, b->alg);
@@ -29,6 +35,196 @@ TEST(builder, crush_make_bucket) {
   crush_destroy(m);
 }
 
+/* the node weights of @b are the sums of the weights of their children */
+static void expect_straw2_tree_nodes(crush_bucket_straw2_tree *b) {
+  __u32 sizes[CRUSH_STRAW2_TREE_MAX_LEVELS + 1];
+  int levels = crush_straw2_tree_levels(b->h.size, sizes);
+  __u32 num_nodes = 0;
+  for (int l = 1; l <= levels; l++)
+    num_nodes += sizes[l];
+  ASSERT_EQ(num_nodes, b->num_nodes);
+  const __u32 *children = b->item_weights;
+  const __u32 *nodes = b->node_weights;
+  __u32 total = 0;
+  for (__u32 i = 0; i < b->h.size; i++)
+    total += b->item_weights[i];
+  EXPECT_EQ(total, b->h.weight);
+  for (int l = 1; l <= levels; l++) {
+    std::vector<__u32> sums(sizes[l], 0);
+    for (__u32 i = 0; i < sizes[l - 1]; i++)
+      sums[i / CRUSH_STRAW2_TREE_FANOUT] += children[i];
+    for (__u32 n = 0; n < sizes[l]; n++)
+      EXPECT_EQ(sums[n], nodes[n]);
+    children = nodes;
+    nodes += sizes[l];
+  }
+  if (levels > 0) {
+    EXPECT_GE(CRUSH_STRAW2_TREE_FANOUT, (int)sizes[levels]);
+  }
+}
+
+TEST(builder, straw2_tree) {
+  crush_map *m = crush_create();
+  std::vector<int> items(300), weights(300);
+  for (int i = 0; i < 300; i++) {
+    items[i] = i;
+    weights[i] = 0x10000 + i;
+  }
+  crush_bucket_straw2_tree *b =
+    (crush_bucket_straw2_tree *)crush_make_bucket(m, CRUSH_BUCKET_STRAW2_TREE,
+                                                  CRUSH_HASH_DEFAULT, 1, 300,
+                                                  &items[0], &weights[0]);
+  ASSERT_TRUE(b);
+  /* 300 items, 19 nodes of 16 items, 2 nodes of 16 nodes */
+  EXPECT_EQ(21u, b->num_nodes);
+  expect_straw2_tree_nodes(b);
+
+  EXPECT_EQ(0x10000 - (0x10000 + 20),
+            crush_bucket_adjust_item_weight(m, &b->h, 20, 0x10000));
+  expect_straw2_tree_nodes(b);
+  EXPECT_EQ(0, crush_bucket_add_item(m, &b->h, 300, 0x20000));
+  EXPECT_EQ(301u, b->h.size);
+  expect_straw2_tree_nodes(b);
+  /* the last item takes the place of the removed item */
+  EXPECT_EQ(0, crush_bucket_remove_item(m, &b->h, 5));
+  EXPECT_EQ(300, b->h.items[5]);
+  EXPECT_EQ(0x20000u, b->item_weights[5]);
+  EXPECT_EQ(6, b->h.items[6]);
+  expect_straw2_tree_nodes(b);
+  EXPECT_EQ(-ENOENT, crush_bucket_remove_item(m, &b->h, 5));
+  /* down to a bucket without nodes */
+  for (int i = 0; i < 300; i++) {
+    if (i == 5)
+      continue;
+    EXPECT_EQ(0, crush_bucket_remove_item(m, &b->h, i));
+  }
+  EXPECT_EQ(1u, b->h.size);
+  EXPECT_EQ(0u, b->num_nodes);
+  EXPECT_EQ(0, crush_bucket_remove_item(m, &b->h, 300));
+  EXPECT_EQ(0u, b->h.size);
+  EXPECT_EQ(0u, b->h.weight);
+  crush_destroy_bucket(&b->h);
+  crush_destroy(m);
+}
+
+/* the node weights of @b are the sums of the weights of their leaves
+   and its descent weights are a breadth first copy of them */
+static void expect_tree_nodes(crush_bucket_tree *b) {
+  if (b->h.size == 0) {
+    EXPECT_EQ(0u, b->num_nodes);
+    EXPECT_FALSE(b->descent_weights);
+    return;
+  }
+  __u32 num_nodes = 2;
+  while (num_nodes < 2 * b->h.size)
+    num_nodes <<= 1;
+  ASSERT_EQ(num_nodes, b->num_nodes);
+  std::vector<__u32> nodes(num_nodes, 0);
+  for (__u32 i = 0; i < b->h.size; i++) {
+    __u32 leaf = crush_calc_tree_node(i);
+    EXPECT_EQ(b->node_weights[leaf], crush_get_bucket_item_weight(&b->h, i));
+    for (__u32 bit = 2; bit < num_nodes; bit <<= 1)
+      nodes[(leaf & ~(2 * bit - 1)) | bit] += b->node_weights[leaf];
+  }
+  for (__u32 n = 2; n < num_nodes; n += 2)
+    EXPECT_EQ(nodes[n], b->node_weights[n]) << "node " << n;
+  EXPECT_EQ(b->h.weight, b->node_weights[num_nodes / 2]);
+  if (num_nodes == 2) {
+    EXPECT_FALSE(b->descent_weights);
+    return;
+  }
+  ASSERT_TRUE(b->descent_weights);
+  __u32 p = 0;
+  for (__u32 half = num_nodes / 2; half > 1; half >>= 1) {
+    for (__u32 n = half; n < num_nodes; n += 2 * half, p++) {
+      EXPECT_EQ(b->node_weights[n], b->descent_weights[2 * p]);
+      EXPECT_EQ(b->node_weights[n - half / 2], b->descent_weights[2 * p + 1]);
+    }
+  }
+}
+
+TEST(builder, tree) {
+  crush_map *m = crush_create();
+  const int size = 300;
+  std::vector<int> items(size), weights(size);
+  for (int i = 0; i < size; i++) {
+    items[i] = i;
+    weights[i] = 0x10000 + i;
+  }
+  crush_bucket_tree *b =
+    (crush_bucket_tree *)crush_make_bucket(m, CRUSH_BUCKET_TREE,
+                                           CRUSH_HASH_DEFAULT, 1, size,
+                                           &items[0], &weights[0]);
+  ASSERT_TRUE(b);
+  /* more nodes than a byte can count */
+  EXPECT_EQ(1024u, b->num_nodes);
+  expect_tree_nodes(b);
+
+  /* adding the items one at a time builds the same tree */
+  crush_bucket_tree *grown =
+    (crush_bucket_tree *)crush_make_bucket(m, CRUSH_BUCKET_TREE,
+                                           CRUSH_HASH_DEFAULT, 1, 0,
+                                           NULL, NULL);
+  ASSERT_TRUE(grown);
+  for (int i = 0; i < size; i++) {
+    ASSERT_EQ(0, crush_bucket_add_item(m, &grown->h, items[i], weights[i]));
+    expect_tree_nodes(grown);
+  }
+  ASSERT_EQ(b->num_nodes, grown->num_nodes);
+  EXPECT_EQ(0, memcmp(b->node_weights, grown->node_weights,
+                      b->num_nodes * sizeof(__u32)));
+  crush_destroy_bucket(&grown->h);
+
+  EXPECT_EQ(0x10000 - (0x10000 + 20),
+            crush_bucket_adjust_item_weight(m, &b->h, 20, 0x10000));
+  expect_tree_nodes(b);
+  /* a hole of weight 0 is left in the middle */
+  EXPECT_EQ(0, crush_bucket_remove_item(m, &b->h, 5));
+  EXPECT_EQ((__u32)size, b->h.size);
+  EXPECT_EQ(0u, crush_get_bucket_item_weight(&b->h, 5));
+  expect_tree_nodes(b);
+  EXPECT_EQ(-ENOENT, crush_bucket_remove_item(m, &b->h, 5));
+  /* the tree shrinks with the items at its end */
+  for (int i = size - 1; i > 5; i--) {
+    EXPECT_EQ(0, crush_bucket_remove_item(m, &b->h, i));
+    expect_tree_nodes(b);
+  }
+  EXPECT_EQ(5u, b->h.size);
+  EXPECT_EQ(16u, b->num_nodes);
+  for (int i = 4; i >= 0; i--)
+    EXPECT_EQ(0, crush_bucket_remove_item(m, &b->h, i));
+  expect_tree_nodes(b);
+  EXPECT_EQ(0u, b->h.weight);
+  crush_destroy_bucket(&b->h);
+  crush_destroy(m);
+}
+
+TEST(builder, tree_reweight) {
+  crush_map *m = crush_create();
+  std::vector<int> hosts(20), host_weights(20, 0);
+  for (int h = 0; h < 20; h++) {
+    int items[] = { 2 * h, 2 * h + 1 };
+    int weights[] = { 0x10000, 0x10000 * (1 + h % 3) };
+    crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                        1, 2, items, weights);
+    ASSERT_EQ(0, crush_add_bucket(m, 0, b, &hosts[h]));
+  }
+  /* the host weights are not known yet */
+  crush_bucket_tree *root =
+    (crush_bucket_tree *)crush_make_bucket(m, CRUSH_BUCKET_TREE, CRUSH_HASH_DEFAULT,
+                                           2, 20, &hosts[0], &host_weights[0]);
+  int rootno;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, &root->h, &rootno));
+  EXPECT_EQ(0u, root->h.weight);
+  EXPECT_EQ(0, crush_reweight_bucket(m, &root->h));
+  __u32 weight = 0;
+  for (int h = 0; h < 20; h++)
+    weight += m->buckets[-1-hosts[h]]->weight;
+  EXPECT_EQ(weight, root->h.weight);
+  expect_tree_nodes(root);
+  crush_destroy(m);
+}
+
 TEST(builder, crush_add_bucket) {
   crush_map *m = crush_create();
   const int type = 1;
@@ -50,6 +246,255 @@ TEST(builder, crush_add_bucket) {
   crush_destroy(m);
 }
 
+TEST(builder, crush_calc_straw2_reciprocal) {
+  EXPECT_EQ(0u, crush_calc_straw2_reciprocal(0));
+  const __u64 max_ln = 0x1000000000000ull;
+  for (__u64 weight : { 1ull, 2ull, 3ull, 7ull, 0x10000ull, 0x10001ull,
+                        0xffffull, 0x7fffffffull, 0x80000000ull,
+                        0x80000001ull, 0xfffffffeull, 0xffffffffull }) {
+    __u64 r = crush_calc_straw2_reciprocal(weight);
+    for (__u64 a : { 0ull, 1ull, weight - 1, weight, weight + 1,
+                     max_ln / weight * weight - 1, max_ln / weight * weight,
+                     max_ln - 1, max_ln })
+      ASSERT_EQ(a / weight,
+                mul_u64_u64_shr(a, crush_reciprocal_multiplier(r),
+                                crush_reciprocal_shift(r))) << weight << " " << a;
+  }
+  unsigned int seed = 1;
+  for (int i = 0; i < 100000; i++) {
+    __u64 weight = 1 + ((__u64)rand_r(&seed) * rand_r(&seed)) % 0xffffffffull;
+    __u64 a = (((__u64)rand_r(&seed) << 31) ^ rand_r(&seed)) % (max_ln + 1);
+    __u64 r = crush_calc_straw2_reciprocal(weight);
+    ASSERT_EQ(a / weight,
+              mul_u64_u64_shr(a, crush_reciprocal_multiplier(r),
+                              crush_reciprocal_shift(r))) << weight << " " << a;
+  }
+}
+
+TEST(builder, straw2_reciprocals) {
+  crush_map *m = crush_create();
+  m->straw2_reciprocals = 1;
+  int items[3] = { 0, 1, 2 };
+  int weights[3] = { 0x10000, 0x20000, 0x30000 };
+  crush_bucket_straw2 *b = (crush_bucket_straw2 *)
+    crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1, 3,
+                      items, weights);
+  ASSERT_TRUE(b->item_reciprocals);
+  ASSERT_EQ(0, crush_bucket_add_item(m, &b->h, 3, 0x40000));
+  ASSERT_EQ(0x10000, crush_bucket_adjust_item_weight(m, &b->h, 0, 0x20000));
+  ASSERT_EQ(0, crush_bucket_remove_item(m, &b->h, 1));
+  ASSERT_EQ(3u, b->h.size);
+  for (unsigned i = 0; i < b->h.size; i++)
+    EXPECT_EQ(crush_calc_straw2_reciprocal(b->item_weights[i]),
+              b->item_reciprocals[i]);
+  m->straw2_reciprocals = 0;
+  ASSERT_EQ(0, crush_calc_straw2_reciprocals(m, b));
+  ASSERT_FALSE(b->item_reciprocals);
+  crush_destroy_bucket(&b->h);
+  crush_destroy(m);
+}
+
 TEST(builder, crush_multiplication_is_unsafe) {
   ASSERT_TRUE(crush_multiplication_is_unsafe(1, 0));
 }
+
+/* a straw2 root of 2 straw2 racks of 3 hosts of 4 devices each */
+static crush_map *make_hierarchy(int *rootno) {
+  crush_map *m = crush_create();
+  m->allowed_bucket_algs = 0xff;
+  const int algs[] = { CRUSH_BUCKET_LIST, CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2 };
+  int racks[2], rack_weights[2];
+  for (int rack = 0; rack < 2; rack++) {
+    int hosts[3], host_weights[3];
+    for (int host = 0; host < 3; host++) {
+      int items[4], weights[4];
+      for (int i = 0; i < 4; i++) {
+        items[i] = (rack * 3 + host) * 4 + i;
+        weights[i] = 0x10000 * (i + 1);
+      }
+      crush_bucket *b = crush_make_bucket(m, algs[host], CRUSH_HASH_DEFAULT,
+                                          1, 4, items, weights);
+      EXPECT_EQ(0, crush_add_bucket(m, 0, b, &hosts[host]));
+      host_weights[host] = b->weight;
+    }
+    crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                        2, 3, hosts, host_weights);
+    EXPECT_EQ(0, crush_add_bucket(m, 0, b, &racks[rack]));
+    rack_weights[rack] = b->weight;
+  }
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                      3, 2, racks, rack_weights);
+  EXPECT_EQ(0, crush_add_bucket(m, 0, b, rootno));
+  crush_finalize(m);
+  return m;
+}
+
+static void expect_same_map(const crush_map *a, const crush_map *b) {
+  EXPECT_EQ(a->max_devices, b->max_devices);
+  EXPECT_EQ(a->working_size, b->working_size);
+  ASSERT_EQ(a->max_buckets, b->max_buckets);
+  for (int i = 0; i < a->max_buckets; i++) {
+    if (!a->buckets[i]) {
+      EXPECT_FALSE(b->buckets[i]);
+      continue;
+    }
+    const crush_bucket *x = a->buckets[i], *y = b->buckets[i];
+    EXPECT_EQ(x->weight, y->weight) << "bucket " << x->id;
+    ASSERT_EQ(x->size, y->size);
+    for (__u32 j = 0; j < x->size; j++) {
+      EXPECT_EQ(x->items[j], y->items[j]);
+      EXPECT_EQ(crush_get_bucket_item_weight(x, j),
+                crush_get_bucket_item_weight(y, j));
+    }
+  }
+}
+
+TEST(builder, crush_map_add_item) {
+  int rootno;
+  crush_map *a = make_hierarchy(&rootno);
+  crush_map *b = make_hierarchy(&rootno);
+  /* the parents of device 0 */
+  const int host = crush_get_parent(a, 0);
+  const int rack = crush_get_parent(a, host);
+  ASSERT_GT(0, host);
+  EXPECT_EQ(rootno, crush_get_parent(a, rack));
+  EXPECT_EQ(0, crush_get_parent(a, rootno));
+  EXPECT_EQ(0, crush_get_parent(a, 1000));
+
+  /* the same changes, incremental on a and followed by a full
+     reweight and finalize on b */
+  auto reweight = [&]() {
+    EXPECT_EQ(0, crush_reweight_bucket(b, b->buckets[-1-rootno]));
+    crush_finalize(b);
+    expect_same_map(a, b);
+  };
+
+  for (int device : { 0, 5, 13, 23 }) {
+    int parent = crush_get_parent(a, device);
+    EXPECT_EQ(0, crush_map_adjust_item_weight(a, device, 0x38000));
+    crush_bucket_adjust_item_weight(b, b->buckets[-1-parent], device, 0x38000);
+    reweight();
+  }
+
+  EXPECT_EQ(0, crush_map_add_item(a, host, 100, 0x18000));
+  EXPECT_EQ(0, crush_bucket_add_item(b, b->buckets[-1-host], 100, 0x18000));
+  reweight();
+  EXPECT_EQ(101, a->max_devices);
+  EXPECT_EQ(host, crush_get_parent(a, 100));
+
+  EXPECT_EQ(0, crush_map_remove_item(a, 7));
+  EXPECT_EQ(0, crush_bucket_remove_item(b, b->buckets[-1-crush_get_parent(b, 7)], 7));
+  reweight();
+  EXPECT_EQ(0, crush_get_parent(a, 7));
+
+  /* move a host to the other rack */
+  const int other_rack = crush_get_parent(a, 23 - 1);
+  const int moved = crush_get_parent(a, 5);
+  ASSERT_NE(rack, other_rack);
+  const int weight = a->buckets[-1-moved]->weight;
+  EXPECT_EQ(0, crush_map_remove_item(a, moved));
+  EXPECT_EQ(0, crush_map_add_item(a, other_rack, moved, weight));
+  EXPECT_EQ(0, crush_bucket_remove_item(b, b->buckets[-1-rack], moved));
+  EXPECT_EQ(0, crush_bucket_add_item(b, b->buckets[-1-other_rack], moved, weight));
+  reweight();
+  EXPECT_EQ(other_rack, crush_get_parent(a, moved));
+
+  EXPECT_EQ(0, crush_map_remove_item(a, 100));
+  EXPECT_EQ(0, crush_bucket_remove_item(b, b->buckets[-1-host], 100));
+  reweight();
+  EXPECT_EQ(24, a->max_devices);
+
+  EXPECT_EQ(-EEXIST, crush_map_add_item(a, host, 1, 0x10000));
+  EXPECT_EQ(-ENOENT, crush_map_add_item(a, -100, 7, 0x10000));
+  EXPECT_EQ(-ENOENT, crush_map_add_item(a, host, -100, 0x10000));
+  EXPECT_EQ(-ELOOP, crush_map_add_item(a, host, rootno, 0x10000));
+  EXPECT_EQ(-ENOENT, crush_map_adjust_item_weight(a, 7, 0x10000));
+  EXPECT_EQ(-ENOENT, crush_map_remove_item(a, 1000));
+
+  /* an item in two buckets cannot be updated incrementally */
+  EXPECT_EQ(0, crush_bucket_add_item(a, a->buckets[-1-other_rack], 7, 0x10000));
+  EXPECT_EQ(0, crush_bucket_add_item(a, a->buckets[-1-host], 7, 0x10000));
+  crush_finalize(a);
+  EXPECT_EQ(CRUSH_PARENT_MANY, crush_get_parent(a, 7));
+  EXPECT_EQ(-EINVAL, crush_map_adjust_item_weight(a, 7, 0x20000));
+
+  crush_destroy(a);
+  crush_destroy(b);
+}
+
+TEST(builder, crush_map_add_bucket) {
+  int rootno;
+  crush_map *a = make_hierarchy(&rootno);
+  crush_map *b = make_hierarchy(&rootno);
+  const int rack = crush_get_parent(a, crush_get_parent(a, 0));
+
+  /* enough hosts for the array of buckets to grow */
+  for (int host = 0; host < 8; host++) {
+    int items[3], weights[3];
+    for (int i = 0; i < 3; i++) {
+      items[i] = 100 + host * 3 + i;
+      weights[i] = 0x10000 * (i + 1);
+    }
+    int ida, idb;
+    crush_bucket *bucket = crush_make_bucket(a, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                             1, 3, items, weights);
+    ASSERT_EQ(0, crush_map_add_bucket(a, 0, bucket, &ida));
+    EXPECT_EQ(ida, crush_get_parent(a, items[0]));
+    EXPECT_EQ(0, crush_get_parent(a, ida));
+    EXPECT_EQ(0, crush_map_add_item(a, rack, ida, bucket->weight));
+    bucket = crush_make_bucket(b, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                               1, 3, items, weights);
+    ASSERT_EQ(0, crush_add_bucket(b, 0, bucket, &idb));
+    EXPECT_EQ(ida, idb);
+    EXPECT_EQ(0, crush_bucket_add_item(b, b->buckets[-1-rack], idb, bucket->weight));
+    EXPECT_EQ(0, crush_reweight_bucket(b, b->buckets[-1-rootno]));
+    crush_finalize(b);
+    expect_same_map(a, b);
+  }
+  EXPECT_EQ(124, a->max_devices);
+
+  int items[2] = { 1, 200 }, weights[2] = { 0x10000, 0x10000 };
+  crush_bucket *bucket = crush_make_bucket(a, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                           1, 2, items, weights);
+  EXPECT_EQ(-EEXIST, crush_map_add_bucket(a, 0, bucket, NULL));
+  bucket->items[0] = -100;
+  EXPECT_EQ(-ENOENT, crush_map_add_bucket(a, 0, bucket, NULL));
+  crush_destroy_bucket(bucket);
+
+  crush_destroy(a);
+  crush_destroy(b);
+}
+
+TEST(builder, crush_clone_bucket) {
+  crush_map *m = crush_create();
+  m->straw2_reciprocals = 1;
+  int items[5] = { 0, 1, 2, 3, 4 };
+  int weights[5] = { 0x10000, 0x20000, 0x30000, 0x40000, 0x50000 };
+  for (auto alg : { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+                    CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2,
+                    CRUSH_BUCKET_STRAW2_TREE }) {
+    crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, 1, 5,
+                                        items, weights);
+    ASSERT_TRUE(b);
+    b->id = -3;
+    crush_bucket *c = crush_clone_bucket(b);
+    ASSERT_TRUE(c);
+    EXPECT_EQ(b->id, c->id);
+    EXPECT_EQ(b->weight, c->weight);
+    ASSERT_EQ(b->size, c->size);
+    EXPECT_NE(b->items, c->items);
+    for (__u32 i = 0; i < b->size; i++) {
+      EXPECT_EQ(b->items[i], c->items[i]);
+      EXPECT_EQ(crush_get_bucket_item_weight(b, i),
+                crush_get_bucket_item_weight(c, i));
+    }
+    /* the copy is modified on its own */
+    crush_bucket_adjust_item_weight(m, c, 2, 0x80000);
+    EXPECT_NE(b->weight, c->weight);
+    EXPECT_EQ(alg == CRUSH_BUCKET_UNIFORM ? 0x10000 : 0x30000,
+              crush_get_bucket_item_weight(b, 2));
+    crush_destroy_bucket(b);
+    crush_destroy_bucket(c);
+  }
+  crush_destroy(m);
+}
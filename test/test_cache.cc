@@ -0,0 +1,161 @@
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/cache.h"
+}
+
+#include "make_map.h"
+
+/* a straw2 root of @hosts_count straw2 hosts of 4 devices, rule 0 is
+   chooseleaf firstn and rule 1 chooseleaf indep */
+static crush_map *make_map(int hosts_count) {
+  test_map spec(hosts_count);
+  spec.weight = [](int, int) { return 0x10000; };
+  return make_map(spec);
+}
+
+static std::vector<int> mapping(crush_map *m, int ruleno, int x, int result_max,
+                                const std::vector<__u32> &weights, void *cwin) {
+  std::vector<int> result(result_max);
+  result.resize(crush_do_rule(m, ruleno, x, &result[0], result_max,
+                              &weights[0], weights.size(), cwin, NULL));
+  return result;
+}
+
+static std::vector<int> cached(crush_cache *cache, crush_map *m, __u32 epoch,
+                               int ruleno, int x, int result_max,
+                               const std::vector<__u32> &weights,
+                               __u32 generation, void *cwin) {
+  std::vector<int> result(result_max);
+  result.resize(crush_cache_do_rule(cache, m, epoch, ruleno, x, &result[0],
+                                    result_max, &weights[0], weights.size(),
+                                    generation, cwin));
+  return result;
+}
+
+TEST(cache, crush_cache_do_rule) {
+  const int result_max = 3;
+  crush_map *m = make_map(10);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<__u32> changed(weights);
+  changed[3] = 0;
+  changed[17] = 0;
+  std::vector<char> cwin(crush_work_size(m, result_max + 1));
+  crush_init_workspace(m, &cwin[0]);
+
+  EXPECT_EQ(NULL, crush_cache_create(1 << 20, 0));
+  EXPECT_EQ(NULL, crush_cache_create(16, result_max));
+  crush_cache *cache = crush_cache_create(1 << 20, result_max);
+  ASSERT_TRUE(cache);
+
+  for (int ruleno : { 0, 1 }) {
+    for (int x = 0; x < 1000; x++) {
+      EXPECT_EQ(mapping(m, ruleno, x, result_max, weights, &cwin[0]),
+                cached(cache, m, 1, ruleno, x, result_max, weights, 1, &cwin[0]));
+    }
+  }
+  int moved = 0;
+  for (int x = 0; x < 1000; x++) {
+    std::vector<int> before = mapping(m, 0, x, result_max, weights, &cwin[0]);
+    moved += before != mapping(m, 0, x, result_max, changed, &cwin[0]);
+    /* the same generation returns the cached results */
+    EXPECT_EQ(before, cached(cache, m, 1, 0, x, result_max, changed, 1, &cwin[0]));
+  }
+  for (int x = 0; x < 1000; x++) {
+    /* a new generation or epoch maps again */
+    std::vector<int> after = mapping(m, 0, x, result_max, changed, &cwin[0]);
+    EXPECT_EQ(after, cached(cache, m, 1, 0, x, result_max, changed, 2, &cwin[0]));
+    EXPECT_EQ(after, cached(cache, m, 2, 0, x, result_max, changed, 1, &cwin[0]));
+    /* the results are kept per result_max */
+    EXPECT_EQ(mapping(m, 0, x, 2, changed, &cwin[0]),
+              cached(cache, m, 2, 0, x, 2, changed, 1, &cwin[0]));
+    /* larger than the cache */
+    EXPECT_EQ(mapping(m, 0, x, result_max + 1, changed, &cwin[0]),
+              cached(cache, m, 2, 0, x, result_max + 1, changed, 1, &cwin[0]));
+  }
+  EXPECT_LT(0, moved);
+
+  crush_cache_clear(cache);
+  for (int x = 0; x < 1000; x++) {
+    EXPECT_EQ(mapping(m, 0, x, result_max, changed, &cwin[0]),
+              cached(cache, m, 1, 0, x, result_max, changed, 1, &cwin[0]));
+  }
+  crush_cache_destroy(cache);
+  crush_destroy(m);
+}
+
+TEST(cache, crush_cache_create_dense) {
+  const int result_max = 3;
+  const int pgs = 512;
+  crush_map *m = make_map(10);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<__u32> out(m->max_devices, 0);
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, &cwin[0]);
+
+  EXPECT_EQ(NULL, crush_cache_create_dense(0, result_max));
+  crush_cache *cache = crush_cache_create_dense(pgs, result_max);
+  ASSERT_TRUE(cache);
+  std::vector<int> x(pgs);
+  for (int pg = 0; pg < pgs; pg++)
+    x[pg] = pg;
+  EXPECT_EQ(pgs, crush_cache_warm(cache, m, 7, 1, &x[0], pgs,
+                                  &weights[0], weights.size(), 3, &cwin[0]));
+  for (int pg = 0; pg < pgs; pg++) {
+    /* served from the table: the devices being out does not matter */
+    EXPECT_EQ(mapping(m, 1, pg, result_max, weights, &cwin[0]),
+              cached(cache, m, 7, 1, pg, result_max, out, 3, &cwin[0]));
+  }
+  /* outside of the table */
+  EXPECT_EQ(mapping(m, 1, pgs, result_max, out, &cwin[0]),
+            cached(cache, m, 7, 1, pgs, result_max, out, 3, &cwin[0]));
+  /* another rule replaces the result of the input */
+  EXPECT_EQ(mapping(m, 0, 5, result_max, weights, &cwin[0]),
+            cached(cache, m, 7, 0, 5, result_max, weights, 3, &cwin[0]));
+  EXPECT_EQ(mapping(m, 1, 5, result_max, out, &cwin[0]),
+            cached(cache, m, 7, 1, 5, result_max, out, 3, &cwin[0]));
+  crush_cache_destroy(cache);
+  crush_destroy(m);
+}
+
+TEST(cache, threads) {
+  const int result_max = 3;
+  crush_map *m = make_map(10);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  /* a small cache so that the threads keep replacing the same slots */
+  crush_cache *cache = crush_cache_create(4096, result_max);
+  ASSERT_TRUE(cache);
+  std::vector<std::vector<int> > expected(2000);
+  {
+    std::vector<char> cwin(crush_work_size(m, result_max));
+    crush_init_workspace(m, &cwin[0]);
+    for (int x = 0; x < (int)expected.size(); x++)
+      expected[x] = mapping(m, 0, x, result_max, weights, &cwin[0]);
+  }
+  std::vector<int> errors(4, 0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < (int)errors.size(); t++) {
+    threads.push_back(std::thread([&, t]() {
+      std::vector<char> cwin(crush_work_size(m, result_max));
+      crush_init_workspace(m, &cwin[0]);
+      for (int i = 0; i < 20000; i++) {
+        int x = (i * 7 + t * 13) % expected.size();
+        if (cached(cache, m, 1, 0, x, result_max, weights, 1, &cwin[0]) !=
+            expected[x])
+          errors[t]++;
+      }
+    }));
+  }
+  for (auto &thread : threads)
+    thread.join();
+  for (int e : errors)
+    EXPECT_EQ(0, e);
+  crush_cache_destroy(cache);
+  crush_destroy(m);
+}
@@ -0,0 +1,238 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/compiler.h"
+}
+
+static int compile(const std::string &text, crush_map **m, __u32 **weights,
+                   std::string *error = NULL) {
+  char buf[256];
+  int r = crush_compile(text.c_str(), text.size(), m, weights,
+                        buf, sizeof(buf));
+  if (error)
+    *error = buf;
+  return r;
+}
+
+static const char *sample =
+  "# devices\n"
+  "device 1 osd001\n"
+  "device 2 osd002\n"
+  "device 3 osd003 down   # same as offload 1.0\n"
+  "device 4 osd004 offload 0       # 0.0 -> normal, 1.0 -> failed\n"
+  "device 5 osd005 offload 0.1\n"
+  "device 6 osd006 offload 0.1\n"
+  "\n"
+  "# hierarchy\n"
+  "type 0 osd   # 'device' is actually the default for 0\n"
+  "type 2 cab\n"
+  "type 3 row\n"
+  "type 10 pool\n"
+  "\n"
+  "cab root {\n"
+  "       id -1         # optional\n"
+  "       alg tree     # required\n"
+  "       item osd001\n"
+  "       item osd002 weight 600 pos 1\n"
+  "       item osd003 weight 600 pos 0\n"
+  "       item osd004 weight 600 pos 3\n"
+  "       item osd005 weight 600 pos 4\n"
+  "}\n"
+  "\n"
+  "# rules\n"
+  "rule normal {\n"
+  "     # these are required.\n"
+  "     pool 0\n"
+  "     type replicated \n"
+  "     min_size 1\n"
+  "     max_size 4\n"
+  "     # need 1 or more of these.\n"
+  "     step take root\n"
+  "     step choose firstn 0 type osd\n"
+  "     step emit\n"
+  "}\n"
+  "\n"
+  "rule {\n"
+  "     pool 1\n"
+  "     type erasure\n"
+  "     min_size 3\n"
+  "     max_size 6\n"
+  "     step take root\n"
+  "     step choose indep 0 type osd\n"
+  "     step emit\n"
+  "}\n";
+
+TEST(compiler, sample) {
+  crush_map *m;
+  __u32 *weights;
+  std::string error;
+  ASSERT_EQ(0, compile(sample, &m, &weights, &error)) << error;
+
+  EXPECT_EQ(7, m->max_devices);
+  EXPECT_EQ(0x10000u, weights[1]);
+  EXPECT_EQ(0u, weights[3]);
+  EXPECT_EQ(0x10000u, weights[4]);
+  EXPECT_EQ((__u32)(0.9 * 0x10000 + 0.5), weights[5]);
+
+  crush_bucket *root = m->buckets[0];
+  ASSERT_TRUE(root);
+  EXPECT_EQ(-1, root->id);
+  EXPECT_EQ(CRUSH_BUCKET_TREE, root->alg);
+  EXPECT_EQ(2, root->type);
+  ASSERT_EQ(5u, root->size);
+  /* the items with a pos first, osd001 in the free position */
+  EXPECT_EQ(3, root->items[0]);
+  EXPECT_EQ(2, root->items[1]);
+  EXPECT_EQ(1, root->items[2]);
+  EXPECT_EQ(4, root->items[3]);
+  EXPECT_EQ(5, root->items[4]);
+  EXPECT_EQ(0x10000u + 4 * 600 * 0x10000u, root->weight);
+
+  ASSERT_EQ(2u, m->max_rules);
+  EXPECT_EQ(0, m->rules[0]->mask.ruleset);
+  EXPECT_EQ(1, m->rules[0]->mask.type);
+  EXPECT_EQ(4, m->rules[0]->mask.max_size);
+  ASSERT_EQ(3u, m->rules[0]->len);
+  EXPECT_EQ(CRUSH_RULE_TAKE, m->rules[0]->steps[0].op);
+  EXPECT_EQ(-1, m->rules[0]->steps[0].arg1);
+  EXPECT_EQ(CRUSH_RULE_CHOOSE_FIRSTN, m->rules[0]->steps[1].op);
+  EXPECT_EQ(0, m->rules[0]->steps[1].arg2);
+  EXPECT_EQ(1, m->rules[1]->mask.ruleset);
+  EXPECT_EQ(3, m->rules[1]->mask.type);
+  EXPECT_EQ(CRUSH_RULE_CHOOSE_INDEP, m->rules[1]->steps[1].op);
+
+  /* the down device is never chosen */
+  std::vector<char> cwin(crush_work_size(m, 3));
+  crush_init_workspace(m, &cwin[0]);
+  for (int x = 0; x < 100; x++) {
+    int result[3];
+    int len = crush_do_rule(m, 0, x, result, 3, weights, m->max_devices,
+                            &cwin[0], NULL);
+    EXPECT_EQ(3, len);
+    for (int i = 0; i < len; i++)
+      EXPECT_NE(3, result[i]);
+  }
+
+  free(weights);
+  crush_destroy(m);
+}
+
+TEST(compiler, hierarchy) {
+  std::string text =
+    "tunable choose_total_tries 50\n"
+    "tunable chooseleaf_vary_r 1\n"
+    "type 0 osd\ntype 1 host\ntype 2 root\n";
+  for (int d = 0; d < 12; d++)
+    text += "device " + std::to_string(d) + " osd." + std::to_string(d) + "\n";
+  for (int h = 0; h < 4; h++) {
+    text += "host host" + std::to_string(h) + " {\n";
+    if (h == 1)
+      text += "  alg uniform\n";
+    for (int i = 0; i < 3; i++)
+      text += "  item osd." + std::to_string(3 * h + i) + " weight 2.0\n";
+    text += "}\n";
+  }
+  text += "root default{id -10 hash rjenkins1";
+  for (int h = 0; h < 4; h++)
+    text += " item host" + std::to_string(h);
+  text += "}\n"
+    "rule data { id 3 type replicated min_size 1 max_size 10\n"
+    "  step set_chooseleaf_tries 5\n"
+    "  step take default step chooseleaf firstn 0 type host step emit }\n";
+
+  crush_map *m;
+  std::string error;
+  ASSERT_EQ(0, compile(text, &m, NULL, &error)) << error;
+  EXPECT_EQ(50u, m->choose_total_tries);
+  EXPECT_EQ(1, m->chooseleaf_vary_r);
+  EXPECT_EQ(12, m->max_devices);
+
+  crush_bucket *root = m->buckets[-1-(-10)];
+  ASSERT_TRUE(root);
+  EXPECT_EQ(CRUSH_BUCKET_STRAW2, root->alg);
+  EXPECT_EQ(4u, root->size);
+  /* a bucket weighs the sum of its items by default */
+  EXPECT_EQ(4u * 3 * 0x20000, root->weight);
+  EXPECT_EQ(CRUSH_BUCKET_UNIFORM, m->buckets[-1-root->items[1]]->alg);
+
+  ASSERT_EQ(4u, m->max_rules);
+  ASSERT_TRUE(m->rules[3]);
+  EXPECT_EQ(3, m->rules[3]->mask.ruleset);
+  EXPECT_EQ(CRUSH_RULE_SET_CHOOSELEAF_TRIES, m->rules[3]->steps[0].op);
+  EXPECT_EQ(5, m->rules[3]->steps[0].arg1);
+  EXPECT_EQ(CRUSH_RULE_CHOOSELEAF_FIRSTN, m->rules[3]->steps[2].op);
+  EXPECT_EQ(1, m->rules[3]->steps[2].arg2);
+
+  std::vector<char> cwin(crush_work_size(m, 3));
+  crush_init_workspace(m, &cwin[0]);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  for (int x = 0; x < 100; x++) {
+    int result[3];
+    EXPECT_EQ(3, crush_do_rule(m, 3, x, result, 3, &weights[0],
+                               weights.size(), &cwin[0], NULL));
+    /* one device per host */
+    EXPECT_NE(result[0] / 3, result[1] / 3);
+    EXPECT_NE(result[0] / 3, result[2] / 3);
+    EXPECT_NE(result[1] / 3, result[2] / 3);
+  }
+  crush_destroy(m);
+}
+
+TEST(compiler, errors) {
+  const char *header =
+    "device 0 osd0\ndevice 1 osd1\ntype 0 osd\ntype 1 host\n";
+  const struct {
+    const char *text;
+    const char *error;
+  } cases[] = {
+    { "foo", "line 5: unexpected 'foo'" },
+    { "device x osd2", "line 5: 'x' is not an integer" },
+    { "device 2 osd0", "line 5: item 'osd0' already defined" },
+    { "type 2 host", "line 5: type 'host' already defined" },
+    { "tunable foo 1", "line 5: unknown tunable 'foo'" },
+    { "host h {\n item osd2\n}", "line 6: unknown item 'osd2'" },
+    { "host h {\n alg foo\n}", "line 6: unknown bucket algorithm 'foo'" },
+    { "host h {\n id 1\n}", "line 6: bucket id 1 must be negative" },
+    { "host h {\n item osd0 weight -1\n}", "line 6: weight -1 out of range" },
+    { "host h { item osd0 pos 2 }", "line 5: position 2 out of range" },
+    { "host h { item osd0 pos 0 item osd1 pos 0 }",
+      "line 5: position 0 used twice" },
+    { "host h { alg uniform item osd0 item osd1 weight 2 }",
+      "line 5: the items of uniform bucket h must have the same weight" },
+    { "host h { id -1 }\nhost g { id -1 }", "line 6: bucket id -1 already used" },
+    { "host h {\n item osd0", "line 6: unexpected end of file, expected }" },
+    { "rule { step take osd0 step choose firstn 0 type rack }",
+      "line 5: unknown type 'rack'" },
+    { "rule { step choose foo 0 type osd }",
+      "line 5: expected firstn or indep instead of 'foo'" },
+    { "rule { step foo }", "line 5: unknown step 'foo'" },
+    { "rule { id 0 }\nrule { id 0 }", "line 6: rule id 0 already used" },
+    { "rule { id -2 }", "line 5: rule id -2 out of range" },
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    crush_map *m = NULL;
+    __u32 *weights = NULL;
+    std::string error;
+    EXPECT_EQ(-EINVAL, compile(std::string(header) + cases[i].text,
+                               &m, &weights, &error)) << cases[i].text;
+    EXPECT_EQ(cases[i].error, error);
+    EXPECT_EQ(NULL, m);
+    EXPECT_EQ(NULL, weights);
+  }
+
+  /* the error is truncated to the buffer */
+  crush_map *m;
+  char error[8];
+  EXPECT_EQ(-EINVAL, crush_compile("foo", 3, &m, NULL, error, sizeof(error)));
+  EXPECT_STREQ("line 1:", error);
+  EXPECT_EQ(-EINVAL, crush_compile("foo", 3, &m, NULL, NULL, 0));
+}
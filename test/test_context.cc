@@ -0,0 +1,219 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/context.h"
+}
+
+#include "make_map.h"
+
+/* @hosts_count straw2 hosts of @host_size devices, of which the ones
+   of odd size, in a straw2 root and a rule choosing 3 of them */
+static crush_map *make_map(int hosts_count, int host_size) {
+  test_map spec(hosts_count);
+  spec.host_size = [host_size](int h) { return host_size + h % 2; };
+  spec.weight = [](int h, int i) { return 0x10000 * (1 + (h + i) % 3); };
+  spec.ops = { CRUSH_RULE_CHOOSELEAF_FIRSTN };
+  return make_map(spec);
+}
+
+static void expect_same_mappings(crush_map *m, crush_context *ctx) {
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  weights[3] = 0;
+  std::vector<char> cwin(crush_work_size(m, 3));
+  crush_init_workspace(m, &cwin[0]);
+  for (int x = 0; x < 1000; x++) {
+    int expected[3], result[3];
+    int len = crush_do_rule(m, 0, x, expected, 3, &weights[0], weights.size(),
+                            &cwin[0], NULL);
+    ASSERT_EQ(len, crush_context_do_rule(ctx, 0, x, result, 3, &weights[0],
+                                         weights.size(), NULL));
+    for (int i = 0; i < len; i++)
+      ASSERT_EQ(expected[i], result[i]);
+  }
+}
+
+TEST(context, crush_context_bind) {
+  crush_context *ctx = crush_context_create();
+  ASSERT_TRUE(ctx);
+  int result[3];
+  __u32 weights[1] = { 0x10000 };
+  EXPECT_EQ(0, crush_context_do_rule(ctx, 0, 1, result, 3, weights, 1, NULL));
+  EXPECT_EQ(NULL, crush_context_workspace(ctx));
+
+  crush_map *m = make_map(20, 5);
+  EXPECT_EQ(-EINVAL, crush_context_bind(ctx, m, 1, 0));
+  EXPECT_EQ(0, crush_context_bind(ctx, m, 1, 3));
+  void *cwin = crush_context_workspace(ctx);
+  ASSERT_TRUE(cwin);
+  /* every bucket has its own cache lines */
+  EXPECT_EQ(0u, (uintptr_t)cwin % 64);
+  crush_work *work = (crush_work *)cwin;
+  for (int b = 0; b < m->max_buckets; b++) {
+    if (!m->buckets[b])
+      continue;
+    EXPECT_EQ(0u, (uintptr_t)work->work[b] % 64);
+    EXPECT_EQ((char *)(work->work[b] + 1), (char *)work->work[b]->perm);
+  }
+  expect_same_mappings(m, ctx);
+  /* more items than it was bound for */
+  int more[4];
+  EXPECT_EQ(0, crush_context_do_rule(ctx, 0, 1, more, 4, weights, 1, NULL));
+
+  /* the same epoch is not initialized again */
+  work->work[0]->perm_x = 1234;
+  EXPECT_EQ(0, crush_context_bind(ctx, m, 1, 2));
+  EXPECT_EQ(1234u, work->work[0]->perm_x);
+  EXPECT_EQ(0, crush_context_bind(ctx, m, 2, 3));
+  EXPECT_EQ(0u, work->work[0]->perm_x);
+
+  /* a smaller map reuses the workspace */
+  crush_map *smaller = make_map(10, 5);
+  EXPECT_EQ(0, crush_context_bind(ctx, smaller, 3, 3));
+  EXPECT_EQ(cwin, crush_context_workspace(ctx));
+  expect_same_mappings(smaller, ctx);
+
+  /* a larger one is mapped in a larger workspace */
+  crush_map *larger = make_map(100, 7);
+  EXPECT_EQ(0, crush_context_bind(ctx, larger, 4, 3));
+  EXPECT_EQ(0u, (uintptr_t)crush_context_workspace(ctx) % 64);
+  expect_same_mappings(larger, ctx);
+
+  /* the map grows and is bound again */
+  EXPECT_EQ(0, crush_map_add_item(larger, -1, larger->max_devices, 0x10000));
+  EXPECT_EQ(0, crush_context_bind(ctx, larger, 5, 3));
+  expect_same_mappings(larger, ctx);
+
+  crush_context_destroy(ctx);
+  crush_destroy(m);
+  crush_destroy(smaller);
+  crush_destroy(larger);
+}
+
+TEST(context, crush_context_set_cache) {
+  crush_map *m = make_map(20, 5);
+  crush_context *ctx = crush_context_create();
+  ASSERT_TRUE(ctx);
+  ASSERT_EQ(0, crush_context_bind(ctx, m, 1, 3));
+  crush_cache *cache = crush_cache_create(1 << 16, 3);
+  ASSERT_TRUE(cache);
+  crush_context_set_cache(ctx, cache, 1);
+  expect_same_mappings(m, ctx);
+
+  /* the cached mapping is returned for the same generation */
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  int result[3], cached[3];
+  ASSERT_EQ(3, crush_context_do_rule(ctx, 0, 7, result, 3, &weights[0],
+                                     weights.size(), NULL));
+  weights[result[0]] = 0;
+  ASSERT_EQ(3, crush_context_do_rule(ctx, 0, 7, cached, 3, &weights[0],
+                                     weights.size(), NULL));
+  EXPECT_EQ(result[0], cached[0]);
+  crush_context_set_cache(ctx, cache, 2);
+  ASSERT_EQ(3, crush_context_do_rule(ctx, 0, 7, cached, 3, &weights[0],
+                                     weights.size(), NULL));
+  EXPECT_NE(result[0], cached[0]);
+
+  crush_context_set_cache(ctx, NULL, 0);
+  expect_same_mappings(m, ctx);
+  crush_cache_destroy(cache);
+  crush_context_destroy(ctx);
+  crush_destroy(m);
+}
+
+TEST(context, crush_context_set_stats) {
+  crush_map *m = make_map(20, 5);
+  crush_context *ctx = crush_context_create();
+  ASSERT_TRUE(ctx);
+  crush_stats *stats = crush_stats_create(m);
+  ASSERT_TRUE(stats);
+  EXPECT_EQ(-EINVAL, crush_context_set_stats(ctx, stats));
+  ASSERT_EQ(0, crush_context_bind(ctx, m, 1, 3));
+  int r = crush_context_set_stats(ctx, stats);
+  if (r == -EOPNOTSUPP) {
+    /* built without CRUSH_STATS */
+    crush_stats_destroy(stats);
+    crush_context_destroy(ctx);
+    crush_destroy(m);
+    return;
+  }
+  ASSERT_EQ(0, r);
+  expect_same_mappings(m, ctx);
+  EXPECT_EQ(1000u, stats->rules[0].mappings);
+
+  /* the stats keep counting after binding again */
+  ASSERT_EQ(0, crush_context_bind(ctx, m, 2, 3));
+  expect_same_mappings(m, ctx);
+  EXPECT_EQ(2000u, stats->rules[0].mappings);
+
+  /* and are detached if the map has more buckets */
+  crush_map *larger = make_map(100, 5);
+  EXPECT_EQ(-EINVAL, crush_context_bind(ctx, larger, 3, 3));
+  expect_same_mappings(larger, ctx);
+  EXPECT_EQ(2000u, stats->rules[0].mappings);
+
+  crush_stats_destroy(stats);
+  crush_context_destroy(ctx);
+  crush_destroy(m);
+  crush_destroy(larger);
+}
+
+TEST(context, crush_context_set_weight_summary) {
+  crush_map *m = make_map(20, 5);
+  crush_context *ctx = crush_context_create();
+  ASSERT_TRUE(ctx);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  crush_weight_summary *summary = crush_make_weight_summary(&weights[0],
+                                                            weights.size());
+  ASSERT_TRUE(summary);
+  EXPECT_EQ(-EINVAL, crush_context_set_weight_summary(ctx, summary));
+  ASSERT_EQ(0, crush_context_bind(ctx, m, 1, 3));
+  ASSERT_EQ(0, crush_context_set_weight_summary(ctx, summary));
+  crush_work *work = (crush_work *)crush_context_workspace(ctx);
+  EXPECT_EQ(summary, work->weight_summary);
+
+  /* it remains attached to the new workspace */
+  crush_map *larger = make_map(100, 7);
+  ASSERT_EQ(0, crush_context_bind(ctx, larger, 2, 3));
+  work = (crush_work *)crush_context_workspace(ctx);
+  EXPECT_EQ(summary, work->weight_summary);
+  ASSERT_EQ(0, crush_context_set_weight_summary(ctx, NULL));
+  EXPECT_EQ(NULL, work->weight_summary);
+
+  crush_destroy_weight_summary(summary);
+  crush_context_destroy(ctx);
+  crush_destroy(m);
+  crush_destroy(larger);
+}
+
+static void *thread_context(void *arg) {
+  crush_context *ctx = crush_context_thread();
+  EXPECT_EQ(ctx, crush_context_thread());
+  EXPECT_EQ(0, crush_context_bind(ctx, (crush_map *)arg, 1, 3));
+  expect_same_mappings((crush_map *)arg, ctx);
+  return ctx;
+}
+
+TEST(context, crush_context_thread) {
+  crush_map *m = make_map(20, 5);
+  crush_context *ctx = crush_context_thread();
+  ASSERT_TRUE(ctx);
+  EXPECT_EQ(ctx, crush_context_thread());
+  ASSERT_EQ(0, crush_context_bind(ctx, m, 1, 3));
+
+  /* another thread has its own, released when it exits */
+  pthread_t thread;
+  void *other;
+  ASSERT_EQ(0, pthread_create(&thread, NULL, thread_context, m));
+  ASSERT_EQ(0, pthread_join(thread, &other));
+  EXPECT_NE((void *)ctx, other);
+  expect_same_mappings(m, ctx);
+  crush_destroy(m);
+}
@@ -0,0 +1,150 @@
+#include <errno.h>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/diff.h"
+}
+
+#include "make_map.h"
+
+typedef std::map<__u32, std::pair<std::vector<int>, std::vector<int> > > changes_t;
+
+/* the changes computed by mapping all inputs with both maps */
+static changes_t expected_changes(const crush_map *a, const std::vector<__u32> &wa,
+                                  const crush_map *b, const std::vector<__u32> &wb,
+                                  int ruleno, int result_max, __u32 count) {
+  std::vector<char> cwa(crush_work_size(a, result_max));
+  std::vector<char> cwb(crush_work_size(b, result_max));
+  crush_init_workspace(a, &cwa[0]);
+  crush_init_workspace(b, &cwb[0]);
+  changes_t changes;
+  for (__u32 x = 0; x < count; x++) {
+    std::vector<int> ra(result_max), rb(result_max);
+    ra.resize(crush_do_rule(a, ruleno, x, &ra[0], result_max,
+                            &wa[0], wa.size(), &cwa[0], NULL));
+    rb.resize(crush_do_rule(b, ruleno, x, &rb[0], result_max,
+                            &wb[0], wb.size(), &cwb[0], NULL));
+    if (ra != rb)
+      changes[x] = std::make_pair(ra, rb);
+  }
+  return changes;
+}
+
+static changes_t diff_changes(crush_diff *diff) {
+  changes_t changes;
+  crush_diff_change change;
+  __u32 last = 0;
+  int r;
+  while ((r = crush_diff_next(diff, &change)) == 1) {
+    if (!changes.empty()) {
+      EXPECT_LT(last, change.x);
+    }
+    last = change.x;
+    changes[change.x] = std::make_pair(
+      std::vector<int>(change.old_result, change.old_result + change.old_len),
+      std::vector<int>(change.new_result, change.new_result + change.new_len));
+  }
+  EXPECT_EQ(0, r);
+  return changes;
+}
+
+TEST(diff, device_weights) {
+  const int result_max = 3;
+  const __u32 count = 100000;
+  crush_map *m = make_map(test_map(10));
+  std::vector<__u32> before(m->max_devices, 0x10000);
+  std::vector<__u32> after(before);
+  /* mark a device out and offload another */
+  after[5] = 0;
+  after[22] = 0x8000;
+
+  for (int ruleno : { 0, 1 }) {
+    changes_t expected = expected_changes(m, before, m, after, ruleno,
+                                          result_max, count);
+    ASSERT_FALSE(expected.empty());
+    for (int threads : { 1, 3 }) {
+      crush_diff *diff = crush_diff_create(m, &before[0], before.size(),
+                                           m, &after[0], after.size(),
+                                           ruleno, result_max, 0, count, threads);
+      ASSERT_TRUE(diff);
+      EXPECT_EQ(expected, diff_changes(diff));
+      /* the inputs that never chose from the two hosts are mapped once */
+      EXPECT_LT(count / 3, crush_diff_skipped(diff));
+
+      std::vector<crush_diff_move> moves(1000);
+      int n = crush_diff_movement(diff, &moves[0], moves.size());
+      ASSERT_LT(0, n);
+      ASSERT_GE((int)moves.size(), n);
+      __u32 from_5 = 0, total = 0;
+      for (int i = 0; i < n; i++) {
+        if (i > 0) {
+          EXPECT_TRUE(moves[i-1].from < moves[i].from ||
+                      (moves[i-1].from == moves[i].from &&
+                       moves[i-1].to < moves[i].to));
+        }
+        EXPECT_NE(5, moves[i].to);
+        if (moves[i].from == 5)
+          from_5 += moves[i].count;
+        total += moves[i].count;
+      }
+      /* every replica on the out device moved */
+      __u32 on_5 = 0;
+      for (auto &c : expected)
+        for (int item : c.second.first)
+          on_5 += item == 5;
+      EXPECT_EQ(on_5, from_5);
+      EXPECT_LE(expected.size(), total);
+      crush_diff_destroy(diff);
+    }
+  }
+  crush_destroy(m);
+}
+
+TEST(diff, buckets) {
+  const int result_max = 4;
+  const __u32 count = 20000;
+  crush_map *a = make_map(test_map(8));
+  crush_map *b = make_map(test_map(8));
+  std::vector<__u32> weights(a->max_devices + 4, 0x10000);
+  /* a new device in a host and a heavier device in another */
+  const int host = crush_get_parent(b, 0);
+  EXPECT_EQ(0, crush_map_add_item(b, host, a->max_devices, 0x10000));
+  EXPECT_EQ(0, crush_map_adjust_item_weight(b, 9, 0x30000));
+
+  changes_t expected = expected_changes(a, weights, b, weights, 0,
+                                        result_max, count);
+  ASSERT_FALSE(expected.empty());
+  crush_diff *diff = crush_diff_create(a, &weights[0], weights.size(),
+                                       b, &weights[0], weights.size(),
+                                       0, result_max, 0, count, 0);
+  ASSERT_TRUE(diff);
+  EXPECT_EQ(expected, diff_changes(diff));
+  crush_diff_destroy(diff);
+
+  /* an empty range and an identical map */
+  diff = crush_diff_create(a, &weights[0], weights.size(),
+                           a, &weights[0], weights.size(), 0, result_max, 10, 10, 2);
+  ASSERT_TRUE(diff);
+  crush_diff_change change;
+  EXPECT_EQ(0, crush_diff_next(diff, &change));
+  EXPECT_EQ(0, crush_diff_movement(diff, NULL, 0));
+  crush_diff_destroy(diff);
+  diff = crush_diff_create(a, &weights[0], weights.size(),
+                           a, &weights[0], weights.size(), 0, result_max, 0, 1000, 2);
+  ASSERT_TRUE(diff);
+  EXPECT_EQ(0, crush_diff_next(diff, &change));
+  EXPECT_EQ(1000u, crush_diff_skipped(diff));
+  crush_diff_destroy(diff);
+
+  EXPECT_EQ(NULL, crush_diff_create(a, &weights[0], weights.size(),
+                                    b, &weights[0], weights.size(), 0, 0, 0, 10, 1));
+  crush_destroy(a);
+  crush_destroy(b);
+}
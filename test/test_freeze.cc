@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <string.h>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/freeze.h"
+}
+
+#include "make_map.h"
+
+/*
+ * a straw2 root of @hosts_count hosts of 4 devices, cycling through
+ * all bucket algorithms, with a chooseleaf firstn rule
+ */
+static crush_map *make_map(int hosts_count, int *ruleno) {
+  static const int algs[] = { CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST,
+                              CRUSH_BUCKET_TREE, CRUSH_BUCKET_STRAW,
+                              CRUSH_BUCKET_STRAW2, CRUSH_BUCKET_STRAW2_TREE };
+  test_map spec(hosts_count);
+  spec.map = crush_create();
+  spec.map->allowed_bucket_algs = 0xff;
+  spec.map->straw2_reciprocals = 1;
+  spec.tunables = false;
+  spec.host_alg = [](int host) { return algs[host % 6]; };
+  spec.weight = [](int host, int i) {
+    return algs[host % 6] == CRUSH_BUCKET_UNIFORM ? 0x10000 : 0x8000 * (i + 1);
+  };
+  spec.ops = { CRUSH_RULE_CHOOSELEAF_FIRSTN };
+  return make_map(spec, NULL, ruleno);
+}
+
+static std::vector<int> mappings(const crush_map *m, int ruleno) {
+  const int result_max = 3;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, &cwin[0]);
+  std::vector<int> out;
+  for (int x = 0; x < 1000; x++) {
+    int result[result_max];
+    int len = crush_do_rule(m, ruleno, x, result, result_max,
+                            &weights[0], weights.size(), &cwin[0], NULL);
+    out.insert(out.end(), result, result + len);
+    out.push_back(-1);
+  }
+  return out;
+}
+
+TEST(freeze, crush_map_freeze) {
+  int ruleno;
+  crush_map *m = make_map(12, &ruleno);
+  crush_map *frozen = crush_map_freeze(m);
+  ASSERT_TRUE(frozen);
+  ASSERT_LT(0u, frozen->frozen_size);
+  EXPECT_EQ(m->working_size, frozen->working_size);
+
+  const char *begin = (const char *)frozen;
+  const char *end = begin + frozen->frozen_size;
+  const char *root = NULL;
+  for (int b = 0; b < frozen->max_buckets; b++) {
+    const crush_bucket *bucket = frozen->buckets[b];
+    if (!bucket)
+      continue;
+    ASSERT_LE(begin, (const char *)bucket);
+    ASSERT_GT(end, (const char *)bucket);
+    ASSERT_LE(begin, (const char *)bucket->items);
+    ASSERT_GE(end, (const char *)(bucket->items + bucket->size));
+    /* the structures come before the arrays */
+    ASSERT_LT((const char *)bucket, (const char *)frozen->buckets[0]->items);
+    if (bucket->type == 2)
+      root = (const char *)bucket;
+  }
+  /* breadth first: the root comes before the hosts */
+  ASSERT_TRUE(root);
+  for (int b = 0; b < frozen->max_buckets; b++) {
+    if (frozen->buckets[b] && frozen->buckets[b]->type == 1) {
+      ASSERT_LT(root, (const char *)frozen->buckets[b]);
+    }
+  }
+
+  EXPECT_EQ(mappings(m, ruleno), mappings(frozen, ruleno));
+
+  crush_destroy(m);
+  crush_destroy(frozen);
+}
+
+TEST(freeze, crush_map_frozen_rebase) {
+  int ruleno;
+  crush_map *m = make_map(7, &ruleno);
+  std::vector<int> expected = mappings(m, ruleno);
+  crush_map *frozen = crush_map_freeze(m);
+  crush_destroy(m);
+  ASSERT_TRUE(frozen);
+
+  /* turn the pointers into offsets, as in a file, and back */
+  std::vector<char> copy((const char *)frozen,
+                         (const char *)frozen + frozen->frozen_size);
+  crush_map *moved = (crush_map *)&copy[0];
+  crush_map_frozen_rebase(moved, (uintptr_t)frozen, 0);
+  crush_destroy(frozen);
+  ASSERT_GT(moved->frozen_size, (uintptr_t)moved->buckets);
+  ASSERT_GT(moved->frozen_size, (uintptr_t)moved->rules);
+  crush_map_frozen_rebase(moved, 0, (uintptr_t)moved);
+
+  EXPECT_EQ(expected, mappings(moved, ruleno));
+}
+
+/* the address of @p in @map, a frozen map whose pointers are offsets */
+template <typename T> static T *at(crush_map *map, T *p) {
+  return (T *)((char *)map + (uintptr_t)p);
+}
+
+TEST(freeze, crush_map_frozen_check) {
+  int ruleno;
+  crush_map *m = make_map(12, &ruleno);
+  crush_map *frozen = crush_map_freeze(m);
+  crush_destroy(m);
+  ASSERT_TRUE(frozen);
+  /* __u64 aligned copies with offsets instead of pointers */
+  std::vector<__u64> offsets((frozen->frozen_size + 7) / 8);
+  memcpy(&offsets[0], frozen, frozen->frozen_size);
+  crush_map_frozen_rebase((crush_map *)&offsets[0], (uintptr_t)frozen, 0);
+  std::vector<__u64> buf;
+  crush_map *c;
+#define reset() (buf = offsets, c = (crush_map *)&buf[0])
+
+  reset();
+  EXPECT_EQ(0, crush_map_frozen_check(c));
+
+  EXPECT_EQ(-EINVAL, crush_map_frozen_check((reset(), c->max_buckets = -1, c)));
+  EXPECT_EQ(-EINVAL, crush_map_frozen_check((reset(), c->max_buckets = 1 << 30, c)));
+  EXPECT_EQ(-EINVAL, crush_map_frozen_check((reset(), c->frozen_size = 100, c)));
+  for (int b = 0; b < c->max_buckets; b++) {
+    reset();
+    const crush_bucket *bucket = at(c, at(c, c->buckets)[b]);
+    const size_t offset = (char *)bucket - (char *)c;
+    int alg = bucket->alg;
+    crush_bucket *p;
+#define corrupt() (reset(), p = (crush_bucket *)((char *)c + offset))
+    EXPECT_EQ(-EINVAL, crush_map_frozen_check((corrupt(), p->alg = 42, c)));
+    EXPECT_EQ(-EINVAL, crush_map_frozen_check((corrupt(), p->id = 0, c)));
+    EXPECT_EQ(-EINVAL, crush_map_frozen_check((corrupt(), p->size = 1 << 30, c)));
+    EXPECT_EQ(-EINVAL, crush_map_frozen_check(
+                (corrupt(), p->items = (__s32 *)((char *)p->items + 1), c)));
+    EXPECT_EQ(-EINVAL, crush_map_frozen_check(
+                (corrupt(), p->items = (__s32 *)(uintptr_t)c->frozen_size, c)));
+    EXPECT_EQ(-EINVAL, crush_map_frozen_check(
+                (corrupt(), at(c, c->buckets)[b] =
+                 (crush_bucket *)(uintptr_t)(c->frozen_size - 8), c)));
+    if (bucket->size > 0) {
+      EXPECT_EQ(-EINVAL, crush_map_frozen_check(
+                  (corrupt(), at(c, p->items)[0] = -1 - c->max_buckets, c)));
+    }
+    if (alg == CRUSH_BUCKET_TREE) {
+      EXPECT_EQ(-EINVAL, crush_map_frozen_check(
+                  (corrupt(), ((crush_bucket_tree *)p)->num_nodes *= 2, c)));
+    }
+    if (alg == CRUSH_BUCKET_STRAW2) {
+      EXPECT_EQ(-EINVAL, crush_map_frozen_check(
+                  (corrupt(), ((crush_bucket_straw2 *)p)->item_reciprocals =
+                   (__u64 *)(uintptr_t)(c->frozen_size - 8), c)));
+    }
+    EXPECT_EQ(0, crush_map_frozen_check((corrupt(), c)));
+#undef corrupt
+  }
+
+  /* the first host is in the root */
+  reset();
+  at(c, c->buckets)[0] = NULL;
+  EXPECT_EQ(-EINVAL, crush_map_frozen_check(c));
+
+  reset();
+  crush_rule *rule = at(c, at(c, c->rules)[ruleno]);
+  rule->len = 1 << 30;
+  EXPECT_EQ(-EINVAL, crush_map_frozen_check(c));
+  reset();
+  rule = at(c, at(c, c->rules)[ruleno]);
+  ASSERT_EQ((__u32)CRUSH_RULE_TAKE, rule->steps[0].op);
+  rule->steps[0].arg1 = -1 - c->max_buckets;
+  EXPECT_EQ(-EINVAL, crush_map_frozen_check(c));
+  reset();
+  ASSERT_TRUE(c->rule_table);
+  at(c, c->rule_table)->rules[0][3] = c->max_rules;
+  EXPECT_EQ(-EINVAL, crush_map_frozen_check(c));
+  reset();
+  at(c, c->rule_table)->first[CRUSH_MAX_RULESET] = 0xffff;
+  EXPECT_EQ(-EINVAL, crush_map_frozen_check(c));
+#undef reset
+  crush_destroy(frozen);
+}
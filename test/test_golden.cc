@@ -0,0 +1,444 @@
+/*
+ * The mappings of randomized maps must be the same with every engine
+ * and the same as the ones recorded in golden/mappings.txt, found in
+ * $CRUSH_GOLDEN_DIR or test/golden.
+ *
+ * CRUSH_GOLDEN_INPUTS=n maps n inputs per rule instead of 256 when
+ * comparing the engines, for instance a few millions before a release.
+ * CRUSH_GOLDEN_WRITE=path writes the digests of the mappings to path
+ * instead of comparing them, to record the corpus with a reference
+ * version of the mapper.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/simd.h"
+#include "crush/freeze.h"
+#include "crush/parallel.h"
+#include "crush/context.h"
+#include "crush/arena.h"
+}
+
+static const int seeds = 24;
+static const int result_maxes[] = { 1, 3, 7 };
+/* the inputs recorded in the corpus, in blocks */
+static const int golden_inputs = 1024;
+static const int golden_block = 512;
+
+/* the same sequence on every platform, unlike <random> distributions */
+struct golden_random {
+  __u32 seed, n;
+  golden_random(__u32 seed) : seed(seed), n(0) {}
+  __u32 below(__u32 k) {
+    return crush_hash32_2(CRUSH_HASH_RJENKINS1, seed, n++) % k;
+  }
+};
+
+/* the rules of every golden map, numbered from 0 */
+static const int golden_rules = 8;
+
+/*
+ * Build in @m a hierarchy of buckets of random algorithms, sizes and
+ * weights, with random tunables: hosts of type 1 contain the devices and
+ * are grouped in buckets of type 2 and above up to a single root.
+ */
+static crush_map *golden_map(int seed, crush_map *m) {
+  static const int algs[] = {
+    CRUSH_BUCKET_UNIFORM, CRUSH_BUCKET_LIST, CRUSH_BUCKET_TREE,
+    CRUSH_BUCKET_STRAW, CRUSH_BUCKET_STRAW2, CRUSH_BUCKET_STRAW2_TREE,
+  };
+  golden_random rnd(seed);
+  m->allowed_bucket_algs = 0;
+  for (int alg : algs)
+    m->allowed_bucket_algs |= 1 << alg;
+  m->straw_calc_version = rnd.below(2);
+  switch (rnd.below(3)) {
+  case 0:
+    /* the legacy tunables of crush_create() */
+    break;
+  case 1:
+    m->choose_local_tries = 0;
+    m->choose_local_fallback_tries = 0;
+    m->choose_total_tries = 50;
+    m->chooseleaf_descend_once = 1;
+    break;
+  case 2:
+    m->choose_local_tries = 0;
+    m->choose_local_fallback_tries = 0;
+    m->choose_total_tries = 50;
+    m->chooseleaf_descend_once = 1;
+    m->chooseleaf_vary_r = 1 + rnd.below(2);
+    m->chooseleaf_stable = 1;
+    break;
+  }
+
+  std::vector<int> items, weights;
+  int device = 0, host = 0;
+  int hosts = 2 + rnd.below(30);
+  for (int h = 0; h < hosts; h++) {
+    int alg = algs[rnd.below(6)];
+    int size = 1 + rnd.below(12);
+    if (rnd.below(20) == 0 && alg != CRUSH_BUCKET_UNIFORM)
+      size = 0;
+    std::vector<int> devices(size + 1), device_weights(size + 1);
+    int uniform_weight = 0x10000 * (1 + rnd.below(3));
+    for (int i = 0; i < size; i++) {
+      device += 1 + (rnd.below(8) == 0);
+      devices[i] = device;
+      device_weights[i] = alg == CRUSH_BUCKET_UNIFORM ? uniform_weight :
+        rnd.below(16) == 0 ? 0 : 0x4000 * rnd.below(12) + rnd.below(0x4000);
+    }
+    crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, 1, size,
+                                        &devices[0], &device_weights[0]);
+    int id;
+    EXPECT_EQ(0, crush_add_bucket(m, 0, b, &id));
+    if (h == 0)
+      host = id;
+    items.push_back(id);
+    weights.push_back(b->weight);
+  }
+  for (int type = 2; items.size() > 1; type++) {
+    std::vector<int> buckets, bucket_weights;
+    size_t group = 2 + rnd.below(6);
+    for (size_t i = 0; i < items.size(); i += group) {
+      int alg = algs[1 + rnd.below(5)];
+      int size = std::min(group, items.size() - i);
+      crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, type, size,
+                                          &items[i], &weights[i]);
+      int id;
+      EXPECT_EQ(0, crush_add_bucket(m, 0, b, &id));
+      buckets.push_back(id);
+      bucket_weights.push_back(b->weight);
+    }
+    items.swap(buckets);
+    weights.swap(bucket_weights);
+  }
+  int root = items[0];
+
+  for (int ruleno = 0; ruleno < golden_rules; ruleno++) {
+    crush_rule *r = crush_make_rule(8, ruleno, 1, 1, 10);
+    int step = 0;
+    switch (ruleno) {
+    case 0:
+      crush_rule_set_step(r, step++, CRUSH_RULE_TAKE, root, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+      break;
+    case 1:
+      crush_rule_set_step(r, step++, CRUSH_RULE_TAKE, root, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_CHOOSELEAF_INDEP, 0, 1);
+      break;
+    case 2:
+      crush_rule_set_step(r, step++, CRUSH_RULE_TAKE, root, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_CHOOSE_FIRSTN, 0, 0);
+      break;
+    case 3:
+      crush_rule_set_step(r, step++, CRUSH_RULE_TAKE, root, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_CHOOSE_INDEP, 0, 1);
+      break;
+    case 4:
+      crush_rule_set_step(r, step++, CRUSH_RULE_TAKE, root, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_CHOOSE_FIRSTN, 0, 1);
+      crush_rule_set_step(r, step++, CRUSH_RULE_CHOOSE_FIRSTN, 1, 0);
+      break;
+    case 5:
+      crush_rule_set_step(r, step++, CRUSH_RULE_SET_CHOOSE_TRIES, 100, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_SET_CHOOSELEAF_TRIES, 3, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_SET_CHOOSE_LOCAL_TRIES, 2, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_SET_CHOOSELEAF_VARY_R, 1, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_SET_CHOOSELEAF_STABLE, 1, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_TAKE, root, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, 1);
+      break;
+    case 6:
+      crush_rule_set_step(r, step++, CRUSH_RULE_SET_CHOOSELEAF_TRIES, 5, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_TAKE, root, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_CHOOSELEAF_INDEP, 0, 1);
+      break;
+    case 7:
+      crush_rule_set_step(r, step++, CRUSH_RULE_TAKE, host, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_CHOOSE_FIRSTN, 1, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_EMIT, 0, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_TAKE, root, 0);
+      crush_rule_set_step(r, step++, CRUSH_RULE_CHOOSELEAF_FIRSTN, -1, 1);
+      break;
+    }
+    crush_rule_set_step(r, step++, CRUSH_RULE_EMIT, 0, 0);
+    r->len = step;
+    EXPECT_EQ(ruleno, crush_add_rule(m, r, ruleno));
+  }
+  crush_finalize(m);
+  return m;
+}
+
+/* out and reweighted devices, the last ones missing sometimes */
+static std::vector<__u32> golden_weights(int seed, const crush_map *m) {
+  golden_random rnd(seed + 1000);
+  std::vector<__u32> weights(m->max_devices);
+  for (size_t i = 0; i < weights.size(); i++) {
+    __u32 r = rnd.below(16);
+    weights[i] = r == 0 ? 0 : r == 1 ? rnd.below(0x10000) : 0x10000;
+  }
+  if (rnd.below(4) == 0)
+    weights.resize(weights.size() - std::min<size_t>(weights.size(), 2));
+  return weights;
+}
+
+/* weight sets different from the weights of the buckets, one seed in four */
+static crush_choose_arg *golden_choose_args(int seed, const crush_map *m) {
+  golden_random rnd(seed + 2000);
+  if (seed % 4)
+    return NULL;
+  crush_choose_arg *args = crush_make_choose_args(m, 2);
+  EXPECT_TRUE(args);
+  for (int b = 0; b < m->max_buckets; b++)
+    for (__u32 p = 0; p < args[b].weight_set_size; p++)
+      for (__u32 i = 0; i < args[b].weight_set[p].size; i++)
+        if (rnd.below(3) == 0)
+          args[b].weight_set[p].weights[i] = rnd.below(0x30000);
+  return args;
+}
+
+/* the mappings of the inputs 0 to n - 1 */
+struct mappings {
+  int result_max;
+  std::vector<int> result;
+  std::vector<int> len;
+  mappings(int n, int result_max)
+    : result_max(result_max), result(n * result_max), len(n) {}
+  int *row(int x) { return &result[x * result_max]; }
+};
+
+/* an input mapped differently by @got, the first one */
+static void expect_same(const char *engine, int seed, int ruleno,
+                        mappings &expected, mappings &got) {
+  for (size_t x = 0; x < expected.len.size(); x++) {
+    bool same = expected.len[x] == got.len[x];
+    for (int i = 0; same && i < expected.len[x]; i++)
+      same = expected.row(x)[i] == got.row(x)[i];
+    if (!same) {
+      std::string e, g;
+      for (int i = 0; i < expected.len[x]; i++)
+        e += " " + std::to_string(expected.row(x)[i]);
+      for (int i = 0; i < got.len[x]; i++)
+        g += " " + std::to_string(got.row(x)[i]);
+      ADD_FAILURE() << engine << ": seed " << seed << " rule " << ruleno
+                    << " result_max " << expected.result_max << " x " << x
+                    << " expected" << e << " got" << g;
+      return;
+    }
+  }
+}
+
+static void do_rule(const crush_map *m, int ruleno, const std::vector<__u32> &weights,
+                    const crush_choose_arg *choose_args, mappings &out) {
+  std::vector<char> cwin(crush_work_size(m, out.result_max));
+  crush_init_workspace(m, &cwin[0]);
+  for (size_t x = 0; x < out.len.size(); x++)
+    out.len[x] = crush_do_rule(m, ruleno, x, out.row(x), out.result_max,
+                               weights.data(), weights.size(), &cwin[0],
+                               choose_args);
+}
+
+/* release the arrays the mapper can do without */
+static void drop_derived(crush_map *m) {
+  for (int b = 0; b < m->max_buckets; b++) {
+    crush_bucket *bucket = m->buckets[b];
+    if (!bucket)
+      continue;
+    if (bucket->alg == CRUSH_BUCKET_STRAW2) {
+      crush_bucket_straw2 *s = (crush_bucket_straw2 *)bucket;
+      free(s->item_reciprocals);
+      s->item_reciprocals = NULL;
+    } else if (bucket->alg == CRUSH_BUCKET_TREE) {
+      crush_bucket_tree *t = (crush_bucket_tree *)bucket;
+      free(t->descent_weights);
+      t->descent_weights = NULL;
+    }
+  }
+}
+
+static int golden_engine_inputs() {
+  const char *n = getenv("CRUSH_GOLDEN_INPUTS");
+  return n ? atoi(n) : 256;
+}
+
+TEST(golden, engines) {
+  const int n = golden_engine_inputs();
+  for (int seed = 1; seed <= seeds; seed++) {
+    crush_map *m = golden_map(seed, crush_create());
+    std::vector<__u32> weights = golden_weights(seed, m);
+    crush_choose_arg *choose_args = golden_choose_args(seed, m);
+    crush_map *frozen = crush_map_freeze(m);
+    ASSERT_TRUE(frozen);
+    crush_map *arena = golden_map(seed, crush_create_arena(crush_arena_create(0, NULL)));
+    crush_map *fallback = golden_map(seed, crush_create());
+    drop_derived(fallback);
+    crush_context *ctx = crush_context_create();
+    ASSERT_TRUE(ctx);
+
+    for (int ruleno = 0; ruleno < golden_rules; ruleno++) {
+      for (int result_max : result_maxes) {
+        /* the reference is the scalar implementation */
+        mappings expected(n, result_max), got(n, result_max);
+        ASSERT_EQ(0, crush_simd_set_impl(CRUSH_SIMD_SCALAR));
+        do_rule(m, ruleno, weights, choose_args, expected);
+        ASSERT_EQ(0, crush_simd_set_impl(CRUSH_SIMD_AUTO));
+
+        do_rule(m, ruleno, weights, choose_args, got);
+        expect_same("simd", seed, ruleno, expected, got);
+
+        std::vector<int> x(n);
+        for (int i = 0; i < n; i++)
+          x[i] = i;
+        std::vector<char> cwin(crush_work_size(m, result_max));
+        crush_init_workspace(m, &cwin[0]);
+        ASSERT_EQ(n, crush_do_rule_batch(m, ruleno, &x[0], n, &got.result[0],
+                                         result_max, result_max, &got.len[0],
+                                         weights.data(), weights.size(),
+                                         &cwin[0], choose_args));
+        expect_same("batch", seed, ruleno, expected, got);
+
+        crush_plan *plan = crush_compile_rule(m, ruleno, result_max);
+        ASSERT_TRUE(plan);
+        for (int i = 0; i < n; i++)
+          got.len[i] = crush_do_plan(plan, i, got.row(i), weights.data(),
+                                     weights.size(), &cwin[0], choose_args);
+        expect_same("plan", seed, ruleno, expected, got);
+
+        std::vector<char> interleave_cwin(crush_interleave_work_size(plan));
+        crush_init_workspace(m, &interleave_cwin[0]);
+        ASSERT_EQ(n, crush_do_plan_interleaved(plan, &x[0], n, &got.result[0],
+                                               result_max, &got.len[0],
+                                               weights.data(), weights.size(),
+                                               &interleave_cwin[0], choose_args));
+        crush_destroy_plan(plan);
+        expect_same("interleaved", seed, ruleno, expected, got);
+
+        ASSERT_EQ(n, crush_do_rule_parallel(m, ruleno, 0, n, &got.result[0],
+                                            result_max, result_max, &got.len[0],
+                                            weights.data(), weights.size(),
+                                            choose_args, 3));
+        expect_same("parallel", seed, ruleno, expected, got);
+
+        ASSERT_EQ(0, crush_context_bind(ctx, m, 1, result_max));
+        for (int i = 0; i < n; i++)
+          got.len[i] = crush_context_do_rule(ctx, ruleno, i, got.row(i), result_max,
+                                             weights.data(), weights.size(),
+                                             choose_args);
+        expect_same("context", seed, ruleno, expected, got);
+
+        crush_weight_summary *summary = crush_make_weight_summary(weights.data(),
+                                                                  weights.size());
+        ASSERT_TRUE(summary);
+        crush_init_workspace(m, &cwin[0]);
+        crush_set_weight_summary(&cwin[0], summary);
+        for (int i = 0; i < n; i++)
+          got.len[i] = crush_do_rule(m, ruleno, i, got.row(i), result_max,
+                                     weights.data(), weights.size(), &cwin[0],
+                                     choose_args);
+        crush_destroy_weight_summary(summary);
+        expect_same("summary", seed, ruleno, expected, got);
+
+        do_rule(frozen, ruleno, weights, choose_args, got);
+        expect_same("frozen", seed, ruleno, expected, got);
+        do_rule(arena, ruleno, weights, choose_args, got);
+        expect_same("arena", seed, ruleno, expected, got);
+        do_rule(fallback, ruleno, weights, choose_args, got);
+        expect_same("fallback", seed, ruleno, expected, got);
+      }
+    }
+
+    crush_context_destroy(ctx);
+    crush_destroy_choose_args(choose_args);
+    crush_destroy(fallback);
+    crush_destroy(arena);
+    crush_destroy(frozen);
+    crush_destroy(m);
+  }
+}
+
+/* FNV-1a of the mappings of a block of inputs */
+static unsigned long long digest(mappings &m, int x_begin, int x_count) {
+  unsigned long long h = 14695981039346656037ULL;
+  for (int x = x_begin; x < x_begin + x_count; x++) {
+    h = (h ^ (__u32)m.len[x]) * 1099511628211ULL;
+    for (int i = 0; i < m.len[x]; i++)
+      h = (h ^ (__u32)m.row(x)[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+static std::string golden_path() {
+  const char *dir = getenv("CRUSH_GOLDEN_DIR");
+  return std::string(dir ? dir : "test/golden") + "/mappings.txt";
+}
+
+/* a line of the corpus is: seed ruleno result_max x_begin digest */
+TEST(golden, corpus) {
+  const char *write = getenv("CRUSH_GOLDEN_WRITE");
+  std::map<std::string, std::string> corpus;
+  FILE *f = fopen(write ? write : golden_path().c_str(), write ? "w" : "r");
+  ASSERT_TRUE(f) << (write ? write : golden_path()) << ": " << strerror(errno);
+  if (write) {
+    fprintf(f, "# seed ruleno result_max x_begin digest, see test_golden.cc\n");
+  } else {
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+      int seed, ruleno, result_max, x_begin;
+      char d[32];
+      if (sscanf(line, "%d %d %d %d %31s", &seed, &ruleno, &result_max,
+                 &x_begin, d) != 5)
+        continue;
+      char key[64];
+      snprintf(key, sizeof(key), "%d %d %d %d", seed, ruleno, result_max, x_begin);
+      corpus[key] = d;
+    }
+  }
+
+  int compared = 0;
+  for (int seed = 1; seed <= seeds; seed++) {
+    crush_map *m = golden_map(seed, crush_create());
+    std::vector<__u32> weights = golden_weights(seed, m);
+    crush_choose_arg *choose_args = golden_choose_args(seed, m);
+    for (int ruleno = 0; ruleno < golden_rules; ruleno++) {
+      for (int result_max : result_maxes) {
+        mappings got(golden_inputs, result_max);
+        do_rule(m, ruleno, weights, choose_args, got);
+        for (int x = 0; x < golden_inputs; x += golden_block) {
+          char key[64], d[32];
+          snprintf(key, sizeof(key), "%d %d %d %d", seed, ruleno, result_max, x);
+          snprintf(d, sizeof(d), "%016llx", digest(got, x, golden_block));
+          if (write) {
+            fprintf(f, "%s %s\n", key, d);
+            continue;
+          }
+          ASSERT_TRUE(corpus.count(key)) << key << " is not in " << golden_path();
+          EXPECT_EQ(corpus[key], d) << "the mappings of seed " << seed << " rule "
+                                    << ruleno << " result_max " << result_max
+                                    << " differ for some x in [" << x << ", "
+                                    << x + golden_block << "[";
+          compared++;
+        }
+      }
+    }
+    crush_destroy_choose_args(choose_args);
+    crush_destroy(m);
+  }
+  fclose(f);
+  if (!write) {
+    EXPECT_EQ(corpus.size(), (size_t)compared);
+  }
+}
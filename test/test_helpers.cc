@@ -39,3 +39,85 @@ TEST(helpers, crush_find_roots) {
 
   crush_destroy(m);
 }
+
+TEST(helpers, crush_find_roots_sparse) {
+  /* a single bucket at the end of a large array of buckets */
+  struct crush_map *m = crush_create();
+  int items[2] = { 0, 1 }, weights[2] = { 0x10000, 0x10000 };
+  struct crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                             2, items, weights);
+  int id;
+  ASSERT_EQ(0, crush_add_bucket(m, -(1 << 22), b, &id));
+  int *roots = NULL;
+  ASSERT_EQ(1, crush_find_roots(m, &roots));
+  EXPECT_EQ(-(1 << 22), roots[0]);
+  free(roots);
+  crush_destroy(m);
+}
+
+TEST(helpers, crush_analyze) {
+  struct crush_analysis a;
+  struct crush_map *m = crush_create();
+  ASSERT_EQ(0, crush_analyze(m, &a));
+  EXPECT_EQ(0, a.roots_count);
+  EXPECT_EQ(0, a.order_count);
+  crush_analysis_release(&a);
+
+  /* a root of two hosts sharing device 3, and a second root */
+  int host0_items[3] = { 0, 1, 3 }, host1_items[2] = { 2, 3 };
+  int weights[3] = { 0x10000, 0x10000, 0x10000 };
+  int host0, host1, root, other;
+  ASSERT_EQ(0, crush_add_bucket(m, 0, crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                                        1, 3, host0_items, weights), &host0));
+  ASSERT_EQ(0, crush_add_bucket(m, 0, crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                                        1, 2, host1_items, weights), &host1));
+  int root_items[2] = { host0, host1 };
+  struct crush_bucket *r = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                             2, 2, root_items, weights);
+  ASSERT_EQ(0, crush_add_bucket(m, 0, r, &root));
+  struct crush_bucket *o = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                             2, 0, NULL, NULL);
+  ASSERT_EQ(0, crush_add_bucket(m, 0, o, &other));
+
+  ASSERT_EQ(0, crush_analyze(m, &a));
+  EXPECT_EQ(m->max_buckets, a.max_buckets);
+  EXPECT_EQ(4, a.max_devices);
+  ASSERT_EQ(2, a.roots_count);
+  EXPECT_EQ(root, a.order[0]);
+  EXPECT_EQ(other, a.order[1]);
+  EXPECT_EQ(4, a.order_count);
+  EXPECT_EQ(root, a.bucket_parents[-1-host0]);
+  EXPECT_EQ(0, a.bucket_parents[-1-root]);
+  EXPECT_EQ(host0, a.device_parents[0]);
+  EXPECT_EQ(CRUSH_PARENT_MANY, a.device_parents[3]);
+  EXPECT_EQ(0, a.depth[-1-root]);
+  EXPECT_EQ(1, a.depth[-1-host1]);
+  EXPECT_EQ(3u, a.devices[-1-host0]);
+  EXPECT_EQ(5u, a.devices[-1-root]);
+  EXPECT_EQ(0u, a.devices[-1-other]);
+  EXPECT_EQ(0, a.cyclic);
+  EXPECT_EQ(0, a.dangling);
+  EXPECT_EQ(1, a.empty);
+  crush_analysis_release(&a);
+
+  /* other under host1, then a cycle through root and a missing bucket */
+  ASSERT_EQ(0, crush_bucket_add_item(m, m->buckets[-1-host1], other, 0));
+  ASSERT_EQ(0, crush_analyze(m, &a));
+  EXPECT_EQ(1, a.roots_count);
+  EXPECT_EQ(2, a.depth[-1-other]);
+  EXPECT_EQ(host1, a.bucket_parents[-1-other]);
+  EXPECT_EQ(5u, a.devices[-1-root]);
+  crush_analysis_release(&a);
+
+  ASSERT_EQ(0, crush_bucket_add_item(m, o, root, 0));
+  ASSERT_EQ(0, crush_bucket_add_item(m, r, -100, 0));
+  ASSERT_EQ(-EINVAL, crush_analyze(m, &a));
+  EXPECT_EQ(0, a.roots_count);
+  EXPECT_EQ(0, a.order_count);
+  EXPECT_EQ(4, a.cyclic);
+  EXPECT_EQ(1, a.dangling);
+  EXPECT_EQ(0, a.empty);
+  EXPECT_EQ(-1, a.depth[-1-host0]);
+  crush_analysis_release(&a);
+  crush_destroy(m);
+}
@@ -0,0 +1,198 @@
+#include <errno.h>
+#include <set>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/parallel.h"
+#include "crush/diff.h"
+#include "crush/index.h"
+}
+
+#include "make_map.h"
+
+/* a straw2 root of @hosts_count straw2 hosts of 4 devices and a rule
+   choosing 3 hosts */
+static crush_map *make_map(int hosts_count) {
+  test_map spec(hosts_count);
+  spec.ops = { CRUSH_RULE_CHOOSELEAF_FIRSTN };
+  return make_map(spec);
+}
+
+struct mappings {
+  std::vector<int> result;
+  std::vector<int> len;
+};
+
+static void map_all(const crush_map *m, const std::vector<__u32> &weights,
+                    __u32 x_begin, __u32 x_count, mappings *out) {
+  out->result.assign(x_count * 3, CRUSH_ITEM_NONE);
+  out->len.assign(x_count, 0);
+  ASSERT_EQ((int)x_count,
+            crush_do_rule_parallel(m, 0, x_begin, x_count, &out->result[0], 3, 3,
+                                   &out->len[0], &weights[0], weights.size(),
+                                   NULL, 2));
+}
+
+/* the inputs mapped to device, in increasing order */
+static std::vector<__u32> expected_inputs(const mappings &mapped, __u32 x_begin,
+                                          int device) {
+  std::vector<__u32> xs;
+  for (__u32 i = 0; i < mapped.len.size(); i++)
+    for (int j = 0; j < mapped.len[i]; j++)
+      if (mapped.result[i * 3 + j] == device) {
+        xs.push_back(x_begin + i);
+        break;
+      }
+  return xs;
+}
+
+static void expect_same_index(crush_index *index, const mappings &mapped,
+                              __u32 x_begin, int devices) {
+  for (int d = 0; d < devices; d++) {
+    const std::vector<__u32> expected = expected_inputs(mapped, x_begin, d);
+    std::vector<__u32> xs(expected.size() + 1);
+    ASSERT_EQ((int)expected.size(), crush_index_device(index, d, &xs[0], xs.size()));
+    xs.pop_back();
+    EXPECT_EQ(expected, xs);
+  }
+}
+
+TEST(index, crush_index_create) {
+  EXPECT_EQ(NULL, crush_index_create(-1, 0, 0, NULL, 0, 0, NULL));
+  EXPECT_EQ(NULL, crush_index_create(1, 0, 0, NULL, 3, 2, NULL));
+
+  /* repeated items, buckets and unknown devices are ignored */
+  const int result[] = {
+    0, 0, 1,
+    -1, CRUSH_ITEM_NONE, 5,
+    1, 0, 2,
+  };
+  crush_index *index = crush_index_create(3, 100, 3, result, 3, 3, NULL);
+  ASSERT_TRUE(index);
+  __u32 xs[3];
+  ASSERT_EQ(2, crush_index_device(index, 0, xs, 3));
+  EXPECT_EQ(100u, xs[0]);
+  EXPECT_EQ(102u, xs[1]);
+  ASSERT_EQ(2, crush_index_device(index, 1, xs, 1));
+  EXPECT_EQ(100u, xs[0]);
+  ASSERT_EQ(1, crush_index_device(index, 2, xs, 3));
+  EXPECT_EQ(102u, xs[0]);
+  EXPECT_EQ(0, crush_index_device(index, 5, xs, 3));
+  EXPECT_EQ(0, crush_index_device(index, -1, xs, 3));
+  EXPECT_EQ(5, crush_index_size(index));
+
+  /* the row sizes */
+  const int len[] = { 1, 0, 3 };
+  crush_index_destroy(index);
+  index = crush_index_create(3, 100, 3, result, 3, 3, len);
+  ASSERT_TRUE(index);
+  EXPECT_EQ(2, crush_index_device(index, 0, xs, 3));
+  EXPECT_EQ(1, crush_index_device(index, 1, xs, 3));
+  EXPECT_EQ(102u, xs[0]);
+  crush_index_destroy(index);
+  crush_index_destroy(NULL);
+}
+
+TEST(index, crush_index_bucket) {
+  crush_map *m = make_map(10);
+  const __u32 x_begin = 1000, x_count = 10000;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  mappings mapped;
+  map_all(m, weights, x_begin, x_count, &mapped);
+  crush_index *index = crush_index_create(m->max_devices, x_begin, x_count,
+                                          &mapped.result[0], 3, 3, &mapped.len[0]);
+  ASSERT_TRUE(index);
+  expect_same_index(index, mapped, x_begin, m->max_devices);
+  /* about one byte per replica */
+  EXPECT_GT(x_count * 3 * 11 / 10, (__u32)crush_index_size(index));
+
+  std::vector<__u32> xs(x_count);
+  for (int b = 0; b < m->max_buckets; b++) {
+    const crush_bucket *bucket = m->buckets[b];
+    if (!bucket)
+      continue;
+    std::set<__u32> expected;
+    for (__u32 i = 0; i < bucket->size; i++) {
+      if (bucket->items[i] < 0)
+        continue;
+      const std::vector<__u32> device =
+        expected_inputs(mapped, x_begin, bucket->items[i]);
+      expected.insert(device.begin(), device.end());
+    }
+    if (bucket->type == 2)
+      for (__u32 i = 0; i < x_count; i++)
+        expected.insert(x_begin + i);
+    ASSERT_EQ((int)expected.size(), crush_index_bucket(index, m, bucket->id,
+                                                       &xs[0], xs.size()));
+    EXPECT_TRUE(std::equal(expected.begin(), expected.end(), xs.begin()));
+  }
+  EXPECT_EQ(-ENOENT, crush_index_bucket(index, m, 0, &xs[0], xs.size()));
+  EXPECT_EQ(-ENOENT, crush_index_bucket(index, m, -1 - m->max_buckets,
+                                        &xs[0], xs.size()));
+  crush_index_destroy(index);
+  crush_destroy(m);
+}
+
+TEST(index, crush_index_update) {
+  crush_map *m = make_map(10);
+  const __u32 x_begin = 0, x_count = 10000;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  mappings before;
+  map_all(m, weights, x_begin, x_count, &before);
+  crush_index *index = crush_index_create(m->max_devices, x_begin, x_count,
+                                          &before.result[0], 3, 3, &before.len[0]);
+  ASSERT_TRUE(index);
+
+  crush_diff_change change = { x_count, 0, 0, NULL, NULL };
+  EXPECT_EQ(-EINVAL, crush_index_update(index, &change));
+
+  /* two devices fail, then one comes back, without looking up in between */
+  std::vector<__u32> failed = weights;
+  failed[5] = 0;
+  failed[17] = 0;
+  std::vector<__u32> recovered = failed;
+  recovered[5] = 0x10000;
+  const std::vector<__u32> *steps[3] = { &weights, &failed, &recovered };
+  for (int step = 0; step < 2; step++) {
+    crush_diff *diff = crush_diff_create(m, &(*steps[step])[0], weights.size(),
+                                         m, &(*steps[step + 1])[0], weights.size(),
+                                         0, 3, x_begin, x_begin + x_count, 2);
+    ASSERT_TRUE(diff);
+    int changes = 0, r;
+    while ((r = crush_diff_next(diff, &change)) > 0) {
+      ASSERT_EQ(0, crush_index_update(index, &change));
+      changes++;
+    }
+    EXPECT_EQ(0, r);
+    EXPECT_LT(0, changes);
+    crush_diff_destroy(diff);
+  }
+
+  mappings after;
+  map_all(m, recovered, x_begin, x_count, &after);
+  expect_same_index(index, after, x_begin, m->max_devices);
+  EXPECT_EQ(0, crush_index_device(index, 17, NULL, 0));
+
+  /* the same lists as an index of the new mappings */
+  crush_index *rebuilt = crush_index_create(m->max_devices, x_begin, x_count,
+                                            &after.result[0], 3, 3, &after.len[0]);
+  ASSERT_TRUE(rebuilt);
+  EXPECT_EQ(crush_index_size(rebuilt), crush_index_size(index));
+  crush_index_destroy(rebuilt);
+
+  /* a device that was not in the index */
+  const int old_result[3] = { 0, 1, 2 }, new_result[3] = { 0, 1, 100 };
+  change = { 42, 3, 3, old_result, new_result };
+  ASSERT_EQ(0, crush_index_update(index, &change));
+  __u32 xs[1];
+  ASSERT_EQ(1, crush_index_device(index, 100, xs, 1));
+  EXPECT_EQ(42u, xs[0]);
+  crush_index_destroy(index);
+  crush_destroy(m);
+}
+
@@ -0,0 +1,133 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/freeze.h"
+#include "crush/mapfile.h"
+}
+
+#include "make_map.h"
+
+/* a straw2 root of @hosts_count straw2 hosts of 3 devices */
+static crush_map *make_map(int hosts_count, int *ruleno) {
+  test_map spec(hosts_count);
+  spec.tunables = false;
+  spec.host_size = [](int) { return 3; };
+  spec.weight = [](int, int i) { return 0x10000 + 0x1000 * i; };
+  spec.ops = { CRUSH_RULE_CHOOSELEAF_FIRSTN };
+  return make_map(spec, NULL, ruleno);
+}
+
+static std::vector<int> mappings(const crush_map *m, int ruleno) {
+  const int result_max = 3;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, &cwin[0]);
+  std::vector<int> out;
+  for (int x = 0; x < 1000; x++) {
+    int result[result_max];
+    int len = crush_do_rule(m, ruleno, x, result, result_max,
+                            &weights[0], weights.size(), &cwin[0], NULL);
+    out.insert(out.end(), result, result + len);
+    out.push_back(-1);
+  }
+  return out;
+}
+
+static std::string temp_path() {
+  char path[] = "/tmp/test_mapfile.XXXXXX";
+  int fd = mkstemp(path);
+  EXPECT_LE(0, fd);
+  close(fd);
+  return path;
+}
+
+static std::vector<char> read_file(const std::string &path) {
+  std::ifstream in(path.c_str(), std::ios::binary);
+  return std::vector<char>(std::istreambuf_iterator<char>(in),
+                           std::istreambuf_iterator<char>());
+}
+
+TEST(mapfile, crush_map_mmap) {
+  int ruleno;
+  crush_map *m = make_map(9, &ruleno);
+  std::vector<int> expected = mappings(m, ruleno);
+  std::string path = temp_path();
+  ASSERT_EQ(0, crush_map_save(m, path.c_str()));
+
+  crush_map *mapped;
+  ASSERT_EQ(0, crush_map_mmap(path.c_str(), &mapped));
+  EXPECT_EQ(expected, mappings(mapped, ruleno));
+  ASSERT_TRUE(mapped->rule_table);
+  EXPECT_EQ(ruleno, crush_find_rule(mapped, 0, 1, 3));
+  EXPECT_EQ(-1, crush_find_rule(mapped, 0, 1, 11));
+
+  /* saving a frozen map gives the same file */
+  std::string path2 = temp_path();
+  ASSERT_EQ(0, crush_map_save(mapped, path2.c_str()));
+  EXPECT_EQ(read_file(path), read_file(path2));
+  crush_map_munmap(mapped);
+
+  EXPECT_EQ(-ENOENT, crush_map_mmap("/nonexistent/map", &mapped));
+  crush_destroy(m);
+  unlink(path.c_str());
+  unlink(path2.c_str());
+}
+
+TEST(mapfile, crush_map_decode) {
+  int ruleno;
+  crush_map *m = make_map(5, &ruleno);
+  std::vector<int> expected = mappings(m, ruleno);
+  std::string path = temp_path();
+  ASSERT_EQ(0, crush_map_save(m, path.c_str()));
+  crush_destroy(m);
+  const std::vector<char> file = read_file(path);
+  unlink(path.c_str());
+  ASSERT_LT((size_t)CRUSH_MAP_FILE_ARENA_OFFSET, file.size());
+
+  /* __u64 aligned copies of the file */
+  std::vector<__u64> buf((file.size() + 7) / 8);
+  crush_map *decoded;
+  memcpy(&buf[0], &file[0], file.size());
+  ASSERT_EQ(0, crush_map_decode(&buf[0], file.size(), &decoded));
+  EXPECT_EQ(expected, mappings(decoded, ruleno));
+  EXPECT_EQ(0, crush_map_verify(decoded));
+
+  memcpy(&buf[0], &file[0], file.size());
+  EXPECT_EQ(-EINVAL, crush_map_decode(&buf[0], file.size() - 1, &decoded));
+  EXPECT_EQ(-EINVAL, crush_map_decode(&buf[0], 10, &decoded));
+
+  /* the arrays are only verified by crush_map_verify() */
+  memcpy(&buf[0], &file[0], file.size());
+  ((char *)&buf[0])[file.size() - 1] ^= 1;
+  ASSERT_EQ(0, crush_map_decode(&buf[0], file.size(), &decoded));
+  EXPECT_EQ(-EBADMSG, crush_map_verify(decoded));
+
+  memcpy(&buf[0], &file[0], file.size());
+  ((char *)&buf[0])[CRUSH_MAP_FILE_ARENA_OFFSET +
+                    offsetof(crush_map, choose_total_tries)] ^= 1;
+  EXPECT_EQ(-EBADMSG, crush_map_decode(&buf[0], file.size(), &decoded));
+
+  memcpy(&buf[0], &file[0], file.size());
+  ((crush_map_file_header *)&buf[0])->structs_size -= 8;
+  EXPECT_EQ(-EBADMSG, crush_map_decode(&buf[0], file.size(), &decoded));
+
+  memcpy(&buf[0], &file[0], file.size());
+  ((crush_map_file_header *)&buf[0])->version++;
+  EXPECT_EQ(-ENOTSUP, crush_map_decode(&buf[0], file.size(), &decoded));
+
+  memcpy(&buf[0], &file[0], file.size());
+  ((char *)&buf[0])[0] = 'X';
+  EXPECT_EQ(-EINVAL, crush_map_decode(&buf[0], file.size(), &decoded));
+}
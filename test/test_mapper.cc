@@ -0,0 +1,784 @@
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/simd.h"
+#include "crush/freeze.h"
+}
+
+/*
+ * a root of @hosts_count straw2 hosts, each containing @disks_per_host
+ * devices, with a chooseleaf firstn rule and a choose indep rule
+ */
+static crush_map *make_map(int hosts_count, int disks_per_host,
+                           int *firstn_rule, int *indep_rule) {
+  crush_map *m = crush_create();
+  m->choose_local_tries = 0;
+  m->choose_local_fallback_tries = 0;
+  m->choose_total_tries = 50;
+  m->chooseleaf_descend_once = 1;
+  m->chooseleaf_vary_r = 1;
+  m->chooseleaf_stable = 1;
+  const int root_type = 2;
+  const int host_type = 1;
+  std::vector<int> hosts(hosts_count);
+  std::vector<int> weights(hosts_count);
+  int disk = 0;
+  for (int host = 0; host < hosts_count; host++) {
+    crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                        host_type, 0, NULL, NULL);
+    for (int i = 0; i < disks_per_host; i++)
+      EXPECT_EQ(0, crush_bucket_add_item(m, b, disk++, 0x10000));
+    EXPECT_EQ(0, crush_add_bucket(m, 0, b, &hosts[host]));
+    weights[host] = b->weight;
+  }
+  crush_bucket *root = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                         root_type, hosts_count, &hosts[0], &weights[0]);
+  int rootno;
+  EXPECT_EQ(0, crush_add_bucket(m, 0, root, &rootno));
+
+  crush_rule *r = crush_make_rule(3, 0, 1, 1, 10);
+  crush_rule_set_step(r, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(r, 1, CRUSH_RULE_CHOOSELEAF_FIRSTN, 0, host_type);
+  crush_rule_set_step(r, 2, CRUSH_RULE_EMIT, 0, 0);
+  *firstn_rule = crush_add_rule(m, r, -1);
+
+  r = crush_make_rule(3, 1, 3, 1, 10);
+  crush_rule_set_step(r, 0, CRUSH_RULE_TAKE, rootno, 0);
+  crush_rule_set_step(r, 1, CRUSH_RULE_CHOOSE_INDEP, 0, host_type);
+  crush_rule_set_step(r, 2, CRUSH_RULE_EMIT, 0, 0);
+  *indep_rule = crush_add_rule(m, r, -1);
+
+  crush_finalize(m);
+  return m;
+}
+
+TEST(mapper, crush_do_rule_batch) {
+  int firstn, indep;
+  crush_map *m = make_map(10, 3, &firstn, &indep);
+  const int result_max = 3;
+  const int stride = result_max + 1;
+  const int x_count = 1000;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  weights[4] = 0;
+  weights[7] = 0x8000;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  std::vector<int> x(x_count);
+  for (int i = 0; i < x_count; i++)
+    x[i] = i * 7919;
+
+  for (int ruleno : { firstn, indep }) {
+    std::vector<int> result(x_count * stride, -42);
+    std::vector<int> result_len(x_count);
+    crush_init_workspace(m, &cwin[0]);
+    ASSERT_EQ(x_count, crush_do_rule_batch(m, ruleno, &x[0], x_count,
+                                           &result[0], result_max, stride,
+                                           &result_len[0],
+                                           &weights[0], weights.size(),
+                                           &cwin[0], NULL));
+    for (int i = 0; i < x_count; i++) {
+      int expected[result_max];
+      int len = crush_do_rule(m, ruleno, x[i], expected, result_max,
+                              &weights[0], weights.size(), &cwin[0], NULL);
+      ASSERT_EQ(len, result_len[i]);
+      for (int j = 0; j < len; j++)
+        ASSERT_EQ(expected[j], result[i * stride + j]);
+      ASSERT_EQ(-42, result[i * stride + result_max]);
+    }
+  }
+
+  int result[result_max];
+  EXPECT_EQ(0, crush_do_rule_batch(m, firstn, &x[0], 1, result, result_max,
+                                   result_max - 1, NULL,
+                                   &weights[0], weights.size(), &cwin[0], NULL));
+  EXPECT_EQ(0, crush_do_rule_batch(m, firstn + 100, &x[0], 1, result, result_max,
+                                   result_max, NULL,
+                                   &weights[0], weights.size(), &cwin[0], NULL));
+  crush_destroy(m);
+}
+
+TEST(mapper, straw2_reciprocals) {
+  int firstn, indep;
+  crush_map *m = make_map(10, 8, &firstn, &indep);
+  unsigned int seed = 42;
+  int root = -1;
+  for (int b = 0; b < m->max_buckets; b++) {
+    crush_bucket *bucket = m->buckets[b];
+    if (!bucket)
+      continue;
+    if (bucket->type != 1) {
+      root = b;
+      continue;
+    }
+    for (unsigned i = 0; i < bucket->size; i++)
+      crush_bucket_adjust_item_weight(m, bucket, bucket->items[i],
+                                      1 + rand_r(&seed) % 0x40000);
+  }
+  ASSERT_LE(0, root);
+  ASSERT_EQ(0, crush_reweight_bucket(m, m->buckets[root]));
+  crush_finalize(m);
+
+  ASSERT_EQ(0, crush_simd_set_impl(CRUSH_SIMD_SCALAR));
+  const int result_max = 3;
+  const int x_count = 1000;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<int> expected(x_count * result_max);
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  for (int ruleno : { firstn, indep }) {
+    crush_init_workspace(m, &cwin[0]);
+    for (int x = 0; x < x_count; x++)
+      crush_do_rule(m, ruleno, x, &expected[x * result_max], result_max,
+                    &weights[0], weights.size(), &cwin[0], NULL);
+
+    m->straw2_reciprocals = 1;
+    crush_finalize(m);
+    ASSERT_TRUE(((crush_bucket_straw2 *)m->buckets[root])->item_reciprocals);
+    crush_init_workspace(m, &cwin[0]);
+    for (int x = 0; x < x_count; x++) {
+      int result[result_max];
+      int len = crush_do_rule(m, ruleno, x, result, result_max,
+                              &weights[0], weights.size(), &cwin[0], NULL);
+      for (int j = 0; j < len; j++)
+        ASSERT_EQ(expected[x * result_max + j], result[j]);
+    }
+
+    m->straw2_reciprocals = 0;
+    crush_finalize(m);
+    ASSERT_FALSE(((crush_bucket_straw2 *)m->buckets[root])->item_reciprocals);
+  }
+  ASSERT_EQ(0, crush_simd_set_impl(CRUSH_SIMD_AUTO));
+  crush_destroy(m);
+}
+
+TEST(mapper, crush_do_plan) {
+  int firstn, indep;
+  crush_map *m = make_map(10, 4, &firstn, &indep);
+  int root = -1;
+  for (int b = 0; b < m->max_buckets; b++)
+    if (m->buckets[b] && m->buckets[b]->type == 2)
+      root = -1 - b;
+
+  /* tunables overridden by the rule, a bad take and a relative numrep */
+  crush_rule *r = crush_make_rule(10, 2, 1, 1, 10);
+  crush_rule_set_step(r, 0, CRUSH_RULE_SET_CHOOSE_TRIES, 100, 0);
+  crush_rule_set_step(r, 1, CRUSH_RULE_SET_CHOOSELEAF_TRIES, 3, 0);
+  crush_rule_set_step(r, 2, CRUSH_RULE_SET_CHOOSELEAF_VARY_R, 0, 0);
+  crush_rule_set_step(r, 3, CRUSH_RULE_TAKE, root, 0);
+  crush_rule_set_step(r, 4, CRUSH_RULE_TAKE, -1000, 0);
+  crush_rule_set_step(r, 5, CRUSH_RULE_CHOOSE_FIRSTN, -1, 1);
+  crush_rule_set_step(r, 6, CRUSH_RULE_SET_CHOOSELEAF_STABLE, 0, 0);
+  crush_rule_set_step(r, 7, CRUSH_RULE_CHOOSELEAF_INDEP, 1, 0);
+  crush_rule_set_step(r, 8, CRUSH_RULE_EMIT, 0, 0);
+  crush_rule_set_step(r, 9, 1000, 0, 0);
+  int custom = crush_add_rule(m, r, -1);
+
+  EXPECT_EQ(NULL, crush_compile_rule(m, custom + 1, 3));
+  EXPECT_EQ(NULL, crush_compile_rule(m, firstn, 0));
+
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  weights[3] = 0;
+  weights[5] = 0x8000;
+  for (int ruleno : { firstn, indep, custom }) {
+    for (int result_max = 1; result_max <= 6; result_max++) {
+      crush_plan *plan = crush_compile_rule(m, ruleno, result_max);
+      ASSERT_TRUE(plan);
+      EXPECT_EQ(ruleno, plan->ruleno);
+      std::vector<char> cwin(crush_work_size(m, result_max));
+      crush_init_workspace(m, &cwin[0]);
+      for (int x = 0; x < 500; x++) {
+        int expected[result_max + 1], result[result_max + 1];
+        int len = crush_do_rule(m, ruleno, x, expected, result_max,
+                                &weights[0], weights.size(), &cwin[0], NULL);
+        ASSERT_EQ(len, crush_do_plan(plan, x, result,
+                                     &weights[0], weights.size(), &cwin[0], NULL));
+        for (int j = 0; j < len; j++)
+          ASSERT_EQ(expected[j], result[j]);
+      }
+      crush_destroy_plan(plan);
+    }
+  }
+  crush_destroy(m);
+}
+
+TEST(mapper, crush_do_plan_interleaved) {
+  int firstn, indep;
+  crush_map *m = make_map(10, 4, &firstn, &indep);
+  int root = -1;
+  for (int b = 0; b < m->max_buckets; b++)
+    if (m->buckets[b] && m->buckets[b]->type == 2)
+      root = -1 - b;
+
+  /* chooseleaf indep and two choose steps with local retries */
+  crush_rule *r = crush_make_rule(4, 2, 1, 1, 10);
+  crush_rule_set_step(r, 0, CRUSH_RULE_SET_CHOOSE_LOCAL_FALLBACK_TRIES, 2, 0);
+  crush_rule_set_step(r, 1, CRUSH_RULE_TAKE, root, 0);
+  crush_rule_set_step(r, 2, CRUSH_RULE_CHOOSELEAF_INDEP, 0, 1);
+  crush_rule_set_step(r, 3, CRUSH_RULE_EMIT, 0, 0);
+  int leaf_indep = crush_add_rule(m, r, -1);
+  r = crush_make_rule(4, 3, 1, 1, 10);
+  crush_rule_set_step(r, 0, CRUSH_RULE_TAKE, root, 0);
+  crush_rule_set_step(r, 1, CRUSH_RULE_CHOOSE_FIRSTN, 2, 1);
+  crush_rule_set_step(r, 2, CRUSH_RULE_CHOOSE_FIRSTN, 0, 0);
+  crush_rule_set_step(r, 3, CRUSH_RULE_EMIT, 0, 0);
+  int two_steps = crush_add_rule(m, r, -1);
+
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  weights[3] = 0;
+  weights[5] = 0x8000;
+  weights[10] = 0x1000;
+  const int x_count = 1003;
+  std::vector<int> x(x_count);
+  for (int i = 0; i < x_count; i++)
+    x[i] = i * 7919;
+  for (int ruleno : { firstn, indep, leaf_indep, two_steps }) {
+    for (int result_max : { 1, 3, 5 }) {
+      crush_plan *plan = crush_compile_rule(m, ruleno, result_max);
+      ASSERT_TRUE(plan);
+      const int stride = result_max + 1;
+      std::vector<int> result(x_count * stride, -42), result_len(x_count);
+      std::vector<char> cwin(crush_interleave_work_size(plan));
+      crush_init_workspace(m, &cwin[0]);
+      __u32 tries[10] = { 0 }, expected_tries[10] = { 0 };
+      crush_set_choose_tries(&cwin[0], tries, 10);
+      ASSERT_EQ(x_count, crush_do_plan_interleaved(plan, &x[0], x_count,
+                                                   &result[0], stride,
+                                                   &result_len[0],
+                                                   &weights[0], weights.size(),
+                                                   &cwin[0], NULL));
+      crush_set_choose_tries(&cwin[0], expected_tries, 10);
+      for (int i = 0; i < x_count; i++) {
+        int expected[result_max];
+        int len = crush_do_rule(m, ruleno, x[i], expected, result_max,
+                                &weights[0], weights.size(), &cwin[0], NULL);
+        ASSERT_EQ(len, result_len[i]);
+        for (int j = 0; j < len; j++)
+          ASSERT_EQ(expected[j], result[i * stride + j]);
+        ASSERT_EQ(-42, result[i * stride + result_max]);
+      }
+      for (int i = 0; i < 10; i++)
+        EXPECT_EQ(expected_tries[i], tries[i]);
+
+      /* fewer inputs than are interleaved */
+      std::vector<int> few(3 * result_max);
+      ASSERT_EQ(3, crush_do_plan_interleaved(plan, &x[0], 3, &few[0],
+                                             result_max, NULL, &weights[0],
+                                             weights.size(), &cwin[0], NULL));
+      for (int i = 0; i < 3; i++)
+        for (int j = 0; j < result_len[i]; j++)
+          ASSERT_EQ(result[i * stride + j], few[i * result_max + j]);
+      EXPECT_EQ(0, crush_do_plan_interleaved(plan, &x[0], 1, &few[0],
+                                             result_max - 1, NULL, &weights[0],
+                                             weights.size(), &cwin[0], NULL));
+      crush_destroy_plan(plan);
+    }
+  }
+  crush_destroy(m);
+}
+
+TEST(mapper, crush_set_choose_tries) {
+  int firstn, indep;
+  crush_map *m = make_map(10, 3, &firstn, &indep);
+  const int result_max = 4;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  /* retries are needed to avoid the out devices */
+  for (int device = 0; device < m->max_devices; device += 4)
+    weights[device] = 0;
+  const unsigned int size = m->choose_total_tries + 1;
+
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, &cwin[0]);
+  std::vector<__u32> all(size, 0);
+  crush_set_choose_tries(&cwin[0], &all[0], size);
+  int result[result_max];
+  for (int x = 0; x < 1000; x++)
+    crush_do_rule(m, indep, x, result, result_max,
+                  &weights[0], weights.size(), &cwin[0], NULL);
+  /* a choose indep step counts once per mapping */
+  __u32 total = 0;
+  for (__u32 count : all)
+    total += count;
+  EXPECT_EQ(1000u, total);
+  EXPECT_LT(0u, total - all[0]);
+
+  /* the same inputs split in two workspaces, as two threads would */
+  for (int rule : { firstn, indep }) {
+    std::vector<__u32> one(size, 0), halves[2], merged(size, 0);
+    std::vector<char> cwins[2];
+    crush_set_choose_tries(&cwin[0], &one[0], size);
+    for (int i = 0; i < 2; i++) {
+      halves[i].assign(size, 0);
+      cwins[i].resize(crush_work_size(m, result_max));
+      crush_init_workspace(m, &cwins[i][0]);
+      crush_set_choose_tries(&cwins[i][0], &halves[i][0], size);
+    }
+    for (int x = 0; x < 1000; x++) {
+      crush_do_rule(m, rule, x, result, result_max,
+                    &weights[0], weights.size(), &cwin[0], NULL);
+      crush_do_rule(m, rule, x, result, result_max,
+                    &weights[0], weights.size(), &cwins[x % 2][0], NULL);
+    }
+    crush_merge_choose_tries(&merged[0], &halves[0][0], size);
+    crush_merge_choose_tries(&merged[0], &halves[1][0], size);
+    EXPECT_EQ(one, merged);
+    EXPECT_NE(halves[0], halves[1]);
+  }
+
+  /* counting stops with NULL */
+  std::vector<__u32> before(all);
+  crush_set_choose_tries(&cwin[0], &all[0], size);
+  crush_set_choose_tries(&cwin[0], NULL, size);
+  crush_do_rule(m, indep, 1, result, result_max,
+                &weights[0], weights.size(), &cwin[0], NULL);
+  EXPECT_EQ(before, all);
+  crush_destroy(m);
+}
+
+TEST(mapper, crush_set_track_visited) {
+  int firstn, indep;
+  crush_map *m = make_map(10, 3, &firstn, &indep);
+  const int result_max = 3;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, &cwin[0]);
+  int result[result_max];
+
+  /* nothing is recorded by default */
+  crush_do_rule(m, firstn, 1, result, result_max,
+                &weights[0], weights.size(), &cwin[0], NULL);
+  EXPECT_EQ(0u, crush_take_visited(&cwin[0]));
+
+  crush_set_track_visited(&cwin[0], 1);
+  const int root = m->bucket_parents[-1-m->device_parents[0]];
+  for (int x = 0; x < 100; x++) {
+    int len = crush_do_rule(m, firstn, x, result, result_max,
+                            &weights[0], weights.size(), &cwin[0], NULL);
+    __u64 expected = crush_visited_bit(root);
+    for (int i = 0; i < len; i++)
+      expected |= crush_visited_bit(m->device_parents[result[i]]);
+    /* without out devices, no other bucket is chosen from */
+    EXPECT_EQ(expected, crush_take_visited(&cwin[0]));
+    EXPECT_EQ(0u, crush_take_visited(&cwin[0]));
+  }
+
+  crush_set_track_visited(&cwin[0], 0);
+  crush_do_rule(m, indep, 1, result, result_max,
+                &weights[0], weights.size(), &cwin[0], NULL);
+  EXPECT_EQ(0u, crush_take_visited(&cwin[0]));
+  crush_destroy(m);
+}
+
+/* as many replicas as an EC profile with k+m=20 */
+TEST(mapper, chooseleaf_firstn_wide) {
+  int firstn, indep;
+  crush_map *m = make_map(24, 3, &firstn, &indep);
+  const int result_max = 20;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  for (int device = 0; device < m->max_devices; device += 4)
+    weights[device] = 0;
+  const unsigned int size = m->choose_total_tries + 1;
+  for (int stable : { 1, 0 }) {
+    m->chooseleaf_stable = stable;
+    std::vector<char> cwin(crush_work_size(m, result_max));
+    crush_init_workspace(m, &cwin[0]);
+    std::vector<__u32> tries(size, 0);
+    crush_set_choose_tries(&cwin[0], &tries[0], size);
+    __u32 mapped = 0;
+    for (int x = 0; x < 1000; x++) {
+      int result[result_max];
+      int len = crush_do_rule(m, firstn, x, result, result_max,
+                              &weights[0], weights.size(), &cwin[0], NULL);
+      EXPECT_LT(0, len);
+      mapped += len;
+      std::vector<int> hosts;
+      for (int i = 0; i < len; i++) {
+        EXPECT_NE(0u, weights[result[i]]);
+        hosts.push_back(result[i] / 3);
+      }
+      std::sort(hosts.begin(), hosts.end());
+      EXPECT_EQ(hosts.end(), std::unique(hosts.begin(), hosts.end()));
+    }
+    /* each replica counts once for its host and once for its leaf */
+    __u32 total = 0;
+    for (__u32 count : tries)
+      total += count;
+    EXPECT_EQ(2 * mapped, total);
+    EXPECT_LT(0u, total - tries[0]);
+  }
+  crush_destroy(m);
+}
+
+TEST(mapper, crush_set_weight_summary) {
+  int firstn, indep;
+  crush_map *m = make_map(10, 10, &firstn, &indep);
+  const int result_max = 3;
+  std::vector<char> cwin(crush_work_size(m, result_max)), with(cwin);
+  crush_init_workspace(m, &cwin[0]);
+  crush_init_workspace(m, &with[0]);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  crush_weight_summary *summary = crush_make_weight_summary(&weights[0],
+                                                            weights.size());
+  ASSERT_TRUE(summary);
+  EXPECT_EQ(0, summary->reweighted);
+  crush_set_weight_summary(&with[0], summary);
+
+  /* the summary is trusted: device 5 is in until it is updated */
+  weights[5] = 0;
+  bool chosen = false;
+  for (int x = 0; x < 1000; x++) {
+    int result[result_max];
+    int len = crush_do_rule(m, firstn, x, result, result_max, &weights[0],
+                            weights.size(), &with[0], NULL);
+    for (int i = 0; i < len; i++)
+      chosen |= result[i] == 5;
+  }
+  EXPECT_TRUE(chosen);
+
+  /* out and reweighted devices */
+  for (int device = 0; device < m->max_devices; device += 7)
+    weights[device] = device % 2 ? 0 : 0x4000;
+  for (int device = 0; device < m->max_devices; device++)
+    crush_update_weight_summary(summary, device);
+  EXPECT_EQ((m->max_devices + 6) / 7 + 1, summary->reweighted);
+  for (int rule : { firstn, indep }) {
+    for (int x = 0; x < 1000; x++) {
+      int expected[result_max], result[result_max];
+      int len = crush_do_rule(m, rule, x, expected, result_max, &weights[0],
+                              weights.size(), &cwin[0], NULL);
+      ASSERT_EQ(len, crush_do_rule(m, rule, x, result, result_max, &weights[0],
+                                   weights.size(), &with[0], NULL));
+      for (int i = 0; i < len; i++) {
+        ASSERT_EQ(expected[i], result[i]);
+        EXPECT_NE(5, result[i]);
+      }
+    }
+  }
+
+  /* another vector is not summarized */
+  std::vector<__u32> other(weights);
+  other[1] = 0;
+  for (int x = 0; x < 1000; x++) {
+    int result[result_max];
+    int len = crush_do_rule(m, firstn, x, result, result_max, &other[0],
+                            other.size(), &with[0], NULL);
+    for (int i = 0; i < len; i++)
+      ASSERT_NE(1, result[i]);
+  }
+  crush_destroy_weight_summary(summary);
+  crush_destroy(m);
+}
+
+TEST(mapper, choose_args) {
+  int firstn, indep;
+  crush_map *m = make_map(6, 4, &firstn, &indep);
+  const int result_max = 3;
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, &cwin[0]);
+  const int root = m->rules[firstn]->steps[0].arg1;
+  crush_bucket_straw2 *rootb = (crush_bucket_straw2 *)m->buckets[-1-root];
+  const __u32 root_weight = rootb->item_weights[0];
+
+  EXPECT_EQ(NULL, crush_make_choose_args(m, 0));
+  crush_choose_arg *args = crush_make_choose_args(m, 2);
+  ASSERT_TRUE(args);
+  crush_choose_arg &arg = args[-1-root];
+  ASSERT_EQ(2u, arg.weight_set_size);
+  ASSERT_EQ(rootb->h.size, arg.ids_size);
+  ASSERT_EQ(rootb->h.size, arg.weight_set[1].size);
+
+  /* initialized with the map: the same mappings */
+  int result[result_max], expected[result_max];
+  for (int rule : { firstn, indep }) {
+    for (int x = 0; x < 1000; x++) {
+      int len = crush_do_rule(m, rule, x, expected, result_max,
+                              &weights[0], weights.size(), &cwin[0], NULL);
+      ASSERT_EQ(len, crush_do_rule(m, rule, x, result, result_max, &weights[0],
+                                   weights.size(), &cwin[0], args));
+      for (int i = 0; i < len; i++)
+        EXPECT_EQ(expected[i], result[i]);
+    }
+  }
+
+  /* the first host never comes first, the map is not modified */
+  arg.weight_set[0].weights[0] = 0;
+  const int host0 = rootb->h.items[0];
+  int host0_after_first = 0;
+  for (int x = 0; x < 1000; x++) {
+    int len = crush_do_rule(m, firstn, x, result, result_max, &weights[0],
+                            weights.size(), &cwin[0], args);
+    ASSERT_EQ(result_max, len);
+    EXPECT_NE(host0, crush_get_parent(m, result[0]));
+    host0_after_first += crush_get_parent(m, result[1]) == host0 ||
+      crush_get_parent(m, result[2]) == host0;
+  }
+  EXPECT_LT(0, host0_after_first);
+  EXPECT_EQ(root_weight, rootb->item_weights[0]);
+
+  /* a single weight set applies to all positions */
+  arg.weight_set_size = 1;
+  for (int x = 0; x < 1000; x++) {
+    int len = crush_do_rule(m, indep, x, result, result_max, &weights[0],
+                            weights.size(), &cwin[0], args);
+    for (int i = 0; i < len; i++)
+      EXPECT_NE(host0, result[i]);
+  }
+  arg.weight_set_size = 2;
+  arg.weight_set[0].weights[0] = root_weight;
+
+  /* other ids change the draws but not the items */
+  for (__u32 i = 0; i < arg.ids_size; i++)
+    arg.ids[i] = 1000 + i;
+  int moved = 0;
+  for (int x = 0; x < 1000; x++) {
+    crush_do_rule(m, indep, x, expected, result_max,
+                  &weights[0], weights.size(), &cwin[0], NULL);
+    int len = crush_do_rule(m, indep, x, result, result_max, &weights[0],
+                            weights.size(), &cwin[0], args);
+    for (int i = 0; i < len; i++) {
+      EXPECT_GT(0, result[i]);
+      moved += result[i] != expected[i];
+    }
+  }
+  EXPECT_LT(0, moved);
+
+  crush_destroy_choose_args(args);
+  crush_destroy(m);
+}
+
+/* a bucket of @size devices of various weights and a rule choosing one */
+static crush_map *make_flat_map(int alg, int size, int *rootno) {
+  crush_map *m = crush_create();
+  m->choose_total_tries = 50;
+  std::vector<int> items(size), item_weights(size);
+  for (int i = 0; i < size; i++) {
+    items[i] = i;
+    item_weights[i] = 0x10000 * (1 + i % 3);
+  }
+  crush_bucket *b = crush_make_bucket(m, alg, CRUSH_HASH_DEFAULT, 1, size,
+                                      &items[0], &item_weights[0]);
+  EXPECT_EQ(0, crush_add_bucket(m, 0, b, rootno));
+  crush_rule *r = crush_make_rule(3, 0, 1, 1, 10);
+  crush_rule_set_step(r, 0, CRUSH_RULE_TAKE, *rootno, 0);
+  crush_rule_set_step(r, 1, CRUSH_RULE_CHOOSE_FIRSTN, 0, 0);
+  crush_rule_set_step(r, 2, CRUSH_RULE_EMIT, 0, 0);
+  crush_add_rule(m, r, -1);
+  crush_finalize(m);
+  return m;
+}
+
+static std::vector<int> flat_mappings(crush_map *m, int x_count) {
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  std::vector<char> cwin(crush_work_size(m, 1));
+  crush_init_workspace(m, &cwin[0]);
+  std::vector<int> out(x_count);
+  for (int x = 0; x < x_count; x++)
+    EXPECT_EQ(1, crush_do_rule(m, 0, x, &out[x], 1, &weights[0],
+                               weights.size(), &cwin[0], NULL));
+  return out;
+}
+
+TEST(mapper, bucket_perm_choose) {
+  for (int size : { 1, 2, 3, 4, 40, 64, 100, 1000 }) {
+    int rootno;
+    crush_map *m = make_flat_map(CRUSH_BUCKET_UNIFORM, size, &rootno);
+    crush_bucket *b = m->buckets[-1-rootno];
+    std::vector<__u32> weights(m->max_devices, 0x10000);
+    std::vector<char> cwin(crush_work_size(m, size));
+    crush_init_workspace(m, &cwin[0]);
+    std::vector<int> result(size);
+    for (int x = 0; x < 200; x++) {
+      /* the Fisher-Yates shuffle of the items */
+      std::vector<int> perm(size);
+      for (int i = 0; i < size; i++)
+        perm[i] = i;
+      for (int p = 0; p < size - 1; p++)
+        std::swap(perm[p], perm[p + crush_hash32_3(b->hash, x, b->id, p) % (size - p)]);
+      /* the permutation of x is extended, then read again */
+      for (int count : { 1, 3, 1, 20, size, 2 }) {
+        count = std::min(count, size);
+        ASSERT_EQ(count, crush_do_rule(m, 0, x, &result[0], count, &weights[0],
+                                       weights.size(), &cwin[0], NULL));
+        for (int i = 0; i < count; i++)
+          ASSERT_EQ(b->items[perm[i]], result[i]) << "size " << size << " x " << x;
+      }
+    }
+    crush_destroy(m);
+  }
+}
+
+TEST(mapper, straw2_tree) {
+  const int x_count = 100000;
+  int rootno;
+
+  /* no more than a group: the same draws as straw2 */
+  crush_map *straw2 = make_flat_map(CRUSH_BUCKET_STRAW2, 16, &rootno);
+  crush_map *tree = make_flat_map(CRUSH_BUCKET_STRAW2_TREE, 16, &rootno);
+  EXPECT_EQ(flat_mappings(straw2, 10000), flat_mappings(tree, 10000));
+  crush_destroy(straw2);
+  crush_destroy(tree);
+
+  /* each item in proportion of its weight */
+  const int size = 300;
+  tree = make_flat_map(CRUSH_BUCKET_STRAW2_TREE, size, &rootno);
+  crush_bucket *b = tree->buckets[-1-rootno];
+  std::vector<int> before = flat_mappings(tree, x_count);
+  std::vector<int> count(size, 0);
+  for (int item : before)
+    count[item]++;
+  for (int i = 0; i < size; i++) {
+    double expected = (double)x_count * crush_get_bucket_item_weight(b, i) / b->weight;
+    EXPECT_NEAR(expected, count[i], expected * 0.25) << "item " << i;
+  }
+
+  /* adding an item moves data to it and within the groups above it */
+  __u32 old_weight = b->weight;
+  EXPECT_EQ(0, crush_bucket_add_item(tree, b, size, 0x20000));
+  crush_finalize(tree);
+  std::vector<int> after = flat_mappings(tree, x_count);
+  int moved = 0, to_new = 0;
+  for (int x = 0; x < x_count; x++) {
+    moved += before[x] != after[x];
+    to_new += after[x] == size;
+  }
+  double optimal = (double)x_count * 0x20000 / (old_weight + 0x20000);
+  EXPECT_NEAR(optimal, to_new, optimal * 0.25);
+  /* 3 levels: 300 items, 19 nodes, 2 nodes */
+  EXPECT_GE(3 * optimal, moved);
+
+  /* changing the weight of an item only moves data in its groups */
+  before = after;
+  crush_bucket_adjust_item_weight(tree, b, 7, 0x30000);
+  crush_finalize(tree);
+  after = flat_mappings(tree, x_count);
+  moved = 0;
+  for (int x = 0; x < x_count; x++) {
+    if (before[x] == after[x])
+      continue;
+    moved++;
+    /* from or to the first node of 16 nodes */
+    EXPECT_TRUE(before[x] < 256 || after[x] < 256);
+  }
+  EXPECT_LT(0, moved);
+  crush_destroy(tree);
+
+  /* growing past a power of the fanout adds a level above the others */
+  for (int full : { 16, 256 }) {
+    tree = make_flat_map(CRUSH_BUCKET_STRAW2_TREE, full, &rootno);
+    b = tree->buckets[-1-rootno];
+    before = flat_mappings(tree, x_count);
+    EXPECT_EQ(0, crush_bucket_add_item(tree, b, full, 0x10000));
+    crush_finalize(tree);
+    after = flat_mappings(tree, x_count);
+    moved = to_new = 0;
+    for (int x = 0; x < x_count; x++) {
+      moved += before[x] != after[x];
+      to_new += after[x] == full;
+    }
+    /* the old top level is a node of the new one, only the new item wins */
+    EXPECT_EQ(to_new, moved) << "size " << full;
+    EXPECT_LT(0, moved);
+    crush_destroy(tree);
+  }
+}
+
+TEST(mapper, tree) {
+  const int x_count = 100000;
+  const int size = 300;
+  int rootno;
+
+  /* each item in proportion of its weight */
+  crush_map *m = make_flat_map(CRUSH_BUCKET_TREE, size, &rootno);
+  crush_bucket_tree *b = (crush_bucket_tree *)m->buckets[-1-rootno];
+  ASSERT_TRUE(b->descent_weights);
+  std::vector<int> mappings = flat_mappings(m, x_count);
+  std::vector<int> count(size, 0);
+  for (int item : mappings)
+    count[item]++;
+  for (int i = 0; i < size; i++) {
+    double expected = (double)x_count * crush_get_bucket_item_weight(&b->h, i) / b->h.weight;
+    EXPECT_NEAR(expected, count[i], expected * 0.25) << "item " << i;
+  }
+
+  /* the breadth first descent is the in order descent */
+  free(b->descent_weights);
+  b->descent_weights = NULL;
+  EXPECT_EQ(mappings, flat_mappings(m, x_count));
+
+  /* an item of weight 0 is never chosen */
+  crush_finalize(m);
+  ASSERT_TRUE(b->descent_weights);
+  EXPECT_GT(0, crush_bucket_adjust_item_weight(m, &b->h, 7, 0));
+  crush_finalize(m);
+  for (int item : flat_mappings(m, x_count))
+    EXPECT_NE(7, item);
+  crush_destroy(m);
+}
+
+/* the first rule matching, as crush_find_rule() would without an index */
+static int scan_rules(const crush_map *m, int ruleset, int type, int size) {
+  for (__u32 r = 0; r < m->max_rules; r++) {
+    const crush_rule *rule = m->rules[r];
+    if (rule && rule->mask.ruleset == ruleset && rule->mask.type == type &&
+        rule->mask.min_size <= size && rule->mask.max_size >= size)
+      return r;
+  }
+  return -1;
+}
+
+static void expect_same_rules(const crush_map *m) {
+  for (int ruleset : { -1, 0, 1, 7, 39, 40, 255, 256 })
+    for (int type : { -1, 0, 1, 2, 3, 256 })
+      for (int size = -1; size <= 257; size++)
+        ASSERT_EQ(scan_rules(m, ruleset, type, size),
+                  crush_find_rule(m, ruleset, type, size))
+          << "ruleset " << ruleset << " type " << type << " size " << size;
+}
+
+TEST(mapper, crush_find_rule) {
+  crush_map *m = crush_create();
+  crush_finalize(m);
+  ASSERT_TRUE(m->rule_table);
+  EXPECT_EQ(-1, crush_find_rule(m, 0, 1, 3));
+
+  /* overlapping sizes, several types per ruleset and a hole */
+  srand(3);
+  for (int r = 0; r < 200; r++) {
+    int min_size = rand() % 20, max_size = min_size + rand() % 10;
+    if (r == 100)
+      max_size = 255;
+    crush_rule *rule = crush_make_rule(1, r % 40, 1 + r % 3, min_size, max_size);
+    crush_rule_set_step(rule, 0, CRUSH_RULE_EMIT, 0, 0);
+    ASSERT_EQ(r, crush_add_rule(m, rule, -1));
+  }
+  crush_rule *last = crush_make_rule(1, 255, 2, 0, 255);
+  crush_rule_set_step(last, 0, CRUSH_RULE_EMIT, 0, 0);
+  ASSERT_EQ(255, crush_add_rule(m, last, 255));
+  EXPECT_FALSE(m->rule_table);
+  expect_same_rules(m);
+  crush_finalize(m);
+  ASSERT_TRUE(m->rule_table);
+  expect_same_rules(m);
+
+  crush_map *frozen = crush_map_freeze(m);
+  ASSERT_TRUE(frozen);
+  ASSERT_TRUE(frozen->rule_table);
+  EXPECT_NE(m->rule_table, frozen->rule_table);
+  expect_same_rules(frozen);
+  crush_destroy(frozen);
+
+  /* a rule added after crush_finalize() is found */
+  crush_rule *rule = crush_make_rule(1, 50, 1, 0, 10);
+  crush_rule_set_step(rule, 0, CRUSH_RULE_EMIT, 0, 0);
+  int ruleno = crush_add_rule(m, rule, -1);
+  EXPECT_EQ(ruleno, crush_find_rule(m, 50, 1, 3));
+  crush_finalize(m);
+  EXPECT_EQ(ruleno, crush_find_rule(m, 50, 1, 3));
+  expect_same_rules(m);
+  crush_destroy(m);
+}
@@ -0,0 +1,119 @@
+#include <errno.h>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/parallel.h"
+}
+
+#include "make_map.h"
+
+TEST(parallel, crush_do_rule_parallel) {
+  const int result_max = 3;
+  const int stride = result_max + 1;
+  const int x_begin = 100;
+  const int x_count = 5000;
+  crush_map *m = make_map(test_map(5));
+  /* hosts without enough devices return short mappings */
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  for (int device = 0; device < 12; device++)
+    weights[device] = 0;
+
+  for (int ruleno : { 0, 1 }) {
+    std::vector<int> x(x_count);
+    for (int i = 0; i < x_count; i++)
+      x[i] = x_begin + i;
+    std::vector<int> expected(x_count * stride, -1), expected_len(x_count);
+    std::vector<char> cwin(crush_work_size(m, result_max));
+    crush_init_workspace(m, &cwin[0]);
+    ASSERT_EQ(x_count, crush_do_rule_batch(m, ruleno, &x[0], x_count,
+                                           &expected[0], result_max, stride,
+                                           &expected_len[0], &weights[0],
+                                           weights.size(), &cwin[0], NULL));
+    for (int threads : { 0, 1, 3, 16 }) {
+      std::vector<int> result(x_count * stride, -1), result_len(x_count);
+      EXPECT_EQ(x_count, crush_do_rule_parallel(m, ruleno, x_begin, x_count,
+                                                &result[0], result_max, stride,
+                                                &result_len[0], &weights[0],
+                                                weights.size(), NULL, threads));
+      EXPECT_EQ(expected_len, result_len);
+      EXPECT_EQ(expected, result);
+    }
+  }
+
+  std::vector<int> result(stride);
+  EXPECT_EQ(0, crush_do_rule_parallel(m, 0, 0, 0, &result[0], result_max, stride,
+                                      NULL, &weights[0], weights.size(), NULL, 4));
+  EXPECT_EQ(1, crush_do_rule_parallel(m, 0, 0, 1, &result[0], result_max, stride,
+                                      NULL, &weights[0], weights.size(), NULL, 4));
+  EXPECT_EQ(-EINVAL, crush_do_rule_parallel(m, 2, 0, 1, &result[0], result_max,
+                                            stride, NULL, &weights[0],
+                                            weights.size(), NULL, 4));
+  EXPECT_EQ(-EINVAL, crush_do_rule_parallel(m, 0, 0, 1, &result[0], result_max,
+                                            result_max - 1, NULL, &weights[0],
+                                            weights.size(), NULL, 4));
+  crush_destroy(m);
+}
+
+static void count_run(void *arg, int worker) {
+  std::vector<int> *runs = (std::vector<int> *)arg;
+  __atomic_fetch_add(&(*runs)[worker], 1, __ATOMIC_RELAXED);
+}
+
+TEST(parallel, crush_pool_run) {
+  crush_pool *pool = crush_pool_create(4, 3);
+  ASSERT_TRUE(pool);
+  EXPECT_EQ(3, crush_pool_threads(pool));
+  /* the threads are reused by each run */
+  std::vector<int> runs(3, 0);
+  for (int i = 0; i < 100; i++)
+    crush_pool_run(pool, count_run, &runs);
+  EXPECT_EQ(std::vector<int>(3, 100), runs);
+  crush_pool_destroy(pool);
+
+  pool = crush_pool_create(0, 0);
+  ASSERT_TRUE(pool);
+  EXPECT_EQ(1, crush_pool_threads(pool));
+  crush_pool_destroy(pool);
+  pool = crush_pool_create(0, 1000);
+  ASSERT_TRUE(pool);
+  EXPECT_LE(1, crush_pool_threads(pool));
+  crush_pool_destroy(pool);
+  crush_pool_destroy(NULL);
+}
+
+struct chunks_run {
+  crush_chunks chunks;
+  std::vector<int> taken;
+};
+
+static void take_run(void *arg, int) {
+  chunks_run *c = (chunks_run *)arg;
+  int begin, end;
+  while (crush_chunks_take(&c->chunks, &begin, &end))
+    for (int i = begin; i < end; i++)
+      __atomic_fetch_add(&c->taken[i], 1, __ATOMIC_RELAXED);
+}
+
+TEST(parallel, crush_chunks_take) {
+  chunks_run c;
+  crush_chunks_init(&c.chunks, 1000, 64);
+  EXPECT_EQ(16, crush_chunks_count(&c.chunks));
+  c.taken.assign(1000, 0);
+  crush_pool *pool = crush_pool_create(4, crush_chunks_count(&c.chunks));
+  ASSERT_TRUE(pool);
+  /* each job is taken once, the last chunk is smaller */
+  crush_pool_run(pool, take_run, &c);
+  EXPECT_EQ(std::vector<int>(1000, 1), c.taken);
+  int begin, end;
+  EXPECT_EQ(0, crush_chunks_take(&c.chunks, &begin, &end));
+
+  crush_chunks_init(&c.chunks, 0, 64);
+  EXPECT_EQ(0, crush_chunks_count(&c.chunks));
+  EXPECT_EQ(0, crush_chunks_take(&c.chunks, &begin, &end));
+  crush_pool_destroy(pool);
+}
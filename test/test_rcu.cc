@@ -0,0 +1,210 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/context.h"
+#include "crush/rcu.h"
+}
+
+#include "make_map.h"
+
+/* a straw2 root of @racks racks of 4 hosts of 3 devices and a rule
+   choosing 3 hosts */
+static crush_map *make_map(int racks, int *rootno) {
+  test_map spec(racks * 4);
+  spec.hosts_per_rack = 4;
+  spec.host_size = [](int) { return 3; };
+  spec.weight = [](int, int) { return 0x10000; };
+  spec.ops = { CRUSH_RULE_CHOOSELEAF_FIRSTN };
+  return make_map(spec, rootno);
+}
+
+static void expect_same_mappings(const crush_map *a, const crush_map *b) {
+  ASSERT_EQ(a->working_size, b->working_size);
+  ASSERT_EQ(a->max_devices, b->max_devices);
+  std::vector<__u32> weights(a->max_devices, 0x10000);
+  std::vector<char> cwa(crush_work_size(a, 3)), cwb(crush_work_size(b, 3));
+  crush_init_workspace(a, &cwa[0]);
+  crush_init_workspace(b, &cwb[0]);
+  for (int x = 0; x < 1000; x++) {
+    int ra[3], rb[3];
+    int len = crush_do_rule(a, 0, x, ra, 3, &weights[0], weights.size(),
+                            &cwa[0], NULL);
+    ASSERT_EQ(len, crush_do_rule(b, 0, x, rb, 3, &weights[0], weights.size(),
+                                 &cwb[0], NULL));
+    for (int i = 0; i < len; i++)
+      ASSERT_EQ(ra[i], rb[i]);
+  }
+}
+
+TEST(rcu, crush_rcu_create) {
+  int rootno;
+  crush_map *m = make_map(2, &rootno);
+  EXPECT_EQ(NULL, crush_rcu_create(m, 0));
+  /* without back-links */
+  free(m->bucket_parents);
+  m->bucket_parents = NULL;
+  EXPECT_EQ(NULL, crush_rcu_create(m, 1));
+  crush_destroy(m);
+
+  crush_rcu *rcu = crush_rcu_create(make_map(2, &rootno), 2);
+  ASSERT_TRUE(rcu);
+  EXPECT_EQ(0, crush_rcu_register(rcu));
+  EXPECT_EQ(1, crush_rcu_register(rcu));
+  EXPECT_EQ(-ENOSPC, crush_rcu_register(rcu));
+  crush_rcu_unregister(rcu, 0);
+  EXPECT_EQ(0, crush_rcu_register(rcu));
+  EXPECT_EQ(-EINVAL, crush_rcu_adjust_item_weight(rcu, 0, 0x20000));
+  crush_rcu_destroy(rcu);
+  crush_rcu_destroy(NULL);
+}
+
+TEST(rcu, crush_rcu_publish) {
+  int rootno;
+  crush_map *expected = make_map(3, &rootno);
+  crush_rcu *rcu = crush_rcu_create(make_map(3, &rootno), 1);
+  ASSERT_TRUE(rcu);
+  int reader = crush_rcu_register(rcu);
+  __u32 epoch;
+  const crush_map *first = crush_rcu_read_lock(rcu, reader, &epoch);
+  EXPECT_EQ(1u, epoch);
+  EXPECT_EQ(NULL, first->bucket_parents);
+  expect_same_mappings(expected, first);
+
+  /* only the path from the device to the root is copied */
+  const int host = crush_get_parent(expected, 4);
+  const int rack = crush_get_parent(expected, host);
+  crush_map *pending = crush_rcu_begin(rcu);
+  ASSERT_TRUE(pending);
+  EXPECT_EQ(0, crush_rcu_adjust_item_weight(rcu, 4, 0x28000));
+  EXPECT_EQ(0, crush_rcu_adjust_item_weight(rcu, 5, 0x8000));
+  EXPECT_EQ(-ENOENT, crush_rcu_adjust_item_weight(rcu, 1000, 0x8000));
+  EXPECT_EQ(2u, crush_rcu_publish(rcu));
+  EXPECT_EQ(0, crush_map_adjust_item_weight(expected, 4, 0x28000));
+  EXPECT_EQ(0, crush_map_adjust_item_weight(expected, 5, 0x8000));
+
+  /* the version held is unchanged */
+  crush_map *before = make_map(3, &rootno);
+  expect_same_mappings(before, first);
+  crush_destroy(before);
+  crush_rcu_read_unlock(rcu, reader);
+
+  const crush_map *second = crush_rcu_read_lock(rcu, reader, &epoch);
+  EXPECT_EQ(2u, epoch);
+  expect_same_mappings(expected, second);
+  for (int b = 0; b < second->max_buckets; b++) {
+    int id = -1-b;
+    if (id == host || id == rack || id == rootno) {
+      EXPECT_NE(expected->buckets[b], second->buckets[b]);
+    }
+  }
+  crush_rcu_read_unlock(rcu, reader);
+
+  /* a new host in the first rack */
+  const crush_bucket *shared = second->buckets[-1-crush_get_parent(expected, 30)];
+  pending = crush_rcu_begin(rcu);
+  ASSERT_TRUE(pending);
+  int items[3] = { 100, 101, 102 }, weights[3] = { 0x10000, 0x20000, 0x30000 };
+  int id;
+  crush_bucket *b = crush_make_bucket(pending, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                                      1, 3, items, weights);
+  ASSERT_EQ(0, crush_rcu_add_bucket(rcu, 0, b, &id));
+  ASSERT_EQ(0, crush_rcu_add_item(rcu, rack, id, b->weight));
+  EXPECT_EQ(0, crush_rcu_remove_item(rcu, 7));
+  EXPECT_EQ(3u, crush_rcu_publish(rcu));
+  b = crush_make_bucket(expected, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT,
+                        1, 3, items, weights);
+  ASSERT_EQ(0, crush_map_add_bucket(expected, 0, b, &id));
+  ASSERT_EQ(0, crush_map_add_item(expected, rack, id, b->weight));
+  EXPECT_EQ(0, crush_map_remove_item(expected, 7));
+
+  const crush_map *third = crush_rcu_read_lock(rcu, reader, &epoch);
+  EXPECT_EQ(3u, epoch);
+  expect_same_mappings(expected, third);
+  /* the buckets of the other racks are shared */
+  EXPECT_EQ(shared, third->buckets[-1-shared->id]);
+  crush_rcu_read_unlock(rcu, reader);
+
+  crush_rcu_synchronize(rcu);
+  crush_rcu_destroy(rcu);
+  crush_destroy(expected);
+}
+
+struct reader_arg {
+  crush_rcu *rcu;
+  int devices;
+  int done;
+  __u32 last_epoch;
+};
+
+static void *read_mappings(void *p) {
+  reader_arg *arg = (reader_arg *)p;
+  int reader = crush_rcu_register(arg->rcu);
+  EXPECT_LE(0, reader);
+  crush_context *ctx = crush_context_create();
+  std::vector<__u32> weights(arg->devices * 2, 0x10000);
+  int x = 0;
+  while (!__atomic_load_n(&arg->done, __ATOMIC_ACQUIRE)) {
+    __u32 epoch;
+    const crush_map *m = crush_rcu_read_lock(arg->rcu, reader, &epoch);
+    EXPECT_LE(arg->last_epoch, epoch);
+    arg->last_epoch = epoch;
+    EXPECT_EQ(0, crush_context_bind(ctx, m, epoch, 3));
+    for (int i = 0; i < 20; i++, x++) {
+      int result[3];
+      int len = crush_context_do_rule(ctx, 0, x, result, 3, &weights[0],
+                                      weights.size(), NULL);
+      EXPECT_EQ(3, len);
+      for (int j = 0; j < len; j++)
+        EXPECT_GT(m->max_devices, result[j]);
+    }
+    crush_rcu_read_unlock(arg->rcu, reader);
+  }
+  crush_context_destroy(ctx);
+  crush_rcu_unregister(arg->rcu, reader);
+  return NULL;
+}
+
+TEST(rcu, concurrent_readers) {
+  int rootno;
+  crush_map *m = make_map(4, &rootno);
+  const int devices = m->max_devices;
+  crush_rcu *rcu = crush_rcu_create(m, 4);
+  ASSERT_TRUE(rcu);
+  reader_arg args[4];
+  pthread_t threads[4];
+  for (int t = 0; t < 4; t++) {
+    args[t] = { rcu, devices, 0, 1 };
+    ASSERT_EQ(0, pthread_create(&threads[t], NULL, read_mappings, &args[t]));
+  }
+  for (int update = 0; update < 200; update++) {
+    crush_map *pending = crush_rcu_begin(rcu);
+    ASSERT_TRUE(pending);
+    EXPECT_EQ(0, crush_rcu_adjust_item_weight(rcu, update % devices,
+                                              0x10000 + (update % 7) * 0x4000));
+    if (update % 50 == 0) {
+      int items[1] = { devices + update / 50 }, weights[1] = { 0x10000 };
+      int id;
+      crush_bucket *b = crush_make_bucket(pending, CRUSH_BUCKET_STRAW2,
+                                          CRUSH_HASH_DEFAULT, 1, 1, items, weights);
+      ASSERT_EQ(0, crush_rcu_add_bucket(rcu, 0, b, &id));
+      const int rack = crush_get_parent(pending, crush_get_parent(pending, 0));
+      ASSERT_EQ(0, crush_rcu_add_item(rcu, rack, id, 0x10000));
+    }
+    EXPECT_EQ((__u32)update + 2, crush_rcu_publish(rcu));
+    sched_yield();
+  }
+  for (int t = 0; t < 4; t++) {
+    __atomic_store_n(&args[t].done, 1, __ATOMIC_RELEASE);
+    ASSERT_EQ(0, pthread_join(threads[t], NULL));
+  }
+  crush_rcu_synchronize(rcu);
+  crush_rcu_destroy(rcu);
+}
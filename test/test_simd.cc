@@ -0,0 +1,138 @@
+#include <errno.h>
+#include <string.h>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/simd.h"
+}
+
+TEST(simd, crush_simd_set_impl) {
+  int impl = crush_simd_get_impl();
+  EXPECT_NE(CRUSH_SIMD_AUTO, impl);
+  EXPECT_EQ(0, crush_simd_set_impl(CRUSH_SIMD_SCALAR));
+  EXPECT_EQ(CRUSH_SIMD_SCALAR, crush_simd_get_impl());
+  EXPECT_EQ(-ENOTSUP, crush_simd_set_impl(42));
+  EXPECT_STREQ("scalar", crush_simd_impl_name(CRUSH_SIMD_SCALAR));
+  EXPECT_EQ(0, crush_simd_set_impl(CRUSH_SIMD_AUTO));
+  EXPECT_EQ(impl, crush_simd_get_impl());
+}
+
+/*
+ * map with a single straw2 bucket of @size devices, with weights and
+ * holes designed to create many ties and zero weight items
+ */
+static std::vector<int> map_straw2(int impl, int size, unsigned seed,
+                                   bool reciprocals = false) {
+  crush_map *m = crush_create();
+  m->straw2_reciprocals = reciprocals;
+  std::vector<int> items(size), weights(size);
+  for (int i = 0; i < size; i++) {
+    seed = seed * 1103515245 + 12345;
+    items[i] = i;
+    switch (seed % 5) {
+    case 0: weights[i] = 0; break;
+    case 1: weights[i] = 0x10000; break;
+    case 2: weights[i] = 1; break;
+    case 3: weights[i] = 0xffff0000u; break;
+    default: weights[i] = seed >> 8; break;
+    }
+  }
+  crush_bucket *b = crush_make_bucket(m, CRUSH_BUCKET_STRAW2, CRUSH_HASH_DEFAULT, 1,
+                                      size, &items[0], &weights[0]);
+  int root;
+  EXPECT_EQ(0, crush_add_bucket(m, 0, b, &root));
+  crush_rule *r = crush_make_rule(3, 0, 1, 1, 10);
+  crush_rule_set_step(r, 0, CRUSH_RULE_TAKE, root, 0);
+  crush_rule_set_step(r, 1, CRUSH_RULE_CHOOSE_FIRSTN, 0, 0);
+  crush_rule_set_step(r, 2, CRUSH_RULE_EMIT, 0, 0);
+  int ruleno = crush_add_rule(m, r, -1);
+  crush_finalize(m);
+
+  EXPECT_EQ(0, crush_simd_set_impl(impl));
+  const int result_max = 4;
+  std::vector<__u32> device_weights(size, 0x10000);
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, &cwin[0]);
+  std::vector<int> mappings;
+  for (int x = 0; x < 500; x++) {
+    int result[result_max];
+    int len = crush_do_rule(m, ruleno, x * 2654435761u, result, result_max,
+                            &device_weights[0], size, &cwin[0], NULL);
+    mappings.insert(mappings.end(), result, result + len);
+    mappings.push_back(-1);
+  }
+  crush_destroy(m);
+  return mappings;
+}
+
+TEST(simd, bucket_straw2_choose) {
+  for (int impl : { CRUSH_SIMD_SSE42, CRUSH_SIMD_AVX2, CRUSH_SIMD_NEON }) {
+    if (crush_simd_set_impl(impl) < 0)
+      continue;
+    for (int size = 1; size < 70; size++) {
+      std::vector<int> expected = map_straw2(CRUSH_SIMD_SCALAR, size, size);
+      ASSERT_EQ(expected, map_straw2(impl, size, size))
+        << crush_simd_impl_name(impl) << " size " << size;
+      /* the reciprocals do not change the mappings */
+      ASSERT_EQ(expected, map_straw2(impl, size, size, true))
+        << crush_simd_impl_name(impl) << " size " << size << " reciprocals";
+    }
+  }
+  EXPECT_EQ(0, crush_simd_set_impl(CRUSH_SIMD_AUTO));
+}
+
+TEST(simd, crush_hash32_xN) {
+  unsigned int seed = 7;
+  __u32 a[16], b[16], c[16], hash2[16], hash3[16];
+  for (int impl : { CRUSH_SIMD_SCALAR, CRUSH_SIMD_SSE42, CRUSH_SIMD_AVX2,
+                    CRUSH_SIMD_NEON }) {
+    if (crush_simd_set_impl(impl) < 0)
+      continue;
+    for (int round = 0; round < 100; round++) {
+      for (int i = 0; i < 16; i++) {
+        a[i] = rand_r(&seed) ^ ((__u32)rand_r(&seed) << 16);
+        b[i] = rand_r(&seed) ^ ((__u32)rand_r(&seed) << 16);
+        c[i] = rand_r(&seed) % 100;
+      }
+      for (int lanes : { 4, 8, 16 }) {
+        memset(hash2, 0, sizeof(hash2));
+        memset(hash3, 0, sizeof(hash3));
+        switch (lanes) {
+        case 4:
+          crush_hash32_2_x4(CRUSH_HASH_RJENKINS1, a, b, hash2);
+          crush_hash32_3_x4(CRUSH_HASH_RJENKINS1, a, b, c, hash3);
+          break;
+        case 8:
+          crush_hash32_2_x8(CRUSH_HASH_RJENKINS1, a, b, hash2);
+          crush_hash32_3_x8(CRUSH_HASH_RJENKINS1, a, b, c, hash3);
+          break;
+        default:
+          crush_hash32_2_x16(CRUSH_HASH_RJENKINS1, a, b, hash2);
+          crush_hash32_3_x16(CRUSH_HASH_RJENKINS1, a, b, c, hash3);
+          break;
+        }
+        for (int i = 0; i < 16; i++) {
+          if (i < lanes) {
+            ASSERT_EQ(crush_hash32_2(CRUSH_HASH_RJENKINS1, a[i], b[i]),
+                      hash2[i]) << crush_simd_impl_name(impl);
+            ASSERT_EQ(crush_hash32_3(CRUSH_HASH_RJENKINS1, a[i], b[i], c[i]),
+                      hash3[i]) << crush_simd_impl_name(impl);
+            ASSERT_EQ(crush_hash32_rjenkins1_3(a[i], b[i], c[i]), hash3[i]);
+          } else {
+            ASSERT_EQ(0u, hash2[i]);
+            ASSERT_EQ(0u, hash3[i]);
+          }
+        }
+      }
+    }
+  }
+  crush_hash32_3_x4(42, a, b, c, hash3);
+  for (int i = 0; i < 4; i++)
+    EXPECT_EQ(0u, hash3[i]);
+  EXPECT_EQ(0, crush_simd_set_impl(CRUSH_SIMD_AUTO));
+}
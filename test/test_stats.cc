@@ -0,0 +1,165 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+extern "C" {
+#include "crush/hash.h"
+#include "crush/builder.h"
+#include "crush/mapper.h"
+#include "crush/stats.h"
+}
+
+#include "make_map.h"
+
+/* a straw2 root of @hosts_count straw2 hosts of 3 devices, rule 0 is
+   chooseleaf firstn and rule 1 choose indep of hosts */
+static crush_map *make_map(int hosts_count) {
+  test_map spec(hosts_count);
+  spec.host_size = [](int) { return 3; };
+  spec.weight = [](int, int) { return 0x10000; };
+  spec.ops = { CRUSH_RULE_CHOOSELEAF_FIRSTN, CRUSH_RULE_CHOOSE_INDEP };
+  crush_map *m = make_map(spec);
+  m->choose_local_tries = 2;
+  m->choose_local_fallback_tries = 0;
+  return m;
+}
+
+static void map_all(crush_map *m, int ruleno, int begin, int end,
+                    int result_max, const std::vector<__u32> &weights,
+                    void *cwin) {
+  for (int x = begin; x < end; x++) {
+    int result[8];
+    crush_do_rule(m, ruleno, x, result, result_max,
+                  &weights[0], weights.size(), cwin, NULL);
+  }
+}
+
+static void expect_same_stats(const crush_stats *a, const crush_stats *b) {
+  ASSERT_EQ(a->max_rules, b->max_rules);
+  ASSERT_EQ(a->max_buckets, b->max_buckets);
+  EXPECT_EQ(0, memcmp(a->rules, b->rules, a->max_rules * sizeof(a->rules[0])));
+  EXPECT_EQ(0, memcmp(a->buckets, b->buckets,
+                      a->max_buckets * sizeof(a->buckets[0])));
+}
+
+TEST(stats, crush_set_stats) {
+  const int result_max = 3;
+  crush_map *m = make_map(6);
+  std::vector<__u32> weights(m->max_devices, 0x10000);
+  weights[1] = 0;
+  weights[8] = 0;
+  std::vector<char> cwin(crush_work_size(m, result_max));
+  crush_init_workspace(m, &cwin[0]);
+  crush_stats *stats = crush_stats_create(m);
+  ASSERT_TRUE(stats);
+  EXPECT_EQ(m->max_rules, stats->max_rules);
+  EXPECT_EQ(m->max_buckets, stats->max_buckets);
+
+  int r = crush_set_stats(m, &cwin[0], stats);
+  if (r == -EOPNOTSUPP) {
+    /* built without CRUSH_STATS: mapping is unaffected */
+    map_all(m, 0, 0, 100, result_max, weights, &cwin[0]);
+    EXPECT_EQ(0u, stats->rules[0].mappings);
+    crush_stats_destroy(stats);
+    crush_destroy(m);
+    return;
+  }
+  ASSERT_EQ(0, r);
+
+  map_all(m, 0, 0, 1000, result_max, weights, &cwin[0]);
+  map_all(m, 1, 0, 1000, result_max, weights, &cwin[0]);
+  const crush_rule_stats &firstn = stats->rules[0];
+  const crush_rule_stats &indep = stats->rules[1];
+  EXPECT_EQ(1000u, firstn.mappings);
+  EXPECT_EQ(1000u, indep.mappings);
+  /* a descent from the root and one in the host per replica at least */
+  EXPECT_LE(2u * 1000 * result_max, firstn.descents);
+  EXPECT_LT(0u, firstn.rejects);
+  EXPECT_LT(0u, firstn.collisions);
+  EXPECT_LT(0u, firstn.local_retries);
+  EXPECT_EQ(0u, firstn.perm_fallbacks);
+  /* hosts are never out */
+  EXPECT_EQ(0u, indep.rejects);
+  EXPECT_LT(0u, indep.descent_retries);
+  EXPECT_EQ(0u, indep.local_retries);
+  EXPECT_LE(1000u * result_max, indep.descents);
+
+  /* the hosts of the out devices cause the most retries */
+  const int root = m->rules[0]->steps[0].arg1;
+  EXPECT_LT(0u, stats->buckets[-1-root].visits);
+  int host1 = crush_get_parent(m, 1);
+  int host8 = crush_get_parent(m, 8);
+  for (int b = 0; b < m->max_buckets; b++) {
+    if (!m->buckets[b] || -1-b == root || -1-b == host1 || -1-b == host8) {
+      continue;
+    }
+    EXPECT_GT(stats->buckets[-1-host1].retries, stats->buckets[b].retries);
+  }
+
+  /* the same inputs split in two workspaces, as two threads would */
+  crush_stats *halves[2], *merged = crush_stats_create(m);
+  std::vector<char> cwins[2];
+  for (int i = 0; i < 2; i++) {
+    halves[i] = crush_stats_create(m);
+    cwins[i].resize(crush_work_size(m, result_max));
+    crush_init_workspace(m, &cwins[i][0]);
+    ASSERT_EQ(0, crush_set_stats(m, &cwins[i][0], halves[i]));
+    map_all(m, 0, 500 * i, 500 * (i + 1), result_max, weights, &cwins[i][0]);
+    map_all(m, 1, 500 * i, 500 * (i + 1), result_max, weights, &cwins[i][0]);
+    EXPECT_EQ(0, crush_stats_merge(merged, halves[i]));
+  }
+  expect_same_stats(stats, merged);
+
+  /* dump the rules then the buckets with the most retries first */
+  char *buf;
+  size_t size;
+  FILE *f = open_memstream(&buf, &size);
+  ASSERT_TRUE(f);
+  EXPECT_EQ(0, crush_stats_dump(stats, f));
+  fclose(f);
+  std::string dump(buf, size);
+  free(buf);
+  EXPECT_EQ(0u, dump.find("rule 0 mappings 1000 descents "));
+  size_t rule1 = dump.find("\nrule 1 mappings 1000 ");
+  EXPECT_NE(std::string::npos, rule1);
+  size_t bucket = dump.find("\nbucket ", rule1);
+  ASSERT_NE(std::string::npos, bucket);
+  unsigned long long last = ~0ULL;
+  for (; bucket != std::string::npos; bucket = dump.find("\nbucket ", bucket + 1)) {
+    int id;
+    unsigned long long visits, retries;
+    ASSERT_EQ(3, sscanf(dump.c_str() + bucket, "\nbucket %d visits %llu retries %llu",
+                        &id, &visits, &retries));
+    EXPECT_EQ(stats->buckets[-1-id].visits, visits);
+    EXPECT_EQ(stats->buckets[-1-id].retries, retries);
+    EXPECT_GE(last, retries);
+    last = retries;
+  }
+
+  /* counting stops with NULL */
+  crush_stats_reset(merged);
+  EXPECT_EQ(0u, merged->rules[0].mappings);
+  EXPECT_EQ(0u, merged->buckets[-1-host1].visits);
+  ASSERT_EQ(0, crush_set_stats(m, &cwin[0], NULL));
+  crush_stats_merge(merged, stats);
+  map_all(m, 0, 0, 10, result_max, weights, &cwin[0]);
+  expect_same_stats(stats, merged);
+
+  /* too few buckets for the map */
+  crush_stats *too_small = crush_stats_create(m);
+  too_small->max_buckets--;
+  EXPECT_EQ(-EINVAL, crush_set_stats(m, &cwin[0], too_small));
+  EXPECT_EQ(-EINVAL, crush_stats_merge(stats, too_small));
+  crush_stats_destroy(too_small);
+
+  for (int i = 0; i < 2; i++)
+    crush_stats_destroy(halves[i]);
+  crush_stats_destroy(merged);
+  crush_stats_destroy(stats);
+  crush_destroy(m);
+}